@@ -107,6 +107,10 @@ extern int ov_pcm_seek_page(OggVorbis_File *vf,ogg_int64_t pos);
 extern int ov_time_seek(OggVorbis_File *vf,ogg_int64_t pos);
 extern int ov_time_seek_page(OggVorbis_File *vf,ogg_int64_t pos);
 
+#ifdef SQUEEZEPLAY
+extern int ov_stream_restart(OggVorbis_File *vf,ogg_int64_t offset);
+#endif
+
 extern ogg_int64_t ov_raw_tell(OggVorbis_File *vf);
 extern ogg_int64_t ov_pcm_tell(OggVorbis_File *vf);
 extern ogg_int64_t ov_time_tell(OggVorbis_File *vf);
@@ -1493,6 +1493,25 @@ int ov_time_seek_page(OggVorbis_File *vf,ogg_int64_t milliseconds){
   }
 }
 
+#ifdef SQUEEZEPLAY
+/* restart decoding after the caller has moved a stream that isn't
+   seekable through the callbacks to offset.  The pcm offset is unknown
+   (-1) until the next page with a granulepos. */
+int ov_stream_restart(OggVorbis_File *vf,ogg_int64_t offset){
+  if(vf->ready_state<OPENED)return OV_EINVAL;
+
+  vf->pcm_offset=-1;
+  ogg_sync_reset(vf->oy);
+  if(vf->ready_state>=STREAMSET)
+    ogg_stream_reset_serialno(vf->os,vf->current_serialno);
+  if(vf->ready_state==INITSET)
+    vorbis_dsp_restart(vf->vd);
+
+  vf->offset=offset;
+  return 0;
+}
+#endif
+
 /* tell the current stream offset cursor.  Note that seek followed by
    tell will likely not give the set offset due to caching */
 ogg_int64_t ov_raw_tell(OggVorbis_File *vf){
@@ -1600,6 +1619,10 @@ long ov_read(OggVorbis_File *vf,void *buffer,int bytes_req,int *bitstream){
       if(samples){
 	if(samples>0){
 	  vorbis_dsp_read(vf->vd,samples);
+#ifdef SQUEEZEPLAY
+	  /* unknown after ov_stream_restart */
+	  if(vf->pcm_offset>=0)
+#endif
 	  vf->pcm_offset+=samples;
 	  if(bitstream)*bitstream=vf->current_link;
 	  return samples*2*channels;
@@ -42,6 +42,11 @@ function registerApplet(self)
 end
 
 
+function registerOnDemand(self)
+	return true
+end
+
+
 --[[
 
 =head1 LICENSE
@@ -23,6 +23,11 @@ function registerApplet(meta)
 end
 
 
+function registerOnDemand(meta)
+	return true
+end
+
+
 --[[
 
 =head1 LICENSE
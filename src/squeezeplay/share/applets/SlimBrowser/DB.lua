@@ -39,6 +39,7 @@ local RadioGroup = require("jive.ui.RadioGroup")
 
 local math = require("math")
 local debug = require("jive.utils.debug")
+local memory = require("jive.utils.memory")
 local log = require("jive.utils.log").logger("applet.SlimBrowser.data")
 
 -- our class
@@ -47,6 +48,9 @@ module(..., oo.class)
 
 local BLOCK_SIZE = 200
 
+-- approximate size of an item, used when shedding memory
+local ITEM_BYTES = 512
+
 -- init
 -- creates an empty database object
 function __init(self, windowSpec)
@@ -67,6 +71,11 @@ function __init(self, windowSpec)
 		-- cache
 		last_indexed_chunk = false,
 		complete = false,
+
+		-- blocks dropped when memory was low, and the last block used
+		shedKeys = {},
+		lastKey = 0,
+		refetch = false,
 		
 		-- windowSpec (to create labels in renderer)
 		windowSpec = windowSpec,
@@ -100,6 +109,57 @@ function getRadioGroup(self)
 end
 
 
+-- setRefetch
+-- Blocks far from the last item used may be dropped when memory is low,
+-- fn(from, qty) is called to fetch them again when they are next used
+function setRefetch(self, fn)
+	self.refetch = fn
+
+	memory:addCache(self, "browse", memory.PRIORITY_BROWSE)
+end
+
+
+function memoryUsage(self)
+	local items = 0
+	for key, block in pairs(self.store) do
+		items = items + #block
+	end
+
+	return items * ITEM_BYTES
+end
+
+
+-- drop the blocks farthest from the last item used, keeping the blocks
+-- either side of it
+function shedMemory(self, bytes)
+	local keys = {}
+	for key in pairs(self.store) do
+		if math.abs(key - self.lastKey) > 1 then
+			keys[#keys + 1] = key
+		end
+	end
+
+	table.sort(keys, function(a, b)
+		return math.abs(a - self.lastKey) > math.abs(b - self.lastKey)
+	end)
+
+	local freed = 0
+	for _, key in ipairs(keys) do
+		if freed >= bytes then
+			break
+		end
+
+		log:debug(self, " shed key number ", key)
+
+		freed = freed + #self.store[key] * ITEM_BYTES
+		self.store[key] = nil
+		self.shedKeys[key] = true
+	end
+
+	return freed
+end
+
+
 -- status
 -- Update the DB status from the chunk.
 function updateStatus(self, chunk)
@@ -139,6 +199,7 @@ function updateStatus(self, chunk)
 		self.upCompleted = false
 		self.downCompleted = false
 		self.textIndex = {}
+		self.shedKeys = {}
 	end
 
 	-- update the window properties
@@ -196,6 +257,7 @@ function menuItems(self, chunk)
 	log:debug('********************************* cTo:   ', cTo)
 
 	self.store[key] = chunk["item_loop"]
+	self.shedKeys[key] = nil
 
 	for i,item in ipairs(chunk["item_loop"]) do
 		local index = i + tonumber(chunk["offset"])
@@ -248,7 +310,14 @@ function item(self, index)
 	local key = math.modf(index / BLOCK_SIZE)
 	local offset = math.fmod(index, BLOCK_SIZE) + 1
 
+	self.lastKey = key
+
 	if not self.store[key] then
+		-- fetch a block dropped when memory was low
+		if self.shedKeys[key] and self.refetch then
+			self.shedKeys[key] = nil
+			self.refetch(key * BLOCK_SIZE, BLOCK_SIZE)
+		end
 		return
 	end
 
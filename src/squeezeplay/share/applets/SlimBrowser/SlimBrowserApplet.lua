@@ -107,6 +107,11 @@ local _networkError = false
 local _serverError  = false
 local _diagWindow   = false
 
+-- how far ahead artwork is prefetched, in ms of scrolling at the current
+-- speed, and at most this many pages beyond the visible items
+local ARTWORK_PREFETCH_TIME  = 1000
+local ARTWORK_PREFETCH_PAGES = 4
+
 -- The path of enlightenment
 local _stepStack = {}
 
@@ -468,8 +473,9 @@ end
 
 
 -- _artworkItem
--- updates a group widget with the artwork for item
-local function _artworkItem(step, item, group, menuAccel)
+-- updates a group widget with the artwork for item, or prefetches the
+-- artwork with the given priority if there is no group
+local function _artworkItem(step, item, group, menuAccel, priority)
 	local icon = group and group:getWidget("icon")
 	local iconSize
 
@@ -482,6 +488,8 @@ local function _artworkItem(step, item, group, menuAccel)
 		if menuAccel and not _server:artworkThumbCached(iconId, iconSize) then
 			-- Don't load artwork while accelerated
 			_server:cancelArtwork(icon)
+		elseif not group then
+			_server:prefetchArtwork(iconId, iconSize, nil, priority)
 		else
 			-- Fetch an image from SlimServer
 			_server:fetchArtwork(iconId, icon, iconSize)
@@ -490,6 +498,8 @@ local function _artworkItem(step, item, group, menuAccel)
 		if menuAccel and not _server:artworkThumbCached(item["params"]["track_id"], iconSize) then
 			-- Don't load artwork while accelerated
 			_server:cancelArtwork(icon)
+		elseif not group then
+			_server:prefetchArtwork(item["params"]["track_id"], iconSize, 'png', priority)
                	else
 			-- workaround: this needs to be png not jpg to allow for transparencies
 			_server:fetchArtwork(item["params"]["track_id"], icon, iconSize, 'png')
@@ -2413,19 +2423,33 @@ local function _browseMenuRenderer(menu, step, widgets, toRenderIndexes, toRende
 		return
 	end
 
-	-- preload artwork in the direction of scrolling
-	-- FIXME wrap around cases
-	local startIndex
-	if dir > 0 then
-		startIndex = toRenderIndexes[toRenderSize]
-	else
-		startIndex = toRenderIndexes[1] - toRenderSize
+	-- preload artwork in the direction of scrolling, looking further
+	-- ahead the faster the menu moves. nearer items are fetched first.
+	local velocity = menu:getScrollVelocity()
+	if math.abs(velocity) >= 1 then
+		dir = velocity
 	end
 
-	for dbIndex = startIndex, startIndex + toRenderSize do
-		local item = db:item(dbIndex)
+	local lookahead = toRenderSize + math.floor(math.abs(velocity) * ARTWORK_PREFETCH_TIME / 1000)
+	lookahead = math.min(lookahead, toRenderSize * ARTWORK_PREFETCH_PAGES)
+
+	-- FIXME wrap around cases
+	local firstIndex = toRenderIndexes[1]
+	local lastIndex = toRenderIndexes[toRenderSize]
+
+	_server:beginArtworkPrefetch()
+
+	for distance = 1, lookahead do
+		local dbIndex
+		if dir < 0 then
+			dbIndex = firstIndex - distance
+		else
+			dbIndex = lastIndex + distance
+		end
+
+		local item = dbIndex >= 1 and db:item(dbIndex)
 		if item then
-			_artworkItem(step, item, nil, false)
+			_artworkItem(step, item, nil, false, distance)
 		end
 	end
 end
@@ -2835,6 +2859,15 @@ _newDestination = function(origin, item, windowSpec, sink, data, containerContex
 		sink(step, chunk, err)
 	end
 
+	-- fetch blocks dropped when memory was low
+	if db and data then
+		db:setRefetch(function(from, qty)
+			if not step.cancelled then
+				_performJSONAction(step.data, from, qty, step, step.sink)
+			end
+		end)
+	end
+
 	return step, step.sink
 end
 
@@ -21,6 +21,7 @@ TODO
 local package, pairs, error, load, loadfile, io, assert, os = package, pairs, error, load, loadfile, io, assert, os
 local setfenv, getfenv, require, pcall, unpack = setfenv, getfenv, require, pcall, unpack
 local tostring, tonumber, collectgarbage = tostring, tonumber, collectgarbage
+local ipairs, type = ipairs, type
 
 local string           = require("jive.utils.string")
                        
@@ -35,6 +36,7 @@ local locale           = require("jive.utils.locale")
 local dumper           = require("jive.utils.dumper")
 local table            = require("jive.utils.table")
 
+local bundle           = require("jive.bundle")
 local System           = require("jive.System")
 
 local JIVE_VERSION     = jive.JIVE_VERSION
@@ -61,6 +63,16 @@ local _sentinel = function () end
 -- applet services
 local _services = {}
 
+-- services registered by each applet, by applet name
+local _appletServices = {}
+
+-- applet index, caches the applet discovery and meta registration between
+-- boots. applets are rescanned when their directory or meta changes.
+local INDEX_VERSION = 1
+local _index = false
+local _newIndex = false
+local _indexChanged = false
+
 local _defaultSettingsByAppletName = {}
 --work in progress-- local _overrideSettingsByAppletName = {}
 
@@ -92,6 +104,7 @@ function _initUserpathdir()
 	
 	_mkdirRecursive(_userpathdir)
 	_mkdirRecursive(_usersettingsdir)
+	_mkdirRecursive(_userpathdir .. "/cache")
 	
 end
 
@@ -117,6 +130,99 @@ function _mkdirRecursive(dir)
     
 end
 
+-- _indexFilepath
+local function _indexFilepath()
+	return _userpathdir .. "/cache/applets.lua"
+end
+
+
+-- _loadIndex
+-- loads the applet index saved by the last boot, if it is still valid
+local function _loadIndex()
+	_newIndex = {
+		version = INDEX_VERSION,
+		jiveVersion = JIVE_VERSION,
+		path = package.path,
+		dirs = {},
+		applets = {},
+	}
+	_index = false
+	_indexChanged = true
+
+	local f = loadfile(_indexFilepath())
+	if not f then
+		return
+	end
+
+	-- evaluate the index in a sandbox
+	local env = {}
+	setfenv(f, env)
+
+	local ok, err = pcall(f)
+	if not ok then
+		log:warn("Error reading applet index: ", err)
+		return
+	end
+
+	local index = env.index
+	if type(index) ~= "table" or index.version ~= INDEX_VERSION
+		or index.jiveVersion ~= JIVE_VERSION or index.path ~= package.path then
+		log:info("Applet index is out of date")
+		return
+	end
+
+	_index = index
+	_indexChanged = false
+end
+
+
+-- _saveIndex
+-- saves the applet index if the applets have changed
+local function _saveIndex()
+	if not _indexChanged then
+		return
+	end
+
+	log:info("Saving applet index")
+
+	System:atomicWrite(_indexFilepath(), dumper.dump(_newIndex, "index", true))
+	_indexChanged = false
+end
+
+
+-- _isPlain
+-- returns true if value only contains strings, numbers and booleans
+local function _isPlain(value)
+	local t = type(value)
+	if t == "table" then
+		for k, v in pairs(value) do
+			if not _isPlain(k) or not _isPlain(v) then
+				return false
+			end
+		end
+		return true
+	end
+	return t == "string" or t == "number" or t == "boolean"
+end
+
+
+-- _appletStamp
+-- returns a stamp that changes when the applet may have changed, or nil if
+-- the applet no longer has a meta
+local function _appletStamp(dirpath, name)
+	local dirTime = lfs.attributes(dirpath, "modification")
+	local metaTime = lfs.attributes(dirpath .. name .. "Meta.lua", "modification")
+
+	if not dirTime or not metaTime then
+		return nil
+	end
+
+	local priorityTime = lfs.attributes(dirpath .. "loadPriority.lua", "modification") or 0
+
+	return dirTime .. ":" .. metaTime .. ":" .. priorityTime
+end
+
+
 -- _saveApplet
 -- creates entries for appletsDb, calculates paths and module names
 local function _saveApplet(name, dir)
@@ -130,6 +236,36 @@ local function _saveApplet(name, dir)
 
 		local dirpath = dir .. "/" .. name .. "/"
 
+		local stamp = _appletStamp(dirpath, name)
+		if not stamp then
+			-- removed since the index was saved
+			_indexChanged = true
+			return
+		end
+
+		-- unchanged applets use the index
+		local indexed = _index and _index.applets[name]
+		if indexed and (indexed.dirpath ~= dirpath or indexed.stamp ~= stamp) then
+			indexed = nil
+		end
+
+		if not indexed then
+			_indexChanged = true
+		end
+
+		local loadPriority
+		if indexed then
+			loadPriority = indexed.loadPriority
+		else
+			loadPriority = _getLoadPriority(dir.. "/" .. name)
+		end
+
+		_newIndex.applets[name] = {
+			dirpath = dirpath,
+			stamp = stamp,
+			loadPriority = loadPriority,
+		}
+
 		local newEntry = {
 			appletName = name,
 
@@ -152,7 +288,8 @@ local function _saveApplet(name, dir)
 			metaConfigured = false,
 			appletLoaded = false,
 			appletEvaluated = false,
-			loadPriority = _getLoadPriority(dir.. "/" .. name)
+			loadPriority = loadPriority,
+			indexed = indexed,
 		}
 		_appletsDb[name] = newEntry
 	end
@@ -170,28 +307,63 @@ local function _findApplets()
 		dir = dir .. "applets"
 		log:debug("..in ", dir)
 		
-		local mode = lfs.attributes(dir, "mode")
-		if mode ~= "directory" then
+		local attr = lfs.attributes(dir)
+		if not attr or attr.mode ~= "directory" then
 			break
 		end
 
-		for entry in lfs.dir(dir) do repeat
-			local entrydir = dir .. "/" .. entry
-			local entrymode = lfs.attributes(entrydir, "mode")
+		-- the applets are only listed if the directory has changed
+		local indexed = _index and _index.dirs[dir]
+		local names
 
-			if entry:match("^%.") or entrymode ~= "directory" then
-				break
-			end
+		if indexed and indexed.modification == attr.modification then
+			names = indexed.applets
+		else
+			log:info("Scanning ", dir)
 
-			local metamode = lfs.attributes(entrydir  .. "/" .. entry .. "Meta.lua", "mode")
-			if metamode == "file" then
-				_saveApplet(entry, dir)
-			end
-		until true end
+			names = {}
+			for entry in lfs.dir(dir) do repeat
+				local entrydir = dir .. "/" .. entry
+				local entrymode = lfs.attributes(entrydir, "mode")
+
+				if entry:match("^%.") or entrymode ~= "directory" then
+					break
+				end
+
+				local metamode = lfs.attributes(entrydir  .. "/" .. entry .. "Meta.lua", "mode")
+				if metamode == "file" then
+					names[#names + 1] = entry
+				end
+			until true end
+
+			_indexChanged = true
+		end
+
+		_newIndex.dirs[dir] = {
+			modification = attr.modification,
+			applets = names,
+		}
+
+		for _, name in ipairs(names) do
+			_saveApplet(name, dir)
+		end
 	until true end
 end
 
 
+-- _loadfile
+-- loads module from the precompiled bundle next to path, unless the file
+-- at path is newer than the bundle, or from the file
+local function _loadfile(module, path)
+	local f = bundle.load(module, path)
+	if f then
+		return f
+	end
+
+	return loadfile(path)
+end
+
+
 -- _loadMeta
 -- loads the meta information of applet entry
 local function _loadMeta(entry)
@@ -204,7 +376,7 @@ local function _loadMeta(entry)
 		end
 		return p
 	end
-	local f, err = loadfile(entry.basename .. "Meta.lua")
+	local f, err = _loadfile(entry.metaModule, entry.basename .. "Meta.lua")
 	if not f then
 		error (string.format ("error loading meta `%s' (%s)", entry.appletName, err))
 	end
@@ -316,6 +488,39 @@ local function _registerMeta(entry)
 	-- so it can be loaded on demand.
 	log:info("Registering: ", entry.appletName)
 	entry.metaObj:registerApplet()
+
+	-- remember the registration in the index
+	local indexed = _newIndex and _newIndex.applets[entry.appletName]
+	if indexed then
+		indexed.services = _appletServices[entry.appletName] or {}
+		-- AppletMeta is required here, it needs the global appletManager
+		local AppletMeta = require("jive.AppletMeta")
+
+		indexed.onDemand = obj:registerOnDemand()
+			and obj.configureApplet == AppletMeta.configureApplet
+		if _isPlain(entry.defaultSettings) then
+			indexed.defaults = entry.defaultSettings
+		end
+	end
+end
+
+
+-- _deferMeta
+-- registers the indexed services of an on demand applet without loading
+-- its meta, the meta is registered when the applet is first loaded
+local function _deferMeta(entry)
+	log:debug("Deferring meta: ", entry.appletName)
+
+	local indexed = entry.indexed
+	for _, service in ipairs(indexed.services) do
+		_services[service] = entry.appletName
+	end
+	entry.defaultSettings = indexed.defaults
+
+	local record = _newIndex.applets[entry.appletName]
+	record.services = indexed.services
+	record.onDemand = true
+	record.defaults = indexed.defaults
 end
 
 
@@ -347,7 +552,9 @@ local function _loadAndRegisterMetas()
 	log:debug("_loadAndRegisterMetas")
 
 	for name, entry in pairs(getSortedAppletDb(_appletsDb)) do
-		if not entry.metaLoaded then
+		if entry.indexed and entry.indexed.onDemand then
+			_deferMeta(entry)
+		elseif not entry.metaLoaded then
 			_ploadMeta(entry)
 			if not entry.metaRegistered then
 				_pregisterMeta(entry)
@@ -398,9 +605,11 @@ end
 function discover(self)
 	log:debug("AppletManager:loadApplets")
 
+	_loadIndex()
 	_findApplets()
 	_loadAndRegisterMetas()
 	_evalMetas()
+	_saveIndex()
 end
 
 
@@ -435,7 +644,7 @@ local function _loadApplet(entry)
 		end
 		return p
 	end
-	local f, err = loadfile(entry.basename .. "Applet.lua")
+	local f, err = _loadfile(entry.appletModule, entry.basename .. "Applet.lua")
 	if not f then
 		--error (string.format ("error loading applet `%s' (%s)\n", entry.appletName, err))
 		error (string.format ("%s|%s", entry.appletName, err))
@@ -785,11 +994,19 @@ end
 function registerService(self, appletName, service)
 	log:debug("registerService appletName=", appletName, " service=", service)
 
-	if _services[service] then
+	-- on demand applets register their indexed services again
+	if _services[service] and _services[service] ~= appletName then
 		log:warn('WARNING: registerService called an already existing service name: ', service)
 	end
 	_services[service] = appletName
 
+	if not _appletServices[appletName] then
+		_appletServices[appletName] = {}
+	end
+	if not table.contains(_appletServices[appletName], service) then
+		table.insert(_appletServices[appletName], service)
+	end
+
 end
 
 
@@ -57,6 +57,22 @@ function registerApplet(self)
 end
 
 
+--[[
+
+=head2 self:registerOnDemand()
+
+Should return true if registerApplet only registers services and
+configureApplet is not used. The services are then remembered in the
+applet index, and the meta is not loaded at boot until the applet is
+first used. Defaults to false.
+
+=cut
+--]]
+function registerOnDemand(self)
+	return false
+end
+
+
 --[[
 
 =head2 self:configureApplet()
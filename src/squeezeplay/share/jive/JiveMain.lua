@@ -40,6 +40,10 @@ local Event         = require("jive.ui.Event")
 local table         = require("jive.utils.table")
 
 local Canvas        = require("jive.ui.Canvas")
+local Label         = require("jive.ui.Label")
+local Surface       = require("jive.ui.Surface")
+
+local memory        = require("jive.utils.memory")
 
 local _inputToActionMap = require("jive.InputToActionMap")
 
@@ -130,6 +134,23 @@ function JiveMain:disconnectPlayer( event) --self, event not used in our case, c
 end
 
 
+-- ui caches shed when memory is low, these are held weakly by jive.utils.memory
+local _imageCache = {
+	memoryUsage = function(self) return Surface:imageCacheUsage() end,
+	shedMemory = function(self, bytes) return Surface:shedImageCache(bytes) end,
+}
+
+local _textCache = {
+	memoryUsage = function(self) return Label:textCacheUsage() end,
+	shedMemory = function(self, bytes) return Label:shedTextCache(bytes) end,
+}
+
+local _styleCache = {
+	memoryUsage = function(self) return Framework:styleCacheUsage() end,
+	shedMemory = function(self, bytes) return Framework:shedStyleCache(bytes) end,
+}
+
+
 --fallback IR->KEY handler after widgets have had a chance to listen for ir - probably will be removed - still using for rew/fwd and volume for now
 local function _irHandler(event)
 	local irCode = event:getIRCode()
@@ -418,8 +439,14 @@ function JiveMain:__init()
 		end)
 	heapTimer:start()
 
+	-- shed caches when memory is low
+	memory:addCache(_imageCache, "images", memory.PRIORITY_IMAGES)
+	memory:addCache(_textCache, "text", memory.PRIORITY_TEXT)
+	memory:addCache(_styleCache, "style", memory.PRIORITY_STYLE)
+	memory:startMonitor(5000)
+
 	-- run event loop
-	Framework:eventLoop(jnt:task())
+	Framework:eventLoop(jnt:task(), jnt)
 
 	Framework:quit()
 
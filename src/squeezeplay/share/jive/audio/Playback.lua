@@ -165,6 +165,13 @@ function __init(self, jnt, slimproto)
 	self.sentAudioUnderrunEvent = false
 	self.ignoreStream = false
 	self.decodeThreshold = 2048
+
+	-- double-buffered streaming, see _timerCallback
+	self.doubleBuffer = true
+	self.prebufferNext = false
+	self.streamComplete = false
+	self.sentNextTrackRequest = false
+	self.deferredStrm = nil
 	
 	self.proxy = nil
 	self.proxyListener = nil
@@ -178,6 +185,11 @@ function setDecodeThreshold(self, threshold)
 end
 
 
+function setDoubleBuffer(self, enabled)
+	self.doubleBuffer = enabled
+end
+
+
 function stop(self)
 	decode:stop()
 	self.timer:stop()
@@ -294,11 +306,44 @@ function _timerCallback(self)
 	end
 
 
+	-- a local seek that could not be made is left to the server
+	if self.seekFallback then
+		if status.seekFailed then
+			local fallback = self.seekFallback
+			self.seekFallback = nil
+			fallback()
+		elseif not status.seekPending then
+			self.seekFallback = nil
+		end
+	end
+
+	-- the decoder needs the stream from another offset
+	local seekOffset = Stream:seekRequest()
+	if seekOffset then
+		self:_streamSeek(seekOffset)
+	end
+
 	-- enable stream reads when decode buffer is not full
 	if status.decodeFull < status.decodeSize and self.stream then
 		self:_proxyAndStream(true)
 	end
 
+	-- In double-buffered mode the server is asked for the next track as
+	-- soon as this stream is complete, rather than when it has been
+	-- decoded. The next stream is then buffered behind this one while the
+	-- decoder drains it, and the decoder switches to it at the end of this
+	-- track without waiting for the network.
+	if self.prebufferNext and self.streamComplete and not self.stream and
+		not self.sentNextTrackRequest and not status.nextTrackPending and
+		status.decodeState & DECODE_RUNNING ~= 0 and
+		status.decodeState & (DECODE_UNDERRUN | DECODE_ERROR) == 0 then
+
+		log:debug("status STREAM COMPLETE, next track")
+		self:sendStatus(status, "STMd")
+
+		self.sentNextTrackRequest = true
+	end
+
 	if status.decodeState & DECODE_UNDERRUN ~= 0 or
 		status.decodeState & DECODE_ERROR ~= 0 then
 
@@ -310,15 +355,20 @@ function _timerCallback(self)
 		-- 2) the connection to us has been closed (indicating
 		-- that the stream is done) or we have an unrecoverable
 		-- decoder error.
+		-- 3) the decoder is not about to switch to a buffered
+		-- next track.
 
-		if not self.sentDecoderUnderrunEvent and
+		if not self.sentDecoderUnderrunEvent and not status.nextTrackPending and
 			(not self.stream or status.decodeState & DECODE_ERROR ~= 0) then
 			if status.decodeState & DECODE_NOT_SUPPORTED ~= 0 then
 				self:sendStatus(status, "STMn")
 			end
 
-			log:debug("status DECODE UNDERRUN")
-			self:sendStatus(status, "STMd")
+			-- the server may already have been asked for the next track
+			if not self.sentNextTrackRequest then
+				log:debug("status DECODE UNDERRUN")
+				self:sendStatus(status, "STMd")
+			end
 
 			self.sentDecoderUnderrunEvent = true
 			self.sentDecoderFullEvent = false
@@ -328,6 +378,14 @@ function _timerCallback(self)
 			self.ignoreStream = false
 
 			decode:songEnded()
+
+			-- start a next track that could not be buffered
+			if self.deferredStrm then
+				local data = self.deferredStrm
+				self.deferredStrm = nil
+
+				self:_strm(data)
+			end
 		end
 	else
 		self.sentDecoderUnderrunEvent = false
@@ -473,7 +531,7 @@ function _ipstring(ip)
 end
 
 
-function _streamConnect(self, serverIp, serverPort, reader, writer, slaves)
+function _streamConnect(self, serverIp, serverPort, reader, writer, slaves, nextTrack)
 	log:info("connect ", _ipstring(serverIp), ":", serverPort, " ", string.match(self.header, "(.-)\n"))
 
 	if serverIp ~= self.slimproto:getServerIp() then
@@ -482,7 +540,8 @@ function _streamConnect(self, serverIp, serverPort, reader, writer, slaves)
 
 	_setSource(self, "stream")
 
-	self.stream = Stream:connect(serverIp, serverPort)
+	-- the next track is streamed behind the track being decoded
+	self.stream = Stream:connect(serverIp, serverPort, nextTrack)
 
 	-- The following manipluates the metatable for the stream object to allow Http and other streaming
 	-- to use different read and write methods while using a common constructor which reuses the same
@@ -516,8 +575,44 @@ function _streamConnect(self, serverIp, serverPort, reader, writer, slaves)
 	
 	self:_proxyInit(slaves, self.stream)
 
-	local wtask = Task("streambufW", self, _streamWrite, nil, Task.PRIORITY_AUDIO)
-	self.jnt:t_addWrite(self.stream, wtask, STREAM_WRITE_TIMEOUT)
+	-- Standard streams are read by a native thread, which sends the request
+	-- and fills the streambuf independently of the lua scheduler. The read
+	-- task then only handles events from the thread. Proxy clients are fed
+	-- by the same thread, unless older lua proxy clients are still draining.
+	-- Like the lua proxy, the thread holds off reading the body until the
+	-- synced players have connected.
+	self.nativeReader = false
+	local proxyOk = not self.proxy or (self.stream.addProxy and not self.proxy.close)
+
+	-- Stream offsets are only file offsets when the whole file is streamed.
+	-- The server's own stream ignores Range, and may be transcoded or start
+	-- after a server side seek. A request with a Range starts part way in.
+	local wholeFile = not string.match(self.header, "^GET /stream%.%w+%?")
+		and not string.match(self.header, "\n[Rr]ange:")
+
+	if m.read == m._streamRead and proxyOk then
+		-- only a native reader without proxy clients can make ranged
+		-- seeks, the decoder may ask as soon as the reader starts
+		Stream:setRanged(wholeFile and not self.proxy and not nextTrack)
+
+		local hold = self.proxy and self.proxy.listenTask ~= nil
+		local ok, err = self.stream:startReader(self.header, false, hold)
+		if ok then
+			self.nativeReader = true
+		else
+			log:warn("native stream reader failed: ", err)
+			Stream:setRanged(false)
+		end
+	end
+
+	self.streamSeekable = wholeFile and self.nativeReader and not self.proxy and not nextTrack
+	self.streamServerIp = serverIp
+	self.streamServerPort = serverPort
+
+	if not self.nativeReader then
+		local wtask = Task("streambufW", self, _streamWrite, nil, Task.PRIORITY_AUDIO)
+		self.jnt:t_addWrite(self.stream, wtask, STREAM_WRITE_TIMEOUT)
+	end
 	
 	self.rtask = Task("streambufR", self, _streamRead, nil, Task.PRIORITY_AUDIO)
 	self:_proxyAndStream(true)
@@ -525,6 +620,74 @@ function _streamConnect(self, serverIp, serverPort, reader, writer, slaves)
 	self.slimproto:sendStatus('STMc')
 end
 
+-- Reconnect to the stream from offset, for example to fetch the moov
+-- box at the end of an mp4 file. The request is repeated with a Range
+-- header, the server is not told about the new connection.
+function _streamSeek(self, offset)
+	log:info("seek stream to ", offset)
+
+	if not self.streamSeekable then
+		log:warn("stream is not seekable")
+		Stream:cancelSeek()
+		return
+	end
+
+	if self.stream then
+		self.jnt:t_removeWrite(self.stream)
+		self.jnt:t_removeRead(self.stream)
+
+		self.stream:disconnect()
+		self.stream = nil
+	end
+
+	-- the track has not been received until the seeks are done
+	self.streamComplete = false
+
+	local header = string.gsub(self.header, "\r?\nRange:[^\r\n]*", "")
+	header = string.gsub(header, "(\r?\n)\r?\n$", "%1Range: bytes=" .. offset .. "-%1%1")
+
+	local err
+	self.stream, err = Stream:connect(self.streamServerIp, self.streamServerPort)
+	if self.stream then
+		Stream:setRanged(true)
+
+		local ok
+		ok, err = self.stream:startReader(header, true)
+		if not ok then
+			self.stream:disconnect()
+			self.stream = nil
+		end
+	end
+
+	if not self.stream then
+		log:warn("stream seek failed: ", err)
+		Stream:cancelSeek()
+		return
+	end
+
+	self.nativeReader = true
+	self.rtask = Task("streambufR", self, _streamRead, nil, Task.PRIORITY_AUDIO)
+	self:_proxyAndStream(true)
+end
+
+-- Seek to ms in the current track without asking the server. The decoder
+-- seeks within the buffered stream, or fetches it from an offset when the
+-- whole file is streamed; if it can't, failed is called so the server can
+-- seek instead. Returns false if a local seek can't be tried.
+function seek(self, ms, failed)
+	if self.source ~= "stream" or self.isLooping or self.tracksStarted == 0 then
+		return false
+	end
+
+	log:info("local seek to ", ms)
+
+	self.seekFallback = failed
+	decode:seek(ms)
+
+	return true
+end
+
+
 function _proxyQueueSegment(self, chunk)
 	if self.proxy then
 		table.insert(self.proxy.q, chunk)
@@ -613,22 +776,34 @@ function _proxyAccept(self, networkErr)
 			local conn = {}
 			conn.ip, conn.port = stream:getpeername()
 			log:info("Proxy connection accepted: from ", conn.ip, ':', conn.port)
-			conn.stream = stream
-			stream:settimeout(0)
-			conn.wtask = Task("proxyW", self, 
-					function (self, networkErr) self:_proxyWrite(conn, networkErr) end,
-					nil, Task.PRIORITY_AUDIO)
-			conn.rtask = Task("proxyR", self, 
-					function (self, networkErr) self:_proxyRead(conn, networkErr) end,
-					nil, Task.PRIORITY_AUDIO)
-			self.jnt:t_addRead(conn.stream, conn.rtask, STREAM_WRITE_TIMEOUT) -- read and discard the request
-			table.insert(self.proxy.connections, conn)
+
+			if self.nativeReader and self.stream == self.proxy.stream then
+				-- the stream reader thread writes to the client straight
+				-- from the streambuf, using its own copy of the socket
+				local ok, err = self.stream:addProxy(stream:getfd())
+				if not ok then
+					log:warn("Proxy connection dropped: ", err)
+				end
+				stream:close()
+			else
+				conn.stream = stream
+				stream:settimeout(0)
+				conn.wtask = Task("proxyW", self, 
+						function (self, networkErr) self:_proxyWrite(conn, networkErr) end,
+						nil, Task.PRIORITY_AUDIO)
+				conn.rtask = Task("proxyR", self, 
+						function (self, networkErr) self:_proxyRead(conn, networkErr) end,
+						nil, Task.PRIORITY_AUDIO)
+				self.jnt:t_addRead(conn.stream, conn.rtask, STREAM_WRITE_TIMEOUT) -- read and discard the request
+				table.insert(self.proxy.connections, conn)
+			end
 			
 			self.proxy.expected = self.proxy.expected - 1
 			if self.proxy.expected <= 0 then -- we have them all
 				log:info("All proxy connections active")
 				self.jnt:t_removeRead(self.proxyListener)
 				self.proxy.listenTask = nil
+				self:_proxyReleaseReader()
 				self:_proxyAndStream(true)
 				return;
 			end
@@ -639,6 +814,7 @@ function _proxyAccept(self, networkErr)
 	
 	self.jnt:t_removeRead(self.proxyListener)
 	self.proxy.listenTask = nil
+	self:_proxyReleaseReader()
 	
 	if self.proxy.expected > 0 then
 		log:warn('Not all proxy connections accepted: ', networkErr)
@@ -648,11 +824,20 @@ function _proxyAccept(self, networkErr)
 	end
 end
 
+-- let the native reader read the body, once the synced players have connected
+-- or the listener has given up on them
+function _proxyReleaseReader(self)
+	if self.nativeReader and self.stream and self.stream == self.proxy.stream then
+		self.stream:releaseReader()
+	end
+end
+
 function _proxyCleanup(self)
 	if self.proxy then
 		-- close existing connections, etc.
 		self.jnt:t_removeRead(self.proxyListener)
 		self.proxy.listenTask = nil
+		self:_proxyReleaseReader()
 		
 		for i, c in ipairs(self.proxy.connections) do
 			self:_proxyConnClose(c, nil, true)
@@ -700,7 +885,9 @@ function _proxyAndStream(self, canRead)
 		self.jnt:t_removeRead(self.stream)
 	end
 
-	if self.proxy then
+	-- the native reader feeds its proxy clients itself, so synced
+	-- players never hold up reading the stream
+	if self.proxy and not self.nativeReader then
 		if self.proxy.listenTask then
 			return
 		end
@@ -753,11 +940,15 @@ function _streamDisconnect(self, reason, flush)
 	self.jnt:t_removeWrite(self.stream)
 	self.jnt:t_removeRead(self.stream)
 
+	-- native proxy clients have been drained and closed by the reader
+	local nativeProxy = self.nativeReader and self.proxy
+
 	self.stream:disconnect()
 	self.stream = nil
+	self.nativeReader = false
 	
 	if self.proxy then
-		if reason and not reason == TCP_CLOSE_FIN then
+		if nativeProxy or (reason and not reason == TCP_CLOSE_FIN) then
 			self:_proxyCleanup()
 		else 
 			if self.proxy.listenTask then
@@ -770,6 +961,9 @@ function _streamDisconnect(self, reason, flush)
 		end
 	end
 
+	-- the next track can be buffered if all of this one was received
+	self.streamComplete = (reason == TCP_CLOSE_FIN)
+
 	-- Notify SqueezeCenter the stream is closed
 	if (flush) then
 		Stream:flush()
@@ -810,8 +1004,9 @@ function _streamRead(self, networkErr)
 	while n do
 		-- stop reading if the decoder is running. the socket will
 		-- be added again by the status timer. this prevents the 
-		-- streambuf starving the cpu
-		self:_proxyAndStream(not self.sentResumeDecoder)
+		-- streambuf starving the cpu. the native reader only
+		-- delivers events here, so keep listening for those.
+		self:_proxyAndStream(self.nativeReader or not self.sentResumeDecoder)
 
 		_, networkErr = Task:yield(false)
 
@@ -840,7 +1035,7 @@ function _reconnect(self)
 		self:sendStatus(status, "STMl")
 	end
 
-	if self.sentDecoderUnderrunEvent or self.sentAudioUnderrunEvent then
+	if self.sentDecoderUnderrunEvent or self.sentAudioUnderrunEvent or self.sentNextTrackRequest then
 		self:sendStatus(status, "STMd")
 	end
 	if self.sentAudioUnderrunEvent then
@@ -888,13 +1083,31 @@ function _strm(self, data)
 			end
 		end
 		
-		-- if we aborted the stream early, or there's any junk left 
-		-- over, flush out whatever's left.
-		self:_streamDisconnect(nil, true)
+		-- In double-buffered mode a standard stream is buffered behind
+		-- the track that is still being decoded. Other tracks wait until
+		-- it has been decoded.
+		local nextTrack = false
+		if self.sentNextTrackRequest and not self.sentDecoderUnderrunEvent then
+			if data.flags & 0x10 == 0 and data.mode ~= 'n' and data.slaves == 0 then
+				log:debug("buffer next track")
+				nextTrack = true
+			else
+				log:debug("defer next track")
+				self.deferredStrm = data
+				return true
+			end
+		end
+
+		if not nextTrack then
+			-- if we aborted the stream early, or there's any junk left 
+			-- over, flush out whatever's left.
+			self:_streamDisconnect(nil, true)
+		end
 
 		-- reset stream state
 		self.sentResume = false
-		self.sentResumeDecoder = false
+		-- the decoder resumes itself when it switches to the next track
+		self.sentResumeDecoder = nextTrack
 		self.sentDecoderFullEvent = false
 		self.sentDecoderUnderrunEvent = false
 		self.sentOutputUnderrunEvent = false
@@ -902,6 +1115,9 @@ function _strm(self, data)
 		self.isLooping = false
 		self.ignoreStream = false
 		self.decodeThreshold = 2048
+		self.prebufferNext = false
+		self.streamComplete = false
+		self.sentNextTrackRequest = false
 
 		if self.mode == 'o' then
 			-- For Vorbis, where we should use the buffer threshold value
@@ -945,7 +1161,10 @@ function _strm(self, data)
 			self:_streamConnect(serverIp, data.serverPort)
 		else
 			-- standard stream - start the decoder and connect
-			decode:start(string.byte(data.mode),
+			self.prebufferNext = self.doubleBuffer and data.slaves == 0
+
+			local start = nextTrack and decode.startNext or decode.start
+			start(decode, string.byte(data.mode),
 			     string.byte(data.transitionType),
 			     data.transitionPeriod,
 			     data.replayGain,
@@ -957,7 +1176,7 @@ function _strm(self, data)
 			     string.byte(data.pcmChannels),
 			     string.byte(data.pcmEndianness)
 		    )
-			self:_streamConnect(serverIp, data.serverPort, nil, nil, data.slaves)
+			self:_streamConnect(serverIp, data.serverPort, nil, nil, data.slaves, nextTrack)
 		end
 
 	elseif data.command == 'q' then
@@ -968,6 +1187,8 @@ function _strm(self, data)
 
 	elseif data.command == 'f' then
 		-- flush
+		self.sentNextTrackRequest = false
+		self.deferredStrm = nil
 		decode:flush()
 		self:_streamDisconnect(nil, true)
 
@@ -1006,6 +1227,10 @@ end
 
 
 function stopInternal(self)
+	self.sentNextTrackRequest = false
+	self.deferredStrm = nil
+	self.seekFallback = nil
+
 	if self.source ~= "capture" then
 		-- don't call stop when using capture mode
 		decode:stop()
@@ -8,10 +8,14 @@ jive.net.DNS - non-blocking dns queries.
 Implements non-block dns queries using the same api a luasocket. These
 functions must be called in a Task.
 
+Lookups run in parallel and are cached, concurrent queries for the same
+address share one lookup. The hostent table also has an I<ip6> list of
+IPv6 addresses.
+
 --]]
 
 
-local assert = assert
+local assert, ipairs = assert, ipairs
 
 local oo          = require("loop.base")
 local table       = require("table")
@@ -41,6 +45,8 @@ function __init(self, jnt)
 
 	local obj = oo.rawnew(self, {})
 	obj.sock = jive_dns:open()
+
+	-- tasks waiting for each address
 	obj.dnsQueue = {}
 
 	jnt:t_addRead(obj.sock,
@@ -51,11 +57,13 @@ function __init(self, jnt)
 				     Task:yield(false)
 
 				     -- read host entry
-				     local hostent, err = obj.sock:read()
+				     local address, hostent, err = obj.sock:read()
+
+				     -- wake up requesting tasks
+				     local tasks = obj.dnsQueue[address]
+				     obj.dnsQueue[address] = nil
 
-				     -- wake up requesting task
-				     local task = table.remove(obj.dnsQueue, 1)
-				     if task then
+				     for i, task in ipairs(tasks or {}) do
 					     task:addTask(hostent, err)
 				     end
 			     end
@@ -67,6 +75,31 @@ function __init(self, jnt)
 end
 
 
+-- resolve address, from the cache or by waiting for the resolver
+local function _resolve(address)
+	local hostent, err = _instance.sock:lookup(address)
+	if hostent ~= false then
+		return hostent, err
+	end
+
+	local task = Task:running()
+
+	-- queue request, unless the address is already being resolved
+	local tasks = _instance.dnsQueue[address]
+	if not tasks then
+		tasks = {}
+		_instance.dnsQueue[address] = tasks
+		_instance.sock:write(address)
+	end
+
+	-- wait for reply
+	table.insert(tasks, task)
+	local _, hostent, err = Task:yield(false)
+
+	return hostent, err
+end
+
+
 function isip(self, address)
 	-- XXXX crude check
 	return string.match(address, "%d+%.%d+%.%d+%.%d+")
@@ -78,12 +111,7 @@ function tohostname(self, address)
 	local task = Task:running()
 	assert(task, "DNS:tohostname must be called in a Task")
 
-	-- queue request
-	_instance.sock:write(address)
-
-	-- wait for reply
-	table.insert(_instance.dnsQueue, task)
-	local _, hostent, err = Task:yield(false)
+	local hostent, err = _resolve(address)
 
 	if err then
 		return nil, err
@@ -98,12 +126,7 @@ function toip(self, address)
 	local task = Task:running()
 	assert(task, "DNS:toip must be called in a Task")
 
-	-- queue request
-	_instance.sock:write(address)
-
-	-- wait for reply
-	table.insert(_instance.dnsQueue, task)
-	local _, hostent, err = Task:yield(false)
+	local hostent, err = _resolve(address)
 
 	if err then
 		return nil, err
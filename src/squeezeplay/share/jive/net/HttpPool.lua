@@ -164,6 +164,28 @@ function queue(self, request)
 end
 
 
+--[[
+
+=head2 jive.net.HttpPool:cancel(request)
+
+Removes I<request> from the queue if it has not been sent yet. Returns
+true if it was removed, a request already sent is not cancelled.
+
+=cut
+--]]
+function cancel(self, request)
+	for i, r in ipairs(self.reqQueue) do
+		if r == request then
+			table.remove(self.reqQueue, i)
+			self.reqQueueCount = self.reqQueueCount - 1
+			return true
+		end
+	end
+
+	return false
+end
+
+
 -- t_dequeue
 -- returns a request if there is any
 -- called by SocketHttpQueue
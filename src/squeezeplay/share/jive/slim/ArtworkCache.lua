@@ -12,6 +12,7 @@ local os          = require("os")
 local oo          = require("loop.base")
 
 local debug       = require("jive.utils.debug")
+local memory      = require("jive.utils.memory")
 local log         = require("jive.utils.log").logger("squeezebox.server.cache")
 
 
@@ -29,6 +30,9 @@ function __init(self)
 	-- initialise state
 	obj:free()
 
+	-- artwork is shed first when memory is low
+	memory:addCache(obj, "artwork", memory.PRIORITY_ARTWORK)
+
 	return obj
 end
 
@@ -64,6 +68,32 @@ function dump(self)
 end
 
 
+-- free the least recently used entries until bytes are freed
+local function _freeLru(self, bytes)
+	local freed = 0
+
+	while freed < bytes and self.lru do
+		local entry = self.lru
+		log:debug("Free artwork entry=", entry.key, " total=", self.total)
+
+		self.cache[entry.key] = nil
+
+		if entry.prev then
+			entry.prev.next = nil
+		end
+		self.lru = entry.prev
+		if not self.lru then
+			self.mru = nil
+		end
+
+		self.total = self.total - entry.bytes
+		freed = freed + entry.bytes
+	end
+
+	return freed
+end
+
+
 function set(self, key, value)
 	-- clear entry
 	if value == nil then
@@ -106,19 +136,7 @@ function set(self, key, value)
 	end
 
 	-- keep cache under artwork limit
-	while self.total > ARTWORK_LIMIT do
-		local entry = self.lru
-		log:debug("Free artwork entry=", entry.key, " total=", self.total)
-
-		self.cache[entry.key] = nil
-
-		if entry.prev then
-			entry.prev.next = nil
-		end
-		self.lru = entry.prev
-
-		self.total = self.total - #entry.value
-	end
+	_freeLru(self, self.total - ARTWORK_LIMIT)
 
 	if log:isDebug() then
 		self:dump()
@@ -167,6 +185,16 @@ function get(self, key)
 end
 
 
+function memoryUsage(self)
+	return self.total
+end
+
+
+function shedMemory(self, bytes)
+	return _freeLru(self, bytes)
+end
+
+
 --[[
 
 =head1 LICENSE
@@ -0,0 +1,270 @@
+
+--[[
+=head1 NAME
+
+jive.slim.ArtworkDiskCache - Size bounded disk cache for decoded artwork
+
+=head1 DESCRIPTION
+
+Artwork is stored already scaled and in the display format, so it can be
+shown after a restart or a server reconnect without fetching or decoding
+it again. Files are named by the sha1 of their key. The least recently
+used files are removed when the cache grows over its limit.
+
+--]]
+
+local ipairs, pairs, setmetatable = ipairs, pairs, setmetatable
+
+local os          = require("os")
+local string      = require("string")
+local table       = require("table")
+local oo          = require("loop.base")
+local lfs         = require("lfs")
+local sha1        = require("sha1")
+
+local System      = require("jive.System")
+local Surface     = require("jive.ui.Surface")
+
+local debug       = require("jive.utils.debug")
+local log         = require("jive.utils.log").logger("squeezebox.server.cache")
+
+
+-- ArtworkDiskCache is a base class
+module(..., oo.class)
+
+
+-- Limit the disk cache, hardware keeps its cache in flash
+local ARTWORK_DISK_LIMIT = 2 * 1024 * 1024
+local ARTWORK_DISK_LIMIT_DESKTOP = 16 * 1024 * 1024
+
+-- Fraction of the limit kept after an eviction pass
+local ARTWORK_DISK_LOW_WATER = 0.9
+
+
+function __init(self, dir, limit)
+	local obj = oo.rawnew(self, {
+		dir = dir or (System.getUserDir() .. "/cache/artwork"),
+		limit = limit or (System:isHardware() and ARTWORK_DISK_LIMIT or ARTWORK_DISK_LIMIT_DESKTOP),
+
+		-- files by name, scanned on first use
+		files = false,
+
+		-- most and least recently used links
+		mru = nil,
+		lru = nil,
+
+		-- total size in bytes
+		total = 0,
+	})
+
+	return obj
+end
+
+
+local function _unlink(self, file)
+	if file.prev then
+		file.prev.next = file.next
+	else
+		self.mru = file.next
+	end
+	if file.next then
+		file.next.prev = file.prev
+	else
+		self.lru = file.prev
+	end
+
+	file.prev = nil
+	file.next = nil
+end
+
+
+local function _linkMru(self, file)
+	file.prev = nil
+	file.next = self.mru
+
+	if self.mru then
+		self.mru.prev = file
+	else
+		self.lru = file
+	end
+	self.mru = file
+end
+
+
+local function _remove(self, file)
+	os.remove(self.dir .. "/" .. file.name)
+
+	_unlink(self, file)
+	self.files[file.name] = nil
+	self.total = self.total - file.bytes
+end
+
+
+-- build the index of cached files. the last use of a file is only
+-- tracked in memory, after a restart files are ordered by when they
+-- were written. this avoids writing to flash on every cache hit.
+local function _scan(self)
+	self.files = {}
+	self.mru = nil
+	self.lru = nil
+	self.total = 0
+
+	if lfs.attributes(self.dir, "mode") ~= "directory" then
+		local parent = string.match(self.dir, "^(.+)/[^/]+$")
+		if parent and lfs.attributes(parent, "mode") == nil then
+			lfs.mkdir(parent)
+		end
+
+		local ok, err = lfs.mkdir(self.dir)
+		if not ok then
+			log:warn("Can't create artwork cache ", self.dir, ": ", err)
+		end
+		return
+	end
+
+	local scanned = {}
+
+	for name in lfs.dir(self.dir) do
+		local path = self.dir .. "/" .. name
+		local attr = lfs.attributes(path)
+
+		if attr and attr.mode == "file" then
+			if string.find(name, "%.tmp$") then
+				-- left over from an interrupted write
+				os.remove(path)
+			else
+				scanned[#scanned + 1] = {
+					name = name,
+					bytes = attr.size,
+					written = attr.modification,
+				}
+			end
+		end
+	end
+
+	-- oldest first, so the newest ends up most recently used
+	table.sort(scanned, function(a, b) return a.written < b.written end)
+
+	for i, file in ipairs(scanned) do
+		file.written = nil
+
+		self.files[file.name] = file
+		self.total = self.total + file.bytes
+		_linkMru(self, file)
+	end
+
+	log:debug("Artwork disk cache ", self.dir, " bytes=", self.total)
+end
+
+
+local function _evict(self)
+	local lowWater = self.limit * ARTWORK_DISK_LOW_WATER
+
+	while self.total > lowWater and self.lru do
+		log:debug("Free artwork file=", self.lru.name, " total=", self.total)
+
+		_remove(self, self.lru)
+	end
+end
+
+
+function free(self)
+	for name, file in pairs(self.files or {}) do
+		os.remove(self.dir .. "/" .. name)
+	end
+
+	self.files = {}
+	self.mru = nil
+	self.lru = nil
+	self.total = 0
+end
+
+
+--[[
+
+=head2 jive.slim.ArtworkDiskCache:get(key)
+
+Returns the image stored for I<key>, or nil if it is not cached.
+
+=cut
+--]]
+function get(self, key)
+	if not self.files then
+		_scan(self)
+	end
+
+	local name = sha1.digest(key)
+	local file = self.files[name]
+	if not file then
+		return nil
+	end
+
+	local image = Surface:loadPixels(self.dir .. "/" .. name, key)
+	if not image then
+		-- unreadable, or a different key with the same name
+		log:debug("Bad artwork file=", name)
+
+		_remove(self, file)
+		return nil
+	end
+
+	if self.mru ~= file then
+		_unlink(self, file)
+		_linkMru(self, file)
+	end
+
+	return image
+end
+
+
+--[[
+
+=head2 jive.slim.ArtworkDiskCache:set(key, image)
+
+Stores I<image> for I<key>, if it is not already cached.
+
+=cut
+--]]
+function set(self, key, image)
+	if not self.files then
+		_scan(self)
+	end
+
+	local name = sha1.digest(key)
+	if self.files[name] then
+		return
+	end
+
+	-- the file is written in the background
+	local path = self.dir .. "/" .. name
+	local bytes = image:savePixels(path, key)
+	if not bytes then
+		log:debug("Can't write artwork file=", path)
+		return
+	end
+
+	local file = {
+		name = name,
+		bytes = bytes,
+	}
+
+	self.files[name] = file
+	self.total = self.total + bytes
+	_linkMru(self, file)
+
+	if self.total > self.limit then
+		_evict(self)
+	end
+end
+
+
+--[[
+
+=head1 LICENSE
+
+Copyright 2010 Logitech. All Rights Reserved.
+
+This file is licensed under BSD. Please see the LICENSE file for details.
+
+=cut
+--]]
@@ -413,6 +413,27 @@ function play(self)
 end
 
 
+--overridden to seek in the current track locally, when the position is buffered or the
+--whole file is streamed. Otherwise the decoder fails the seek and the server seeks.
+function gototime(self, time)
+	-- synced players and remote streams are left to the server
+	if self.state and (self.state.sync_master or self.state.sync_slaves or self.state.remote) then
+		return Player.gototime(self, time)
+	end
+
+	local ok = self.playback:seek(math.floor(time * 1000), function()
+		Player.gototime(self, time)
+	end)
+	if not ok then
+		return Player.gototime(self, time)
+	end
+
+	self.trackSeen = Framework:getTicks() / 1000
+	self.trackTime = time
+	return nil
+end
+
+
 --overridden to stop playback when powering off
 function setPower(self, on, _, isServerRequest) -- ignoring third param 'sequenceNumber' (only used by parent class's version)
 	if not on then
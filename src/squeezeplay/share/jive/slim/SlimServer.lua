@@ -32,7 +32,7 @@ Notifications:
 
 -- our stuff
 local _assert, assert, tostring, type, tonumber = _assert, assert, tostring, type, tonumber
-local pairs, ipairs, require, setmetatable = pairs, ipairs, require, setmetatable
+local pairs, ipairs, require, setmetatable, next = pairs, ipairs, require, setmetatable, next
 
 local os          = require("os")
 local table       = require("jive.utils.table")
@@ -53,6 +53,7 @@ local Task        = require("jive.ui.Task")
 local Framework   = require("jive.ui.Framework")
 
 local ArtworkCache = require("jive.slim.ArtworkCache")
+local ArtworkDiskCache = require("jive.slim.ArtworkDiskCache")
 
 local debug       = require("jive.utils.debug")
 local log         = require("jive.utils.log").logger("squeezebox.server")
@@ -63,6 +64,9 @@ local jnt          = jnt
 
 local SERVER_DISCONNECT_LAG_TIME = 10000
 
+-- number of decoded images kept referenced, for prefetched artwork
+local ARTWORK_DECODED_KEEP = 24
+
 -- jive.slim.SlimServer is a base class
 module(..., oo.class)
 
@@ -95,6 +99,14 @@ local credentials = {}
 
 local lastServerSwitchT = nil
 
+-- artwork being decoded in the background by ticket, shared by all servers
+local artworkDecodeSinks = {}
+local artworkDecodeTask = false
+local artworkDecodeSocket = false
+
+-- decoded artwork kept on disk, shared by all servers
+local artworkDiskCache = ArtworkDiskCache()
+
 --holds the server for which a local connection request has been made. Will be nilled out when SERVER_DISCONNECT_LAG_TIME has passed.
 local locallyRequestedServers = {}
 
@@ -521,13 +533,26 @@ function __init(self, jnt, id, name, version)
 		-- artwork cache: Weak table storing a surface by iconId
 		artworkCache = ArtworkCache(),
 
-		-- Icons waiting for the given iconId
+		-- Icons waiting for the given iconId, and the icons waiting
+		-- for each cacheKey
 		artworkThumbIcons = {},
+		artworkKeyIcons = {},
 
-		-- queue of artwork to fetch
+		-- queue of artwork to fetch, and queued entries by cacheKey
 		artworkFetchQueue = {},
+		artworkFetchKeys = {},
 		artworkFetchCount = 0,
 
+		-- fetches in flight by cacheKey
+		artworkFetching = {},
+
+		-- prefetches from older generations are dropped
+		artworkPrefetchGeneration = 0,
+
+		-- artwork being decoded, and the most recently decoded images
+		artworkDecoding = {},
+		artworkDecoded = {},
+
 		-- loaded images
 		imageCache = {},
 	})
@@ -675,6 +700,7 @@ function free(self)
 	-- clear cache
 	self.artworkCache:free()
 	self.artworkThumbIcons = {}
+	self.artworkKeyIcons = {}
 
 	-- server is gone
 	self.lastSeen = 0
@@ -926,6 +952,15 @@ function linked(self, pin)
 end
 
 
+-- parse size specification for width and height if in format <W>x<H>
+local function _artworkSize(size)
+	local sizeW = tonumber(string.match(size, "(%d+)x%d+") or size)
+	local sizeH = tonumber(string.match(size, "%d+x(%d+)") or size)
+
+	return sizeW, sizeH
+end
+
+
 -- convert artwork to a resized image
 local function _loadArtworkImage(self, cacheKey, chunk, size)
 	-- create a surface
@@ -939,9 +974,7 @@ local function _loadArtworkImage(self, cacheKey, chunk, size)
 		return nil
 	end
 
-	-- parse size specification for width and height if in format <W>x<H>
-	local sizeW = tonumber(string.match(size, "(%d+)x%d+") or size)
-	local sizeH = tonumber(string.match(size, "%d+x(%d+)") or size)
+	local sizeW, sizeH = _artworkSize(size)
 
 	-- Resize image
 	-- Note this allows for artwork to be resized to a larger
@@ -959,6 +992,197 @@ local function _loadArtworkImage(self, cacheKey, chunk, size)
 
 	-- cache image
 	self.imageCache[cacheKey] = image
+	artworkDiskCache:set(self.id .. "/" .. cacheKey, image)
+
+	return image
+end
+
+
+-- returns true if an icon is still waiting for cacheKey
+local function _artworkWanted(self, cacheKey)
+	return self.artworkKeyIcons[cacheKey] ~= nil
+end
+
+
+-- returns true if a fetch is no longer needed, either a prefetch from an
+-- older render or a fetch for icons that have since been reused
+local function _artworkStale(self, entry)
+	if entry.prefetch then
+		return entry.prefetch < self.artworkPrefetchGeneration
+			and not _artworkWanted(self, entry.key)
+	else
+		return entry.icon and not _artworkWanted(self, entry.key)
+	end
+end
+
+
+-- cancel a fetch in flight. a request still queued in the pool is removed
+-- and a remote fetch is closed. a request already sent on a pool
+-- connection completes, closing it would fail the other requests.
+local function _cancelArtworkFetch(self, entry)
+	if entry.http then
+		entry.cancelled = true
+		entry.http:close("cancelled")
+	elseif self.artworkPool and self.artworkPool:cancel(entry.req) then
+		entry.cancelled = true
+		self.artworkFetching[entry.key] = nil
+		self.artworkFetchCount = self.artworkFetchCount - 1
+		self.artworkFetchTask:addTask()
+	else
+		return
+	end
+
+	logcache:debug("..cancelled artwork ", entry.key)
+
+	-- release cache marker
+	self.artworkCache:set(entry.key, nil)
+end
+
+
+-- set the cacheKey icon is waiting for, or nil. a fetch in flight for the
+-- previous cacheKey is cancelled if nothing else wants it.
+local function _setArtworkIcon(self, icon, cacheKey)
+	local oldKey = self.artworkThumbIcons[icon]
+	if oldKey == cacheKey then
+		return
+	end
+
+	self.artworkThumbIcons[icon] = cacheKey
+
+	local icons = oldKey and self.artworkKeyIcons[oldKey]
+	if icons then
+		icons[icon] = nil
+
+		if next(icons) == nil then
+			self.artworkKeyIcons[oldKey] = nil
+
+			local entry = self.artworkFetching[oldKey]
+			if entry and _artworkStale(self, entry) then
+				_cancelArtworkFetch(self, entry)
+			end
+		end
+	end
+
+	if cacheKey then
+		icons = self.artworkKeyIcons[cacheKey]
+		if not icons then
+			icons = {}
+			self.artworkKeyIcons[cacheKey] = icons
+		end
+		icons[icon] = true
+	end
+end
+
+
+-- set image to all icons waiting for cacheKey
+local function _setArtworkImage(self, cacheKey, image)
+	local icons = self.artworkKeyIcons[cacheKey]
+	if not icons then
+		return
+	end
+
+	self.artworkKeyIcons[cacheKey] = nil
+
+	for icon in pairs(icons) do
+		icon:setValue(image)
+		self.artworkThumbIcons[icon] = nil
+	end
+end
+
+
+-- collect artwork decoded in the background, the task runs when the
+-- decode thread signals a result on its socket
+local function _artworkDecodeTask()
+	while true do
+		local ticket, image = Surface:loadImageDataResult()
+		while ticket do
+			local sink = artworkDecodeSinks[ticket]
+			artworkDecodeSinks[ticket] = nil
+
+			if sink then
+				sink(image)
+			end
+
+			ticket, image = Surface:loadImageDataResult()
+		end
+
+		Task:yield(false)
+	end
+end
+
+
+-- keep the most recent images referenced, otherwise prefetched artwork
+-- is collected from the weak image cache before it is shown
+local function _keepArtworkImage(self, image)
+	local decoded = self.artworkDecoded
+	decoded[#decoded + 1] = image
+	if #decoded > ARTWORK_DECODED_KEEP then
+		table.remove(decoded, 1)
+	end
+end
+
+
+-- decode artwork off the ui thread, falling back to decoding it now
+local function _decodeArtworkImage(self, cacheKey, chunk, size)
+	if self.artworkDecoding[cacheKey] then
+		return
+	end
+
+	local sizeW, sizeH = _artworkSize(size)
+
+	local ticket = Surface:loadImageDataAsync(chunk, sizeW, sizeH)
+	if not ticket then
+		_setArtworkImage(self, cacheKey, _loadArtworkImage(self, cacheKey, chunk, size))
+		return
+	end
+
+	self.artworkDecoding[cacheKey] = true
+
+	artworkDecodeSinks[ticket] = function(image)
+		self.artworkDecoding[cacheKey] = nil
+
+		local w, h = 0, 0
+		if image then
+			w, h = image:getSize()
+		end
+
+		-- don't display empty artwork
+		if w == 0 or h == 0 then
+			self.imageCache[cacheKey] = true
+			image = nil
+		else
+			self.imageCache[cacheKey] = image
+			artworkDiskCache:set(self.id .. "/" .. cacheKey, image)
+
+			_keepArtworkImage(self, image)
+		end
+
+		_setArtworkImage(self, cacheKey, image)
+	end
+
+	if not artworkDecodeTask then
+		local fd = Surface:loadImageDataFd()
+		artworkDecodeSocket = {
+			getfd = function() return fd end,
+		}
+
+		artworkDecodeTask = Task("artworkDecode", nil, _artworkDecodeTask)
+		self.jnt:t_addRead(artworkDecodeSocket, artworkDecodeTask, 0) -- no timeout
+	end
+end
+
+
+-- load already decoded artwork from the disk cache
+local function _loadArtworkDisk(self, cacheKey)
+	local image = artworkDiskCache:get(self.id .. "/" .. cacheKey)
+	if not image then
+		return nil
+	end
+
+	logcache:debug("..artwork on disk")
+
+	self.imageCache[cacheKey] = image
+	_keepArtworkImage(self, image)
 
 	return image
 end
@@ -966,20 +1190,27 @@ end
 
 -- _getArworkThumbSink
 -- returns a sink for artwork so we can cache it as Surface before sending it forward
-local function _getArtworkThumbSink(self, cacheKey, size, url)
+local function _getArtworkThumbSink(self, entry)
+	local cacheKey, size, url = entry.key, entry.size, entry.url
 
 	assert(size)
 	
 	return function(chunk, err)
 
 		if err or chunk then
+			if self.artworkFetching[cacheKey] == entry then
+				self.artworkFetching[cacheKey] = nil
+			end
+
 			-- allow more artwork to be fetched
 			self.artworkFetchCount = self.artworkFetchCount - 1
 			self.artworkFetchTask:addTask()
 		end
 
 		-- on error, print something...
-		if err then
+		if err and entry.cancelled then
+			return
+		elseif err then
 			logcache:error("_getArtworkThumbSink(", url, ") error: ", err)
 		end
 		-- if we have data
@@ -989,42 +1220,74 @@ local function _getArtworkThumbSink(self, cacheKey, size, url)
 			-- store the compressed artwork in the cache
 			self.artworkCache:set(cacheKey, chunk)
 
-			local image = _loadArtworkImage(self, cacheKey, chunk, size)
+			_decodeArtworkImage(self, cacheKey, chunk, size)
+		end
+	end
+end
 
-			-- set it to all icons waiting for it
-			local icons = self.artworkThumbIcons
-			for icon, key in pairs(icons) do
-				if key == cacheKey then
-					icon:setValue(image)
-					icons[icon] = nil
-				end
+
+-- remove the most urgent entry from the fetch queue. entries are taken in
+-- priority order, and most recent first for equal priority. stale entries
+-- are dropped.
+local function _nextArtworkEntry(self)
+	local queue = self.artworkFetchQueue
+	local best, bestIndex
+
+	for i = #queue, 1, -1 do
+		local entry = queue[i]
+
+		if _artworkStale(self, entry) then
+			logcache:debug("..dropping stale artwork ", entry.key)
+
+			table.remove(queue, i)
+			self.artworkFetchKeys[entry.key] = nil
+			self.artworkCache:set(entry.key, nil)
+
+			if bestIndex then
+				bestIndex = bestIndex - 1
 			end
+		elseif not best or entry.priority < best.priority then
+			best, bestIndex = entry, i
 		end
 	end
+
+	if best then
+		table.remove(queue, bestIndex)
+		self.artworkFetchKeys[best.key] = nil
+	end
+
+	return best
 end
 
 
 function processArtworkQueue(self)
 	while true do
 		while self.artworkFetchCount < 4 and #self.artworkFetchQueue > 0 do
-			-- remove tail entry
-			local entry = table.remove(self.artworkFetchQueue)
+			local entry = _nextArtworkEntry(self)
+			if not entry then
+				break
+			end
 
 			--log:debug("ARTWORK ID=", entry.key)
 			local req = RequestHttp(
-				_getArtworkThumbSink(self, entry.key, entry.size, entry.url),
+				_getArtworkThumbSink(self, entry),
 				'GET',
 				entry.url
 			)
 
 			self.artworkFetchCount = self.artworkFetchCount + 1
 
+			-- keep the request so it can be cancelled
+			entry.req = req
+			self.artworkFetching[entry.key] = entry
+
 			if string.find(entry.url, "^http") then
 				-- image from remote server
 
 				-- XXXX manage pool of connections to remote server
 				local uri  = req:getURI()
 				local http = SocketHttp(self.jnt, uri.host, uri.port, uri.host)
+				entry.http = http
  
 				http:fetch(req)
 			elseif self.artworkPool then
@@ -1033,6 +1296,7 @@ function processArtworkQueue(self)
 			else
 				log:error("Server ", self.name, " cannot handle artwork for ", entry.url)
 				self.artworkFetchCount = self.artworkFetchCount - 1
+				self.artworkFetching[entry.key] = nil
 			end
 
 			-- try again
@@ -1081,7 +1345,7 @@ function cancelArtwork(self, icon)
 			--only set nil if not already nil
 			icon:setValue(nil)
 		end
-		self.artworkThumbIcons[icon] = nil
+		_setArtworkIcon(self, icon, nil)
 	end
 end
 
@@ -1103,16 +1367,86 @@ function cancelAllArtwork(self, icon)
 		self.artworkCache:set(cacheKey, nil)
 
 		-- release icons
-		local icons = self.artworkThumbIcons
-		for icon, key in pairs(icons) do
-			if key == cacheKey then
-				icons[icon] = nil
+		local icons = self.artworkKeyIcons[cacheKey]
+		if icons then
+			for icon in pairs(icons) do
+				self.artworkThumbIcons[icon] = nil
 			end
+			self.artworkKeyIcons[cacheKey] = nil
 		end
 	end
 
 	-- clear the queue
 	self.artworkFetchQueue = {}
+	self.artworkFetchKeys = {}
+end
+
+
+-- returns the url to fetch artwork for iconId
+local function _artworkUrl(iconId, size, imgFormat)
+	-- parse size specification for width and height if in format <W>x<H>
+	local sizeW = string.match(size, "(%d+)x%d+") or size
+	local sizeH = string.match(size, "%d+x(%d+)") or size
+
+	-- request SqueezeCenter resizes the thumbnail, use 'm' for
+	-- original aspect ratio
+	local resizeFrag = '_' .. sizeW .. 'x' .. sizeH .. '_m'
+
+	local url
+	if string.match(iconId, "^[%x%-]+$") then
+		-- if the iconId is a hex digit, this is a coverid or remote track id (a negative id)
+		url = '/music/' .. iconId .. '/cover' .. resizeFrag
+		if imgFormat then
+		 	url = url .. "." .. imgFormat
+		end
+	else
+		-- Use the SN image resizer on all remote URLs until SP can resize images with better quality
+		if string.find(iconId, "^http") then
+			-- Bug 13937, if URL references a private IP address, don't use imageproxy
+			-- Tests for a numeric IP first to avoid extra string.find calls
+			if string.find(iconId, "^http://%d") and (
+				string.find(iconId, "^http://192%.168") or
+				string.find(iconId, "^http://172%.16%.") or
+				string.find(iconId, "^http://10%.")
+			) then
+				url = iconId
+			else
+				url = 'http://' .. jnt:getSNHostname() .. '/public/imageproxy?w=' .. sizeW .. '&h=' .. sizeH .. '&f=' .. (imgFormat or '') .. '&u=' .. string.urlEncode(iconId)
+			end
+		else
+			url = string.gsub(iconId, "(.+)(%.%a+)", "%1" .. resizeFrag .. "%2")
+
+			if not string.find(url, "^/") then
+				-- Bug 7123, Add a leading slash if needed
+				url = "/" .. url
+			end
+		end
+		
+		logcache:debug("_artworkUrl(", iconId, " => ", url, ")")
+	end
+
+	return url
+end
+
+
+-- queue a request for the artwork
+local function _queueArtwork(self, cacheKey, iconId, size, imgFormat, priority, prefetch, icon)
+	self.artworkCache:set(cacheKey, true)
+
+	local entry = {
+		key = cacheKey,
+		id = iconId,
+		url = _artworkUrl(iconId, size, imgFormat),
+		size = size,
+		priority = priority,
+		prefetch = prefetch,
+		icon = icon,
+	}
+
+	table.insert(self.artworkFetchQueue, entry)
+	self.artworkFetchKeys[cacheKey] = entry
+
+	self.artworkFetchTask:addTask()
 end
 
 
@@ -1143,96 +1477,128 @@ function fetchArtwork(self, iconId, icon, size, imgFormat)
 		if image == true then
 			if icon then
 				icon:setValue(nil)
-				self.artworkThumbIcons[icon] = cacheKey
+				_setArtworkIcon(self, icon, cacheKey)
 			end
 			return
 		else
 			if icon then
 				icon:setValue(image)
-				self.artworkThumbIcons[icon] = nil
+				_setArtworkIcon(self, icon, nil)
 			end
 			return
 		end
 	end
 	
+	-- or is the decoded artwork on disk?
+	if not self.artworkCache:get(cacheKey) then
+		image = _loadArtworkDisk(self, cacheKey)
+		if image then
+			if icon then
+				icon:setValue(image)
+				_setArtworkIcon(self, icon, nil)
+			end
+			return
+		end
+	end
+
 	-- or is the compressed artwork cached?
 	local artwork = self.artworkCache:get(cacheKey)
 	if artwork then
 		if artwork == true then
 			logcache:debug("..artwork already requested")
+
+			-- a queued or fetching prefetch is now wanted on screen
+			local entry = self.artworkFetchKeys[cacheKey] or self.artworkFetching[cacheKey]
+			if entry then
+				entry.priority = 0
+				entry.prefetch = false
+				entry.icon = entry.icon or icon ~= nil
+			end
+
 			if icon then
 				icon:setValue(nil)
-				self.artworkThumbIcons[icon] = cacheKey
+				_setArtworkIcon(self, icon, cacheKey)
 			end
 			return
 		else
 			logcache:debug("..artwork in cache")
 			if icon then
-				image = _loadArtworkImage(self, cacheKey, artwork, size)
-				icon:setValue(image)
-				self.artworkThumbIcons[icon] = nil
+				-- decode it now rather than flash an empty icon, unless
+				-- a background decode is already on its way
+				if self.artworkDecoding[cacheKey] then
+					icon:setValue(nil)
+					_setArtworkIcon(self, icon, cacheKey)
+				else
+					icon:setValue(_loadArtworkImage(self, cacheKey, artwork, size))
+					_setArtworkIcon(self, icon, nil)
+				end
 			end
 			return
 		end
 	end
 
-	-- parse size specification for width and height if in format <W>x<H>
-	local sizeW = string.match(size, "(%d+)x%d+") or size
-	local sizeH = string.match(size, "%d+x(%d+)") or size
+	-- generate a request for the artwork
+	if icon then
+		icon:setValue(nil)
+		_setArtworkIcon(self, icon, cacheKey)
+	end
+	logcache:debug("..fetching artwork")
 
-	-- request SqueezeCenter resizes the thumbnail, use 'm' for
-	-- original aspect ratio
-	local resizeFrag = '_' .. sizeW .. 'x' .. sizeH .. '_m'
+	_queueArtwork(self, cacheKey, iconId, size, imgFormat, 0, false, icon ~= nil)
+end
 
-	local url
-	if string.match(iconId, "^[%x%-]+$") then
-		-- if the iconId is a hex digit, this is a coverid or remote track id (a negative id)
-		url = '/music/' .. iconId .. '/cover' .. resizeFrag
-		if imgFormat then
-		 	url = url .. "." .. imgFormat
-		end
-	else
-		-- Use the SN image resizer on all remote URLs until SP can resize images with better quality
-		if string.find(iconId, "^http") then
-			-- Bug 13937, if URL references a private IP address, don't use imageproxy
-			-- Tests for a numeric IP first to avoid extra string.find calls
-			if string.find(iconId, "^http://%d") and (
-				string.find(iconId, "^http://192%.168") or
-				string.find(iconId, "^http://172%.16%.") or
-				string.find(iconId, "^http://10%.")
-			) then
-				url = iconId
-			else
-				url = 'http://' .. jnt:getSNHostname() .. '/public/imageproxy?w=' .. sizeW .. '&h=' .. sizeH .. '&f=' .. (imgFormat or '') .. '&u=' .. string.urlEncode(iconId)
-			end
-		else
-			url = string.gsub(iconId, "(.+)(%.%a+)", "%1" .. resizeFrag .. "%2")
 
-			if not string.find(url, "^/") then
-				-- Bug 7123, Add a leading slash if needed
-				url = "/" .. url
-			end
-		end
-		
-		logcache:debug(self, ":fetchArtwork(", iconId, " => ", url, ")")
+--[[
+
+=head2 jive.slim.SlimServer:beginArtworkPrefetch()
+
+Starts a new round of prefetching. Prefetches queued before this call
+that are not requested again by L<prefetchArtwork> are dropped before
+they are fetched.
+
+=cut
+--]]
+function beginArtworkPrefetch(self)
+	self.artworkPrefetchGeneration = self.artworkPrefetchGeneration + 1
+end
+
+
+--[[
+
+=head2 jive.slim.SlimServer:prefetchArtwork(iconId, size, imgFormat, priority)
+
+Fetch and decode the artwork for I<iconId> ahead of it being displayed.
+Visible artwork is always fetched first, then prefetches in order of
+I<priority>, lowest first.
+
+=cut
+--]]
+function prefetchArtwork(self, iconId, size, imgFormat, priority)
+	assert(size)
+
+	local cacheKey = iconId .. "@" .. size .. "/" .. (imgFormat or '')
+
+	if self.imageCache[cacheKey] or self.artworkDecoding[cacheKey] then
+		return
 	end
 
-	-- generate a request for the artwork
-	self.artworkCache:set(cacheKey, true)
-	if icon then
-		icon:setValue(nil)
-		self.artworkThumbIcons[icon] = cacheKey
+	local artwork = self.artworkCache:get(cacheKey)
+	if not artwork and _loadArtworkDisk(self, cacheKey) then
+		return
 	end
-	logcache:debug("..fetching artwork")
 
-	-- queue up the request on a lifo
-	table.insert(self.artworkFetchQueue, {
-			     key = cacheKey,
-			     id = iconId,
-			     url = url,
-			     size = size,
-		     })
-	self.artworkFetchTask:addTask()
+	if artwork == true then
+		-- already queued or in flight, refresh its prefetch
+		local entry = self.artworkFetchKeys[cacheKey] or self.artworkFetching[cacheKey]
+		if entry and entry.prefetch then
+			entry.prefetch = self.artworkPrefetchGeneration
+			entry.priority = priority
+		end
+	elseif artwork then
+		_decodeArtworkImage(self, cacheKey, artwork, size)
+	else
+		_queueArtwork(self, cacheKey, iconId, size, imgFormat, priority, self.artworkPrefetchGeneration, false)
+	end
 end
 
 function getAppParameters(self, appType)
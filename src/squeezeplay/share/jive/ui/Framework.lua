@@ -47,6 +47,10 @@ local jnt           = jnt
 
 local LONG_HOLD_TIME  = 3500
 
+-- longest sleep when idle in demand driven mode, the ui watchdog is
+-- pinged on each wakeup
+local IDLE_TIMEOUT = 10000
+
 -- our class
 module(..., oo.class)
 
@@ -157,6 +161,18 @@ Sets the background image I<image>.
 
 Indicates the style parameters have changed, this clears any caching of the style values used.
 
+=head2 jive.ui.Framework:isFrameNeeded()
+
+Returns true if the screen is dirty, a layout is pending, or an animation or transition is running.
+
+=head2 jive.ui.Framework:getEventTimeout()
+
+Returns the number of milliseconds until the event queue next needs processing for queued events, key and mouse holds or input polling, or nil if it is waiting for input.
+
+=head2 jive.ui.Framework:getEventFds()
+
+Returns a list of the input file descriptors registered by the platform.
+
 =cut
 --]]
 
@@ -275,13 +291,50 @@ end
 
 --[[
 
-=head2 jive.ui.Framework:eventLoop(netTask)
+=head2 jive.ui.Framework:setDemandDriven(enabled)
 
-Main event loop.
+In demand driven mode the event loop sleeps until input, a timer, socket activity or an animation needs it, instead of running every frame. This is enabled by default if the platform has input file descriptors to wake on.
 
 =cut
 --]]
-function eventLoop(self, netTask)
+function setDemandDriven(self, enabled)
+	self.demandDriven = enabled
+end
+
+
+-- when the event loop next needs to run in demand driven mode
+local function _nextWakeup(self, now, framedue)
+	-- drawing, animating or in a transition
+	if self:isFrameNeeded() then
+		return framedue
+	end
+
+	local wakeup = now + IDLE_TIMEOUT
+
+	-- queued events, input holds and polling
+	local timeout = self:getEventTimeout()
+	if timeout then
+		wakeup = math.min(wakeup, now + timeout)
+	end
+
+	local expires = Timer:_nextExpiry()
+	if expires then
+		wakeup = math.min(wakeup, expires)
+	end
+
+	return math.max(wakeup, framedue)
+end
+
+
+--[[
+
+=head2 jive.ui.Framework:eventLoop(netTask, jnt)
+
+Main event loop. I<jnt> is used to wake from an idle sleep on input.
+
+=cut
+--]]
+function eventLoop(self, netTask, jnt)
 
 	local eventTask =
 		Task("ui",
@@ -291,6 +344,31 @@ function eventLoop(self, netTask)
 			     while self:processEvents() do end
 		     end)
 
+	-- input file descriptors, these are only selected while idle
+	-- as input is pumped once per frame
+	local wakeTask =
+		Task("uiwake",
+		     self,
+		     function(self)
+			     while true do
+				     Task:yield(false)
+			     end
+		     end)
+
+	local wakeFds = {}
+	if jnt then
+		for i, fd in ipairs(self:getEventFds()) do
+			wakeFds[i] = {
+				getfd = function() return fd end,
+			}
+		end
+	end
+	local wakeFdsSelected = false
+
+	if self.demandDriven == nil then
+		self.demandDriven = #wakeFds > 0
+	end
+
 
 	collectgarbage("collect")
 	collectgarbage("stop")
@@ -326,25 +404,45 @@ function eventLoop(self, netTask)
 
 		-- call the network task, if no tasks are runnable this blocks
 		-- until a file descriptor is ready for io or it will timeout
-		-- before the next frame should be drawn
+		-- before the next frame should be drawn. in demand driven mode
+		-- an idle loop sleeps until the next timer or input instead.
+		local idle = false
 		if tasks then
 			netTask:setArgs(0)
+		elseif self.demandDriven then
+			local wakeup = _nextWakeup(self, now, framedue)
+			idle = wakeup > framedue
+			netTask:setArgs(wakeup - now)
 		else
 			netTask:setArgs(framedue - now)
 		end
+
+		if idle ~= wakeFdsSelected then
+			for i, obj in ipairs(wakeFds) do
+				if idle then
+					jnt:t_addRead(obj, wakeTask, 0)
+				else
+					jnt:t_removeRead(obj)
+				end
+			end
+			wakeFdsSelected = idle
+		end
+
 		netTask:resume()
 
 		-- draw frame and process ui event queue
 		now = self:getTicks()
+		if idle and wakeTask.state == "active" then
+			-- woken by input
+			framedue = now
+		end
+
 		if framedue <= now then
 			logTask:debug("--------")
 
 			-- draw screen
 			self:updateScreen()
 
-			-- keep on top of the garbage
-			collectgarbage("step")
-
 			-- process ui event once per frame
 			Timer:_runTimer(now)
 			running = eventTask:resume()
@@ -354,9 +452,15 @@ function eventLoop(self, netTask)
 
 			now = self:getTicks()
 			if now > framedue - framerefresh then
-				logTask:debug("Dropped frame. delay=", now-framedue, "ms")
+				if not idle then
+					logTask:debug("Dropped frame. delay=", now-framedue, "ms")
+				end
 				framedue = now + framerefresh
 			end
+
+			-- keep on top of the garbage in the time left before
+			-- the next frame, or fully if there is nothing to draw
+			jive.gcstep(framedue - now - framerefresh, not self:isFrameNeeded())
 		end
 	end
 
@@ -1016,6 +1016,9 @@ function __init(self, style, itemRenderer, itemListener, itemAvailable, contextM
 	obj.selected = nil      -- index of selected widget
 	obj.accel = false       -- true if the window is accelerated
 	obj.dir = 0             -- last direction of scrolling
+	obj.scrollVelocity = 0  -- smoothed scroll speed in items per second
+	obj.velocityTopItem = 1
+	obj.velocityT = 0
 
 
 	obj.wraparoundGap = 0
@@ -1308,6 +1311,22 @@ function isAccelerated(self)
 end
 
 
+--[[
+
+=head2 jive.ui.Menu:getScrollVelocity()
+
+Returns the current scroll velocity in items per second. The value is
+negative when scrolling towards the top of the list, and decays to zero
+once the menu stops moving. This may be used to decide how far ahead
+of the visible items to prefetch.
+
+=cut
+--]]
+function getScrollVelocity(self)
+	return self.scrollVelocity
+end
+
+
 --[[
 
 =head2 jive.ui.Menu:lock(self, cancel)
@@ -1558,6 +1577,22 @@ function _scrollList(self)
 end
 
 
+-- track how fast the top item is moving, smoothed over successive layouts
+local function _updateScrollVelocity(self, topItem)
+	local now = Framework:getTicks()
+	local dt = now - self.velocityT
+
+	if dt <= 0 then
+		return
+	end
+
+	local velocity = (topItem - self.velocityTopItem) * 1000 / dt
+	self.scrollVelocity = (self.scrollVelocity + velocity) / 2
+	self.velocityTopItem = topItem
+	self.velocityT = now
+end
+
+
 function _updateWidgets(self)
 
 	local jumpScrollBottom = self.topItem + self.numWidgets
@@ -1580,6 +1615,8 @@ function _updateWidgets(self)
 	end
 	local indexSize = (max - min) + 1
 
+	_updateScrollVelocity(self, min)
+
 
 	-- create index list
 	local indexList = {}
@@ -37,6 +37,22 @@ Load an image from I<path>. If I<path> is relative the lua path is searched for
 
 Load an image from I<data> using I<len> bytes. Returns the loaded image.
 
+=head2 loadImageDataAsync(data, w, h)
+
+Queue I<data> to be decoded on a background thread. If I<w> and I<h> are given the image is scaled to fit, unless one dimension already matches. Returns a ticket, or nil if images cannot be decoded in the background.
+
+=head2 loadImageDataResult()
+
+Returns the ticket and image of the next completed background decode, or nil if none has completed.
+
+=head2 loadImageDataFd()
+
+Returns a file descriptor that is readable while a background decode result can be collected, or nil if images cannot be decoded in the background.
+
+=head2 loadPixels(path, key)
+
+Load an image saved with savePixels from I<path>. Returns nil if the file can't be read or was saved with a different I<key>.
+
 =head2 drawText(font, color, str)
 
 Draw text I<str> in font I<font>, in color I<color>. Returns a new surface containing the text.
@@ -69,6 +85,10 @@ Blits this surface to the I<dst> surface at I<dx, dy> using a per surface alpha
 
 Returns I<w, h>, the surface size.
 
+=head2 savePixels(path, key)
+
+Save the surface pixels in the display format to I<path>, tagged with I<key>. The file is written in the background. Returns the size of the file in bytes, or nil if it can't be saved.
+
 =head2 release()
 
 Free the wrapped surface object. This can be useful if temporary surfaces are created frequently (such as when using rotozoom), Lua has
@@ -8,6 +8,7 @@ local oo               = require("loop.base")
 local debug            = require("jive.utils.debug")
 local table            = require("jive.utils.table")
 local coxpcall         = require("jive.utils.coxpcall")
+local taskqueue        = require("jive.taskqueue")
 
 local log              = require("jive.utils.log").logger("squeezeplay.task")
 
@@ -21,10 +22,8 @@ PRIORITY_HIGH = 2
 PRIORITY_LOW = 3
 
 
--- the task list is modified while iterating over the entries,
--- we use a linked list to make the iteration easier
--- three queues: streaming, high and low
-local taskHead = { nil, nil, nil }
+-- runnable tasks are kept in a native run queue, see jive_task.c.
+-- there are three queues: streaming, high and low
 
 -- the task that is active, or nil for the main thread
 local taskRunning = nil
@@ -44,6 +43,8 @@ function __init(self, name, obj, f, errf, priority)
 				      priority = priority or PRIORITY_LOW,
 			      })
 
+	obj.node = taskqueue.node(obj.priority)
+
 	return obj
 end
 
@@ -53,13 +54,17 @@ function resume(self)
 	log:debug("task: ", self.name)
 
 	taskRunning = self
+	taskqueue.begin(self.node, self.thread)
 
 	local nerr, val = coroutine.resume(self.thread, self.obj, unpack(self.args))
 
+	local alive = (coroutine.status(self.thread) ~= "dead")
+	taskqueue.finish(self.node, nerr and alive)
+
 	taskRunning = nil
 	if nerr then
 		if val == nil then
-			val = (coroutine.status(self.thread) ~= "dead")
+			val = alive
 		end
 
 		if val then
@@ -105,21 +110,8 @@ function addTask(self, ...)
 
 	self.args = { ... }
 	self.state = "active"
-	self.next = nil
 
-	if taskHead[self.priority] == nil then
-		taskHead[self.priority] = self
-	else
-		local entry = taskHead[self.priority]
-		while entry do
-			if not entry.next then
-				entry.next = self
-				break
-			end
-
-			entry = entry.next
-		end
-	end
+	taskqueue.add(self.node, self)
 
 	return true
 end
@@ -131,29 +123,18 @@ function removeTask(self)
 
 	self.state = "suspended"
 
-	-- unlink from linked list
-	if not taskHead then
-		return
-	end
-
-	if taskHead[self.priority] == self then
-		if taskHead[self.priority].next then
-			taskHead[self.priority] = self.next
-		else
-			taskHead[self.priority] = nil
-		end
-		return
-	end
+	taskqueue.remove(self.node)
+end
 
-	local entry = taskHead[self.priority]
-	while entry do
-		if entry.next == self then
-			entry.next = self.next
-			return
-		end
 
-		entry = entry.next
-	end
+-- returns a table of the run time accounting for this task: the number
+-- of resumes, the number of yields and the total and longest time slice
+-- in milliseconds
+function getStats(self)
+	local stats = taskqueue.stats(self.node)
+	stats.name = self.name
+	stats.priority = self.priority
+	return stats
 end
 
 
@@ -178,44 +159,24 @@ end
 
 
 function dump(class)
-	local header = false
+	local tasks = taskqueue.list()
 
-	for i,v in pairs(taskHead) do
-		local entry = taskHead[i]
-
-		if entry and not header then
-			log:info("Task queue:")
-			header = true
-		end
+	if #tasks > 0 then
+		log:info("Task queue:")
+	end
 
-		while entry do
-			log:info(i, ": ", entry.name, " (", entry, ")")
-			entry = entry.next
-		end
+	for i, entry in ipairs(tasks) do
+		local stats = taskqueue.stats(entry.node)
+		log:info(entry.priority, ": ", entry.name, " (", entry, ") resumes=", stats.resumes, " yields=", stats.yields, " runtime=", stats.runtime, "ms max=", stats.maxSlice, "ms")
 	end
 end
 
 
 -- iterate over the task list. it is safe to add or remove tasks while
--- iterating.
+-- iterating, only one iteration can be active at a time.
 function iterator(class)
-	local entry = true
-	local priority = 1
-
-	return function()
-		       if entry == true then
-			       entry = taskHead[priority]
-		       else
-			       entry = entry.next
-		       end
-
-		       while entry == nil and priority < PRIORITY_LOW do
-			       priority = priority + 1
- 			       entry = taskHead[priority]
-		       end
-
-		       return entry
-	       end
+	taskqueue.rewind()
+	return taskqueue.next
 end
 
 
@@ -29,7 +29,7 @@ A timer object.
 local _assert, ipairs, pcall, string, tostring, type = _assert, ipairs, pcall, string, tostring, type
 
 local oo	= require("loop.base")
-local table	= require("jive.utils.table")
+local timerqueue = require("jive.timerqueue")
 
 local Framework = require("jive.ui.Framework")
 
@@ -41,8 +41,7 @@ local log       = require("jive.utils.log").logger("squeezeplay.timer")
 module(..., oo.class)
 
 
--- sorted list of running timers
-local timers = {}
+-- running timers are kept in a native heap, see jive_timer.c
 
 
 --[[
@@ -63,6 +62,7 @@ function __init(self, interval, callback, once)
 		interval = interval,
 		callback = callback,
 		once = once or false,
+		node = timerqueue.node(),
 	})
 end
 
@@ -92,7 +92,7 @@ Stops the timer.
 --]]
 
 function stop(self)
-	 table.delete(timers, self)
+	 timerqueue.remove(self.node)
 	 self.expires = nil
 end
 
@@ -109,7 +109,6 @@ to I<interval>, otherwise the interval is unchanged.
 function restart(self, interval)
 	_assert(interval == nil or type(interval) == "number")
 
-	self:stop()
 	if interval then
 		self.interval = interval
 	end
@@ -150,36 +149,26 @@ function isRunning(self)
 end
 
 
--- insert the timer into timer queue
+-- insert the timer into timer queue, or move it if already queued
 function _insertTimer(self, expires)
-	if self.expires then
-		table.delete(timers, self)
-	end
 	self.expires = expires
-
-	for i, timer in ipairs(timers) do
-		if self.expires < timer.expires then
-	 		table.insert(timers, i, self)
-			return
-		end
-	end
-	table.insert(timers, self)
+	timerqueue.insert(self.node, expires, self)
 end
 
 
--- process timer queue
-function _runTimer(self, now)
-	if timers[1] and not timers[1].expires then
-		log:error("stopped timer in timer list")
-		debug.dump(timers)
-	end
+-- time the next timer expires, or nil if no timers are running
+function _nextExpiry(self)
+	return timerqueue.next()
+end
 
-	while timers[1] and timers[1].expires <= now do
-		local timer = table.remove(timers, 1)
 
+-- process timer queue, all expired timers are run in one pass
+function _runTimer(self, now)
+	local timer, expires = timerqueue.expired(now)
+	while timer do
 		-- call back may modify the timer so update it first
 		if not timer.once then
-			local next = timer.expires + timer.interval
+			local next = expires + timer.interval
 			if next < now then
 				next = now + timer.interval
 			end
@@ -192,6 +181,8 @@ function _runTimer(self, now)
 		if not status then
 			log:warn("timer error: ", err)
 		end
+
+		timer, expires = timerqueue.expired(now)
 	end
 end
 
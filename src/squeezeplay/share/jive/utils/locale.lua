@@ -6,7 +6,11 @@ jive.utils.locale - Deliver strings based on locale (defaults to EN) and path
 
 =head1 DESCRIPTION
 
-Parses strings.txt from appropriate directory and sends it back as a table
+Parses strings.txt from appropriate directory and sends it back as a table.
+
+When compiled string tables for the locale are installed, see mkstrings,
+the strings are looked up in the string table instead of parsing the
+strings.txt file. Only the strings that are used are loaded.
 
 =head1 FUNCTIONS
 
@@ -19,7 +23,10 @@ readStringsFile(thisPath)
 
 -- stuff we use
 local ipairs, pairs, io, select, setmetatable, string, tostring = ipairs, pairs, io, select, setmetatable, string, tostring
+local package, rawget, rawset, type = package, rawget, rawset, type
 
+local lfs              = require("lfs")
+local stringtable      = require("jive.stringtable")
 local log              = require("jive.utils.log").logger("squeezeplay")
 
 local System           = require("jive.System")
@@ -44,6 +51,17 @@ local globalStrings = {}
 -- contains type of machine
 local globalMachine = false
 
+-- compiled string tables open for this locale
+local stringTables = {}
+local stringTablesLocale = false
+
+-- meta table for strings
+local strmt = {
+	__tostring = function(e)
+			     return e.str
+		     end,
+}
+
 --[[
 =head 2 setLocale(newLocale)
 
@@ -65,7 +83,7 @@ function setLocale(self, newLocale, doYield)
 		if doYield then
 			Task:yield(true)
 		end
-		_parseStringsFile(self, newLocale, k, v)
+		_loadStringsFile(self, globalLocale, k, v, globalStrings)
 	end
 end
 
@@ -112,8 +130,7 @@ function readGlobalStringsFile(self)
 	if globalStringsPath == nil then
 		return globalStrings
 	end
-	globalStrings = _parseStringsFile(self, globalLocale, globalStringsPath, globalStrings)
-	setmetatable(globalStrings, { __index = self , mode = "_v" })
+	globalStrings = _loadStringsFile(self, globalLocale, globalStringsPath, globalStrings, self)
 	return globalStrings
 end
 
@@ -123,30 +140,106 @@ function readStringsFile(self, fullPath, stringsTable)
 
 	stringsTable = stringsTable or {}
 	loadedFiles[fullPath] = stringsTable
-	setmetatable(stringsTable, { __index = globalStrings })
-	stringsTable = _parseStringsFile(self, globalLocale, fullPath, stringsTable)
+	stringsTable = _loadStringsFile(self, globalLocale, fullPath, stringsTable, globalStrings)
 
 	return stringsTable
 end
 
-function _parseStringsFile(self, myLocale, myFilePath, stringsTable)
-	log:debug("parsing ", myFilePath)
 
+-- open the compiled string tables for myLocale on the lua path
+local function _openStringTables(myLocale)
+	for _, st in ipairs(stringTables) do
+		st.table:close()
+	end
+	stringTables = {}
+	stringTablesLocale = myLocale
+
+	local suffix = "." .. myLocale .. ".jst"
+
+	for dir in package.path:gmatch("([^;]*)%?[^;]*;") do
+		if lfs.attributes(dir, "mode") == "directory" then
+			for entry in lfs.dir(dir) do
+				local locale = string.match(entry, "^.+%.([^%.]+)%.jst$")
+				if locale then
+					allLocales[locale] = true
+				end
+
+				if string.sub(entry, -#suffix) == suffix then
+					local st, err = stringtable.open(dir .. entry)
+					if st then
+						log:debug("string table ", dir, entry)
+						stringTables[#stringTables + 1] = { dir = dir, table = st }
+					else
+						log:warn(err)
+					end
+				end
+			end
+		end
+	end
+end
+
+
+-- find the string table for a strings file
+local function _findStringTable(myFilePath)
+	for _, st in ipairs(stringTables) do
+		if string.sub(myFilePath, 1, #st.dir) == st.dir then
+			local file = string.sub(myFilePath, #st.dir + 1)
+			if st.table:contains(file) then
+				return st.table, file
+			end
+		end
+	end
+end
+
+
+function _loadStringsFile(self, myLocale, myFilePath, stringsTable, parent)
 	globalMachine = "_" .. string.upper(System:getMachine())
 
+	if stringTablesLocale ~= myLocale then
+		_openStringTables(myLocale)
+	end
+
+	stringsTable = stringsTable or {}
+
+	local st, file = _findStringTable(myFilePath)
+	if not st then
+		setmetatable(stringsTable, { __index = parent })
+		return _parseStringsFile(self, myLocale, myFilePath, stringsTable)
+	end
+
+	log:debug("binding ", myFilePath)
+
+	-- update the strings already in use
+	for token, str in pairs(stringsTable) do
+		str.str = st:lookup(file, token) or false
+	end
+
+	-- other strings are wrapped when they are first used
+	setmetatable(stringsTable, {
+		__index = function(t, token)
+			local translation = type(token) == "string" and st:lookup(file, token)
+			if translation then
+				local str = setmetatable({ str = translation }, strmt)
+				rawset(t, token, str)
+				return str
+			end
+			return parent[token]
+		end
+	})
+
+	return stringsTable
+end
+
+
+function _parseStringsFile(self, myLocale, myFilePath, stringsTable)
+	log:debug("parsing ", myFilePath)
+
 	local stringsFile = io.open(myFilePath)
 	if stringsFile == nil then
 		return stringsTable
 	end
 	stringsTable = stringsTable or {}
 
-	-- meta table for strings
-	local strmt = {
-		__tostring = function(e)
-				     return e.str -- .. "{" .. myLocale .. "}"
-			     end,
-	}
-
 	local token, fallback
 	while true do
 		local line = stringsFile:read()
@@ -172,7 +265,7 @@ function _parseStringsFile(self, myLocale, myFilePath, stringsTable)
 			-- wrap the string in a table to allow the localized
 			-- value to be changed if a different locale is
 			-- later loaded.
-			if not stringsTable[token] then
+			if not rawget(stringsTable, token) then
 				local str = {}
 				setmetatable(str, strmt)
 				stringsTable[token] = str
@@ -0,0 +1,288 @@
+
+--[[
+=head1 NAME
+
+jive.utils.memory - Memory accounting and cache shedding
+
+=head1 DESCRIPTION
+
+Caches register here so they can be asked to free memory when the system
+runs low. A monitor checks the available memory using /proc/meminfo, and
+the cgroup memory limit if there is one. When it falls below the low water
+mark the caches are shed in priority order, lowest first, until the
+available memory is back above the target.
+
+A cache is an object with two methods:
+
+ cache:memoryUsage() returns the bytes used by the cache
+ cache:shedMemory(bytes) frees about bytes, returns the bytes freed
+
+Caches are held weakly, so a cache that is no longer used does not need to
+be removed.
+
+=head1 SYNOPSIS
+
+ -- register a cache
+ memory:addCache(cache, "artwork", memory.PRIORITY_ARTWORK)
+
+ -- check the memory every 5 seconds
+ memory:startMonitor(5000)
+
+=head1 FUNCTIONS
+
+=cut
+--]]
+
+-- stuff we use
+local collectgarbage, io, ipairs, pairs, setmetatable, tonumber = collectgarbage, io, ipairs, pairs, setmetatable, tonumber
+
+local math             = require("math")
+local string           = require("string")
+local table            = require("jive.utils.table")
+
+local Timer            = require("jive.ui.Timer")
+
+local log              = require("jive.utils.log").logger("squeezeplay.memory")
+
+module(...)
+
+
+-- cache priorities, lower priorities are shed first
+PRIORITY_ARTWORK = 10   -- compressed artwork, fetched again from disk or the server
+PRIORITY_IMAGES  = 20   -- skin images, loaded again from flash
+PRIORITY_TEXT    = 30   -- rendered label text, rendered again when drawn
+PRIORITY_BROWSE  = 40   -- browse items, fetched again from the server
+PRIORITY_STYLE   = 50   -- style values, looked up again in the skin
+
+
+-- registered caches, weak keys
+local caches = {}
+setmetatable(caches, { __mode = "k" })
+
+-- shed below lowWater bytes available, until target bytes are available
+local lowWater = 4 * 1024 * 1024
+local target = 8 * 1024 * 1024
+
+local monitorTimer = false
+
+
+--[[
+
+=head2 memory:addCache(cache, name, priority)
+
+Register I<cache> so it is shed when memory is low. I<name> is used when
+logging and by getUsage().
+
+=cut
+--]]
+function addCache(self, cache, name, priority)
+	caches[cache] = {
+		name = name,
+		priority = priority,
+	}
+end
+
+
+--[[
+
+=head2 memory:removeCache(cache)
+
+Remove I<cache>.
+
+=cut
+--]]
+function removeCache(self, cache)
+	caches[cache] = nil
+end
+
+
+--[[
+
+=head2 memory:setLimits(low, target)
+
+Set the low water mark and the target, in bytes.
+
+=cut
+--]]
+function setLimits(self, newLowWater, newTarget)
+	lowWater = newLowWater
+	target = newTarget
+end
+
+
+--[[
+
+=head2 memory:getUsage()
+
+Returns a table of the bytes used by the caches, by name.
+
+=cut
+--]]
+function getUsage(self)
+	local usage = {}
+
+	for cache, info in pairs(caches) do
+		usage[info.name] = (usage[info.name] or 0) + cache:memoryUsage()
+	end
+
+	return usage
+end
+
+
+local function _readFile(path)
+	local fh = io.open(path)
+	if not fh then
+		return nil
+	end
+
+	local str = fh:read("*a")
+	fh:close()
+
+	return str
+end
+
+
+local function _readNumber(path)
+	local str = _readFile(path)
+	return str and tonumber(string.match(str, "^%s*(%d+)"))
+end
+
+
+--[[
+
+=head2 memory:getAvailable()
+
+Returns the bytes available, or nil if this is not known on this platform.
+
+=cut
+--]]
+function getAvailable(self)
+	local meminfo = _readFile("/proc/meminfo")
+	if not meminfo then
+		return nil
+	end
+
+	local function field(name)
+		return tonumber(string.match(meminfo, name .. ":%s*(%d+)"))
+	end
+
+	-- older kernels don't have MemAvailable
+	local available = field("MemAvailable")
+	if not available then
+		available = (field("MemFree") or 0) + (field("Buffers") or 0) + (field("Cached") or 0)
+	end
+	available = available * 1024
+
+	-- cgroup v2 or v1 limit
+	local limit = _readNumber("/sys/fs/cgroup/memory.max")
+	local usage = _readNumber("/sys/fs/cgroup/memory.current")
+	if not limit then
+		limit = _readNumber("/sys/fs/cgroup/memory/memory.limit_in_bytes")
+		usage = _readNumber("/sys/fs/cgroup/memory/memory.usage_in_bytes")
+	end
+
+	if limit and usage then
+		available = math.min(available, math.max(limit - usage, 0))
+	end
+
+	return available
+end
+
+
+--[[
+
+=head2 memory:shed(bytes)
+
+Ask the caches to free I<bytes>, in priority order. Returns the bytes freed.
+
+=cut
+--]]
+function shed(self, bytes)
+	local sorted = {}
+	for cache, info in pairs(caches) do
+		sorted[#sorted + 1] = { cache = cache, name = info.name, priority = info.priority }
+	end
+
+	table.sort(sorted, function(a, b)
+		return a.priority < b.priority
+	end)
+
+	local freed = 0
+	for _, entry in ipairs(sorted) do
+		if freed >= bytes then
+			break
+		end
+
+		local n = entry.cache:shedMemory(bytes - freed) or 0
+		if n > 0 then
+			log:info("shed ", n, " bytes from ", entry.name)
+		end
+		freed = freed + n
+	end
+
+	-- the lua caches are only freed by the collector
+	collectgarbage("collect")
+
+	return freed
+end
+
+
+--[[
+
+=head2 memory:check()
+
+Shed the caches if the available memory is below the low water mark.
+
+=cut
+--]]
+function check(self)
+	local available = self:getAvailable()
+	if not available or available >= lowWater then
+		return
+	end
+
+	log:warn("low memory, ", available, " bytes available")
+
+	local freed = self:shed(target - available)
+
+	log:warn("freed ", freed, " bytes")
+end
+
+
+--[[
+
+=head2 memory:startMonitor(interval)
+
+Check the memory every I<interval> milliseconds. The monitor is not
+started if the available memory is not known on this platform.
+
+=cut
+--]]
+function startMonitor(self, interval)
+	if monitorTimer then
+		monitorTimer:stop()
+		monitorTimer = false
+	end
+
+	if not self:getAvailable() then
+		log:info("memory monitor not available")
+		return
+	end
+
+	monitorTimer = Timer(interval, function()
+		self:check()
+	end)
+	monitorTimer:start()
+end
+
+
+--[[
+
+=head1 LICENSE
+
+Copyright 2010 Logitech. All Rights Reserved.
+
+This file is licensed under BSD. Please see the LICENSE file for details.
+
+=cut
+--]]
@@ -13,14 +13,16 @@
 #include "audio/decode/decode_priv.h"
 
 
-void decode_init_buffers(void *buf, bool_t prio_inherit) {
+void decode_init_buffers(void *buf, size_t fifo_size, bool_t prio_inherit) {
 	decode_audio = buf;
 	decode_fifo_buf = ((u8_t *)decode_audio) + sizeof(struct decode_audio);
-	effect_fifo_buf = ((u8_t *)decode_fifo_buf) + DECODE_FIFO_SIZE;
+	effect_fifo_buf = ((u8_t *)decode_fifo_buf) + fifo_size;
 
 	memset(decode_audio, 0, sizeof(struct decode_audio));
 	decode_audio->set_sample_rate = 44100;
-	fifo_init(&decode_audio->fifo, DECODE_FIFO_SIZE, prio_inherit);
+	decode_audio->fifo_buffer_size = fifo_size;
+	decode_audio->fifo_seconds = DECODE_FIFO_SECONDS;
+	fifo_init(&decode_audio->fifo, fifo_size, prio_inherit);
 	fifo_init(&decode_audio->effect_fifo, EFFECT_FIFO_SIZE, prio_inherit);
 }
 
@@ -58,19 +60,158 @@ bool_t decode_check_start_point(void) {
 	
 	track_start_offset = decode_audio->fifo.rptr - decode_audio->track_start_point;
 	if (track_start_offset < 0) {
-		track_start_offset += DECODE_FIFO_SIZE;
+		track_start_offset += decode_audio->fifo.size;
 	}
 
 	/* Past the start point */
 	decode_audio->check_start_point = FALSE;
 	decode_audio->num_tracks_started++;
-	decode_audio->elapsed_samples = BYTES_TO_SAMPLES(track_start_offset);
+	decode_audio->elapsed_samples = FIFO_BYTES_TO_FRAMES(track_start_offset);
 	decode_audio->sync_elapsed_timestamp = 0; /* bug 15344: don't send previous-track data */
 
 	return true;
 }
 
 
+/* Unpack 16 bit frames from a packed decode fifo.
+ */
+void decode_unpack_frames(sample_t *buffer, s16_t *packed, size_t frames) {
+	frames *= 2;
+	while (frames--) {
+		*buffer++ = *packed++ << 16;
+	}
+}
+
+
+/* Visualizer tap. There is one writer, the audio output, and the readers
+ * only need to see a consistent window of samples, so a barrier between
+ * writing the samples and publishing the write pointer is enough.
+ */
+#if defined(WIN32)
+#define tap_barrier() MemoryBarrier()
+#else
+#define tap_barrier() __sync_synchronize()
+#endif
+
+/* frames the output may write while a reader is copying */
+#define TAP_MARGIN_FRAMES 4096
+
+
+/*
+ * Record the frame being heard now, delay_frames is the number of frames
+ * queued in the output before the next frame written to the tap.
+ */
+void decode_tap_timestamp(u32_t delay_frames, u32_t sample_rate) {
+	struct visualizer_tap *tap = &decode_audio->tap;
+
+	tap->seq++;
+	tap_barrier();
+
+	tap->play_frame = tap->wptr - delay_frames;
+	tap->play_timestamp = jive_jiffies();
+	tap->sample_rate = sample_rate;
+
+	tap_barrier();
+	tap->seq++;
+}
+
+
+/*
+ * Copy samples played by the output to the tap.
+ */
+void decode_tap_write(sample_t *buffer, size_t frames) {
+	struct visualizer_tap *tap = &decode_audio->tap;
+	u32_t wptr = tap->wptr;
+	u32_t filled;
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		s16_t *ptr = tap->buf + ((wptr++ & (VISUALIZER_TAP_FRAMES - 1)) << 1);
+
+		*ptr++ = (*buffer++) >> 16;
+		*ptr = (*buffer++) >> 16;
+	}
+
+	filled = tap->filled + frames;
+	if (filled > VISUALIZER_TAP_FRAMES) {
+		filled = VISUALIZER_TAP_FRAMES;
+	}
+
+	tap_barrier();
+	tap->wptr = wptr;
+	tap->filled = filled;
+}
+
+
+/*
+ * Copy the frames heard most recently from the tap, interleaved. This
+ * can be called from any thread without the audio lock. Returns the
+ * number of frames copied, which may be less than requested if the tap
+ * does not have enough samples.
+ */
+size_t decode_tap_read(s16_t *buffer, size_t frames) {
+	struct visualizer_tap *tap = &decode_audio->tap;
+	u32_t seq, wptr, filled, play_frame, play_timestamp, sample_rate;
+	u32_t end, elapsed, lag;
+	size_t i;
+	int retry = 0;
+
+	do {
+		seq = tap->seq;
+		tap_barrier();
+
+		wptr = tap->wptr;
+		filled = tap->filled;
+		play_frame = tap->play_frame;
+		play_timestamp = tap->play_timestamp;
+		sample_rate = tap->sample_rate;
+
+		tap_barrier();
+	} while ((seq & 1 || seq != tap->seq) && ++retry < 10);
+
+	if (filled < TAP_MARGIN_FRAMES) {
+		return 0;
+	}
+
+	/* the frame heard now, no later than the last frame written */
+	elapsed = jive_jiffies() - play_timestamp;
+	if (elapsed > 1000) {
+		elapsed = 1000;
+	}
+	end = play_frame + (elapsed * sample_rate) / 1000;
+
+	lag = wptr - end;
+	if ((s32_t)lag < 0) {
+		lag = 0;
+	}
+
+	/* don't read samples the output may be writing */
+	if (frames > filled - TAP_MARGIN_FRAMES) {
+		frames = filled - TAP_MARGIN_FRAMES;
+	}
+	if (lag + frames > filled - TAP_MARGIN_FRAMES) {
+		lag = filled - TAP_MARGIN_FRAMES - frames;
+	}
+
+	end = wptr - lag;
+
+	for (i = 0; i < frames; i++) {
+		s16_t *ptr = tap->buf + (((end - frames + i) & (VISUALIZER_TAP_FRAMES - 1)) << 1);
+
+		*buffer++ = *ptr++;
+		*buffer++ = *ptr;
+	}
+
+	/* samples overwritten while copying? */
+	tap_barrier();
+	if (tap->wptr - (end - frames) > VISUALIZER_TAP_FRAMES) {
+		return 0;
+	}
+
+	return frames;
+}
+
+
 static inline s16_t s16_clip(s16_t a, s16_t b) {
 	s32_t s = a + b;
 
@@ -4,8 +4,18 @@
 ** This file is licensed under BSD. Please see the LICENSE file for details.
 */
 
+#if defined(__linux__)
+/* for sched_setaffinity */
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
 #include "audio/mqueue.h"
 #include "audio/fifo.h"
 #include "audio/streambuf.h"
@@ -24,6 +34,14 @@ extern int luaopen_spprivate(lua_State *L);
 
 #define DECODE_METADATA_SIZE 128
 
+#define DECODE_ARENA_SIZE (128 * 1024)
+#define DECODE_ARENA_ALIGN 16
+
+#define DECODE_STACK_PREFAULT (32 * 1024)
+
+/* frames of the next track decoded ahead of the switch */
+#define DECODE_NEXT_FRAMES 8192
+
 /* loggers */
 LOG_CATEGORY *log_audio_decode;
 LOG_CATEGORY *log_audio_codec;
@@ -33,6 +51,22 @@ LOG_CATEGORY *log_audio_output;
 /* decoder thread */
 static SDL_Thread *decode_thread = NULL;
 
+/* decoder thread scheduling, see decode_thread_settings() */
+static int decode_thread_priority = 0;
+static bool_t decode_thread_rr = FALSE;
+static int decode_thread_cpu = -1;
+static bool_t decode_thread_lock_memory = FALSE;
+
+
+/* arena for the decoder state. decode_alloc() allocates from used up to
+ * end, the current decoder's allocations start at start.
+ */
+static u8_t *decode_arena;
+static size_t decode_arena_size = DECODE_ARENA_SIZE;
+static size_t decode_arena_start;
+static size_t decode_arena_used;
+static size_t decode_arena_end = DECODE_ARENA_SIZE;
+
 
 /* current decoder state */
 u32_t current_decoder_state = 0;
@@ -61,6 +95,18 @@ static u8_t *wma_guid;
 
 static bool_t trigger_resume = FALSE;
 
+/* the last local seek could not be made, see decode_seek() */
+static bool_t seek_failed = FALSE;
+
+/* a local seek is queued or waiting for the stream to reconnect */
+static bool_t seek_pending = FALSE;
+
+/* decoder thread only: the stream is being fetched for a local seek, or
+ * that fetch failed and the decoder waits for the server to seek.
+ */
+static bool_t seek_fetching = FALSE;
+static bool_t seek_stalled = FALSE;
+
 
 /* audio instance */
 struct decode_audio *decode_audio;
@@ -71,6 +117,48 @@ static struct decode_module *decoder;
 static void *decoder_data;
 
 
+/* decoder parameters for a track, see decode_start() */
+struct decode_track {
+	Uint32 decoder_id;
+	Uint32 transition_type;
+	Uint32 transition_period;
+	Uint32 replay_gain;
+	Uint32 output_threshold;
+	Uint32 polarity_inversion;
+	Uint32 output_channels;
+	Uint32 num_params;
+	Uint8 params[DECODER_MAX_PARAMS];
+};
+
+/* the next track in double-buffered mode, started when the current
+ * track has been decoded.
+ */
+static struct decode_track next_track;
+static bool_t next_track_pending = FALSE;
+
+/* the next track's decoder, started while the current track drains. its
+ * state and arena are swapped in while it is called, and the frames it
+ * decodes are held until the switch, see decode_prepare_next().
+ */
+static struct decode_module *next_decoder;
+static void *next_decoder_data;
+static u32_t next_decoder_state;
+static size_t next_arena_start;
+static size_t next_arena_used;
+static size_t next_arena_end;
+static bool_t next_preparing = FALSE;
+static bool_t next_prepare_failed = FALSE;
+
+/* frames and metadata of the next track decoded ahead of the switch */
+static sample_t *next_frames;
+static size_t next_frames_size;
+static size_t next_frames_len;
+static size_t next_frames_pos;
+static int next_frames_rate;
+static u8_t *next_packet;
+static size_t next_packet_len;
+
+
 
 /* installed decoders */
 static struct decode_module *all_decoders[] = {
@@ -94,6 +182,23 @@ static struct decode_module *all_decoders[] = {
 };
 
 
+/* decoders that read only through the streambuf, so they can be started
+ * on the next track ahead of the switch.
+ */
+static struct decode_module *prepare_decoders[] = {
+#ifndef _WIN32
+	&decode_alac,
+#endif
+#ifndef WITH_SPPRIVATE
+	&decode_aac,
+#endif
+	&decode_vorbis,
+	&decode_flac,
+	&decode_pcm,
+	&decode_mad,
+};
+
+
 static inline void debug_fullness(void)
 {
 	if (IS_LOG_PRIORITY(log_audio_decode, LOG_PRIORITY_DEBUG)) {
@@ -182,20 +287,149 @@ static void decode_skip_ahead_handler(void) {
 
 	decode_audio_lock();
 
-	decode_audio->skip_ahead_bytes = SAMPLES_TO_BYTES((u32_t)((interval * decode_audio->track_sample_rate) / 1000));
+	decode_audio->skip_ahead_bytes = FRAMES_TO_FIFO_BYTES((u32_t)((interval * decode_audio->track_sample_rate) / 1000));
 
 	decode_audio_unlock();
 }
 
 
+static void decode_seek_handler(void) {
+	Uint32 ms;
+
+	ms = mqueue_read_u32(&decode_mqueue);
+	mqueue_read_complete(&decode_mqueue);
+
+	LOG_DEBUG(log_audio_decode, "decode_seek_handler ms=%d", ms);
+
+	if (!decoder || !decoder->seek || next_track_pending || !streambuf_can_seek()
+	    || (current_decoder_state & DECODE_STATE_ERROR) || seek_stalled
+	    || !decoder->seek(decoder_data, ms)) {
+		LOG_WARN(log_audio_decode, "can't seek %s", decoder ? decoder->name : "");
+
+		decode_audio_lock();
+		seek_failed = TRUE;
+		seek_pending = FALSE;
+		decode_audio_unlock();
+		return;
+	}
+
+	switch (streambuf_get_seek_state()) {
+	case STREAMBUF_SEEK_FAILED:
+		/* the data is not buffered and can't be fetched, keep playing
+		 * the decoded audio until the server seeks.
+		 */
+		LOG_WARN(log_audio_decode, "can't fetch stream for seek");
+
+		seek_stalled = TRUE;
+
+		decode_audio_lock();
+		seek_failed = TRUE;
+		seek_pending = FALSE;
+		decode_audio_unlock();
+		return;
+
+	case STREAMBUF_SEEK_NONE:
+		break;
+
+	default:
+		seek_fetching = TRUE;
+		break;
+	}
+
+	current_decoder_state &= ~DECODE_STATE_UNDERRUN;
+
+	decode_audio_lock();
+
+	seek_failed = FALSE;
+	seek_pending = seek_fetching;
+	decode_audio->skip_ahead_bytes = 0;
+
+	/* frames decoded ahead of the track start are replaced */
+	next_frames_len = 0;
+	next_frames_pos = 0;
+
+	/* drop the decoded audio for this track. if the previous track is
+	 * still playing, this track starts at the start point.
+	 */
+	if (decode_audio->check_start_point) {
+		decode_audio->fifo.wptr = decode_audio->track_start_point;
+	}
+	else {
+		decode_audio->fifo.wptr = decode_audio->fifo.rptr;
+		decode_audio->elapsed_samples = ((u64_t)ms * decode_audio->track_sample_rate) / 1000;
+	}
+
+	decode_audio_unlock();
+}
+
+
+/* The decoder played on from a different position than the seek asked
+ * for, elapsed is moved to the frame reached.
+ */
+void decode_seek_reached(u64_t frames) {
+	decode_audio_lock();
+
+	if (!decode_audio->check_start_point) {
+		decode_audio->elapsed_samples = (u32_t)frames;
+	}
+
+	decode_audio_unlock();
+}
+
+
+/* The decoder can't reach the seek position without another fetch from
+ * the server. The decoder is idle until the server seeks instead.
+ */
+void decode_seek_fail(void) {
+	LOG_WARN(log_audio_decode, "can't reach seek position %s", decoder ? decoder->name : "");
+
+	seek_fetching = FALSE;
+	seek_stalled = TRUE;
+
+	decode_audio_lock();
+	seek_failed = TRUE;
+	seek_pending = FALSE;
+	decode_audio_unlock();
+}
+
+
+/* stop the next track's decoder and drop what it has decoded */
+static void decode_discard_next(void) {
+	if (next_decoder) {
+		next_decoder->stop(next_decoder_data);
+
+		next_decoder = NULL;
+		next_decoder_data = NULL;
+
+		/* the current decoder can use the whole arena again */
+		decode_arena_end = decode_arena_size;
+	}
+
+	free(next_frames);
+	next_frames = NULL;
+	next_frames_size = 0;
+	next_frames_len = 0;
+	next_frames_pos = 0;
+
+	free(next_packet);
+	next_packet = NULL;
+}
+
+
 static void decode_stop_handler(void) {
 	mqueue_read_complete(&decode_mqueue);
 
 	LOG_DEBUG(log_audio_decode, "decode_stop_handler");
 
+	decode_discard_next();
+
 	decode_audio_lock();
 
 	current_decoder_state = 0;
+	next_track_pending = FALSE;
+	seek_pending = FALSE;
+	seek_fetching = FALSE;
+	seek_stalled = FALSE;
 	decode_audio->state = 0;
 
 	if (decoder) {
@@ -218,9 +452,15 @@ static void decode_flush_handler(void) {
 
 	LOG_DEBUG(log_audio_decode, "decode_flush_handler");
 
+	decode_discard_next();
+
 	decode_audio_lock();
 
 	current_decoder_state = 0;
+	next_track_pending = FALSE;
+	seek_pending = FALSE;
+	seek_fetching = FALSE;
+	seek_stalled = FALSE;
 
 	if (decoder) {
 		decoder->stop(decoder_data);
@@ -236,28 +476,73 @@ static void decode_flush_handler(void) {
 }
 
 
-static void decode_start_handler(void) {
-	Uint32 decoder_id, transition_type, transition_period, replay_gain;
-	Uint32 output_threshold, polarity_inversion, output_channels;
-	Uint32 i, num_params;
-	Uint8 params[DECODER_MAX_PARAMS];
+static void decode_read_track(struct decode_track *track) {
+	Uint32 i;
 
-	decoder_id = mqueue_read_u32(&decode_mqueue);
-	transition_type = mqueue_read_u32(&decode_mqueue);
-	transition_period = mqueue_read_u32(&decode_mqueue);
-	replay_gain = mqueue_read_u32(&decode_mqueue);
-	output_threshold = mqueue_read_u32(&decode_mqueue);
-	polarity_inversion = mqueue_read_u32(&decode_mqueue);
-	output_channels = mqueue_read_u32(&decode_mqueue);
+	track->decoder_id = mqueue_read_u32(&decode_mqueue);
+	track->transition_type = mqueue_read_u32(&decode_mqueue);
+	track->transition_period = mqueue_read_u32(&decode_mqueue);
+	track->replay_gain = mqueue_read_u32(&decode_mqueue);
+	track->output_threshold = mqueue_read_u32(&decode_mqueue);
+	track->polarity_inversion = mqueue_read_u32(&decode_mqueue);
+	track->output_channels = mqueue_read_u32(&decode_mqueue);
 
-	num_params = mqueue_read_u32(&decode_mqueue);
-	if (num_params > DECODER_MAX_PARAMS) {
-		num_params = DECODER_MAX_PARAMS;
+	track->num_params = mqueue_read_u32(&decode_mqueue);
+	if (track->num_params > DECODER_MAX_PARAMS) {
+		track->num_params = DECODER_MAX_PARAMS;
 	}
-	for (i = 0; i < num_params; i++) {
-		params[i] = mqueue_read_u8(&decode_mqueue);
+	for (i = 0; i < track->num_params; i++) {
+		track->params[i] = mqueue_read_u8(&decode_mqueue);
 	}
 	mqueue_read_complete(&decode_mqueue);
+}
+
+
+void *decode_alloc(size_t size) {
+	void *ptr;
+
+	size = (size + DECODE_ARENA_ALIGN - 1) & ~(DECODE_ARENA_ALIGN - 1);
+
+	if (!decode_arena || decode_arena_used + size > decode_arena_end) {
+		LOG_DEBUG(log_audio_decode, "decoder arena full, %d bytes from the heap", (int)size);
+		return calloc(1, size);
+	}
+
+	ptr = decode_arena + decode_arena_used;
+	decode_arena_used += size;
+
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+
+void decode_free(void *ptr) {
+	u8_t *p = ptr;
+
+	if (decode_arena && p >= decode_arena && p < decode_arena + decode_arena_size) {
+		/* released when the arena is reset */
+		return;
+	}
+
+	free(ptr);
+}
+
+
+static struct decode_module *decode_find_decoder(Uint32 decoder_id) {
+	Uint32 i;
+
+	for (i=0; i<(sizeof(all_decoders)/sizeof(struct decode_module *)); i++) {
+		if (all_decoders[i]->id == decoder_id) {
+			return all_decoders[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+static void decode_begin_track(struct decode_track *track) {
+	bool_t prepared = (next_decoder != NULL);
 
 	if (decoder) {
 		decoder->stop(decoder_data);
@@ -266,35 +551,278 @@ static void decode_start_handler(void) {
 		decoder_data = NULL;
 	}
 
-	for (i=0; i<(sizeof(all_decoders)/sizeof(struct decode_module *)); i++) {
-		if (all_decoders[i]->id == decoder_id) {
-			decoder = all_decoders[i];
-			break;
-		}
+	if (prepared) {
+		/* started ahead of the switch, see decode_prepare_next() */
+		decoder = next_decoder;
+		decoder_data = next_decoder_data;
+
+		next_decoder = NULL;
+		next_decoder_data = NULL;
+	}
+	else {
+		decoder = decode_find_decoder(track->decoder_id);
 	}
 
 	if (!decoder) {
-		LOG_ERROR(log_audio_decode, "unknown decoder %x\n", decoder_id);
+		LOG_ERROR(log_audio_decode, "unknown decoder %x\n", track->decoder_id);
 		return;
 	}
 
-	LOG_INFO(log_audio_decode, "init decoder %s", decoder->name);
+	LOG_INFO(log_audio_decode, "%s decoder %s", prepared ? "prepared" : "init", decoder->name);
 
 	decode_first_buffer = TRUE;
-	decode_output_set_transition(transition_type, transition_period);
-	decode_output_set_track_gain(replay_gain);
-	decode_set_track_polarity_inversion(polarity_inversion);
-	decode_set_output_channels(output_channels);
+	decode_output_set_transition(track->transition_type, track->transition_period);
+	decode_output_set_track_gain(track->replay_gain);
+	decode_set_track_polarity_inversion(track->polarity_inversion);
+	decode_set_output_channels(track->output_channels);
+
+	if (prepared) {
+		/* the previous decoder has stopped, the arena past the
+		 * prepared decoder's allocations is free.
+		 */
+		decode_arena_start = next_arena_start;
+		decode_arena_used = next_arena_used;
+		decode_arena_end = decode_arena_size;
+
+		if (next_packet) {
+			decode_queue_packet(next_packet, next_packet_len);
+
+			free(next_packet);
+			next_packet = NULL;
+		}
+	}
+	else {
+		/* the previous decoder has stopped */
+		decode_arena_start = 0;
+		decode_arena_used = 0;
+		decode_arena_end = decode_arena_size;
 
-	decoder_data = decoder->start(params, num_params);
+		decoder_data = decoder->start(track->params, track->num_params);
+	}
+
+	seek_fetching = FALSE;
+	seek_stalled = FALSE;
 
 	decode_audio_lock();
-	decode_audio->output_threshold = output_threshold;
+	seek_pending = FALSE;
+	decode_audio->output_threshold = track->output_threshold;
 	decode_output_begin();
 	decode_audio_unlock();
 }
 
 
+/* switch to the next track in double-buffered mode, once the current
+ * track has been decoded. the next stream is already buffered, so the
+ * decoder runs without waiting for resume.
+ */
+static void decode_next_track(void) {
+	if (!streambuf_next_track(next_decoder != NULL)) {
+		/* the next stream is not connected yet */
+		return;
+	}
+
+	LOG_DEBUG(log_audio_decode, "decode_next_track");
+
+	if (decoder) {
+		decode_audio_lock();
+		decode_output_song_ended();
+		decode_audio_unlock();
+	}
+
+	next_track_pending = FALSE;
+	next_prepare_failed = FALSE;
+	decode_begin_track(&next_track);
+
+	current_decoder_state = decoder ? DECODE_STATE_RUNNING : DECODE_STATE_ERROR;
+}
+
+
+/* swap the current decoder's state and arena with the next track's
+ * decoder, before and after it is called ahead of the switch. Lua sees
+ * the current decoder's state throughout, see decode_status().
+ */
+static void decode_swap_next(void) {
+	u32_t state;
+	size_t start, used, end;
+
+	decode_audio_lock();
+	state = current_decoder_state;
+	current_decoder_state = next_decoder_state;
+	next_decoder_state = state;
+	next_preparing = !next_preparing;
+	decode_audio_unlock();
+
+	start = decode_arena_start;
+	used = decode_arena_used;
+	end = decode_arena_end;
+	decode_arena_start = next_arena_start;
+	decode_arena_used = next_arena_used;
+	decode_arena_end = next_arena_end;
+	next_arena_start = start;
+	next_arena_used = used;
+	next_arena_end = end;
+
+	streambuf_select_next(next_preparing);
+}
+
+
+/* Hold frames the next track's decoder outputs ahead of the switch,
+ * returns false if the current decoder is called.
+ */
+bool_t decode_next_hold(sample_t *buffer, u32_t nsamples, int sample_rate) {
+	if (!next_preparing) {
+		return FALSE;
+	}
+
+	if (next_frames_len + nsamples > next_frames_size) {
+		size_t size = next_frames_len + nsamples;
+		sample_t *frames;
+
+		if (size < DECODE_NEXT_FRAMES) {
+			size = DECODE_NEXT_FRAMES;
+		}
+
+		frames = realloc(next_frames, size * 2 * sizeof(sample_t));
+		if (!frames) {
+			LOG_ERROR(log_audio_decode, "can't hold next track frames");
+			current_decoder_state |= DECODE_STATE_ERROR;
+			return TRUE;
+		}
+
+		next_frames = frames;
+		next_frames_size = size;
+	}
+
+	if (next_frames_len == 0) {
+		next_frames_rate = sample_rate;
+	}
+
+	memcpy(next_frames + (next_frames_len * 2), buffer, nsamples * 2 * sizeof(sample_t));
+	next_frames_len += nsamples;
+
+	return TRUE;
+}
+
+
+/* Start the next track's decoder while the current track waits for
+ * space in the output fifo, and decode its first frames. The switch at the
+ * end of the current track then continues from them, see
+ * decode_begin_track(). Filtered or seeking streams are started at the
+ * switch instead.
+ */
+static void decode_prepare_next(void) {
+	struct decode_module *module;
+	Uint32 i;
+
+	if (!next_track_pending || next_prepare_failed || !decoder
+	    || (current_decoder_state & (DECODE_STATE_RUNNING|DECODE_STATE_ERROR)) != DECODE_STATE_RUNNING
+	    || next_frames_len >= DECODE_NEXT_FRAMES
+	    || (!next_decoder && next_frames_len)
+	    || !streambuf_next_available()) {
+		return;
+	}
+
+	if (!next_decoder) {
+		module = decode_find_decoder(next_track.decoder_id);
+
+		for (i=0; module && i<(sizeof(prepare_decoders)/sizeof(struct decode_module *)); i++) {
+			if (prepare_decoders[i] == module) {
+				break;
+			}
+		}
+
+		if (!module || i == (sizeof(prepare_decoders)/sizeof(struct decode_module *))) {
+			next_prepare_failed = TRUE;
+			return;
+		}
+
+		LOG_DEBUG(log_audio_decode, "prepare decoder %s", module->name);
+
+		/* the next decoder allocates from the larger free part of
+		 * the arena, after or before the current decoder's.
+		 */
+		if (decode_arena_size - decode_arena_used >= decode_arena_start) {
+			next_arena_start = decode_arena_used;
+			next_arena_end = decode_arena_size;
+
+			decode_arena_end = decode_arena_used;
+		}
+		else {
+			next_arena_start = 0;
+			next_arena_end = decode_arena_start;
+		}
+		next_arena_used = next_arena_start;
+		next_decoder_state = DECODE_STATE_RUNNING;
+
+		decode_swap_next();
+		next_decoder_data = module->start(next_track.params, next_track.num_params);
+		decode_swap_next();
+
+		next_decoder = module;
+	}
+	else {
+		decode_swap_next();
+		if (!streambuf_would_wait_for(next_decoder == &decode_flac ? DECODE_MINIMUM_BYTES_FLAC : DECODE_MINIMUM_BYTES_OTHER)) {
+			next_decoder->callback(next_decoder_data);
+		}
+		decode_swap_next();
+	}
+
+	if (next_decoder_state & DECODE_STATE_ERROR) {
+		/* try again from the start of the track at the switch */
+		LOG_WARN(log_audio_decode, "can't prepare decoder %s", next_decoder->name);
+
+		decode_discard_next();
+		next_prepare_failed = TRUE;
+	}
+}
+
+
+/* write the frames decoded ahead of the switch, as the fifo has space */
+static void decode_release_frames(void) {
+	size_t n;
+
+	n = decoder->samples(decoder_data);
+	if (n > next_frames_len - next_frames_pos) {
+		n = next_frames_len - next_frames_pos;
+	}
+
+	decode_output_samples(next_frames + (next_frames_pos * 2), n, next_frames_rate);
+	next_frames_pos += n;
+
+	if (next_frames_pos == next_frames_len) {
+		next_frames_len = 0;
+		next_frames_pos = 0;
+	}
+}
+
+
+static void decode_start_handler(void) {
+	struct decode_track track;
+
+	decode_read_track(&track);
+
+	decode_discard_next();
+
+	next_track_pending = FALSE;
+	decode_begin_track(&track);
+}
+
+
+static void decode_start_next_handler(void) {
+	decode_read_track(&next_track);
+
+	LOG_DEBUG(log_audio_decode, "decode_start_next_handler");
+
+	if (next_decoder) {
+		decode_discard_next();
+	}
+
+	next_track_pending = TRUE;
+	next_prepare_failed = FALSE;
+}
+
+
 static void decode_capture_handler(void) {
 	Uint32 loopback;
 
@@ -348,6 +876,50 @@ static bool_t decode_timer_interval(u32_t *delay) {
 		return false;
 	}
 
+	switch (streambuf_get_seek_state()) {
+	case STREAMBUF_SEEK_FAILED:
+		if (seek_fetching) {
+			/* a local seek could not fetch the stream, the server
+			 * seeks instead.
+			 */
+			LOG_WARN(log_audio_decode, "stream fetch for seek failed");
+
+			seek_fetching = FALSE;
+			seek_stalled = TRUE;
+
+			decode_audio_lock();
+			seek_failed = TRUE;
+			seek_pending = FALSE;
+			decode_audio_unlock();
+		}
+		else if (!seek_stalled) {
+			LOG_WARN(log_audio_decode, "stream seek failed");
+			current_decoder_state |= DECODE_STATE_ERROR;
+		}
+
+		*delay = DECODE_MAX_INTERVAL;
+		return false;
+
+	case STREAMBUF_SEEK_NONE:
+		if (seek_fetching) {
+			seek_fetching = FALSE;
+
+			decode_audio_lock();
+			seek_pending = FALSE;
+			decode_audio_unlock();
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if (seek_stalled) {
+		/* waiting for the server to seek */
+		*delay = DECODE_MAX_INTERVAL;
+		return false;
+	}
+
 	/* Small delay if the stream empty but still streaming? */
 	/* special case for flac as it has a minimum number of bytes before the decoder processes anything */
 	if (streambuf_would_wait_for(decoder == &decode_flac ? DECODE_MINIMUM_BYTES_FLAC : DECODE_MINIMUM_BYTES_OTHER)) {
@@ -366,7 +938,7 @@ static bool_t decode_timer_interval(u32_t *delay) {
 	used_bytes = fifo_bytes_used(&decode_audio->fifo);
 	decode_audio_unlock();
 
-	if (SAMPLES_TO_BYTES(max_samples) < free_bytes) {
+	if (FRAMES_TO_FIFO_BYTES(max_samples) < free_bytes) {
 		*delay = 0;
 
 		return true;
@@ -387,6 +959,63 @@ void decode_keepalive(int ticks) {
 }
 
 
+#if defined(__linux__)
+static void decode_prefault_stack(void) {
+	volatile u8_t stack[DECODE_STACK_PREFAULT];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 256) {
+		stack[i] = 0;
+	}
+}
+#endif
+
+
+static void decode_thread_realtime(void) {
+#if defined(__linux__)
+	struct sched_param sched_param;
+	int err;
+
+	if (decode_thread_cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(decode_thread_cpu, &cpus);
+
+		/* on linux this only changes the affinity of this thread */
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+			LOG_WARN(log_audio_decode, "sched_setaffinity: %s", strerror(errno));
+		}
+	}
+
+	/* The priority should be below the audio output thread, see
+	 * decode_realtime_process() in the alsa backend.
+	 */
+	if (decode_thread_priority > 0) {
+		sched_param.sched_priority = decode_thread_priority;
+
+		if ((err = pthread_setschedparam(pthread_self(), decode_thread_rr ? SCHED_RR : SCHED_FIFO, &sched_param)) != 0) {
+			if (err == EPERM) {
+				LOG_INFO(log_audio_decode, "Can't set decode thread priority");
+			}
+			else {
+				LOG_ERROR(log_audio_decode, "pthread_setschedparam: %s", strerror(err));
+			}
+		}
+	}
+
+	if (decode_thread_lock_memory) {
+		decode_prefault_stack();
+
+		if ((decode_arena && mlock(decode_arena, decode_arena_size))
+		    || mlock(decode_audio, DECODE_AUDIO_BUFFER_SIZE(decode_audio->fifo_buffer_size))) {
+			LOG_WARN(log_audio_decode, "mlock: %s", strerror(errno));
+		}
+	}
+#endif
+}
+
+
 static int decode_thread_execute(void *unused) {
 	int decode_debug;
 
@@ -394,6 +1023,8 @@ static int decode_thread_execute(void *unused) {
 
 	decode_watchdog = watchdog_get();
 
+	decode_thread_realtime();
+
 	decode_debug = getenv("SQUEEZEPLAY_DECODE_DEBUG") != NULL;
 
 	while (true) {
@@ -404,7 +1035,17 @@ static int decode_thread_execute(void *unused) {
 		/* XXXX 30 seconds for testing */
 		watchdog_keepalive(decode_watchdog, 3);
 
+		if (next_track_pending && (!decoder
+		    || (current_decoder_state & (DECODE_STATE_UNDERRUN | DECODE_STATE_ERROR)))) {
+			decode_next_track();
+		}
+
 		can_decode = decode_timer_interval(&delay);
+		if (!can_decode) {
+			/* decode ahead for the next track while waiting */
+			decode_prepare_next();
+		}
+
 		while ((handler = mqueue_read_request(&decode_mqueue, delay))) {
 			// for debugging race conditions
 			//sleep(2);
@@ -416,7 +1057,12 @@ static int decode_thread_execute(void *unused) {
 
 		if (can_decode && decoder
 		    && (current_decoder_state & DECODE_STATE_RUNNING)) {
-			decoder->callback(decoder_data);
+			if (next_frames_len && !next_decoder) {
+				decode_release_frames();
+			}
+			else {
+				decoder->callback(decoder_data);
+			}
 
 			/* Additional debugging enabled with an environment
 			 * variable, used to track decoder performance.
@@ -527,6 +1173,18 @@ void decode_queue_metadata(enum metadata_type type, u8_t *metadata, size_t metad
 
 
 void decode_queue_packet(void *data, size_t len) {
+	if (next_preparing) {
+		/* queued when the next track starts */
+		free(next_packet);
+
+		next_packet = malloc(len);
+		if (next_packet) {
+			memcpy(next_packet, data, len);
+			next_packet_len = len;
+		}
+		return;
+	}
+
 	if (mqueue_write_request(&metadata_mqueue, (void *)1, sizeof(Uint32) + len)) {
 		mqueue_write_u32(&metadata_mqueue, len);
 		mqueue_write_array(&metadata_mqueue, data, len);
@@ -658,6 +1316,42 @@ static int decode_skip_ahead(lua_State *L) {
 }
 
 
+static int decode_seek(lua_State *L) {
+	Uint32 ms;
+
+	/* stack is:
+	 * 1: self
+	 * 2: position in the track (ms)
+	 *
+	 * The decoder seeks using the index for its format. If the seek
+	 * can't be made status() returns seekFailed, and the seek should be
+	 * made by the server instead.
+	 */
+
+	ms = (Uint32) luaL_checkinteger(L, 2);
+	LOG_DEBUG(log_audio_decode, "decode_seek ms=%d", ms);
+
+	decode_audio_lock();
+	seek_pending = TRUE;
+	decode_audio_unlock();
+
+	if (mqueue_write_request(&decode_mqueue, decode_seek_handler, sizeof(Uint32))) {
+		mqueue_write_u32(&decode_mqueue, ms);
+		mqueue_write_complete(&decode_mqueue);
+	}
+	else {
+		LOG_DEBUG(log_audio_decode, "Full message queue, dropped seek message");
+
+		decode_audio_lock();
+		seek_failed = TRUE;
+		seek_pending = FALSE;
+		decode_audio_unlock();
+	}
+
+	return 0;
+}
+
+
 static int decode_stop(lua_State *L) {
 	/* stack is:
 	 * 1: self
@@ -699,11 +1393,9 @@ static int decode_flush(lua_State *L) {
 }
 
 
-static int decode_start(lua_State *L) {
+static void decode_queue_start(lua_State *L, mqueue_func_t handler) {
 	int num_params, i;
 
-	LOG_DEBUG(log_audio_decode, "decode_start");
-
 	/* stack is:
 	 * 1: self
 	 * 2: decoder
@@ -716,13 +1408,7 @@ static int decode_start(lua_State *L) {
 	 * 9: params...
 	 */
 
-	/* Reset the decoder state in calling thread to avoid potential
-	 * race condition - we may incorrectly report a decoder underrun
-	 * if we wait till the decoder thread resets it.
-	 */
-	current_decoder_state = 0;
-
-	if (mqueue_write_request(&decode_mqueue, decode_start_handler, 0)) {
+	if (mqueue_write_request(&decode_mqueue, handler, 0)) {
 		mqueue_write_u32(&decode_mqueue, (Uint32) luaL_optinteger(L, 2, 0)); /* decoder */
 		mqueue_write_u32(&decode_mqueue, (Uint32) luaL_optinteger(L, 3, 0)); /* transition_type */
 		mqueue_write_u32(&decode_mqueue, (Uint32) luaL_optinteger(L, 4, 0)); /* transition_period */
@@ -741,6 +1427,39 @@ static int decode_start(lua_State *L) {
 	else {
 		LOG_DEBUG(log_audio_decode, "Full message queue, dropped start message");
 	}
+}
+
+
+static int decode_start(lua_State *L) {
+	LOG_DEBUG(log_audio_decode, "decode_start");
+
+	/* Reset the decoder state in calling thread to avoid potential
+	 * race condition - we may incorrectly report a decoder underrun
+	 * if we wait till the decoder thread resets it.
+	 */
+	decode_audio_lock();
+	if (next_preparing) {
+		next_decoder_state = 0;
+	}
+	else {
+		current_decoder_state = 0;
+	}
+	decode_audio_unlock();
+
+	decode_queue_start(L, decode_start_handler);
+
+	return 0;
+}
+
+
+static int decode_start_next(lua_State *L) {
+	LOG_DEBUG(log_audio_decode, "decode_start_next");
+
+	/* The same parameters as start. The current track keeps decoding,
+	 * the decoder switches to this track when it has reached the end of
+	 * the current track in the streambuf.
+	 */
+	decode_queue_start(L, decode_start_next_handler);
 
 	return 0;
 }
@@ -808,7 +1527,7 @@ static int decode_status(lua_State *L) {
 
 	if (decode_audio->track_sample_rate) {
 		output = fifo_bytes_used(&decode_audio->fifo);
-		output = (BYTES_TO_SAMPLES(output) * 1000) / decode_audio->track_sample_rate;
+		output = (FIFO_BYTES_TO_FRAMES(output) * 1000) / decode_audio->track_sample_rate;
 	}
 	else {
 		output = 0;
@@ -855,6 +1574,11 @@ static int decode_status(lua_State *L) {
 		lua_setfield(L, -2, "decoder");
 	}
 
+	if (next_track_pending) {
+		lua_pushboolean(L, TRUE);
+		lua_setfield(L, -2, "nextTrackPending");
+	}
+
 	lua_pushinteger(L, decode_audio->state);
 	lua_setfield(L, -2, "audioState");
 
@@ -867,6 +1591,17 @@ static int decode_status(lua_State *L) {
 		trigger_resume = FALSE;
 	}
 
+	if (seek_failed) {
+		lua_pushboolean(L, TRUE);
+		lua_setfield(L, -2, "seekFailed");
+		seek_failed = FALSE;
+	}
+
+	if (seek_pending) {
+		lua_pushboolean(L, TRUE);
+		lua_setfield(L, -2, "seekPending");
+	}
+
 	decode_audio_unlock();
 
 
@@ -884,7 +1619,9 @@ static int decode_status(lua_State *L) {
 	lua_pushinteger(L, bytesH);
 	lua_setfield(L, -2, "bytesReceivedH");
 
-	lua_pushinteger(L, current_decoder_state);
+	decode_audio_lock();
+	lua_pushinteger(L, next_preparing ? next_decoder_state : current_decoder_state);
+	decode_audio_unlock();
 	lua_setfield(L, -2, "decodeState");
 
 	return 1;
@@ -1004,6 +1741,77 @@ static int decode_init_audio(lua_State *L) {
 }
 
 
+/* Read the decode fifo settings, and return the fifo size to allocate.
+ * The fifo holds decodeFifoSeconds of audio at any sample rate up to
+ * decodeFifoMaxRate. If packed is not NULL the backend can use a packed
+ * fifo, it is set to decodeFifoPacked or left as the default.
+ */
+size_t decode_fifo_settings(lua_State *L, u32_t *seconds, bool_t *packed) {
+	u32_t max_rate;
+	size_t frame_bytes;
+
+	/* stack is:
+	 * 1: decode
+	 * 2: settings
+	 */
+
+	*seconds = DECODE_FIFO_SECONDS;
+	max_rate = DECODE_FIFO_MAX_RATE;
+
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "decodeFifoSeconds");
+		*seconds = luaL_optinteger(L, -1, DECODE_FIFO_SECONDS);
+		lua_getfield(L, 2, "decodeFifoMaxRate");
+		max_rate = luaL_optinteger(L, -1, DECODE_FIFO_MAX_RATE);
+		lua_getfield(L, 2, "decodeFifoPacked");
+		if (packed && !lua_isnil(L, -1)) {
+			*packed = lua_toboolean(L, -1);
+		}
+		lua_pop(L, 3);
+	}
+
+	frame_bytes = (packed && *packed) ? 2 * sizeof(s16_t) : 2 * sizeof(sample_t);
+
+	LOG_INFO(log_audio_decode, "decode fifo %d seconds at %d Hz, %d bytes per frame", *seconds, max_rate, (int)frame_bytes);
+
+	return (size_t)*seconds * max_rate * frame_bytes;
+}
+
+
+/* Read the decoder thread settings. The priority is a realtime priority
+ * for decodeThreadPolicy "fifo" or "rr", 0 keeps the normal scheduler.
+ */
+static void decode_thread_settings(lua_State *L) {
+	const char *policy;
+
+	/* stack is:
+	 * 1: decode
+	 * 2: settings
+	 */
+
+	if (!lua_istable(L, 2)) {
+		return;
+	}
+
+	lua_getfield(L, 2, "decodeThreadPriority");
+	decode_thread_priority = luaL_optinteger(L, -1, 0);
+	lua_getfield(L, 2, "decodeThreadPolicy");
+	policy = luaL_optstring(L, -1, "fifo");
+	lua_getfield(L, 2, "decodeThreadCpu");
+	decode_thread_cpu = luaL_optinteger(L, -1, -1);
+	lua_getfield(L, 2, "decodeLockMemory");
+	decode_thread_lock_memory = lua_toboolean(L, -1);
+	lua_getfield(L, 2, "decodeArenaSize");
+	decode_arena_size = luaL_optinteger(L, -1, DECODE_ARENA_SIZE);
+	lua_pop(L, 5);
+
+	decode_thread_rr = (strcmp(policy, "rr") == 0);
+
+	LOG_INFO(log_audio_decode, "decode thread priority %d (%s) cpu %d lock %d arena %d bytes",
+		 decode_thread_priority, policy, decode_thread_cpu, decode_thread_lock_memory, (int)decode_arena_size);
+}
+
+
 static int decode_audio_open(lua_State *L) {
 	struct decode_audio_func *f = NULL;
 
@@ -1045,6 +1853,14 @@ static int decode_audio_open(lua_State *L) {
 
 	decode_audio->f = f;
 
+	/* decoder state, touch each page now rather than while decoding */
+	decode_thread_settings(L);
+
+	decode_arena = (decode_arena_size) ? malloc(decode_arena_size) : NULL;
+	if (decode_arena) {
+		memset(decode_arena, 0, decode_arena_size);
+	}
+
 	/* start decoder thread */
 	mqueue_init(&decode_mqueue, decode_mqueue_buffer, sizeof(decode_mqueue_buffer));
 	mqueue_init(&metadata_mqueue, metadata_mqueue_buffer, sizeof(metadata_mqueue_buffer));
@@ -1063,9 +1879,11 @@ static const struct luaL_Reg decode_f[] = {
 	{ "resumeAudio", decode_resume_audio },
 	{ "pauseAudio", decode_pause_audio },
 	{ "skipAhead", decode_skip_ahead },
+	{ "seek", decode_seek },
 	{ "stop", decode_stop },
 	{ "flush", decode_flush },
 	{ "start", decode_start },
+	{ "startNext", decode_start_next },
 	{ "capture", decode_capture },
 	{ "songEnded", decode_song_ended },
 	{ "status", decode_status },
@@ -1077,6 +1895,9 @@ static const struct luaL_Reg decode_f[] = {
 	{ "vumeter", decode_vumeter },
 	{ "spectrum_init", decode_spectrum_init },
 	{ "spectrum", decode_spectrum },
+	{ "spectrum_benchmark", decode_spectrum_benchmark },
+	{ "downmixMatrix", decode_downmix_matrix },
+	{ "downmix_benchmark", decode_downmix_benchmark },
 	{ NULL, NULL }
 };
 
@@ -1094,6 +1915,9 @@ int luaopen_decode(lua_State *L) {
 	/* register sample playback */
 	decode_sample_init(L);
 
+	/* default downmix matrices */
+	decode_downmix_init();
+
 #ifdef WITH_SPPRIVATE
 	luaopen_spprivate(L);
 #endif
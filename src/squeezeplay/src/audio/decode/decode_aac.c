@@ -297,11 +297,10 @@ static void *decode_aac_start(u8_t *params, u32_t num_params) {
 
 	LOG_DEBUG(log_audio_codec, "decode_aac_start(%c)", params[0]);
 
-	self = malloc(sizeof(struct decode_aac));
-	memset(self, 0, sizeof(struct decode_aac));
+	self = decode_alloc(sizeof(struct decode_aac));
 
-	self->input_buffer = malloc(INPUT_BUFFER_SIZE);
-	self->output_buffer = malloc(OUTPUT_BUFFER_SIZE);
+	self->input_buffer = decode_alloc(INPUT_BUFFER_SIZE);
+	self->output_buffer = decode_alloc(OUTPUT_BUFFER_SIZE);
 
 	/* Assume we aren't changing sample rates until proven wrong */
 	self->sample_rate = decode_output_samplerate();
@@ -346,16 +345,40 @@ static void decode_aac_stop(void *data) {
 	}
 
 	if (self->output_buffer) {
-		free(self->output_buffer);
+		decode_free(self->output_buffer);
 		self->output_buffer = NULL;
 	}
 
 	if (self->input_buffer) {
-		free(self->input_buffer);
+		decode_free(self->input_buffer);
 		self->input_buffer = NULL;
 	}
 	
-	free(self);
+	decode_free(self);
+}
+
+
+static bool_t decode_aac_seek(void *data, u32_t ms) {
+	struct decode_aac *self = (struct decode_aac *) data;
+	u32_t skip_frames;
+
+	/* only the mp4 file format has an index */
+	if (!self->isMP4 || !self->heaacdec) {
+		return FALSE;
+	}
+
+	if (!mp4_seek_ms(&self->mp4, self->mp4_track, ms, self->sample_rate, &skip_frames)) {
+		return FALSE;
+	}
+
+	/* drop the rest of the current packet */
+	self->bytes_read = 0;
+	self->bytes_valid = 0;
+	aacDecoder_SetParam(self->heaacdec, AAC_TPDEC_CLEAR_BUFFER, 1);
+
+	decode_output_skip_frames(skip_frames);
+
+	return TRUE;
 }
 
 
@@ -371,4 +394,5 @@ struct decode_module decode_aac = {
 	decode_aac_stop,
 	decode_aac_samples,
 	decode_aac_callback,
+	decode_aac_seek,
 };
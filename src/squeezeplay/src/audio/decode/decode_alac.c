@@ -185,11 +185,11 @@ static void *decode_alac_start(u8_t *params, u32_t num_params) {
 
 	LOG_DEBUG(log_audio_codec, "decode_alac_start");
 
-	self = calloc(1, sizeof(struct decode_alac));
-	self->alacdec.priv_data = calloc(1, alac_priv_data_size);
+	self = decode_alloc(sizeof(struct decode_alac));
+	self->alacdec.priv_data = decode_alloc(alac_priv_data_size);
 	mp4_init(&self->mp4);
 
-	self->output_buffer = malloc(OUTPUT_BUFFER_SIZE);
+	self->output_buffer = decode_alloc(OUTPUT_BUFFER_SIZE);
 
 	/* Assume we aren't changing sample rates until proven wrong */
 	self->sample_rate = decode_output_samplerate();
@@ -204,15 +204,33 @@ static void decode_alac_stop(void *data) {
 	LOG_DEBUG(log_audio_codec, "decode_alac_stop()");
 
 	alac_decode_close(&self->alacdec);
-	free(self->alacdec.priv_data);
+	decode_free(self->alacdec.priv_data);
 	mp4_free(&self->mp4);
 
 	if (self->output_buffer) {
-		free(self->output_buffer);
+		decode_free(self->output_buffer);
 		self->output_buffer = NULL;
 	}
 	
-	free(self);
+	decode_free(self);
+}
+
+
+static bool_t decode_alac_seek(void *data, u32_t ms) {
+	struct decode_alac *self = (struct decode_alac *) data;
+	u32_t skip_frames;
+
+	if (!self->init) {
+		return FALSE;
+	}
+
+	if (!mp4_seek_ms(&self->mp4, 0, ms, self->sample_rate, &skip_frames)) {
+		return FALSE;
+	}
+
+	decode_output_skip_frames(skip_frames);
+
+	return TRUE;
 }
 
 
@@ -229,4 +247,5 @@ struct decode_module decode_alac = {
 	decode_alac_stop,
 	decode_alac_samples,
 	decode_alac_callback,
+	decode_alac_seek,
 };
@@ -193,9 +193,20 @@ static int decode_alsa_init(lua_State *L) {
 	unsigned int buffer_time;
 	unsigned int period_count;
 	unsigned int sample_size;
+	size_t fifo_size;
+	u32_t fifo_seconds;
+	bool_t fifo_packed;
 	int shmid;
 	void *buf;
 
+	lua_getfield(L, 2, "alsaSampleSize");
+	sample_size = luaL_optinteger(L, -1, 16);
+	lua_pop(L, 1);
+
+	/* a packed fifo loses nothing with 16 bit output */
+	fifo_packed = (sample_size == 16);
+	fifo_size = decode_fifo_settings(L, &fifo_seconds, &fifo_packed);
+
 	/* allocate memory */
 
 	// XXXX use shared memory
@@ -204,7 +215,7 @@ static int decode_alsa_init(lua_State *L) {
 		shmctl(shmid, IPC_RMID, NULL);
 	}
 
-	shmid = shmget(56833, DECODE_AUDIO_BUFFER_SIZE, 0600 | IPC_CREAT);
+	shmid = shmget(56833, DECODE_AUDIO_BUFFER_SIZE(fifo_size), 0600 | IPC_CREAT);
 	if (shmid == -1) {
 		// XXXX errors
 		LOG_ERROR(log_audio_codec, "shmget error %s", strerror(errno));
@@ -218,7 +229,9 @@ static int decode_alsa_init(lua_State *L) {
 		return 0;
 	}
 
-	decode_init_buffers(buf, true);
+	decode_init_buffers(buf, fifo_size, true);
+	decode_audio->fifo_seconds = fifo_seconds;
+	decode_audio->fifo_packed = fifo_packed;
 
 
 	/* start threads */
@@ -231,9 +244,6 @@ static int decode_alsa_init(lua_State *L) {
 	lua_getfield(L, 2, "alsaEffectsDevice");
 	effects_device = luaL_optstring(L, -1, NULL);
 
-	lua_getfield(L, 2, "alsaSampleSize");
-	sample_size = luaL_optinteger(L, -1, 16);
-
 
 #if 0
 	/* test if device is available */
@@ -22,6 +22,9 @@
 
 #include <alsa/asoundlib.h>
 
+#include <pthread.h>
+#include <semaphore.h>
+
 /* for real-time behaviour */
 #include <malloc.h>
 #include <sys/mman.h>
@@ -38,21 +41,37 @@
 
 static int is_debug = 0;
 
-static __inline void log_printf(int level, const char *format, ...) {
+/* Messages from the audio loop are queued in a ring and written by a
+ * normal priority thread, so an underrun report doesn't wait on syslog
+ * or stdout. Only the audio loop logs once the writer has started. The
+ * ring is drained at exit.
+ */
+#define LOG_RING_SLOTS 64
+
+struct log_record {
+	struct timeval t;
+	int level;
 	char buf[255];
-	va_list va;
+};
+
+static struct log_record log_ring[LOG_RING_SLOTS];
+static volatile u32_t log_head;		/* written by the audio loop */
+static volatile u32_t log_tail;		/* written by the writer */
+static volatile u32_t log_dropped;
+static u32_t log_reported;
+
+static pthread_t log_writer;
+static sem_t log_writer_sem;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool_t log_writer_running = false;
 
-	va_start(va, format);
-	vsnprintf(buf, sizeof(buf), format, va);
-	va_end(va);
 
+static void log_output(int level, struct timeval *t, const char *buf) {
 	if (is_debug) {
 		char *lstr;
-		struct timeval t;
 		struct tm tm;
 
-		gettimeofday(&t, NULL);
-		gmtime_r(&t.tv_sec, &tm);
+		gmtime_r(&t->tv_sec, &tm);
 
 		switch (level) {
 		case LOG_PRIORITY_ERROR:
@@ -73,7 +92,7 @@ static __inline void log_printf(int level, const char *format, ...) {
 		printf("%04d%02d%02d %02d:%02d:%02d.%03ld %-6s %s\n",
 		       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
 		       tm.tm_hour, tm.tm_min, tm.tm_sec,
-		       (long)(t.tv_usec / 1000),
+		       (long)(t->tv_usec / 1000),
 		       lstr, buf);
 	}
 
@@ -82,6 +101,108 @@ static __inline void log_printf(int level, const char *format, ...) {
 #endif
 }
 
+
+/* write the queued messages, from the writer thread or at exit */
+static void log_drain(void) {
+	struct log_record *rec;
+	struct timeval t;
+	char buf[64];
+	u32_t dropped;
+
+	pthread_mutex_lock(&log_drain_mutex);
+
+	while (log_tail != log_head) {
+		__sync_synchronize();
+
+		rec = &log_ring[log_tail % LOG_RING_SLOTS];
+		log_output(rec->level, &rec->t, rec->buf);
+
+		__sync_synchronize();
+		log_tail++;
+	}
+
+	dropped = log_dropped;
+	if (dropped != log_reported) {
+		gettimeofday(&t, NULL);
+		snprintf(buf, sizeof(buf), "%u log messages dropped", (unsigned int)(dropped - log_reported));
+		log_reported = dropped;
+
+		log_output(LOG_PRIORITY_WARN, &t, buf);
+	}
+
+	if (is_debug) {
+		fflush(stdout);
+	}
+
+	pthread_mutex_unlock(&log_drain_mutex);
+}
+
+
+static void *log_writer_thread(void *unused) {
+	while (1) {
+		while (sem_wait(&log_writer_sem) < 0 && errno == EINTR) {
+			/* retry */
+		}
+		log_drain();
+	}
+
+	return NULL;
+}
+
+
+/* start the writer, before the process is made realtime so the thread
+ * keeps the normal scheduler.
+ */
+static void log_writer_start(void) {
+	if (sem_init(&log_writer_sem, 0, 0) < 0) {
+		return;
+	}
+
+	if (pthread_create(&log_writer, NULL, log_writer_thread, NULL) != 0) {
+		sem_destroy(&log_writer_sem);
+		return;
+	}
+
+	atexit(log_drain);
+	log_writer_running = true;
+}
+
+
+static void log_printf(int level, const char *format, ...) {
+	struct log_record *rec;
+	char buf[255];
+	struct timeval t;
+	va_list va;
+
+	if (!log_writer_running) {
+		va_start(va, format);
+		vsnprintf(buf, sizeof(buf), format, va);
+		va_end(va);
+
+		gettimeofday(&t, NULL);
+		log_output(level, &t, buf);
+		return;
+	}
+
+	if (log_head - log_tail >= LOG_RING_SLOTS) {
+		log_dropped++;
+		return;
+	}
+
+	rec = &log_ring[log_head % LOG_RING_SLOTS];
+	gettimeofday(&rec->t, NULL);
+	rec->level = level;
+
+	va_start(va, format);
+	vsnprintf(rec->buf, sizeof(rec->buf), format, va);
+	va_end(va);
+
+	__sync_synchronize();
+	log_head++;
+
+	sem_post(&log_writer_sem);
+}
+
 #define LOG_DEBUG(FMT, ...) { if (is_debug) log_printf(LOG_PRIORITY_DEBUG, "%s:%d " FMT, __func__, __LINE__, ##__VA_ARGS__); }
 #define LOG_INFO(FMT, ...) log_printf(LOG_PRIORITY_INFO, "%s:%d " FMT, __func__, __LINE__, ##__VA_ARGS__)
 #define LOG_WARN(FMT, ...) log_printf(LOG_PRIORITY_WARN, "%s:%d " FMT, __func__, __LINE__, ##__VA_ARGS__)
@@ -262,6 +383,12 @@ static void decode_alsa_copyright(struct decode_alsa *state,
 }
 
 
+/* Frames unpacked from a packed decode fifo for each write */
+#define UNPACK_FRAMES 1024
+
+static sample_t unpack_buf[UNPACK_FRAMES * 2];
+
+
 /*
  * This function is called by to copy samples from the output buffer to
  * the alsa buffer.
@@ -278,7 +405,7 @@ static void playback_callback(struct decode_alsa *state,
 
 	ASSERT_AUDIO_LOCKED();
 
-	decode_frames = BYTES_TO_SAMPLES(fifo_bytes_used(&decode_audio->fifo));
+	decode_frames = FIFO_BYTES_TO_FRAMES(fifo_bytes_used(&decode_audio->fifo));
 
 	/* Should we start the audio now based on having enough decoded data? */
 	if (decode_audio->state & DECODE_STATE_AUTOSTART
@@ -329,8 +456,8 @@ static void playback_callback(struct decode_alsa *state,
 	/* only skip if it will not cause an underrun */
 	if (decode_frames >= output_frames && decode_audio->skip_ahead_bytes > 0) {
 		skip_frames = decode_frames - output_frames;
-		if (skip_frames > BYTES_TO_SAMPLES(decode_audio->skip_ahead_bytes)) {
-			skip_frames = BYTES_TO_SAMPLES(decode_audio->skip_ahead_bytes);
+		if (skip_frames > FIFO_BYTES_TO_FRAMES(decode_audio->skip_ahead_bytes)) {
+			skip_frames = FIFO_BYTES_TO_FRAMES(decode_audio->skip_ahead_bytes);
 		}
 	}
 
@@ -357,34 +484,45 @@ static void playback_callback(struct decode_alsa *state,
 
 		LOG_DEBUG("Skipping %d frames", (int)skip_frames);
 		
-		wrap_frames = BYTES_TO_SAMPLES(fifo_bytes_until_rptr_wrap(&decode_audio->fifo));
+		wrap_frames = FIFO_BYTES_TO_FRAMES(fifo_bytes_until_rptr_wrap(&decode_audio->fifo));
 
 		if (wrap_frames < skip_frames) {
-			fifo_rptr_incby(&decode_audio->fifo, SAMPLES_TO_BYTES(wrap_frames));
-			decode_audio->skip_ahead_bytes -= SAMPLES_TO_BYTES(wrap_frames);
+			fifo_rptr_incby(&decode_audio->fifo, FRAMES_TO_FIFO_BYTES(wrap_frames));
+			decode_audio->skip_ahead_bytes -= FRAMES_TO_FIFO_BYTES(wrap_frames);
 			decode_audio->elapsed_samples += wrap_frames;
 			skip_frames -= wrap_frames;
 		}
 
-		fifo_rptr_incby(&decode_audio->fifo, SAMPLES_TO_BYTES(skip_frames));
-		decode_audio->skip_ahead_bytes -= SAMPLES_TO_BYTES(skip_frames);
+		fifo_rptr_incby(&decode_audio->fifo, FRAMES_TO_FIFO_BYTES(skip_frames));
+		decode_audio->skip_ahead_bytes -= FRAMES_TO_FIFO_BYTES(skip_frames);
 		decode_audio->elapsed_samples += skip_frames;
 	}
 
 	while (decode_frames) {
 		size_t wrap_frames, frames_write, frames_cnt;
+		sample_t *samples;
 		s32_t lgain, rgain;
 		
 		lgain = decode_audio->lgain;
 		rgain = decode_audio->rgain;
 
-		wrap_frames = BYTES_TO_SAMPLES(fifo_bytes_until_rptr_wrap(&decode_audio->fifo));
+		wrap_frames = FIFO_BYTES_TO_FRAMES(fifo_bytes_until_rptr_wrap(&decode_audio->fifo));
 
 		frames_write = decode_frames;
 		if (wrap_frames < frames_write) {
 			frames_write = wrap_frames;
 		}
 
+		samples = (sample_t *)(void *)(decode_fifo_buf + decode_audio->fifo.rptr);
+		if (decode_audio->fifo_packed) {
+			if (frames_write > UNPACK_FRAMES) {
+				frames_write = UNPACK_FRAMES;
+			}
+
+			decode_unpack_frames(unpack_buf, (s16_t *)(void *)samples, frames_write);
+			samples = unpack_buf;
+		}
+
 		frames_cnt = frames_write;
 		
 		/* Handle fading and delayed fading */
@@ -433,7 +571,7 @@ static void playback_callback(struct decode_alsa *state,
 				Sint32 *output_ptr;
 				
 				output_ptr = (Sint32 *)(void *)output_buffer;
-				decode_ptr = (sample_t *)(void *)(decode_fifo_buf + decode_audio->fifo.rptr);
+				decode_ptr = samples;
 				while (frames_cnt--) {
 					*(output_ptr++) = fixed_mul(lgain, *(decode_ptr++)) >> 8;
 					*(output_ptr++) = fixed_mul(rgain, *(decode_ptr++)) >> 8;
@@ -444,7 +582,7 @@ static void playback_callback(struct decode_alsa *state,
 				u8_t *output_ptr;
 				
 				output_ptr = (u8_t *)(void *)output_buffer;
-				decode_ptr = (sample_t *)(void *)(decode_fifo_buf + decode_audio->fifo.rptr);
+				decode_ptr = samples;
 				while (frames_cnt--) {
 					sample_t lsample = fixed_mul(lgain, *(decode_ptr++));
 					sample_t rsample = fixed_mul(rgain, *(decode_ptr++));
@@ -463,14 +601,16 @@ static void playback_callback(struct decode_alsa *state,
 			Sint16 *output_ptr;
 
 			output_ptr = (Sint16 *)(void *)output_buffer;
-			decode_ptr = (sample_t *)(void *)(decode_fifo_buf + decode_audio->fifo.rptr);
+			decode_ptr = samples;
 			while (frames_cnt--) {
 				*(output_ptr++) = fixed_mul(lgain, *(decode_ptr++)) >> 16;
 				*(output_ptr++) = fixed_mul(rgain, *(decode_ptr++)) >> 16;
 			}
 		}
 
-		fifo_rptr_incby(&decode_audio->fifo, SAMPLES_TO_BYTES(frames_write));
+		decode_tap_write(samples, frames_write);
+
+		fifo_rptr_incby(&decode_audio->fifo, FRAMES_TO_FIFO_BYTES(frames_write));
 		decode_audio->elapsed_samples += frames_write;
 
 		output_buffer += PCM_FRAMES_TO_BYTES(frames_write);
@@ -982,6 +1122,8 @@ static void *audio_thread_execute(void *data) {
 						}
 					
 						decode_audio->sync_elapsed_timestamp = jive_jiffies();
+
+						decode_tap_timestamp(delay, state->pcm_sample_rate);
 					}
 
 					playback_callback(state, buf, frames);
@@ -1101,8 +1243,8 @@ static int decode_lock_memory()
 
 	page_size = sysconf(_SC_PAGESIZE);
 
-	/* touch each page of buffer */
-	for (i=0; i<DECODE_AUDIO_BUFFER_SIZE; i+=page_size) {
+	/* touch each page of the fifo buffers */
+	for (i=0; i<decode_audio->fifo_buffer_size + EFFECT_FIFO_SIZE; i+=page_size) {
 		*(decode_fifo_buf + i) = 0;
 	}
 
@@ -1126,7 +1268,7 @@ static int decode_alsa_shared_mem_attach(void)
 	// XXXX errors
 
 	decode_fifo_buf = (((u8_t *)decode_audio) + sizeof(struct decode_audio));
-	effect_fifo_buf = ((u8_t *)decode_fifo_buf) + DECODE_FIFO_SIZE;
+	effect_fifo_buf = ((u8_t *)decode_fifo_buf) + decode_audio->fifo_buffer_size;
 
 	return 0;
 }
@@ -1180,6 +1322,8 @@ int main(int argv, char **argc)
 	openlog("squeezeplay", LOG_ODELAY | LOG_CONS, LOG_USER);
 #endif
 
+	log_writer_start();
+
 	/* attach to shared memory buffer */
 	if (decode_alsa_shared_mem_attach() != 0) {
 		LOG_ERROR("Can't attach to shared memory");
@@ -0,0 +1,228 @@
+/*
+** Copyright 2010 Logitech. All Rights Reserved.
+**
+** This file is licensed under BSD. Please see the LICENSE file for details.
+*/
+
+#include "common.h"
+
+#include "audio/fifo.h"
+#include "audio/fixed_math.h"
+#include "audio/decode/decode.h"
+#include "audio/decode/decode_priv.h"
+
+
+/* Multichannel audio is mixed down to stereo by the decoders before it
+ * is output. There is a matrix for each channel count, with a left and
+ * right gain for each channel. The default matrices use the ITU-R BS.775
+ * coefficients, the centre and surrounds at -3dB and the LFE dropped,
+ * scaled so the mix does not clip.
+ *
+ * Channels are in the WAVE and FLAC order: L R C LFE, then the back and
+ * side channels.
+ */
+
+enum downmix_position {
+	POS_L, POS_R, POS_C, POS_LFE, POS_LS, POS_RS, POS_BC
+};
+
+static const u8_t downmix_layout[DOWNMIX_MAX_CHANNELS + 1][DOWNMIX_MAX_CHANNELS] = {
+	{ 0 },
+	{ 0 },
+	{ 0 },
+	{ POS_L, POS_R, POS_C },
+	{ POS_L, POS_R, POS_LS, POS_RS },
+	{ POS_L, POS_R, POS_C, POS_LS, POS_RS },
+	{ POS_L, POS_R, POS_C, POS_LFE, POS_LS, POS_RS },
+	{ POS_L, POS_R, POS_C, POS_LFE, POS_BC, POS_LS, POS_RS },
+	{ POS_L, POS_R, POS_C, POS_LFE, POS_LS, POS_RS, POS_LS, POS_RS },
+};
+
+/* Left and right gain for each position, in 1/10000 */
+static const u32_t downmix_gain[][2] = {
+	{ 10000, 0 },		/* L */
+	{ 0, 10000 },		/* R */
+	{ 7071, 7071 },		/* C */
+	{ 0, 0 },		/* LFE */
+	{ 7071, 0 },		/* Ls */
+	{ 0, 7071 },		/* Rs */
+	{ 5000, 5000 },		/* Bc, -3dB into each surround */
+};
+
+static fft_fixed downmix_matrix[DOWNMIX_MAX_CHANNELS + 1][2][DOWNMIX_MAX_CHANNELS];
+
+
+static inline sample_t downmix_clip(s64_t s) {
+	if (s > SAMPLE_MAX) {
+		return SAMPLE_MAX;
+	}
+	else if (s < SAMPLE_MIN) {
+		return SAMPLE_MIN;
+	}
+	return (sample_t)s;
+}
+
+
+static void downmix_default_matrix(u32_t channels) {
+	u32_t c, pos, sum = 0;
+
+	for (c = 0; c < channels; c++) {
+		sum += downmix_gain[downmix_layout[channels][c]][0];
+	}
+
+	for (c = 0; c < channels; c++) {
+		pos = downmix_layout[channels][c];
+
+		downmix_matrix[channels][0][c] = ((s64_t)downmix_gain[pos][0] << FIXED_FRAC_BITS) / sum;
+		downmix_matrix[channels][1][c] = ((s64_t)downmix_gain[pos][1] << FIXED_FRAC_BITS) / sum;
+	}
+}
+
+
+void decode_downmix_init(void) {
+	u32_t channels;
+
+	for (channels = 3; channels <= DOWNMIX_MAX_CHANNELS; channels++) {
+		downmix_default_matrix(channels);
+	}
+}
+
+
+/* 5.1 is the common case, so it is unrolled. */
+static void downmix_6(sample_t *out, sample_t *in, size_t frames) {
+	fft_fixed *lm = downmix_matrix[6][0];
+	fft_fixed *rm = downmix_matrix[6][1];
+	s64_t l, r;
+
+	while (frames--) {
+		l = (s64_t)in[0] * lm[0] + (s64_t)in[1] * lm[1] + (s64_t)in[2] * lm[2]
+			+ (s64_t)in[3] * lm[3] + (s64_t)in[4] * lm[4] + (s64_t)in[5] * lm[5];
+		r = (s64_t)in[0] * rm[0] + (s64_t)in[1] * rm[1] + (s64_t)in[2] * rm[2]
+			+ (s64_t)in[3] * rm[3] + (s64_t)in[4] * rm[4] + (s64_t)in[5] * rm[5];
+		in += 6;
+
+		*out++ = downmix_clip(l >> FIXED_FRAC_BITS);
+		*out++ = downmix_clip(r >> FIXED_FRAC_BITS);
+	}
+}
+
+
+/* Mix frames of interleaved channels down to stereo. out may be the
+ * same buffer as in.
+ */
+void decode_downmix(sample_t *out, sample_t *in, u32_t channels, size_t frames) {
+	fft_fixed *lm = downmix_matrix[channels][0];
+	fft_fixed *rm = downmix_matrix[channels][1];
+	s64_t l, r;
+	u32_t c;
+
+	assert(channels > 2 && channels <= DOWNMIX_MAX_CHANNELS);
+
+	if (channels == 6) {
+		downmix_6(out, in, frames);
+		return;
+	}
+
+	while (frames--) {
+		l = r = 0;
+		for (c = 0; c < channels; c++) {
+			l += (s64_t)in[c] * lm[c];
+			r += (s64_t)in[c] * rm[c];
+		}
+		in += channels;
+
+		*out++ = downmix_clip(l >> FIXED_FRAC_BITS);
+		*out++ = downmix_clip(r >> FIXED_FRAC_BITS);
+	}
+}
+
+
+int decode_downmix_matrix(lua_State *L) {
+	int channels, c;
+
+	/* stack is:
+	 * 1: decode
+	 * 2: channels
+	 * 3: left gain for each channel, or nil for the default matrix
+	 * 4: right gain for each channel
+	 */
+
+	channels = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, channels > 2 && channels <= DOWNMIX_MAX_CHANNELS, 2, "channels out of range");
+
+	if (lua_isnoneornil(L, 3)) {
+		downmix_default_matrix(channels);
+		return 0;
+	}
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+	luaL_checktype(L, 4, LUA_TTABLE);
+
+	for (c = 0; c < channels; c++) {
+		lua_rawgeti(L, 3, c + 1);
+		downmix_matrix[channels][0][c] = double_to_fixed(luaL_optnumber(L, -1, 0));
+		lua_rawgeti(L, 4, c + 1);
+		downmix_matrix[channels][1][c] = double_to_fixed(luaL_optnumber(L, -1, 0));
+		lua_pop(L, 2);
+	}
+
+	return 0;
+}
+
+
+#define BENCHMARK_RATE 96000
+#define BENCHMARK_CHANNELS 6
+#define BENCHMARK_FRAMES 4096
+
+int decode_downmix_benchmark(lua_State *L) {
+	sample_t *in, *out;
+	Uint32 seed = 1, ticks;
+	int iterations, i;
+	size_t n, frames;
+
+	/* stack is:
+	 * 1: decode
+	 * 2: iterations, default 10
+	 *
+	 * Mixes down a second of 6 channel 96kHz audio. Returns the time
+	 * for each second of audio in milliseconds, and the frames mixed
+	 * per second.
+	 */
+
+	iterations = luaL_optinteger(L, 2, 10);
+
+	in = malloc(sizeof(sample_t) * BENCHMARK_CHANNELS * BENCHMARK_FRAMES);
+	out = malloc(sizeof(sample_t) * 2 * BENCHMARK_FRAMES);
+	if (!in || !out) {
+		free(in);
+		free(out);
+		return luaL_error(L, "out of memory");
+	}
+
+	/* noise test signal, 24 bit samples */
+	for (n = 0; n < BENCHMARK_CHANNELS * BENCHMARK_FRAMES; n++) {
+		seed = seed * 1103515245 + 12345;
+		in[n] = (sample_t)(seed & 0xFFFFFF00);
+	}
+
+	ticks = SDL_GetTicks();
+	for (i = 0; i < iterations; i++) {
+		for (n = 0; n < BENCHMARK_RATE; n += frames) {
+			frames = BENCHMARK_RATE - n;
+			if (frames > BENCHMARK_FRAMES) {
+				frames = BENCHMARK_FRAMES;
+			}
+
+			decode_downmix(out, in, BENCHMARK_CHANNELS, frames);
+		}
+	}
+	ticks = SDL_GetTicks() - ticks;
+
+	free(in);
+	free(out);
+
+	lua_pushnumber(L, (double)ticks / iterations);
+	lua_pushnumber(L, (ticks) ? ((double)iterations * BENCHMARK_RATE * 1000) / ticks : 0);
+
+	return 2;
+}
@@ -20,6 +20,24 @@ struct decode_flac {
 
 	int sample_rate;
 	bool_t error_occurred;
+
+	/* interleaved samples, sized from STREAMINFO in the arena. a frame
+	 * larger than max_blocksize grows it on the heap.
+	 */
+	sample_t *output_buffer;
+	size_t output_buffer_size;
+	bool_t output_buffer_heap;
+
+	/* seeking, using the seektable */
+	bool_t is_ogg;
+	u64_t stream_pos;
+	u64_t first_frame_offset;
+	unsigned num_seekpoints;
+	FLAC__StreamMetadata_SeekPoint *seekpoints;
+
+	/* sample to start at after a seek */
+	bool_t seeking;
+	u64_t seek_sample;
 };
 
 
@@ -44,6 +62,8 @@ static FLAC__StreamDecoderReadStatus decode_flac_read_callback(
 	}
 
 	*bytes = streambuf_read(buffer, 0, requested_bytes, &streaming);
+	self->stream_pos += *bytes;
+
 	if (*bytes == 0) {
 		current_decoder_state |= DECODE_STATE_UNDERRUN;
 
@@ -59,6 +79,52 @@ static FLAC__StreamDecoderReadStatus decode_flac_read_callback(
 }
 
 
+static FLAC__StreamDecoderTellStatus decode_flac_tell_callback(
+	const FLAC__StreamDecoder *decoder,
+	FLAC__uint64 *absolute_byte_offset,
+	void *data) {
+
+	struct decode_flac *self = (struct decode_flac *) data;
+
+	*absolute_byte_offset = self->stream_pos;
+
+	return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+
+/* make room for a frame of blocksize samples. the arena block is
+ * allocated once, growth after that reallocs on the heap.
+ */
+static bool_t decode_flac_output_buffer(struct decode_flac *self, unsigned channels, unsigned blocksize) {
+	size_t size = sizeof(sample_t) * ((channels > 2) ? channels : 2) * blocksize;
+	sample_t *buf;
+
+	if (size <= self->output_buffer_size) {
+		return TRUE;
+	}
+
+	if (!self->output_buffer) {
+		buf = decode_alloc(size);
+	}
+	else {
+		LOG_DEBUG(log_audio_codec, "frame larger than max_blocksize, %d bytes", (int)size);
+
+		buf = realloc(self->output_buffer_heap ? self->output_buffer : NULL, size);
+		if (buf) {
+			self->output_buffer_heap = TRUE;
+		}
+	}
+
+	if (!buf) {
+		return FALSE;
+	}
+
+	self->output_buffer = buf;
+	self->output_buffer_size = size;
+	return TRUE;
+}
+
+
 static FLAC__StreamDecoderWriteStatus decode_flac_write_callback(
 	const FLAC__StreamDecoder *decoder,
 	const FLAC__Frame *frame,
@@ -76,9 +142,34 @@ static FLAC__StreamDecoderWriteStatus decode_flac_write_callback(
 
 	self->sample_rate = frame->header.sample_rate;
 
+	if (frame->header.channels > DOWNMIX_MAX_CHANNELS) {
+		LOG_ERROR(log_audio_codec, "too many channels %d", frame->header.channels);
+		current_decoder_state |= DECODE_STATE_ERROR | DECODE_STATE_NOT_SUPPORTED;
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	}
+
+	if (self->seeking) {
+		/* skip to the seek sample in the first frame */
+		u64_t sample = frame->header.number.sample_number;
+
+		if (sample + frame->header.blocksize <= self->seek_sample) {
+			return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+		}
+
+		if (sample < self->seek_sample) {
+			decode_output_skip_frames((u32_t)(self->seek_sample - sample));
+		}
+		self->seeking = FALSE;
+	}
+
+	if (!decode_flac_output_buffer(self, frame->header.channels, frame->header.blocksize)) {
+		current_decoder_state |= DECODE_STATE_ERROR;
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	}
+
 	lptr = buffer[0];
 	rptr = buffer[1];
-	sbuf = sptr = malloc(sizeof(sample_t) * 2 * frame->header.blocksize);
+	sbuf = sptr = self->output_buffer;
 
 	/* Scale samples, and copy if we have mono input */
 	if (frame->header.channels == 1) {
@@ -97,6 +188,20 @@ static FLAC__StreamDecoderWriteStatus decode_flac_write_callback(
 			}
 		}
 	}
+	else if (frame->header.channels > 2) {
+		/* interleave and scale, then mix down to stereo */
+		unsigned int ch, shift;
+
+		shift = (frame->header.bits_per_sample == 16) ? 16 : 8;
+
+		for (i=0; i<frame->header.blocksize; i++) {
+			for (ch=0; ch<frame->header.channels; ch++) {
+				*sptr++ = buffer[ch][i] << shift;
+			}
+		}
+
+		decode_downmix(sbuf, sbuf, frame->header.channels, frame->header.blocksize);
+	}
 	else {
 		if (frame->header.bits_per_sample == 16) {
 			for (i=0; i<frame->header.blocksize; i++) {
@@ -116,8 +221,6 @@ static FLAC__StreamDecoderWriteStatus decode_flac_write_callback(
 			      frame->header.blocksize,
 			      frame->header.sample_rate);
 
-	free(sbuf);
-
 
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
@@ -132,6 +235,17 @@ static void decode_flac_metadata_callback(
 
 	if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
 		self->sample_rate = metadata->data.stream_info.sample_rate;
+
+		decode_flac_output_buffer(self, metadata->data.stream_info.channels, metadata->data.stream_info.max_blocksize);
+	}
+	else if (metadata->type == FLAC__METADATA_TYPE_SEEKTABLE && !self->seekpoints) {
+		size_t size = sizeof(FLAC__StreamMetadata_SeekPoint) * metadata->data.seek_table.num_points;
+
+		self->seekpoints = decode_alloc(size);
+		if (self->seekpoints) {
+			memcpy(self->seekpoints, metadata->data.seek_table.points, size);
+			self->num_seekpoints = metadata->data.seek_table.num_points;
+		}
 	}
 }
 
@@ -163,6 +277,16 @@ static bool_t decode_flac_callback(void *data) {
 		return FALSE;
 	}
 
+	state = FLAC__stream_decoder_get_state(self->decoder);
+	if (state == FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC && !self->first_frame_offset && !self->is_ogg) {
+		/* after the metadata, seekpoint offsets are from here */
+		FLAC__uint64 pos;
+
+		if (FLAC__stream_decoder_get_decode_position(self->decoder, &pos)) {
+			self->first_frame_offset = pos;
+		}
+	}
+
 	FLAC__stream_decoder_process_single(self->decoder);
 
 	state = FLAC__stream_decoder_get_state(self->decoder);
@@ -176,6 +300,46 @@ static bool_t decode_flac_callback(void *data) {
 }		
 
 
+static bool_t decode_flac_seek(void *data, u32_t ms) {
+	struct decode_flac *self = (struct decode_flac *) data;
+	FLAC__StreamMetadata_SeekPoint *point = NULL;
+	u64_t sample;
+	unsigned i;
+
+	if (self->is_ogg || !self->first_frame_offset || !self->sample_rate) {
+		return FALSE;
+	}
+
+	sample = ((u64_t)ms * self->sample_rate) / 1000;
+
+	/* last seekpoint at or before the sample, the points are sorted */
+	for (i = 0; i < self->num_seekpoints; i++) {
+		if (self->seekpoints[i].sample_number == FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER
+		    || self->seekpoints[i].sample_number > sample) {
+			break;
+		}
+		point = &self->seekpoints[i];
+	}
+
+	if (!point) {
+		LOG_DEBUG(log_audio_codec, "no seekpoint for sample %llu", sample);
+		return FALSE;
+	}
+
+	LOG_DEBUG(log_audio_codec, "seek to sample %llu, seekpoint sample %llu offset %llu", sample, point->sample_number, point->stream_offset);
+
+	self->stream_pos = self->first_frame_offset + point->stream_offset;
+	streambuf_seek(self->stream_pos);
+
+	FLAC__stream_decoder_flush(self->decoder);
+
+	self->seeking = TRUE;
+	self->seek_sample = sample;
+
+	return TRUE;
+}
+
+
 static size_t decode_flac_samples(void *data) {
 	return 2 * 4608;
 }
@@ -186,19 +350,20 @@ static void *decode_flac_start(u8_t *params, u32_t num_params) {
 
 	LOG_DEBUG(log_audio_codec, "decode_flac_start()");
 
-	self = malloc(sizeof(struct decode_flac));
-	memset(self, 0, sizeof(struct decode_flac));
+	self = decode_alloc(sizeof(struct decode_flac));
 
 	self->decoder = FLAC__stream_decoder_new();
 	// XXXX error handling
 
+	FLAC__stream_decoder_set_metadata_respond(self->decoder, FLAC__METADATA_TYPE_SEEKTABLE);
+
 	if (params[0] != 'o') {
 
 		FLAC__stream_decoder_init_stream(
 			self->decoder,
 			decode_flac_read_callback,
 			NULL, /* seek_callback */
-			NULL, /* tell_callback */
+			decode_flac_tell_callback,
 			NULL, /* length_callback */
 			NULL, /* eof_callback */
 			decode_flac_write_callback,
@@ -211,6 +376,8 @@ static void *decode_flac_start(u8_t *params, u32_t num_params) {
 
 		LOG_DEBUG(log_audio_codec, "oggflac stream - using init_ogg_stream()");
 
+		self->is_ogg = TRUE;
+
 		FLAC__stream_decoder_init_ogg_stream(
 			self->decoder,
 			decode_flac_read_callback,
@@ -247,8 +414,20 @@ static void decode_flac_stop(void *data) {
 		FLAC__stream_decoder_delete(self->decoder);
 		self->decoder = NULL;
 	}
+
+	if (self->seekpoints) {
+		decode_free(self->seekpoints);
+		self->seekpoints = NULL;
+	}
+
+	if (self->output_buffer_heap) {
+		free(self->output_buffer);
+	}
+	else {
+		decode_free(self->output_buffer);
+	}
 	
-	free(self);
+	decode_free(self);
 }
 
 
@@ -259,4 +438,5 @@ struct decode_module decode_flac = {
 	decode_flac_stop,
 	decode_flac_samples,
 	decode_flac_callback,
+	decode_flac_seek,
 };
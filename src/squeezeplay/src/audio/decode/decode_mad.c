@@ -38,8 +38,18 @@ struct decode_mad {
 	u32_t encoder_padding;
 	u64_t lame_samples;
 	u64_t lame_samples_remain;
+	u64_t lame_samples_playable;
 	u64_t decoded_samples;
 
+	/* seeking, using the xing toc */
+	u64_t stream_pos;
+	u64_t xing_offset;
+	u32_t xing_frames;
+	u32_t xing_bytes;
+	u32_t frame_samples;
+	bool_t has_toc;
+	u8_t xing_toc[100];
+
 	enum {
 		MAD_STATE_OK = 0,
 		MAD_STATE_PCM_READY,
@@ -73,7 +83,7 @@ struct decode_mad {
 static void xing_parse(struct decode_mad *self) {
 	struct mad_bitptr ptr = self->stream.anc_ptr;
 	unsigned int bitlen = self->stream.anc_bitlen;
-	u32_t magic, flags, frames;
+	u32_t magic, flags, frames, i;
 
 	if (bitlen < 64) {
 		LOG_DEBUG(log_audio_codec, "no xing header");
@@ -103,18 +113,23 @@ static void xing_parse(struct decode_mad *self) {
 		return;
 	}
 	
+	self->xing_frames = frames;
+
 	if (flags & XING_BYTES) {
 		if (bitlen < 32) {
 			return;
 		}
-		mad_bit_skip(&ptr, 32);
+		self->xing_bytes = mad_bit_read(&ptr, 32);
 		bitlen -= 32;
 	}
 	if (flags & XING_TOC) {
 		if (bitlen < 800) {
 			return;
 		}
-		mad_bit_skip(&ptr, 800);
+		for (i = 0; i < 100; i++) {
+			self->xing_toc[i] = mad_bit_read(&ptr, 8);
+		}
+		self->has_toc = TRUE;
 		bitlen -= 800;
 	}
 	if (flags & XING_SCALE) {
@@ -158,6 +173,7 @@ static void xing_parse(struct decode_mad *self) {
 	
 	self->lame_samples        = frames * 1152ULL;
 	self->lame_samples_remain = self->lame_samples - self->encoder_delay - self->encoder_padding;
+	self->lame_samples_playable = self->lame_samples_remain;
 
 	LOG_DEBUG(log_audio_codec, "encoder delay=%d padding=%d", self->encoder_delay, self->encoder_padding);
 	LOG_DEBUG(log_audio_codec, "total LAME samples %llu", self->lame_samples);
@@ -265,6 +281,7 @@ static void decode_mad_frame(struct decode_mad *self) {
 			read_max = INPUT_BUFFER_SIZE - remaining;
 
 			read_num = streambuf_read(read_start, 0, read_max, &streaming);
+			self->stream_pos += read_num;
 
 			if (!read_num) {
 				current_decoder_state |= DECODE_STATE_UNDERRUN;
@@ -376,6 +393,10 @@ static void decode_mad_output(struct decode_mad *self) {
 			}
 		}
 
+		/* stream offset of the xing frame, the toc is from here */
+		self->xing_offset = self->stream_pos - (self->stream.bufend - self->stream.this_frame);
+		self->frame_samples = 32 * MAD_NSBSAMPLES(&self->frame.header);
+
 		xing_parse(self);
 		self->state = MAD_STATE_OK;
 		return;
@@ -509,6 +530,60 @@ static bool_t decode_mad_callback(void *data) {
 }
 
 
+static bool_t decode_mad_seek(void *data, u32_t ms) {
+	struct decode_mad *self = (struct decode_mad *) data;
+	u32_t sample_rate = self->frame.header.samplerate;
+	u64_t duration, pct, toc, target;
+	u32_t i, a, b;
+
+	/* radio streams can have a bogus xing header */
+	if (!self->has_toc || !self->xing_bytes || !self->xing_frames
+	    || !sample_rate || streambuf_is_icy()) {
+		return FALSE;
+	}
+
+	duration = ((u64_t)self->xing_frames * self->frame_samples * 1000) / sample_rate;
+	if (!duration || ms >= duration) {
+		return FALSE;
+	}
+
+	/* interpolate the toc, in 1/1000 percent */
+	pct = ((u64_t)ms * 100000) / duration;
+	i = pct / 1000;
+
+	a = self->xing_toc[i];
+	b = (i < 99) ? self->xing_toc[i + 1] : 256;
+	if (b < a) {
+		b = a;
+	}
+
+	toc = a * 1000 + (b - a) * (pct % 1000);
+	self->stream_pos = self->xing_offset + (toc * self->xing_bytes) / 256000;
+
+	LOG_DEBUG(log_audio_codec, "seek to %ums, toc %llu offset %llu", ms, toc, self->stream_pos);
+
+	streambuf_seek(self->stream_pos);
+
+	/* start decoding again at the next frame sync */
+	mad_stream_finish(&self->stream);
+	mad_stream_init(&self->stream);
+	mad_frame_mute(&self->frame);
+	mad_synth_mute(&self->synth);
+
+	self->guard_pointer = NULL;
+	self->encoder_delay = 0;
+	self->state = MAD_STATE_OK;
+
+	target = ((u64_t)ms * sample_rate) / 1000;
+	self->decoded_samples = target;
+	if (self->encoder_padding) {
+		self->lame_samples_remain = (target < self->lame_samples_playable) ? self->lame_samples_playable - target : 0;
+	}
+
+	return TRUE;
+}
+
+
 static size_t decode_mad_samples(void *data) {
 	return BYTES_TO_SAMPLES(OUTPUT_BUFFER_BYTES);
 }
@@ -519,11 +594,10 @@ static void *decode_mad_start(u8_t *params, u32_t num_params) {
 
 	LOG_DEBUG(log_audio_codec, "decode_mad_start()");
 
-	self = malloc(sizeof(struct decode_mad));
-	memset(self, 0, sizeof(struct decode_mad));
+	self = decode_alloc(sizeof(struct decode_mad));
 
-	self->input_buffer = malloc(INPUT_BUFFER_SIZE + MAD_BUFFER_GUARD);
-	self->output_buffer = malloc(OUTPUT_BUFFER_BYTES);
+	self->input_buffer = decode_alloc(INPUT_BUFFER_SIZE + MAD_BUFFER_GUARD);
+	self->output_buffer = decode_alloc(OUTPUT_BUFFER_BYTES);
 	self->guard_pointer = NULL;
 
 	mad_stream_init(&self->stream);
@@ -551,9 +625,9 @@ static void decode_mad_stop(void *data) {
 	mad_frame_finish(&self->frame);
 	mad_synth_finish(&self->synth);
 	
-	free(self->input_buffer);
-	free(self->output_buffer);
-	free(self);
+	decode_free(self->input_buffer);
+	decode_free(self->output_buffer);
+	decode_free(self);
 }
 
 
@@ -564,4 +638,5 @@ struct decode_module decode_mad = {
 	decode_mad_stop,
 	decode_mad_samples,
 	decode_mad_callback,
+	decode_mad_seek,
 };
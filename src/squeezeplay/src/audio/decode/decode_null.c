@@ -74,6 +74,8 @@ static Uint32 callback(Uint32 interval) {
 	}
 	decode_audio->sync_elapsed_timestamp = jive_jiffies();
 
+	decode_tap_timestamp(delay, stream_sample_rate);
+
 	add_silence_ms = decode_audio->add_silence_ms;
 	if (add_silence_ms) {
 		add_bytes = SAMPLES_TO_BYTES((u32_t)((add_silence_ms * stream_sample_rate) / 1000));
@@ -145,6 +147,8 @@ static Uint32 callback(Uint32 interval) {
 			bytes_write = wrap;
 		}
 
+		decode_tap_write((sample_t *)(void *)(decode_fifo_buf + decode_audio->fifo.rptr), BYTES_TO_SAMPLES(bytes_write));
+
 		fifo_rptr_incby(&decode_audio->fifo, bytes_write);
 		decode_audio->elapsed_samples += BYTES_TO_SAMPLES(bytes_write);
 
@@ -228,16 +232,20 @@ static int callback_thread_execute(void *unused) {
 }
 
 static int decode_null_init(lua_State *L) {
+	size_t fifo_size;
+	u32_t fifo_seconds;
 	void *buf;
 
 	/* allocate output memory */
-	buf = malloc(DECODE_AUDIO_BUFFER_SIZE);
+	fifo_size = decode_fifo_settings(L, &fifo_seconds, NULL);
+	buf = malloc(DECODE_AUDIO_BUFFER_SIZE(fifo_size));
 	if (!buf) {
 		LOG_WARN(log_audio_output, "Cannot allocate output buffer");
 		return 0;
 	}
 
-	decode_init_buffers(buf, false);
+	decode_init_buffers(buf, fifo_size, false);
+	decode_audio->fifo_seconds = fifo_seconds;
 	decode_audio->max_rate = 48000;
 
 	stream_sample_rate = decode_audio->set_sample_rate = decode_audio->track_sample_rate = 44100;
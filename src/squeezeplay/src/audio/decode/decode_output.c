@@ -38,6 +38,9 @@ static s32_t track_inversion[2] = { 1, 1 };
 /* Output channels */
 static u8_t output_channels = 0;
 
+/* Frames to drop after a seek */
+static u32_t skip_frames = 0;
+
 /* Upload tests */
 static int upload_fd = 0;
 
@@ -114,6 +117,8 @@ void decode_output_begin(void) {
 
 	ASSERT_AUDIO_LOCKED();
 
+	skip_frames = 0;
+
 	if (decode_audio) {
 		decode_audio->f->start();
 	}
@@ -213,29 +218,38 @@ static inline size_t decode_transition_bytes_remaining(size_t ptr) {
  * a transition - crossfade or fade in. This method applies gain
  * to both the new signal and the one that's already in the fifo.
  */
-static void decode_transition_copy_bytes(sample_t *buffer, size_t nbytes) {
+static void decode_transition_copy_frames(sample_t *buffer, size_t nframes) {
 	sample_t sample, *sptr;
+	s16_t *pptr;
 	int nsamples, s;
-	size_t bytes_read;
 	fft_fixed in_gain, out_gain;
 
 	ASSERT_AUDIO_LOCKED();
 
-	while (nbytes) {
-		bytes_read = SAMPLES_TO_BYTES(transition_sample_step - transition_samples_in_step);
+	while (nframes) {
+		nsamples = transition_sample_step - transition_samples_in_step;
 
-		if (bytes_read > nbytes) {
-			bytes_read = nbytes;
+		if ((size_t)nsamples > nframes) {
+			nsamples = nframes;
 		}
 
-		nsamples = BYTES_TO_SAMPLES(bytes_read);
-
 		sptr = (sample_t *)(void *)(decode_fifo_buf + decode_audio->fifo.wptr);
 
 		in_gain = transition_gain;
 		out_gain = FIXED_ONE - in_gain;
 
-		if (crossfade_started) {
+		if (decode_audio->fifo_packed) {
+			pptr = (s16_t *)(void *)sptr;
+
+			for (s=0; s<nsamples * 2; s++) {
+				sample = fixed_mul(in_gain, *buffer++);
+				if (crossfade_started) {
+					sample += fixed_mul(out_gain, *pptr << 16);
+				}
+				*pptr++ = sample >> 16;
+			}
+		}
+		else if (crossfade_started) {
 			for (s=0; s<nsamples * 2; s++) {
 				sample = fixed_mul(out_gain, *sptr);
 				sample += fixed_mul(in_gain, *buffer++);
@@ -248,8 +262,8 @@ static void decode_transition_copy_bytes(sample_t *buffer, size_t nbytes) {
 			}
 		}
 
-		fifo_wptr_incby(&decode_audio->fifo, bytes_read);
-		nbytes -= bytes_read;
+		fifo_wptr_incby(&decode_audio->fifo, FRAMES_TO_FIFO_BYTES(nsamples));
+		nframes -= nsamples;
 
 		transition_samples_in_step += nsamples;
 		while (transition_samples_in_step >= transition_sample_step) {
@@ -260,8 +274,63 @@ static void decode_transition_copy_bytes(sample_t *buffer, size_t nbytes) {
 }
 
 
+/* Size the decode fifo to hold the same number of seconds at this
+ * sample rate, up to the size allocated. Call with the fifo empty.
+ */
+static void decode_output_size_fifo(u32_t sample_rate) {
+	size_t size;
+
+	ASSERT_AUDIO_LOCKED();
+
+	size = FRAMES_TO_FIFO_BYTES((size_t)decode_audio->fifo_seconds * sample_rate);
+	if (size > decode_audio->fifo_buffer_size) {
+		size = decode_audio->fifo_buffer_size;
+	}
+
+	if (size != decode_audio->fifo.size) {
+		LOG_DEBUG(log_audio_decode, "decode fifo size=%d for sample_rate=%d", (int)size, sample_rate);
+
+		decode_audio->fifo.size = size;
+		decode_audio->fifo.rptr = 0;
+		decode_audio->fifo.wptr = 0;
+	}
+}
+
+
+/* Pack samples into a 16 bit decode fifo.
+ */
+static void decode_pack_frames(s16_t *packed, sample_t *buffer, size_t frames) {
+	frames *= 2;
+	while (frames--) {
+		*packed++ = *buffer++ >> 16;
+	}
+}
+
+
+/* Drop frames decoded after a seek, so playback starts at the seek
+ * point rather than at the start of the frame or page the decoder
+ * could seek to.
+ */
+void decode_output_skip_frames(u32_t frames) {
+	skip_frames = frames;
+}
+
+
 void decode_output_samples(sample_t *buffer, u32_t nsamples, int sample_rate) {
-	size_t bytes_out;
+	size_t frames_out;
+
+	/* the next track is decoding ahead of the switch */
+	if (decode_next_hold(buffer, nsamples, sample_rate)) {
+		return;
+	}
+
+	if (skip_frames) {
+		u32_t n = (nsamples < skip_frames) ? nsamples : skip_frames;
+
+		skip_frames -= n;
+		nsamples -= n;
+		buffer += n * 2;
+	}
 
 	/* Some decoders can pass no samples at the start of the track. Stop
 	 * early, otherwise we may send the track start event at the wrong
@@ -281,6 +350,14 @@ void decode_output_samples(sample_t *buffer, u32_t nsamples, int sample_rate) {
 		upload_open();
 
 		crossfade_started = FALSE;
+
+		/* Resize the fifo for this sample rate while it is empty.
+		 * Gapless tracks keep the size until it next empties.
+		 */
+		if (decode_audio->fifo.rptr == decode_audio->fifo.wptr) {
+			decode_output_size_fifo(sample_rate);
+		}
+
 		decode_audio->track_start_point = decode_audio->fifo.wptr;
 		
 		if (decode_transition_type & TRANSITION_CROSSFADE) {
@@ -288,7 +365,7 @@ void decode_output_samples(sample_t *buffer, u32_t nsamples, int sample_rate) {
 			fft_fixed interval;
 
 			if (decode_transition_type & TRANSITION_IMMEDIATE) {
-				size_t wanted = SAMPLES_TO_BYTES(decode_transition_period * decode_audio->track_sample_rate);
+				size_t wanted = FRAMES_TO_FIFO_BYTES(decode_transition_period * decode_audio->track_sample_rate);
 				size_t used = fifo_bytes_used(&decode_audio->fifo);
 
 				if (used > wanted) {
@@ -368,33 +445,33 @@ void decode_output_samples(sample_t *buffer, u32_t nsamples, int sample_rate) {
 
 	decode_apply_track_gain(buffer, nsamples);
 
-	bytes_out = SAMPLES_TO_BYTES(nsamples);
+	frames_out = nsamples;
 
-	while (bytes_out) {
-		size_t wrap, bytes_write, bytes_remaining;
+	while (frames_out) {
+		size_t wrap, frames_write, frames_remaining;
 
 		/* The size of the output write is limied by the
 		 * space untill our fifo wraps.
 		 */
-		wrap = fifo_bytes_until_wptr_wrap(&decode_audio->fifo);
+		wrap = FIFO_BYTES_TO_FRAMES(fifo_bytes_until_wptr_wrap(&decode_audio->fifo));
 
 		/* When crossfading limit the output write to the
 		 * end of the transition.
 		 */
 		if (crossfade_started) {
-			bytes_remaining = decode_transition_bytes_remaining(crossfade_ptr);
-			if (bytes_remaining < wrap) {
-				wrap = bytes_remaining;
+			frames_remaining = FIFO_BYTES_TO_FRAMES(decode_transition_bytes_remaining(crossfade_ptr));
+			if (frames_remaining < wrap) {
+				wrap = frames_remaining;
 			}
 		}
 
-		bytes_write = bytes_out;
-		if (bytes_write > wrap) {
-			bytes_write = wrap;
+		frames_write = frames_out;
+		if (frames_write > wrap) {
+			frames_write = wrap;
 		}
 
 		if (transition_gain_step) {
-			decode_transition_copy_bytes(buffer, bytes_write);
+			decode_transition_copy_frames(buffer, frames_write);
 
 			if ((crossfade_started && decode_audio->fifo.wptr == crossfade_ptr)
 			    || transition_gain >= FIXED_ONE) {
@@ -404,13 +481,17 @@ void decode_output_samples(sample_t *buffer, u32_t nsamples, int sample_rate) {
 				crossfade_started = FALSE;
 			}
 		}
+		else if (decode_audio->fifo_packed) {
+			decode_pack_frames((s16_t *)(void *)(decode_fifo_buf + decode_audio->fifo.wptr), buffer, frames_write);
+			fifo_wptr_incby(&decode_audio->fifo, FRAMES_TO_FIFO_BYTES(frames_write));
+		}
 		else {
-			memcpy(decode_fifo_buf + decode_audio->fifo.wptr, buffer, bytes_write);
-			fifo_wptr_incby(&decode_audio->fifo, bytes_write);
+			memcpy(decode_fifo_buf + decode_audio->fifo.wptr, buffer, SAMPLES_TO_BYTES(frames_write));
+			fifo_wptr_incby(&decode_audio->fifo, SAMPLES_TO_BYTES(frames_write));
 		}
 
-		buffer += (bytes_write / sizeof(sample_t));
-		bytes_out -= bytes_write;
+		buffer += frames_write * 2;
+		frames_out -= frames_write;
 	}
 
 	decode_audio_unlock();
@@ -1,7 +1,7 @@
 /*
 ** Copyright 2007-2008 Logitech. All Rights Reserved.
 **
-** This file is licensed under BSD. Please see the LICENSE file for details.
+** This file is licensed under BSD. Please see the LICENSE file for details.
 */
 
 #include "common.h"
@@ -21,7 +21,8 @@ struct decode_pcm {
 	bool_t big_endian;
 	u32_t sample_rate;
 	u32_t sample_size;
-	bool_t stereo;
+	u32_t channels;
+	void (*convert)(sample_t *out, u8_t *in, u32_t n);
 };
 
 
@@ -37,71 +38,122 @@ static u32_t pcm_sample_widths[] = {
 };
 
 
-static sample_t pcm_read8bit(u8_t *pos) { 
-	// 8 bit wav stores samples as unsigned char
-	return (sample_t) ((((u8_t)*pos) - 128) << 24);
+/* Sample conversion. The kernels convert a block of samples, and are
+ * specialized for each width and byte order, with a mono version that
+ * copies each sample to both channels. On little endian hosts 16 bit
+ * samples are converted two at a time from each 32 bit word, and 32 bit
+ * little endian samples are not converted at all.
+ */
+#define PCM_8BIT(p)	((sample_t)(((p)[0] - 128) << 24))	/* 8 bit wav stores samples as unsigned char */
+#define PCM_16BIT_LE(p)	((sample_t)(((u32_t)(p)[1] << 24) | ((p)[0] << 16)))
+#define PCM_16BIT_BE(p)	((sample_t)(((u32_t)(p)[0] << 24) | ((p)[1] << 16)))
+#define PCM_24BIT_LE(p)	((sample_t)(((u32_t)(p)[2] << 24) | ((p)[1] << 16) | ((p)[0] << 8)))
+#define PCM_24BIT_BE(p)	((sample_t)(((u32_t)(p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8)))
+#define PCM_32BIT_LE(p)	((sample_t)(((u32_t)(p)[3] << 24) | ((p)[2] << 16) | ((p)[1] << 8) | (p)[0]))
+#define PCM_32BIT_BE(p)	((sample_t)(((u32_t)(p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3]))
+
+#define PCM_CONVERT(name, width, read) \
+static void pcm_convert_##name(sample_t *out, u8_t *in, u32_t n) { \
+	while (n--) { \
+		*out++ = read(in); \
+		in += width; \
+	} \
+} \
+static void pcm_convert_##name##_mono(sample_t *out, u8_t *in, u32_t n) { \
+	while (n--) { \
+		sample_t s = read(in); \
+		*out++ = s; \
+		*out++ = s; \
+		in += width; \
+	} \
 }
 
-static sample_t pcm_read16bitBE(u8_t *pos) { 
-	sample_t sample = *pos << 24;
-	sample |= *++pos << 16;
-	return sample;
-}
+PCM_CONVERT(8bit, 1, PCM_8BIT)
+PCM_CONVERT(24bitLE, 3, PCM_24BIT_LE)
+PCM_CONVERT(24bitBE, 3, PCM_24BIT_BE)
+PCM_CONVERT(32bitBE, 4, PCM_32BIT_BE)
 
-static sample_t pcm_read16bitLE(u8_t *pos) {
-	sample_t sample = *pos << 16;
-	sample |= *++pos << 24;
-	return sample;
-}
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
 
-static sample_t pcm_read24bitBE(u8_t *pos) {
-	sample_t sample = *pos << 24;
-	sample |= *++pos << 16;
-	sample |= *++pos << 8;
-	return sample;
-}
+PCM_CONVERT(16bitLE_bytes, 2, PCM_16BIT_LE)
+PCM_CONVERT(16bitBE_bytes, 2, PCM_16BIT_BE)
+PCM_CONVERT(32bitLE_bytes, 4, PCM_32BIT_LE)
 
-static sample_t pcm_read24bitLE(u8_t *pos) {
-	sample_t sample = *pos << 8;
-	sample |= *++pos << 16;
-	sample |= *++pos << 24;
-	return sample;
-}
+static void pcm_convert_16bitLE(sample_t *out, u8_t *in, u32_t n) {
+	u32_t *wptr, w;
 
-static sample_t pcm_read32bitBE(u8_t *pos) {
-	sample_t sample = *pos << 24;
-	sample |= *++pos << 16;
-	sample |= *++pos << 8;
-	sample |= *++pos;
-	return sample;
+	if (((uintptr_t)in & 3) != 0) {
+		pcm_convert_16bitLE_bytes(out, in, n);
+		return;
+	}
+
+	wptr = (u32_t *)(void *)in;
+	for (; n >= 2; n -= 2) {
+		w = *wptr++;
+		*out++ = w << 16;
+		*out++ = w & 0xFFFF0000;
+	}
+
+	if (n) {
+		pcm_convert_16bitLE_bytes(out, (u8_t *)wptr, n);
+	}
 }
 
-static sample_t pcm_read32bitLE(u8_t *pos) { 
-	/* XXX should this not increment pos? */
-	return *((sample_t *)(void *)pos);
+static void pcm_convert_16bitBE(sample_t *out, u8_t *in, u32_t n) {
+	u32_t *wptr, w;
+
+	if (((uintptr_t)in & 3) != 0) {
+		pcm_convert_16bitBE_bytes(out, in, n);
+		return;
+	}
+
+	wptr = (u32_t *)(void *)in;
+	for (; n >= 2; n -= 2) {
+		w = *wptr++;
+		*out++ = ((w & 0x000000FF) << 24) | ((w & 0x0000FF00) << 8);
+		*out++ = ((w & 0x00FF0000) << 8) | ((w >> 8) & 0x00FF0000);
+	}
+
+	if (n) {
+		pcm_convert_16bitBE_bytes(out, (u8_t *)wptr, n);
+	}
 }
 
+#define pcm_convert_16bitLE_mono pcm_convert_16bitLE_bytes_mono
+#define pcm_convert_16bitBE_mono pcm_convert_16bitBE_bytes_mono
+#define pcm_convert_32bitLE_mono pcm_convert_32bitLE_bytes_mono
+
+/* native samples */
+#define pcm_convert_32bitLE NULL
+
+#else
+
+PCM_CONVERT(16bitLE, 2, PCM_16BIT_LE)
+PCM_CONVERT(16bitBE, 2, PCM_16BIT_BE)
+PCM_CONVERT(32bitLE, 4, PCM_32BIT_LE)
+
+#endif
+
 
-typedef sample_t (*pcm_read_func_t)(u8_t *pos);
-static pcm_read_func_t pcm_read_funcs[] = {
-	pcm_read8bit,
-	pcm_read8bit,
-	pcm_read16bitLE,
-	pcm_read16bitBE,
-	pcm_read24bitLE,
-	pcm_read24bitBE,
-	pcm_read32bitLE,
-	pcm_read32bitBE
+typedef void (*pcm_convert_func_t)(sample_t *out, u8_t *in, u32_t n);
+
+/* Indexed by pcm_sample_size and big_endian, then mono */
+static pcm_convert_func_t pcm_convert_funcs[][2] = {
+	{ pcm_convert_8bit, pcm_convert_8bit_mono },
+	{ pcm_convert_8bit, pcm_convert_8bit_mono },
+	{ pcm_convert_16bitLE, pcm_convert_16bitLE_mono },
+	{ pcm_convert_16bitBE, pcm_convert_16bitBE_mono },
+	{ pcm_convert_24bitLE, pcm_convert_24bitLE_mono },
+	{ pcm_convert_24bitBE, pcm_convert_24bitBE_mono },
+	{ pcm_convert_32bitLE, pcm_convert_32bitLE_mono },
+	{ pcm_convert_32bitBE, pcm_convert_32bitBE_mono },
 };
 
 
 static bool_t decode_pcm_callback(void *data) {
 	struct decode_pcm *self = (struct decode_pcm *) data;
-	pcm_read_func_t read_func;
-	sample_t *write_pos;
-	u8_t *read_pos;
-	u32_t s, num_samples;
-	sample_t sample;
+	sample_t *samples;
+	u32_t num_samples, width;
 	size_t sz;
 
 	sz = streambuf_read(self->read_buffer + self->leftover, 0, BLOCKSIZE - self->leftover, NULL);
@@ -114,33 +166,33 @@ static bool_t decode_pcm_callback(void *data) {
 
 	sz += self->leftover;
 
-	read_func = pcm_read_funcs[(2 * self->sample_size) + self->big_endian];
-	read_pos = self->read_buffer;
-	write_pos = self->write_buffer;
+	width = pcm_sample_widths[self->sample_size];
+	num_samples = sz / width;
+
+	/* we need the same number of samples for all channels */
+	num_samples -= num_samples % self->channels;
 
-	num_samples = sz / pcm_sample_widths[self->sample_size];
-	if (self->stereo) {
-		/* we need the same number of sample for both channels */
-		num_samples &= ~0x01;
+	if (self->convert) {
+		self->convert(self->write_buffer, self->read_buffer, num_samples);
+		samples = self->write_buffer;
+	}
+	else {
+		/* native samples, output them from the read buffer */
+		samples = (sample_t *)(void *)self->read_buffer;
 	}
 
-	for (s = 0; s < num_samples; s++) {
-		sample = read_func(read_pos);
-		*write_pos++ = sample;
-		if (!self->stereo) {
-			*write_pos++ = sample;
-		}
-		read_pos += pcm_sample_widths[self->sample_size];
+	if (self->channels > 2) {
+		decode_downmix(samples, samples, self->channels, num_samples / self->channels);
 	}
 
 	if (num_samples) {
-		decode_output_samples(self->write_buffer, self->stereo ? num_samples / 2 : num_samples, self->sample_rate);
+		decode_output_samples(samples, num_samples / self->channels, self->sample_rate);
 	}
 
-	self->leftover = sz - (read_pos - self->read_buffer);
+	self->leftover = sz - (num_samples * width);
 
 	if (self->leftover) {
-		memcpy(self->read_buffer, read_pos, self->leftover);
+		memmove(self->read_buffer, self->read_buffer + (num_samples * width), self->leftover);
 	}
 					      
 	return TRUE;
@@ -157,19 +209,25 @@ static void *decode_pcm_start(u8_t *params, u32_t num_params) {
 
 	LOG_DEBUG(log_audio_codec, "decode_pcm_start()");
 
-	self = malloc(sizeof(struct decode_pcm));
-	memset(self, 0, sizeof(struct decode_pcm));
+	self = decode_alloc(sizeof(struct decode_pcm));
 
 	self->sample_size = (params[0] - '0');
 	self->sample_rate = pcm_sample_rates[(params[1] - '0')];
-	self->stereo = (params[2] == '2');
+	self->channels = (params[2] - '0');
 	self->big_endian = (params[3] == '0');
 
-	LOG_DEBUG(log_audio_codec, "sample_size=%d sample_rate=%d stereo=%d big_endian=%d",
-		    self->sample_size, self->sample_rate, self->stereo, self->big_endian);
+	if (self->channels < 1 || self->channels > DOWNMIX_MAX_CHANNELS) {
+		LOG_WARN(log_audio_codec, "unsupported channels %d", self->channels);
+		self->channels = 2;
+	}
+
+	LOG_DEBUG(log_audio_codec, "sample_size=%d sample_rate=%d channels=%d big_endian=%d",
+		    self->sample_size, self->sample_rate, self->channels, self->big_endian);
+
+	self->convert = pcm_convert_funcs[(2 * self->sample_size) + self->big_endian][self->channels == 1];
 
-	self->read_buffer = malloc(sizeof(u8_t) * BLOCKSIZE);
-	self->write_buffer = malloc(sizeof(sample_t) * 2 * BLOCKSIZE);
+	self->read_buffer = decode_alloc(sizeof(u8_t) * BLOCKSIZE);
+	self->write_buffer = decode_alloc(sizeof(sample_t) * 2 * BLOCKSIZE);
 	
 	return self;
 }
@@ -180,9 +238,9 @@ static void decode_pcm_stop(void *data) {
 
 	LOG_DEBUG(log_audio_codec, "decode_pcm_stop()");
 	
-	free(self->read_buffer);
-	free(self->write_buffer);
-	free(self);
+	decode_free(self->read_buffer);
+	decode_free(self->write_buffer);
+	decode_free(self);
 }
 
 
@@ -193,4 +251,5 @@ struct decode_module decode_pcm = {
 	decode_pcm_stop,
 	decode_pcm_samples,
 	decode_pcm_callback,
+	NULL,
 };
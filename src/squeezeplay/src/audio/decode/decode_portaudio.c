@@ -89,6 +89,8 @@ static int callback(const void *inputBuffer,
 	}
 	decode_audio->sync_elapsed_timestamp = jive_jiffies();
 
+	decode_tap_timestamp(delay, stream_sample_rate);
+
 	add_silence_ms = decode_audio->add_silence_ms;
 	if (add_silence_ms) {
 		add_bytes = SAMPLES_TO_BYTES((u32_t)((add_silence_ms * stream_sample_rate) / 1000));
@@ -217,6 +219,8 @@ static int callback(const void *inputBuffer,
 			*(output_ptr++) = fixed_mul(rgain, *(decode_ptr++));
 		}
 
+		decode_tap_write((sample_t *)(decode_fifo_buf + decode_audio->fifo.rptr), BYTES_TO_SAMPLES(bytes_write));
+
 		fifo_rptr_incby(&decode_audio->fifo, bytes_write);
 		decode_audio->elapsed_samples += BYTES_TO_SAMPLES(bytes_write);
 
@@ -359,6 +363,8 @@ static int decode_portaudio_init(lua_State *L) {
 	int num_devices, i;
 	const PaDeviceInfo *device_info;
 	const PaHostApiInfo *host_info;
+	size_t fifo_size;
+	u32_t fifo_seconds;
 	void *buf;
 
 	if ((err = Pa_Initialize()) != paNoError) {
@@ -399,12 +405,14 @@ static int decode_portaudio_init(lua_State *L) {
 	outputParam.suggestedLatency = Pa_GetDeviceInfo(outputParam.device)->defaultHighOutputLatency;
 
 	/* allocate output memory */
-	buf = malloc(DECODE_AUDIO_BUFFER_SIZE);
+	fifo_size = decode_fifo_settings(L, &fifo_seconds, NULL);
+	buf = malloc(DECODE_AUDIO_BUFFER_SIZE(fifo_size));
 	if (!buf) {
 		goto err0;
 	}
 
-	decode_init_buffers(buf, false);
+	decode_init_buffers(buf, fifo_size, false);
+	decode_audio->fifo_seconds = fifo_seconds;
 	decode_audio->max_rate = 48000;
 
 	/* open stream */
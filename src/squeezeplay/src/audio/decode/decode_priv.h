@@ -68,6 +68,10 @@ struct decode_module {
 	size_t (*samples)(void *data);
 	/* callback to decode samples to output buffer */
 	bool_t (*callback)(void *data);
+	/* seek to ms in the track, optional. returns false if the decoder
+	 * can't seek this stream.
+	 */
+	bool_t (*seek)(void *data, u32_t ms);
 };
 
 
@@ -101,6 +105,26 @@ extern u32_t decode_output_percent_used(void);
 
 extern void decode_output_samples(sample_t *buffer, u32_t samples, int sample_rate);
 
+extern void decode_output_skip_frames(u32_t frames);
+
+extern void decode_seek_reached(u64_t frames);
+
+extern void decode_seek_fail(void);
+
+/* Frames output by the next track's decoder ahead of the switch are held
+ * until it starts, returns false for the current decoder.
+ */
+extern bool_t decode_next_hold(sample_t *buffer, u32_t nsamples, int sample_rate);
+
+/* Decoder state is allocated, zeroed, from an arena that is reset when
+ * the next decoder starts. A decoder started ahead of the next track
+ * shares the arena. decode_free() only frees memory that did not fit in
+ * the arena.
+ */
+extern void *decode_alloc(size_t size);
+
+extern void decode_free(void *ptr);
+
 extern int decode_output_samplerate(void);
 
 extern int decode_output_max_rate(void);
@@ -126,6 +150,27 @@ struct decode_audio_func {
 	void (*stop)(void);
 };
 
+/* Visualizer tap. The audio output copies the samples it plays into a
+ * ring, 16 bits per channel, and records which frame is being heard
+ * and when. The visualizers read the ring without the audio lock, so
+ * they don't contend with the output and they show what is heard.
+ */
+#define VISUALIZER_TAP_FRAMES 32768	/* must be a power of 2 */
+
+struct visualizer_tap {
+	/* frames written, and frames in the ring */
+	volatile u32_t wptr;
+	volatile u32_t filled;
+
+	/* frame heard at play_timestamp, seq is odd while these change */
+	volatile u32_t seq;
+	volatile u32_t play_frame;
+	volatile u32_t play_timestamp;
+	volatile u32_t sample_rate;
+
+	s16_t buf[VISUALIZER_TAP_FRAMES * 2];
+};
+
 struct decode_audio {
 	struct decode_audio_func *f;
 
@@ -163,6 +208,11 @@ struct decode_audio {
 
 	/* device info */
 	u32_t max_rate;
+
+	/* decode fifo: bytes allocated, seconds buffered, 16 bit frames */
+	size_t fifo_buffer_size;
+	u32_t fifo_seconds;
+	bool_t fifo_packed;
 	
 	/* fading state */
 	u32_t samples_until_fade;
@@ -172,6 +222,9 @@ struct decode_audio {
 	fft_fixed transition_gain_step;
 	u32_t transition_sample_step;
 	u32_t transition_samples_in_step;
+
+	/* lock free */
+	struct visualizer_tap tap;
 };
 
 extern struct decode_audio *decode_audio;
@@ -187,13 +240,20 @@ extern struct decode_audio_func decode_portaudio;
 extern struct decode_audio_func decode_null;
 
 /* Decode output api */
-extern void decode_init_buffers(void *buf, bool_t prio_inherit);
+extern size_t decode_fifo_settings(lua_State *L, u32_t *seconds, bool_t *packed);
+extern void decode_init_buffers(void *buf, size_t fifo_size, bool_t prio_inherit);
+extern void decode_unpack_frames(sample_t *buffer, s16_t *packed, size_t frames);
 extern void decode_output_begin(void);
 extern void decode_output_end(void);
 extern void decode_output_flush(void);
 extern bool_t decode_check_start_point(void);
 extern void decode_mix_effects(void *outputBuffer, size_t framesPerBuffer, int sample_width, int output_sample_rate);
 
+/* Visualizer tap api */
+extern void decode_tap_timestamp(u32_t delay_frames, u32_t sample_rate);
+extern void decode_tap_write(sample_t *buffer, size_t frames);
+extern size_t decode_tap_read(s16_t *buffer, size_t frames);
+
 
 /* Sample playback api (sound effects) */
 extern int decode_sample_init(lua_State *L);
@@ -204,24 +264,41 @@ extern void decode_sample_fill_buffer(void);
 extern int decode_vumeter(lua_State *L);
 extern int decode_spectrum(lua_State *L);
 extern int decode_spectrum_init(lua_State *L);
+extern int decode_spectrum_benchmark(lua_State *L);
+
+/* Multichannel downmix */
+#define DOWNMIX_MAX_CHANNELS 8
+
+extern void decode_downmix_init(void);
+extern void decode_downmix(sample_t *out, sample_t *in, u32_t channels, size_t frames);
+extern int decode_downmix_matrix(lua_State *L);
+extern int decode_downmix_benchmark(lua_State *L);
 
 /* Internal state */
 
 #define SAMPLES_TO_BYTES(n)  (2 * (n) * sizeof(sample_t))
 #define BYTES_TO_SAMPLES(n)  ((n) / (2 * sizeof(sample_t)))
 
+/* A packed decode fifo stores 16 bits per channel */
+#define DECODE_FIFO_FRAME_BYTES (decode_audio->fifo_packed ? 2 * sizeof(s16_t) : 2 * sizeof(sample_t))
+#define FRAMES_TO_FIFO_BYTES(n) ((n) * DECODE_FIFO_FRAME_BYTES)
+#define FIFO_BYTES_TO_FRAMES(n) ((n) / DECODE_FIFO_FRAME_BYTES)
+
 /* State variables for the current track */
 extern bool_t decode_first_buffer;
 
 
-/* The fifo used to store decoded samples */
-#define DECODE_FIFO_SIZE (10 * 2 * 44100 * sizeof(sample_t)) 
+/* The fifo used to store decoded samples. It holds the same number of
+ * seconds at any sample rate up to the max rate it is allocated for.
+ */
+#define DECODE_FIFO_SECONDS 10
+#define DECODE_FIFO_MAX_RATE 44100
 extern u8_t *decode_fifo_buf;
 
 #define EFFECT_FIFO_SIZE (1 * 1 * 44100 * sizeof(effect_t))
 extern u8_t *effect_fifo_buf;
 
-#define DECODE_AUDIO_BUFFER_SIZE (sizeof(struct decode_audio) + DECODE_FIFO_SIZE + EFFECT_FIFO_SIZE)
+#define DECODE_AUDIO_BUFFER_SIZE(fifo_size) (sizeof(struct decode_audio) + (fifo_size) + EFFECT_FIFO_SIZE)
 
 /* Decode message queue */
 extern struct mqueue decode_mqueue;
@@ -243,14 +320,14 @@ static fft_fixed determine_transition_interval(u32_t sample_rate, u32_t transiti
 	}
 
 	bytes_used = fifo_bytes_used(&decode_audio->fifo);
-	*nbytes = SAMPLES_TO_BYTES(TRANSITION_MINIMUM_SECONDS * sample_rate);
+	*nbytes = FRAMES_TO_FIFO_BYTES(TRANSITION_MINIMUM_SECONDS * sample_rate);
 	if (bytes_used < *nbytes) {
 		return 0;
 	}
 
-	*nbytes = SAMPLES_TO_BYTES(transition_period * sample_rate);
+	*nbytes = FRAMES_TO_FIFO_BYTES(transition_period * sample_rate);
 	transition_sample_step = sample_rate / TRANSITION_STEPS_PER_SECOND;
-	sample_step_bytes = SAMPLES_TO_BYTES(transition_sample_step);
+	sample_step_bytes = FRAMES_TO_FIFO_BYTES(transition_sample_step);
 
 	interval = s32_to_fixed(transition_period);
 	interval_step = fixed_div(FIXED_ONE, TRANSITION_STEPS_PER_SECOND);
@@ -18,6 +18,18 @@
 #define OUTPUT_BUFFER_SIZE 8192
 #define METADATA_SIZE      1024
 
+/* Ogg has no index, a seek probes the stream at an offset estimated
+ * from the bitrate and then uses the page granule positions to correct
+ * it. The probe aims before the seek position by the preroll and a part
+ * of the distance, and up to the max decode is decoded forward rather
+ * than probing again. Probes within the buffered data are free, at most
+ * one probe per seek fetches the stream from the server. A seek that
+ * would need more fails, and the server seeks.
+ */
+#define SEEK_PREROLL_MS    500
+#define SEEK_MAX_DECODE_MS 5000
+#define SEEK_MAX_PROBES    4
+
 struct decode_vorbis {
 	OggVorbis_File vf;
 	int bitstream;
@@ -26,12 +38,21 @@ struct decode_vorbis {
 		OGG_STATE_INIT = 0,
 		OGG_STATE_HEADER,
 		OGG_STATE_STREAM,
+		OGG_STATE_SEEK,
 	} state;
 
 	char *output_buffer;
 
 	int channels;
 	int sample_rate;
+
+	/* seeking */
+	ogg_int64_t data_start;
+	ogg_int64_t seek_sample;
+	ogg_int64_t seek_probe;
+	int seek_probes;
+	bool_t seek_fetched;
+	long bitrate;
 };
 
 
@@ -152,6 +173,118 @@ static bool_t decode_vorbis_read_header(struct decode_vorbis *self) {
 	return TRUE;
 }
 
+/* estimated stream bytes for frames of audio */
+static ogg_int64_t decode_vorbis_seek_bytes(struct decode_vorbis *self, ogg_int64_t frames) {
+	if (frames <= 0) {
+		return 0;
+	}
+
+	return (frames * self->bitrate) / (8 * self->sample_rate);
+}
+
+
+/* Returns FALSE if the probe would need a second fetch from the server,
+ * or a fetch when the stream can't be fetched from an offset.
+ */
+static bool_t decode_vorbis_seek_probe(struct decode_vorbis *self, ogg_int64_t offset) {
+	if (offset < self->data_start) {
+		offset = self->data_start;
+	}
+
+	if (self->seek_probes >= SEEK_MAX_PROBES) {
+		return FALSE;
+	}
+
+	if (!streambuf_is_buffered(offset)) {
+		if (self->seek_fetched || !streambuf_can_fetch()) {
+			return FALSE;
+		}
+		self->seek_fetched = TRUE;
+	}
+
+	LOG_DEBUG(log_audio_codec, "seek probe %d at %lld", self->seek_probes, offset);
+
+	self->seek_probe = offset;
+	self->seek_probes++;
+
+	streambuf_seek(offset);
+	ov_stream_restart(&self->vf, offset);
+
+	return TRUE;
+}
+
+
+/* frames to aim before the seek position, the bitrate estimate is less
+ * accurate further into the stream.
+ */
+static ogg_int64_t decode_vorbis_seek_margin(struct decode_vorbis *self, ogg_int64_t frames) {
+	ogg_int64_t preroll = (self->sample_rate * SEEK_PREROLL_MS) / 1000;
+	ogg_int64_t max_decode = (self->sample_rate * SEEK_MAX_DECODE_MS) / 1000;
+
+	frames /= 16;
+	return preroll + ((frames < max_decode) ? frames : max_decode);
+}
+
+
+/* Returns TRUE when the decoded frames reach the seek position and
+ * should be output.
+ */
+static bool_t decode_vorbis_seek_frames(struct decode_vorbis *self, long frames) {
+	ogg_int64_t start, end;
+	ogg_int64_t preroll = (self->sample_rate * SEEK_PREROLL_MS) / 1000;
+	ogg_int64_t max_decode = (self->sample_rate * SEEK_MAX_DECODE_MS) / 1000;
+
+	end = ov_pcm_tell(&self->vf);
+	if (end < 0) {
+		/* position not known until a page with a granulepos */
+		return FALSE;
+	}
+	start = end - frames;
+
+	if (start > self->seek_sample) {
+		/* past the seek position, probe back. without another fetch
+		 * the track plays on from here, and elapsed is moved to it.
+		 */
+		if (self->seek_probe > self->data_start
+		    && decode_vorbis_seek_probe(self, self->seek_probe - decode_vorbis_seek_bytes(self, start - self->seek_sample + decode_vorbis_seek_margin(self, start - self->seek_sample)))) {
+			return FALSE;
+		}
+
+		LOG_DEBUG(log_audio_codec, "seek to %lld ended at %lld", self->seek_sample, start);
+
+		decode_seek_reached(start);
+
+		self->state = OGG_STATE_STREAM;
+		return TRUE;
+	}
+
+	if (self->seek_sample - start > max_decode) {
+		/* too far before the seek position, probe forward. without
+		 * another fetch the seek fails and the server seeks instead.
+		 */
+		if (!decode_vorbis_seek_probe(self, self->seek_probe + decode_vorbis_seek_bytes(self, self->seek_sample - start - preroll))) {
+			LOG_DEBUG(log_audio_codec, "seek to %lld stopped at %lld", self->seek_sample, start);
+
+			decode_seek_fail();
+		}
+		return FALSE;
+	}
+
+	if (end <= self->seek_sample) {
+		return FALSE;
+	}
+
+	if (self->seek_sample > start) {
+		decode_output_skip_frames((u32_t)(self->seek_sample - start));
+	}
+
+	LOG_DEBUG(log_audio_codec, "seek to %lld after %d probes", self->seek_sample, self->seek_probes);
+
+	self->state = OGG_STATE_STREAM;
+	return TRUE;
+}
+
+
 static bool_t decode_vorbis_callback(void *data) {
 	struct decode_vorbis *self = (struct decode_vorbis *) data;
 	size_t i, nsamples;
@@ -173,6 +306,8 @@ static bool_t decode_vorbis_callback(void *data) {
 				return FALSE;
 			}
 
+			self->data_start = ov_raw_tell(&self->vf);
+
 			self->state = OGG_STATE_HEADER;
 			// fall through
 
@@ -184,6 +319,7 @@ static bool_t decode_vorbis_callback(void *data) {
 			// fall through
 
 		case OGG_STATE_STREAM:
+		case OGG_STATE_SEEK:
 
 			buffer_size = OUTPUT_BUFFER_SIZE >> 1;
 
@@ -221,6 +357,11 @@ static bool_t decode_vorbis_callback(void *data) {
 					if ( !decode_vorbis_read_header(self) )
 						return FALSE;
 				}
+
+				if (self->state == OGG_STATE_SEEK &&
+				    !decode_vorbis_seek_frames(self, bytes / (2 * self->channels))) {
+					return TRUE;
+				}
 				
 				if (self->channels == 1) {
 					nsamples = bytes / 2;
@@ -262,6 +403,46 @@ static bool_t decode_vorbis_callback(void *data) {
 }
 
 
+static bool_t decode_vorbis_seek_ms(void *data, u32_t ms) {
+	struct decode_vorbis *self = (struct decode_vorbis *) data;
+	vorbis_info *vi;
+
+	/* chained streams restart the granule positions */
+	if ((self->state != OGG_STATE_STREAM && self->state != OGG_STATE_SEEK)
+	    || self->vf.current_link > 0) {
+		return FALSE;
+	}
+
+	vi = ov_info(&self->vf, -1);
+	if (!vi) {
+		return FALSE;
+	}
+
+	if (vi->bitrate_nominal > 0) {
+		self->bitrate = vi->bitrate_nominal;
+	}
+	else if (vi->bitrate_upper > 0 && vi->bitrate_lower > 0) {
+		self->bitrate = (vi->bitrate_upper + vi->bitrate_lower) / 2;
+	}
+	else {
+		return FALSE;
+	}
+
+	self->seek_sample = ((ogg_int64_t)ms * self->sample_rate) / 1000;
+	self->seek_probes = 0;
+	self->seek_fetched = FALSE;
+
+	/* the stream plays on if the seek can't be made */
+	if (!decode_vorbis_seek_probe(self, self->data_start + decode_vorbis_seek_bytes(self, self->seek_sample - decode_vorbis_seek_margin(self, self->seek_sample)))) {
+		return FALSE;
+	}
+
+	self->state = OGG_STATE_SEEK;
+
+	return TRUE;
+}
+
+
 static size_t decode_vorbis_samples(void *data) {
 	return BYTES_TO_SAMPLES(OUTPUT_BUFFER_SIZE);
 }
@@ -272,10 +453,9 @@ static void *decode_vorbis_start(u8_t *params, u32_t num_params) {
 
 	LOG_DEBUG(log_audio_codec, "decode_vorbis_start()");
 
-	self = malloc(sizeof(struct decode_vorbis));
-	memset(self, 0, sizeof(struct decode_vorbis));
+	self = decode_alloc(sizeof(struct decode_vorbis));
 
-	self->output_buffer = malloc(OUTPUT_BUFFER_SIZE);
+	self->output_buffer = decode_alloc(OUTPUT_BUFFER_SIZE);
 	self->state = OGG_STATE_INIT;
 	
 	return self;
@@ -287,8 +467,8 @@ static void decode_vorbis_stop(void *data) {
 
 	LOG_DEBUG(log_audio_codec, "decode_vorbis_stop()");
 
-	free(self->output_buffer);
-	free(self);
+	decode_free(self->output_buffer);
+	decode_free(self);
 }
 
 
@@ -299,4 +479,5 @@ struct decode_module decode_vorbis = {
 	decode_vorbis_stop,
 	decode_vorbis_samples,
 	decode_vorbis_callback,
+	decode_vorbis_seek_ms,
 };
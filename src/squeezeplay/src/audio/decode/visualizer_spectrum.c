@@ -16,6 +16,18 @@
 #include <math.h>
 
 
+/* The spectrum is computed with a float FFT on targets with an FPU, and
+ * with a fixed point FFT on targets without one. The fixed point FFT
+ * uses integer window, twiddle and preemphasis tables, so no floating
+ * point is used per update.
+ */
+#if defined(__SOFTFP__)
+#define SPECTRUM_FIXED_POINT 1
+#else
+#define SPECTRUM_FIXED_POINT 0
+#endif
+
+
 /////////////////////////////////////////////////////////
 //
 // Package constants
@@ -49,10 +61,9 @@ static int power_map[32] = {
 // The minimum size of the FFT that we'll do.
 #define MIN_SUBBANDS 32
 
-// The minimum total number of input samples to consider for the FFT.
-// If the sample window used is smaller, then we will use multiple
-// sample windows.
-#define MIN_FFT_INPUT_SAMPLES 128
+// The subband power is clipped to this, well above the top of the
+// power map, so the bar averaging can't overflow.
+#define SUBBAND_POWER_MAX 0x7FFFFF
 
 /////////////////////////////////////////////////////////
 //
@@ -90,8 +101,11 @@ static int num_subbands;
 // The number of input points to the FFT.
 static int sample_window;
 
-// The number of sample windows that we will average across.
-static int num_windows;
+// log2 of sample_window
+static int sample_window_bits;
+
+// Use the fixed point FFT?
+static int use_fixed_point = SPECTRUM_FIXED_POINT;
 
 // Should we combine the channel histograms and only show a single
 // channel?
@@ -116,9 +130,19 @@ double filter_window[MAX_SAMPLE_WINDOW];
 // based on a db/KHz value.
 double preemphasis[MAX_SUBBANDS];
 
-// Used in power computation across multiple sample windows.
-// For a small window size, this could be stack based.
-float avg_power[2 * MAX_SUBBANDS];
+// The Hamming window and preemphasis for the fixed point FFT. The
+// window is Q15 and the preemphasis is Q8.
+static s32_t filter_window_fixed[MAX_SAMPLE_WINDOW];
+static u32_t preemphasis_fixed[MAX_SUBBANDS];
+
+// Q30 twiddle factors and the bit reversed input order for the fixed
+// point FFT.
+static s32_t twiddle_r[MAX_SAMPLE_WINDOW / 2];
+static s32_t twiddle_i[MAX_SAMPLE_WINDOW / 2];
+static u16_t bit_reverse[MAX_SAMPLE_WINDOW];
+
+// The power in each subband, interleaved left and right.
+static int subband_power[2 * MAX_SUBBANDS];
 
 kiss_fft_cfg cfg = NULL;
 
@@ -244,10 +268,9 @@ int decode_spectrum_init( lua_State *L) {
 	// as many.
 	sample_window = num_subbands * 2;
 
-	if( sample_window < MIN_FFT_INPUT_SAMPLES) {
-		num_windows = MIN_FFT_INPUT_SAMPLES / sample_window;
-	} else {
-		num_windows = 1;
+	sample_window_bits = 0;
+	while( (1 << sample_window_bits) < sample_window) {
+		sample_window_bits++;
 	}
 
 	if( cfg) {
@@ -281,6 +304,25 @@ int decode_spectrum_init( lua_State *L) {
 		for( w = 0; w < sample_window; w++) {
 			const double twopi = 6.283185307179586476925286766;
 			filter_window[w] = const1 - ( const2 * cos( twopi * (double) w / (double) sample_window));
+			filter_window_fixed[w] = (s32_t) ( filter_window[w] * 32767 + 0.5);
+		}
+
+		// Fixed point FFT tables
+		for( w = 0; w < sample_window / 2; w++) {
+			const double twopi = 6.283185307179586476925286766;
+			double phase = -twopi * (double) w / (double) sample_window;
+
+			twiddle_r[w] = (s32_t) floor( cos( phase) * (1 << 30) + 0.5);
+			twiddle_i[w] = (s32_t) floor( sin( phase) * (1 << 30) + 0.5);
+		}
+
+		for( w = 0; w < sample_window; w++) {
+			int b, r = 0;
+
+			for( b = 0; b < sample_window_bits; b++) {
+				r |= (( w >> b) & 1) << ( sample_window_bits - 1 - b);
+			}
+			bit_reverse[w] = r;
 		}
 
 		// Compute the preemphasis
@@ -301,6 +343,7 @@ int decode_spectrum_init( lua_State *L) {
 			} else {
 				preemphasis[s] = 1;
 			}
+			preemphasis_fixed[s] = (u32_t) ( preemphasis[s] * 256 + 0.5);
 			freq_sum += subband_width;
 		}
 	}
@@ -316,126 +359,166 @@ int decode_spectrum_init( lua_State *L) {
 }
 
 
-int decode_spectrum( lua_State *L) {
-	int sample_bin_ch0[MAX_SUBBANDS];
-	int sample_bin_ch1[MAX_SUBBANDS];
+/* Fixed point complex FFT of sample_window points, the input is in bit
+ * reversed order. Each stage is scaled by 1/2 so the output is the FFT
+ * divided by sample_window, and the values stay within 31 bits for
+ * inputs with a magnitude below 2^30.
+ */
+static void spectrum_fft_fixed( s32_t *re, s32_t *im) {
+	int len, half, step;
+	int i, j;
+
+	for( len = 2; len <= sample_window; len <<= 1) {
+		half = len >> 1;
+		step = sample_window / len;
+
+		for( i = 0; i < sample_window; i += len) {
+			for( j = 0; j < half; j++) {
+				s32_t wr = twiddle_r[j * step];
+				s32_t wi = twiddle_i[j * step];
+				int a = i + j;
+				int b = a + half;
+				s32_t tr, ti, ar, ai;
+
+				// Half of w * x[b], the twiddles are Q30
+				tr = (s32_t) ( ( (s64_t) wr * re[b] - (s64_t) wi * im[b]) >> 31);
+				ti = (s32_t) ( ( (s64_t) wr * im[b] + (s64_t) wi * re[b]) >> 31);
+
+				ar = re[a] >> 1;
+				ai = im[a] >> 1;
+
+				re[a] = ar + tr;
+				im[a] = ai + ti;
+				re[b] = ar - tr;
+				im[b] = ai - ti;
+			}
+		}
+	}
+}
 
-	int i;
-	int w;
-	int ch;
 
-	// Shortcut if audio isn't running
-	if( !( decode_audio->state & DECODE_STATE_RUNNING)) {
+static inline int spectrum_power_scale_fixed( s32_t r, s32_t i, u32_t preemphasis, int shift) {
+	u64_t power;
 
-		lua_newtable( L);
-		for( i = 0; i < num_bars[0]; i++) {
-			lua_pushinteger( L, 0);
-			lua_rawseti( L, -2, i + 1);
-		}
+	// r and i are the float FFT values scaled by 2^15 / sample_window,
+	// keep 46 bits of the power so the Q8 preemphasis can't overflow.
+	power = (u64_t) ( (s64_t) r * r + (s64_t) i * i) >> 16;
+	power = ( power * preemphasis) >> shift;
 
-		lua_newtable( L);
-		for( i = 0; i < num_bars[1]; i++) {
-			lua_pushinteger( L, 0);
-			lua_rawseti( L, -2, i + 1);
-		}
-		return 2;
-	}
+	return ( power > SUBBAND_POWER_MAX) ? SUBBAND_POWER_MAX : (int) power;
+}
 
-	// Init avg_power
-	for( i = 0; i < (2 * MAX_SUBBANDS); i++) {
-		avg_power[i] = 0;
-	}
 
-	for( w = 0; w < num_windows; w++) {
-		kiss_fft_cpx fin_buf[MAX_SAMPLE_WINDOW];
-		kiss_fft_cpx fout_buf[MAX_SAMPLE_WINDOW];
+// Compute the subband power using the fixed point FFT. The input is
+// interleaved left and right samples.
+static void spectrum_power_fixed( const s16_t *in) {
+	s32_t re[MAX_SAMPLE_WINDOW];
+	s32_t im[MAX_SAMPLE_WINDOW];
 
-		int avg_ptr;
-		int s;
+	// Scale to match the float power, see spectrum_power_scale_fixed()
+	int shift = 38 - 2 * sample_window_bits;
 
-		sample_t *ptr;
-		size_t samples_until_wrap;
+	int avg_ptr;
+	int i, s;
 
-		int sample;
+	for( i = 0; i < sample_window; i++) {
+		int r = bit_reverse[i];
 
-		decode_audio_lock();
+		re[r] = in[2 * i] * filter_window_fixed[i];
+		im[r] = in[2 * i + 1] * filter_window_fixed[i];
+	}
 
-		ptr = (sample_t *) (void *) ( decode_fifo_buf + decode_audio->fifo.rptr);
-		samples_until_wrap = BYTES_TO_SAMPLES( fifo_bytes_until_rptr_wrap( &decode_audio->fifo));
+	spectrum_fft_fixed( re, im);
 
-		for( i = 0; i < sample_window; i++) {
-			sample = (*ptr++) >> 16;
-			fin_buf[i].r = (float) ( filter_window[i] * sample);
+	// Extract the two separate frequency domain signals
+	// and keep track of the power per bin.
+	avg_ptr = 0;
+	for( s = 1; s <= num_subbands; s++) {
+		int k = s;
+		int nk = sample_window - s;
 
-			sample = (*ptr++) >> 16;
-			fin_buf[i].i = (float) ( filter_window[i] * sample);
+		s32_t r, i;
 
-			samples_until_wrap -= 2;
-			if( samples_until_wrap <= 0) {
-				ptr = (sample_t *) (void *) decode_fifo_buf;
-			}
-		}
+		r = ( re[k] >> 1) + ( re[nk] >> 1);
+		i = ( im[k] >> 1) - ( im[nk] >> 1);
 
-		decode_audio_unlock();
+		subband_power[avg_ptr++] = spectrum_power_scale_fixed( r, i, preemphasis_fixed[s - 1], shift);
 
-#if 0
-// Test case
-		{
-			double freq = ( M_PI * 16) / 256;
-			float ampl = ( (int) pow( 2, 16)) / 2;
-			int i;
+		r = ( im[nk] >> 1) + ( im[k] >> 1);
+		i = ( re[nk] >> 1) - ( re[k] >> 1);
 
-			for( i = 0; i < sample_window; i++) {
-				fin_buf[i].r = ( ampl * (float) sin( i * freq)) + ( ampl * (float) cos( i * freq));
-				fin_buf[i].i = ( ampl * (float) sin( i * freq)) + ( ampl * (float) cos( i * freq));
-			}
-		}
-#endif
+		subband_power[avg_ptr++] = spectrum_power_scale_fixed( r, i, preemphasis_fixed[s - 1], shift);
+	}
+}
 
-		kiss_fft( cfg, fin_buf, fout_buf);
 
-		// Extract the two separate frequency domain signals
-		// and keep track of the power per bin.
-		avg_ptr = 0;
-		for( s = 1; s <= num_subbands; s++) {
-			kiss_fft_cpx ck, cnk;
+// Compute the subband power using the float FFT. The input is
+// interleaved left and right samples.
+static void spectrum_power_float( const s16_t *in) {
+	kiss_fft_cpx fin_buf[MAX_SAMPLE_WINDOW];
+	kiss_fft_cpx fout_buf[MAX_SAMPLE_WINDOW];
 
-			float r, i;
+	int avg_ptr;
+	int i, s;
 
-			ck = fout_buf[s];
-			cnk = fout_buf[sample_window - s];
+	for( i = 0; i < sample_window; i++) {
+		fin_buf[i].r = (float) ( filter_window[i] * in[2 * i]);
+		fin_buf[i].i = (float) ( filter_window[i] * in[2 * i + 1]);
+	}
 
-			r = ( ck.r + cnk.r) / 2;
-			i = ( ck.i - cnk.i) / 2;
+	kiss_fft( cfg, fin_buf, fout_buf);
 
-			avg_power[avg_ptr++] += ( r * r + i * i) / num_windows;
+	// Extract the two separate frequency domain signals
+	// and keep track of the power per bin.
+	avg_ptr = 0;
+	for( s = 1; s <= num_subbands; s++) {
+		kiss_fft_cpx ck, cnk;
 
-			r = ( cnk.i + ck.i) / 2;
-			i = ( cnk.r - ck.r) / 2;
+		float r, i;
+		double product;
 
-			avg_power[avg_ptr++] += ( r * r + i * i) / num_windows;
-		}
-	}
+		ck = fout_buf[s];
+		cnk = fout_buf[sample_window - s];
 
+		r = ( ck.r + cnk.r) / 2;
+		i = ( ck.i - cnk.i) / 2;
 
-	{
-		int pre_ptr = 0;
-		int avg_ptr = 0;
-		int p;
+		product = ( r * r + i * i) * preemphasis[s - 1] / 65536;
+		subband_power[avg_ptr++] = ( product > SUBBAND_POWER_MAX) ? SUBBAND_POWER_MAX : (int) product;
 
-		for( p = 0; p < num_subbands; p++) {
-			long product = (long) ( avg_power[avg_ptr] * preemphasis[pre_ptr]);
-			product >>= 16;
-			avg_power[avg_ptr++] = (int) product;
+		r = ( cnk.i + ck.i) / 2;
+		i = ( cnk.r - ck.r) / 2;
 
-			product = (long) ( avg_power[avg_ptr] * preemphasis[pre_ptr]);
-			product >>= 16;
-			avg_power[avg_ptr++] = (int) product;
+		product = ( r * r + i * i) * preemphasis[s - 1] / 65536;
+		subband_power[avg_ptr++] = ( product > SUBBAND_POWER_MAX) ? SUBBAND_POWER_MAX : (int) product;
+	}
+}
+
+
+// Map the power to a bar value, the largest power_map entry not
+// above the power.
+static inline int spectrum_map_power( int power) {
+	int lo = 0;
+	int hi = 31;
 
-			pre_ptr++;
+	while( lo < hi) {
+		int mid = ( lo + hi + 1) / 2;
+
+		if( power >= power_map[mid]) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
 		}
 	}
 
+	return lo;
+}
+
+
+// Average the subband power into the histogram bars.
+static void spectrum_bars( int *sample_bin_ch0, int *sample_bin_ch1) {
+	int ch;
+
 	for( ch = 0; ch < (( is_mono) ? 1 : 2); ch++) {
 		int power_sum = 0;
 		int in_bar = 0;
@@ -448,15 +531,14 @@ int decode_spectrum( lua_State *L) {
 		for( s = 0; s < num_subbands; s++) {
 			// Average out the power for all subbands represented
 			// by a bar.
-			power_sum += avg_power[avg_ptr] / subbands_in_bar[ch];
+			power_sum += subband_power[avg_ptr] / subbands_in_bar[ch];
 
 			if( is_mono) {
-				power_sum += avg_power[avg_ptr + 1] / subbands_in_bar[ch];
+				power_sum += subband_power[avg_ptr + 1] / subbands_in_bar[ch];
 			}
 
 			if( ++in_bar == subbands_in_bar[ch]) {
 				int val;
-				int i;
 
 				if( is_mono) {
 					power_sum >>= 2;
@@ -464,13 +546,7 @@ int decode_spectrum( lua_State *L) {
 
 				power_sum <<= 6; // FIXME scaling
 
-				val = 0;
-				for( i = 31; i > 0; i--) {
-					if( power_sum >= power_map[i]) {
-						val = i;
-						break;
-					}
-				}
+				val = spectrum_map_power( power_sum);
 
 				if( ch == 0) {
 					sample_bin_ch0[curr_bar++] = val;
@@ -479,9 +555,6 @@ int decode_spectrum( lua_State *L) {
 					sample_bin_ch1[curr_bar++] = val;
 				}
 
-//				printf( "*** ch: %d, curr_bar: %d, val: %d\n", ch, curr_bar, val);
-//				curr_bar++;
-
 				if( curr_bar == num_bars[ch]) {
 					break;
 				}
@@ -492,7 +565,50 @@ int decode_spectrum( lua_State *L) {
 			avg_ptr += 2;
 		}
 	}
+}
+
+
+int decode_spectrum( lua_State *L) {
+	s16_t in[2 * MAX_SAMPLE_WINDOW];
+
+	int sample_bin_ch0[MAX_SUBBANDS];
+	int sample_bin_ch1[MAX_SUBBANDS];
+
+	size_t frames;
+
+	int i;
+
+	// Shortcut if audio isn't running
+	if( !( decode_audio->state & DECODE_STATE_RUNNING)) {
+
+		lua_newtable( L);
+		for( i = 0; i < num_bars[0]; i++) {
+			lua_pushinteger( L, 0);
+			lua_rawseti( L, -2, i + 1);
+		}
+
+		lua_newtable( L);
+		for( i = 0; i < num_bars[1]; i++) {
+			lua_pushinteger( L, 0);
+			lua_rawseti( L, -2, i + 1);
+		}
+		return 2;
+	}
+
+	// The samples being heard, read without the audio lock
+	frames = decode_tap_read( in, sample_window);
+	for( i = frames; i < sample_window; i++) {
+		in[2 * i] = 0;
+		in[2 * i + 1] = 0;
+	}
+
+	if( use_fixed_point) {
+		spectrum_power_fixed( in);
+	} else {
+		spectrum_power_float( in);
+	}
 
+	spectrum_bars( sample_bin_ch0, sample_bin_ch1);
 
 	lua_newtable( L);
 	for( i = 0; i < num_bars[0]; i++) {
@@ -518,3 +634,63 @@ int decode_spectrum( lua_State *L) {
 }
 
 
+// Parameters on the lua stack for the benchmark:
+//   2 - Iterations, default 1000
+//
+// Runs the float and fixed point analyzers on a test signal, using
+// the settings from decode_spectrum_init(). Returns the time per
+// update in microseconds for the float and the fixed point analyzer,
+// and the largest difference between their bar values.
+
+int decode_spectrum_benchmark( lua_State *L) {
+	s16_t in[2 * MAX_SAMPLE_WINDOW];
+
+	int float_bin[2][MAX_SUBBANDS];
+	int fixed_bin[2][MAX_SUBBANDS];
+
+	Uint32 float_ticks, fixed_ticks;
+	int iterations;
+	int diff = 0;
+	int i, ch;
+
+	iterations = luaL_optinteger( L, 2, 1000);
+
+	if( !cfg) {
+		return luaL_error( L, "spectrum_init has not been called");
+	}
+
+	// Test signal, two tones in each channel
+	for( i = 0; i < sample_window; i++) {
+		in[2 * i] = (s16_t) ( 8000 * sin( i * 0.05) + 4000 * sin( i * 0.9));
+		in[2 * i + 1] = (s16_t) ( 12000 * sin( i * 0.3) + 2000 * cos( i * 1.7));
+	}
+
+	float_ticks = SDL_GetTicks();
+	for( i = 0; i < iterations; i++) {
+		spectrum_power_float( in);
+		spectrum_bars( float_bin[0], float_bin[1]);
+	}
+	float_ticks = SDL_GetTicks() - float_ticks;
+
+	fixed_ticks = SDL_GetTicks();
+	for( i = 0; i < iterations; i++) {
+		spectrum_power_fixed( in);
+		spectrum_bars( fixed_bin[0], fixed_bin[1]);
+	}
+	fixed_ticks = SDL_GetTicks() - fixed_ticks;
+
+	for( ch = 0; ch < (( is_mono) ? 1 : 2); ch++) {
+		for( i = 0; i < num_bars[ch]; i++) {
+			int d = abs( float_bin[ch][i] - fixed_bin[ch][i]);
+			if( d > diff) {
+				diff = d;
+			}
+		}
+	}
+
+	lua_pushnumber( L, ( float_ticks * 1000.0) / iterations);
+	lua_pushnumber( L, ( fixed_ticks * 1000.0) / iterations);
+	lua_pushinteger( L, diff);
+
+	return 3;
+}
@@ -15,45 +15,48 @@
 
 #define VUMETER_DEFAULT_SAMPLE_WINDOW 8 * 1024
 
+/* The largest window that can be read from the visualizer tap */
+#define VUMETER_MAX_SAMPLE_WINDOW 8 * 1024
+
 int decode_vumeter(lua_State *L) {
+	static s16_t buf[VUMETER_MAX_SAMPLE_WINDOW * 2];
 	u32_t sample_accumulator[2];
-	sample_t *ptr;
-	size_t samples_until_wrap;
+	s16_t *ptr;
 	s16_t sample;
 	s32_t sample_sq;
 	size_t i, num_samples;
 
 	num_samples = luaL_optinteger(L, 2, VUMETER_DEFAULT_SAMPLE_WINDOW);
+	if (num_samples > VUMETER_MAX_SAMPLE_WINDOW) {
+		num_samples = VUMETER_MAX_SAMPLE_WINDOW;
+	}
 
 	sample_accumulator[0] = 0;
 	sample_accumulator[1] = 0;
 
-	decode_audio_lock();
-
 	if (decode_audio->state & DECODE_STATE_RUNNING) {
-		ptr = (sample_t *)(void *)(decode_fifo_buf + decode_audio->fifo.rptr);
-		samples_until_wrap = BYTES_TO_SAMPLES(fifo_bytes_until_rptr_wrap(&decode_audio->fifo));
+		/* samples being heard, read without the audio lock */
+		num_samples = decode_tap_read(buf, num_samples);
 
+		ptr = buf;
 		for (i=0; i<num_samples; i++) {
-			sample = (*ptr++) >> 24;
+			sample = (*ptr++) >> 8;
 			sample_sq = sample * sample;
 			sample_accumulator[0] += sample_sq;
 
-			sample = (*ptr++) >> 24;
+			sample = (*ptr++) >> 8;
 			sample_sq = sample * sample;
 			sample_accumulator[1] += sample_sq;
-
-			samples_until_wrap -= 2;
-			if (samples_until_wrap <= 0) {
-				ptr = (sample_t *)(void *)decode_fifo_buf;
-			}
 		}
 	}
+	else {
+		num_samples = 0;
+	}
 
-	decode_audio_unlock();
-
-	sample_accumulator[0] /= num_samples;
-	sample_accumulator[1] /= num_samples;
+	if (num_samples) {
+		sample_accumulator[0] /= num_samples;
+		sample_accumulator[1] /= num_samples;
+	}
 
 	lua_newtable(L);
 	lua_pushinteger(L, sample_accumulator[0]);
@@ -13,6 +13,8 @@
 static int mp4_parse_container_box(struct decode_mp4 *mp4, size_t r);
 static int mp4_parse_track_box(struct decode_mp4 *mp4, size_t r);
 static int mp4_parse_track_header_box(struct decode_mp4 *mp4, size_t r);
+static int mp4_parse_media_header_box(struct decode_mp4 *mp4, size_t r);
+static int mp4_parse_time_to_sample_box(struct decode_mp4 *mp4, size_t r);
 static int mp4_parse_sample_to_chunk_box(struct decode_mp4 *mp4, size_t r);
 static int mp4_parse_sample_table_box(struct decode_mp4 *mp4, size_t r);
 static int mp4_parse_sample_size_box(struct decode_mp4 *mp4, size_t r);
@@ -32,28 +34,82 @@ struct mp4_sample_to_chunk {
 	u32_t description_index;
 };
 
+struct mp4_time_to_sample {
+	u32_t sample_count;
+	u32_t sample_delta;
+};
+
+/* The sample sizes and chunk offsets are read in order, so they are
+ * packed as variable length deltas from the previous value. A run of
+ * equal values is packed as a run length. Each entry is a varint, with
+ * the low bit set for a run.
+ *
+ * Seeking can't index the packed entries directly, so the read state is
+ * saved every MP4_TABLE_CHECKPOINT entries when the table is finished.
+ */
+#ifndef MP4_TABLE_CHECKPOINT
+#define MP4_TABLE_CHECKPOINT 1024
+#endif
+
+struct mp4_table_checkpoint {
+	size_t pos;
+	u64_t value;
+	u32_t run;
+};
+
+struct mp4_table {
+	u8_t *buf;
+	size_t len, size;
+
+	/* read position */
+	size_t pos;
+
+	/* last value written or read */
+	u64_t value;
+
+	/* run length to write, or left to read */
+	u32_t run;
+
+	/* number of entries */
+	u32_t count;
+
+	/* read state at every MP4_TABLE_CHECKPOINT entry */
+	struct mp4_table_checkpoint *checkpoint;
+	u32_t checkpoint_count;
+};
+
 struct mp4_track {
 	int track_id;
 	char data_format[4];
 
+	/* media time units per second */
+	u32_t timescale;
+
 	/* number samples */
 	u32_t sample_count;
 
 	/* sample size (fixed or variable) */
 	u32_t fixed_sample_size;
-	u32_t *sample_size;
+	u8_t sample_size_bits;		/* stz2 field size */
+	struct mp4_table sample_size;
 
 	/* chunk offsets */
 	u32_t chunk_offset_count;
-	u64_t *chunk_offset;
+	struct mp4_table chunk_offset;
 
 	/* sample to chunk */
 	u32_t sample_to_chunk_count;
 	struct mp4_sample_to_chunk *sample_to_chunk;
 
+	/* sample durations, for seeking */
+	u32_t time_to_sample_count;
+	struct mp4_time_to_sample *time_to_sample;
+
 	/* stream state */
 	u32_t sample_num;		/* current sample */
+	u32_t sample_len;		/* current sample size */
 	u32_t chunk_num;		/* current chunk, index into chunk_offset */
+	u64_t chunk_pos;		/* current chunk offset */
 	u32_t chunk_idx;		/* index into sample_to_chunk */
 	u32_t chunk_sample_num;		/* current sample in chunk */
 	size_t chunk_sample_offset;	/* offset into chunk */
@@ -73,8 +129,10 @@ static struct mp4_parser mp4_parsers[] = {
 	{ "trak", &mp4_parse_track_box, },
 	{ "tkhd", &mp4_parse_track_header_box, },
 	{ "mdia", &mp4_parse_container_box, },
+	{ "mdhd", &mp4_parse_media_header_box, },
 	{ "minf", &mp4_parse_container_box, },
 	{ "stbl", &mp4_parse_container_box, },
+	{ "stts", &mp4_parse_time_to_sample_box, },
 	{ "stsc", &mp4_parse_sample_to_chunk_box, },
 	{ "stsd", &mp4_parse_sample_table_box, },
 	{ "stsz", &mp4_parse_sample_size_box, },
@@ -165,8 +223,8 @@ static inline u64_t mp4_get_u64(struct decode_mp4 *mp4)
 	v |= (uint64_t)mp4->ptr[6] << 8;
 	v |= (uint64_t)mp4->ptr[7];
 
-	mp4->ptr += 4;
-	mp4->off += 4;
+	mp4->ptr += 8;
+	mp4->off += 8;
 	return v;
 }
 
@@ -203,6 +261,218 @@ static inline int mp4_skip(struct decode_mp4 *mp4, size_t n)
 }
 
 
+/* continue parsing from offset in the file, see mp4_open */
+static void mp4_seek(struct decode_mp4 *mp4, size_t offset, mp4_read_box_t f)
+{
+	LOG_DEBUG(log_audio_codec, "seek to %u", (unsigned int)offset);
+
+	mp4->seek_offset = offset;
+	mp4->seeking = TRUE;
+	mp4->f = f;
+
+	streambuf_seek(offset);
+}
+
+
+static int mp4_table_put_varint(struct mp4_table *t, u64_t v)
+{
+	if (t->len + 10 > t->size) {
+		size_t size = t->size ? t->size * 2 : 1024;
+		u8_t *buf;
+
+		buf = realloc(t->buf, size);
+		if (!buf) {
+			LOG_ERROR(log_audio_codec, "can't allocate sample table");
+			return 0;
+		}
+
+		t->buf = buf;
+		t->size = size;
+	}
+
+	do {
+		u8_t b = v & 0x7F;
+
+		v >>= 7;
+		if (v) {
+			b |= 0x80;
+		}
+		t->buf[t->len++] = b;
+	} while (v);
+
+	return 1;
+}
+
+
+static int mp4_table_put(struct mp4_table *t, u64_t value)
+{
+	s64_t delta;
+
+	t->count++;
+
+	if (value == t->value) {
+		t->run++;
+		return 1;
+	}
+
+	if (t->run) {
+		if (!mp4_table_put_varint(t, ((u64_t)t->run << 1) | 1)) {
+			return 0;
+		}
+		t->run = 0;
+	}
+
+	/* zigzag encoded delta */
+	delta = value - t->value;
+	t->value = value;
+
+	return mp4_table_put_varint(t, (((u64_t)delta << 1) ^ (u64_t)(delta >> 63)) << 1);
+}
+
+
+static void mp4_table_rewind(struct mp4_table *t)
+{
+	t->pos = 0;
+	t->value = 0;
+	t->run = 0;
+}
+
+
+static u64_t mp4_table_get(struct mp4_table *t);
+
+
+/* End of the table, save the checkpoints and rewind it for reading */
+static int mp4_table_finish(struct mp4_table *t)
+{
+	u32_t i, n;
+
+	if (t->run) {
+		if (!mp4_table_put_varint(t, ((u64_t)t->run << 1) | 1)) {
+			return 0;
+		}
+	}
+
+	if (t->len && t->len < t->size) {
+		u8_t *buf = realloc(t->buf, t->len);
+		if (buf) {
+			t->buf = buf;
+			t->size = t->len;
+		}
+	}
+
+	mp4_table_rewind(t);
+
+	if (t->checkpoint) {
+		free(t->checkpoint);
+		t->checkpoint = NULL;
+		t->checkpoint_count = 0;
+	}
+
+	n = (t->count + MP4_TABLE_CHECKPOINT - 1) / MP4_TABLE_CHECKPOINT;
+	if (n < 2) {
+		/* short table, seek from the start */
+		return 1;
+	}
+
+	t->checkpoint = malloc(n * sizeof(struct mp4_table_checkpoint));
+	if (!t->checkpoint) {
+		/* seeking steps through the whole table */
+		LOG_WARN(log_audio_codec, "can't allocate sample table checkpoints");
+		return 1;
+	}
+	t->checkpoint_count = n;
+
+	for (i = 0; i < t->count; i++) {
+		if (i % MP4_TABLE_CHECKPOINT == 0) {
+			struct mp4_table_checkpoint *c = &t->checkpoint[i / MP4_TABLE_CHECKPOINT];
+
+			c->pos = t->pos;
+			c->value = t->value;
+			c->run = t->run;
+		}
+		mp4_table_get(t);
+	}
+
+	mp4_table_rewind(t);
+
+	return 1;
+}
+
+
+static u64_t mp4_table_get(struct mp4_table *t)
+{
+	u64_t v = 0;
+	int shift = 0;
+	u8_t b;
+
+	if (t->run) {
+		t->run--;
+		return t->value;
+	}
+
+	do {
+		if (t->pos >= t->len) {
+			return t->value;
+		}
+
+		b = t->buf[t->pos++];
+		v |= (u64_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	if (v & 1) {
+		/* run of the last value */
+		t->run = (u32_t)(v >> 1) - 1;
+		return t->value;
+	}
+
+	v >>= 1;
+	t->value += (v >> 1) ^ -(v & 1);
+
+	return t->value;
+}
+
+
+/* Position the table so the next read is entry idx */
+static void mp4_table_seek(struct mp4_table *t, u32_t idx)
+{
+	u32_t i = idx / MP4_TABLE_CHECKPOINT;
+
+	if (i < t->checkpoint_count) {
+		struct mp4_table_checkpoint *c = &t->checkpoint[i];
+
+		t->pos = c->pos;
+		t->value = c->value;
+		t->run = c->run;
+		idx -= i * MP4_TABLE_CHECKPOINT;
+	}
+	else {
+		mp4_table_rewind(t);
+	}
+
+	while (idx--) {
+		mp4_table_get(t);
+	}
+}
+
+
+static void mp4_table_free(struct mp4_table *t)
+{
+	if (t->buf) {
+		free(t->buf);
+		t->buf = NULL;
+	}
+	t->len = t->size = 0;
+	t->count = 0;
+
+	if (t->checkpoint) {
+		free(t->checkpoint);
+		t->checkpoint = NULL;
+	}
+	t->checkpoint_count = 0;
+}
+
+
 static int mp4_parse_container_box(struct decode_mp4 *mp4, size_t r)
 {
 	struct mp4_parser *parser;
@@ -233,6 +503,11 @@ static int mp4_parse_container_box(struct decode_mp4 *mp4, size_t r)
 
 	LOG_DEBUG(log_audio_codec, "box %.4s, size without header %u (%x)", mp4->box_type, mp4->box_size, mp4->box_size);
 
+	if (mp4->mdat_offset && FOURCC_EQ(mp4->box_type, "moov")) {
+		/* seek back to the media data after this box */
+		mp4->moov_end = mp4->off + mp4->box_size;
+	}
+
 	/* find box parser */
 	for (parser = &mp4_parsers[0]; parser->type; parser++) {
 		if (FOURCC_EQ(mp4->box_type, parser->type)) {
@@ -297,6 +572,86 @@ static int mp4_parse_track_header_box(struct decode_mp4 *mp4, size_t r)
 }
 
 
+static int mp4_parse_media_header_box(struct decode_mp4 *mp4, size_t r)
+{
+	struct mp4_track *track = &mp4->track[mp4->track_idx];
+	int version;
+
+	if (r < 24) {
+		return 1;
+	}
+
+	mp4_get_fullbox(mp4, &version, NULL);
+
+	/* skip times */
+	if (version == 1) {
+		mp4_skip(mp4, 16);
+	}
+	else {
+		mp4_skip(mp4, 8);
+	}
+
+	track->timescale = mp4_get_u32(mp4);
+
+	/* skip rest of box */
+	if (version == 1) {
+		mp4->box_size -= 24;
+	}
+	else {
+		mp4->box_size -= 16;
+	}
+	mp4->f = mp4_skip_box;
+
+	return 1;
+}
+
+
+static int mp4_parse_time_to_sample_box(struct decode_mp4 *mp4, size_t r)
+{
+	struct mp4_track *track = &mp4->track[mp4->track_idx];
+
+	if (!track->time_to_sample) {
+		if (r < 8) {
+			return 1;
+		}
+
+		/* skip version, flags */
+		mp4_skip(mp4, 4);
+
+		track->time_to_sample_count = mp4_get_u32(mp4);
+		track->sample_num = 0;
+
+		track->time_to_sample = malloc(sizeof(struct mp4_time_to_sample) * track->time_to_sample_count);
+		if (!track->time_to_sample) {
+			LOG_ERROR(log_audio_codec, "can't allocate time to sample table");
+			return 0;
+		}
+
+		mp4->box_size -= 8;
+	}
+
+	while (track->sample_num < track->time_to_sample_count) {
+		if ((mp4->end - mp4->ptr) < 8) {
+			return 1;
+		}
+
+		track->time_to_sample[track->sample_num].sample_count = mp4_get_u32(mp4);
+		track->time_to_sample[track->sample_num].sample_delta = mp4_get_u32(mp4);
+
+		track->sample_num++;
+
+		mp4->box_size -= 8;
+	}
+
+	track->sample_num = 0;
+
+	/* skip rest of box */
+	mp4->f = mp4_skip_box;
+
+	return 1;
+}
+
+
 static int mp4_parse_sample_to_chunk_box(struct decode_mp4 *mp4, size_t r)
 {
 	struct mp4_track *track = &mp4->track[mp4->track_idx];
@@ -380,8 +735,6 @@ static int mp4_parse_sample_size_box(struct decode_mp4 *mp4, size_t r)
 			mp4->f = mp4_skip_box;
 		}
 
-		track->sample_size = malloc(sizeof(u32_t) * track->sample_count);
-
 		mp4->box_size -= 12;
 	}
 
@@ -391,10 +744,16 @@ static int mp4_parse_sample_size_box(struct decode_mp4 *mp4, size_t r)
 				return 1;
 			}
 
-			track->sample_size[track->sample_num++] = mp4_get_u32(mp4);
+			if (!mp4_table_put(&track->sample_size, mp4_get_u32(mp4))) {
+				return 0;
+			}
+			track->sample_num++;
 			mp4->box_size -= 4;
 		}
 
+		if (!mp4_table_finish(&track->sample_size)) {
+			return 0;
+		}
 		track->sample_num = 0;
 
 		/* skip rest of box */
@@ -407,12 +766,77 @@ static int mp4_parse_sample_size_box(struct decode_mp4 *mp4, size_t r)
 
 static int mp4_parse_sample_size2_box(struct decode_mp4 *mp4, size_t r)
 {
-	LOG_ERROR(log_audio_codec, "need to implement stz2");
-	return 0;
+	struct mp4_track *track = &mp4->track[mp4->track_idx];
+	u32_t size;
+
+	if (!track->sample_count) {
+		if (r < 12) {
+			return 1;
+		}
+
+		/* skip version, flags, reserved */
+		mp4_skip(mp4, 7);
+
+		track->sample_size_bits = mp4_get_u8(mp4);
+		track->sample_count = mp4_get_u32(mp4);
+		track->sample_num = 0;
+
+		if (track->sample_size_bits != 4 && track->sample_size_bits != 8 && track->sample_size_bits != 16) {
+			LOG_ERROR(log_audio_codec, "stz2 field size %d", track->sample_size_bits);
+			return 0;
+		}
+
+		mp4->box_size -= 12;
+	}
+
+	while (track->sample_num < track->sample_count) {
+		if ((mp4->end - mp4->ptr) < ((track->sample_size_bits == 16) ? 2 : 1)) {
+			return 1;
+		}
+
+		if (track->sample_size_bits == 16) {
+			size = (mp4->ptr[0] << 8) | mp4->ptr[1];
+			mp4_skip(mp4, 2);
+			mp4->box_size -= 2;
+		}
+		else if (track->sample_size_bits == 8) {
+			size = mp4_get_u8(mp4);
+			mp4->box_size -= 1;
+		}
+		else {
+			/* two samples in each byte */
+			if (!mp4_table_put(&track->sample_size, mp4->ptr[0] >> 4)) {
+				return 0;
+			}
+
+			size = mp4->ptr[0] & 0x0F;
+			mp4_skip(mp4, 1);
+			mp4->box_size -= 1;
+
+			if (++track->sample_num == track->sample_count) {
+				break;
+			}
+		}
+
+		if (!mp4_table_put(&track->sample_size, size)) {
+			return 0;
+		}
+		track->sample_num++;
+	}
+
+	if (!mp4_table_finish(&track->sample_size)) {
+		return 0;
+	}
+	track->sample_num = 0;
+
+	/* skip rest of box */
+	mp4->f = mp4_skip_box;
+
+	return 1;
 }
 
 
-static int mp4_parse_chunk_offset_box(struct decode_mp4 *mp4, size_t r)
+static int mp4_parse_chunk_offsets(struct decode_mp4 *mp4, size_t r, int entry_size)
 {
 	struct mp4_track *track = &mp4->track[mp4->track_idx];
 
@@ -427,20 +851,24 @@ static int mp4_parse_chunk_offset_box(struct decode_mp4 *mp4, size_t r)
 		track->chunk_offset_count = mp4_get_u32(mp4);		
 		track->sample_num = 0;
 
-		track->chunk_offset = malloc(sizeof(u64_t) * track->chunk_offset_count);
-
 		mp4->box_size -= 8;
 	}
 
 	while (track->sample_num < track->chunk_offset_count) {
-		if ((mp4->end - mp4->ptr) < 4) {
+		if ((mp4->end - mp4->ptr) < entry_size) {
 			return 1;
 		}
 
-		track->chunk_offset[track->sample_num++] = mp4_get_u32(mp4);
-		mp4->box_size -= 4;
+		if (!mp4_table_put(&track->chunk_offset, (entry_size == 8) ? mp4_get_u64(mp4) : mp4_get_u32(mp4))) {
+			return 0;
+		}
+		track->sample_num++;
+		mp4->box_size -= entry_size;
 	}
 
+	if (!mp4_table_finish(&track->chunk_offset)) {
+		return 0;
+	}
 	track->sample_num = 0;
 
 	/* skip rest of box */
@@ -450,10 +878,15 @@ static int mp4_parse_chunk_offset_box(struct decode_mp4 *mp4, size_t r)
 }
 
 
+static int mp4_parse_chunk_offset_box(struct decode_mp4 *mp4, size_t r)
+{
+	return mp4_parse_chunk_offsets(mp4, r, 4);
+}
+
+
 static int mp4_parse_chunk_large_offset_box(struct decode_mp4 *mp4, size_t r)
 {
-	LOG_ERROR(log_audio_codec, "need to implement co64");
-	return 0;
+	return mp4_parse_chunk_offsets(mp4, r, 8);
 }
 
 
@@ -592,10 +1025,45 @@ static int mp4_parse_esds_box(struct decode_mp4 *mp4, size_t r)
 }
 
 
+static void mp4_track_start(struct mp4_track *track)
+{
+	track->sample_num = 0;
+	track->chunk_num = 0;
+	track->chunk_idx = 0;
+	track->chunk_sample_num = 0;
+	track->chunk_sample_offset = 0;
+
+	if (track->fixed_sample_size) {
+		track->sample_len = track->fixed_sample_size;
+	}
+	else {
+		track->sample_len = mp4_table_get(&track->sample_size);
+	}
+	track->chunk_pos = mp4_table_get(&track->chunk_offset);
+}
+
+
 static int mp4_parse_mdat_box(struct decode_mp4 *mp4, size_t r)
 {
 	int i;
 
+	if (mp4->track_count == 0) {
+		/* The moov box is after the media data. Skip the media
+		 * data with a ranged seek to fetch the moov box, and come
+		 * back here once the sample tables have been parsed.
+		 */
+		if (mp4->mdat_offset || mp4->box_size == ULONG_MAX) {
+			LOG_ERROR(log_audio_codec, "no moov box");
+			return 0;
+		}
+
+		LOG_DEBUG(log_audio_codec, "moov after mdat, %u bytes of media data", (unsigned int)mp4->box_size);
+
+		mp4->mdat_offset = mp4->off;
+		mp4_seek(mp4, mp4->off + mp4->box_size, mp4_parse_container_box);
+		return 1;
+	}
+
 	if (r < 12) {
 		mp4->box_size = 16;
 		return 1;
@@ -613,7 +1081,12 @@ static int mp4_parse_mdat_box(struct decode_mp4 *mp4, size_t r)
 
 	LOG_DEBUG(log_audio_codec, "tracks: %d", mp4->track_count);
 	for (i=0; i<mp4->track_count; i++) {
-		LOG_DEBUG(log_audio_codec, "%d:\t%d, %.4s", i, mp4->track[i].track_id, mp4->track[i].data_format);
+		struct mp4_track *track = &mp4->track[i];
+
+		LOG_DEBUG(log_audio_codec, "%d:\t%d, %.4s, %u samples, tables %u bytes", i, track->track_id, track->data_format,
+			track->sample_count, (unsigned int)(track->sample_size.len + track->chunk_offset.len));
+
+		mp4_track_start(track);
 	}
 
 	/* start streaming content */
@@ -675,18 +1148,54 @@ void mp4_init(struct decode_mp4 *mp4)
 	// FIXME +1 is to prevent valgrind error, I really can't spot
 	// the off-by-one error in this code :(. See also the commented
 	// assert in mp4_read().
-	mp4->buf = malloc(MP4_BUFFER_SIZE + 1);
+	mp4->buf = decode_alloc(MP4_BUFFER_SIZE + 1);
 	mp4->ptr = mp4->end = NULL;
 
 	mp4->f = mp4_parse_container_box;
 }
 
 
+/* Returns 1 once a seek is complete, 2 while waiting for it, or 0 if
+ * the seek failed.
+ */
+static int mp4_seek_wait(struct decode_mp4 *mp4)
+{
+	switch (streambuf_get_seek_state()) {
+	case STREAMBUF_SEEK_NONE:
+		break;
+	case STREAMBUF_SEEK_FAILED:
+		LOG_ERROR(log_audio_codec, "stream seek failed");
+		mp4->seeking = FALSE;
+		return 0;
+	default:
+		return 2;
+	}
+
+	/* the streambuf now starts at the seek offset */
+	mp4->seeking = FALSE;
+	mp4->ptr = mp4->end = mp4->buf;
+	mp4->off = mp4->seek_offset;
+
+	return 1;
+}
+
+
 size_t mp4_open(struct decode_mp4 *mp4)
 {
 	while (mp4->f) {
 		ssize_t r;
 		bool_t streaming;
+		int status;
+
+		if (mp4->moov_end && mp4->off >= mp4->moov_end && mp4->f == mp4_parse_container_box) {
+			/* moov parsed, stream the media data */
+			mp4->moov_end = 0;
+			mp4_seek(mp4, mp4->mdat_offset, mp4_parse_mdat_box);
+		}
+
+		if (mp4->seeking && (status = mp4_seek_wait(mp4)) != 1) {
+			return status;
+		}
 
 		r = mp4_fill_buffer(mp4, &streaming);
 		if (r < 0) {
@@ -711,40 +1220,36 @@ size_t mp4_open(struct decode_mp4 *mp4)
 
 static inline void packet_size(struct mp4_track *track, size_t *pos, size_t *len)
 {
-	if (track->sample_count <= track->sample_num) {
+	if (track->sample_count <= track->sample_num
+			|| track->chunk_offset_count <= track->chunk_num) {
 		*pos = 0;
 		*len = 0;
 		return;
 	}
 
-	*pos = track->chunk_offset[track->chunk_num] + track->chunk_sample_offset;
-
-	if (track->fixed_sample_size) {
-		*len = track->fixed_sample_size;
-	}
-	else {
-		*len = track->sample_size[track->sample_num];
-	}
+	*pos = track->chunk_pos + track->chunk_sample_offset;
+	*len = track->sample_len;
 }
 
 
 static inline void next_packet(struct mp4_track *track)
 {
-	size_t pos, len;
-
-	packet_size(track, &pos, &len);
-
-	track->chunk_sample_offset += len;
+	track->chunk_sample_offset += track->sample_len;
 
 	track->sample_num++;
 	track->chunk_sample_num++;
 
+	if (!track->fixed_sample_size) {
+		track->sample_len = mp4_table_get(&track->sample_size);
+	}
+
 	if (track->chunk_sample_num == track->sample_to_chunk[track->chunk_idx].samples_per_chunk) {
 		track->chunk_num++;
 		track->chunk_sample_num = 0;
 		track->chunk_sample_offset = 0;
+		track->chunk_pos = mp4_table_get(&track->chunk_offset);
 
-		if (track->chunk_idx < track->chunk_offset_count
+		if (track->chunk_idx + 1 < track->sample_to_chunk_count
 				&& track->sample_to_chunk[track->chunk_idx + 1].first_chunk == track->chunk_num + 1) // first_chunk starts at 1
 		{
 			track->chunk_idx++;
@@ -762,6 +1267,16 @@ u8_t *mp4_read(struct decode_mp4 *mp4, int track_idx, size_t *rlen, bool_t *stre
 		ssize_t r;
 		struct mp4_track *track = &mp4->track[track_idx];
 
+		if (mp4->seeking) {
+			int status = mp4_seek_wait(mp4);
+
+			if (status != 1) {
+				*rlen = 0;
+				if (streaming) *streaming = (status == 2);
+				return 0;
+			}
+		}
+
 		r = mp4_fill_buffer(mp4, streaming);
 		if (r < 0) {
 			*rlen = 0;
@@ -811,6 +1326,118 @@ u8_t *mp4_read(struct decode_mp4 *mp4, int track_idx, size_t *rlen, bool_t *stre
 }
 
 
+/* Move the track to the sample playing at ms. The media data is fetched
+ * from the sample, skip_frames is set to the frames at sample_rate to
+ * drop from the start of its decoded audio.
+ */
+int mp4_seek_ms(struct decode_mp4 *mp4, int track_idx, u32_t ms, u32_t sample_rate, u32_t *skip_frames)
+{
+	struct mp4_track *track;
+	u64_t target, time = 0, first = 0;
+	u32_t i, j, sample = 0, n = 0, chunk = 0;
+	size_t pos, len;
+
+	if (track_idx >= mp4->track_count || mp4->f) {
+		return 0;
+	}
+
+	track = &mp4->track[track_idx];
+	if (!track->timescale || !track->time_to_sample) {
+		return 0;
+	}
+
+	/* find the sample in the time to sample table */
+	target = ((u64_t)ms * track->timescale) / 1000;
+
+	for (i = 0; i < track->time_to_sample_count; i++) {
+		struct mp4_time_to_sample *stts = &track->time_to_sample[i];
+		u64_t duration = (u64_t)stts->sample_count * stts->sample_delta;
+
+		if (time + duration > target) {
+			n = (stts->sample_delta) ? (target - time) / stts->sample_delta : 0;
+			time += (u64_t)n * stts->sample_delta;
+			break;
+		}
+
+		time += duration;
+		sample += stts->sample_count;
+	}
+
+	sample += n;
+	if (i == track->time_to_sample_count || sample >= track->sample_count) {
+		return 0;
+	}
+
+	/* find the chunk in the sample to chunk table, chunk and first are
+	 * the first chunk and sample of each run of chunks.
+	 */
+	for (i = 0; i < track->sample_to_chunk_count; i++) {
+		struct mp4_sample_to_chunk *stsc = &track->sample_to_chunk[i];
+		u32_t end = (i + 1 < track->sample_to_chunk_count) ? stsc[1].first_chunk - 1 : track->chunk_offset_count;
+		u64_t samples;
+
+		if (end < chunk || !stsc->samples_per_chunk) {
+			return 0;
+		}
+
+		samples = (u64_t)(end - chunk) * stsc->samples_per_chunk;
+		if (sample < first + samples) {
+			break;
+		}
+
+		chunk = end;
+		first += samples;
+	}
+
+	if (i == track->sample_to_chunk_count) {
+		return 0;
+	}
+
+	/* move the track to the sample, the tables are read from their
+	 * nearest checkpoints.
+	 */
+	n = track->sample_to_chunk[i].samples_per_chunk;
+
+	track->sample_num = sample;
+	track->chunk_idx = i;
+	track->chunk_num = chunk + (u32_t)((sample - first) / n);
+	track->chunk_sample_num = (u32_t)((sample - first) % n);
+
+	mp4_table_seek(&track->chunk_offset, track->chunk_num);
+	track->chunk_pos = mp4_table_get(&track->chunk_offset);
+
+	if (track->fixed_sample_size) {
+		track->sample_len = track->fixed_sample_size;
+		track->chunk_sample_offset = (size_t)track->chunk_sample_num * track->fixed_sample_size;
+	}
+	else {
+		mp4_table_seek(&track->sample_size, sample - track->chunk_sample_num);
+
+		track->chunk_sample_offset = 0;
+		for (j = 0; j < track->chunk_sample_num; j++) {
+			track->chunk_sample_offset += mp4_table_get(&track->sample_size);
+		}
+		track->sample_len = mp4_table_get(&track->sample_size);
+	}
+
+	packet_size(track, &pos, &len);
+	if (pos == 0) {
+		return 0;
+	}
+
+	*skip_frames = ((target - time) * sample_rate) / track->timescale;
+
+	LOG_DEBUG(log_audio_codec, "seek to sample %u offset %llu skip %u", sample, (u64_t)pos, *skip_frames);
+
+	if (pos < mp4->off || pos > mp4->off + (mp4->end - mp4->ptr)) {
+		mp4_seek(mp4, pos, NULL);
+	}
+	mp4->box_size = len;
+
+	return 1;
+}
+
+
 void mp4_track_conf(struct decode_mp4 *mp4, int track, u8_t **conf, size_t *size)
 {
 	if (track >= mp4->track_count) {
@@ -833,7 +1460,7 @@ void mp4_free(struct decode_mp4 *mp4)
 	int i;
 
 	if (mp4->buf) {
-		free(mp4->buf);
+		decode_free(mp4->buf);
 		mp4->buf = NULL;
 	}
 
@@ -844,14 +1471,12 @@ void mp4_free(struct decode_mp4 *mp4)
 			free(track->sample_to_chunk);
 			track->sample_to_chunk = NULL;
 		}
-		if (track->sample_size) {
-			free(track->sample_size);
-			track->sample_size = NULL;
-		}
-		if (track->chunk_offset) {
-			free(track->chunk_offset);
-			track->chunk_offset = NULL;
+		if (track->time_to_sample) {
+			free(track->time_to_sample);
+			track->time_to_sample = NULL;
 		}
+		mp4_table_free(&track->sample_size);
+		mp4_table_free(&track->chunk_offset);
 		if (track->conf) {
 			free(track->conf);
 			track->conf = NULL;
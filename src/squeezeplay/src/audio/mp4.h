@@ -26,12 +26,19 @@ struct decode_mp4 {
 	int track_idx;
 	struct mp4_track *track;
 
+	/* moov after mdat, the moov box is fetched with a ranged seek */
+	size_t mdat_offset;
+	size_t moov_end;
+	size_t seek_offset;
+	bool_t seeking;
+
 };
 
 
 void mp4_init(struct decode_mp4 *mp4);
 size_t mp4_open(struct decode_mp4 *mp4);
 u8_t *mp4_read(struct decode_mp4 *mp4, int track, size_t *len, bool_t *streaming);
+int mp4_seek_ms(struct decode_mp4 *mp4, int track, u32_t ms, u32_t sample_rate, u32_t *skip_frames);
 void mp4_track_conf(struct decode_mp4 *mp4, int track, u8_t **conf, size_t *size);
 void mp4_free(struct decode_mp4 *mp4);
 int mp4_track_is_type(struct decode_mp4 *mp4, int track, const char *type);
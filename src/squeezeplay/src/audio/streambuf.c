@@ -31,14 +31,38 @@ typedef int socket_t;
 #endif
 
 
+#if !defined(HAVE_SOCKETPAIR)
+/* provided by jive_dns.c */
+extern int socketpair(int domain, int type, int protocol, socket_t socks[2]);
+#endif
+
+
 #define STREAMBUF_SIZE (3 * 1024 * 1024)
 
+/* reader thread timeouts (ms) */
+#define STREAM_CONNECT_TIMEOUT 5000
+#define STREAM_POLL_INTERVAL 100
+
+/* reader thread events, sent to lua over the event socketpair */
+#define STREAM_EVENT_PROGRESS 1
+#define STREAM_EVENT_HEADERS 2
+#define STREAM_EVENT_CLOSED 3
+#define STREAM_EVENT_ERROR 4
+
+/* proxy fan-out to synced players */
+#define STREAM_PROXY_MAX_CLIENTS 8
+/* a client this far behind the stream is evicted rather than throttling it */
+#define STREAM_PROXY_MAX_LAG (STREAMBUF_SIZE / 2)
+/* time allowed for clients to drain at the end of the stream (ms) */
+#define STREAM_PROXY_DRAIN_TIMEOUT 10000
+
 static u8_t streambuf_buf[STREAMBUF_SIZE];
 static struct fifo streambuf_fifo;
 static size_t streambuf_lptr = 0;
 static bool_t streambuf_loop = FALSE;
 static bool_t streambuf_streaming = FALSE;
 static u64_t streambuf_bytes_received = 0;
+static u32_t streambuf_flush_count = 0;
 
 /* streambuf filter, used to parse metadata */
 static streambuf_filter_t streambuf_filter;
@@ -50,6 +74,39 @@ static bool_t streambuf_copyright;
 static u32_t icy_meta_interval;
 static s32_t icy_meta_remaining;
 
+/* double-buffered streaming. the next track is streamed into the
+ * streambuf behind the current track while the decoder drains it, the
+ * current track ends at streambuf_next_ptr. the next track's filter is
+ * held here until the decoder switches to it, see streambuf_next_track().
+ */
+static bool_t streambuf_next_pending = FALSE;
+static size_t streambuf_next_ptr;
+static streambuf_filter_t streambuf_pending_filter;
+static u32_t icy_next_interval;
+
+/* the decoder thread can read the next track ahead of the switch, to
+ * start its decoder early. reads are from streambuf_next_rptr while
+ * streambuf_read_next is set, see streambuf_select_next(). the next
+ * track can't seek until the switch.
+ */
+static bool_t streambuf_read_next = FALSE;
+static size_t streambuf_next_rptr;
+static bool_t streambuf_next_seek_failed = FALSE;
+
+/* ranged seeks. the decoder asks for the stream from an offset, for
+ * example to fetch the moov box at the end of an mp4 file. Playback.lua
+ * reconnects with a Range header, and the reader thread completes the
+ * seek when the server sends the partial content.
+ */
+static enum streambuf_seek_state streambuf_seek_state = STREAMBUF_SEEK_NONE;
+static u64_t streambuf_seek_offset;
+
+/* Playback.lua can reconnect to this stream with a Range header */
+static bool_t streambuf_ranged = FALSE;
+
+/* offset in the stream of the first byte received on this connection */
+static u64_t streambuf_stream_offset = 0;
+
 struct chunk {
 	u8_t *buf;
 	size_t len;
@@ -112,23 +169,54 @@ size_t streambuf_get_usedbytes(void) {
 	return n;
 }
 
-size_t streambuf_fast_usedbytes(void) {
+/* bytes of the current track, the next track is not visible to the decoder */
+static size_t streambuf_track_bytes_used(void) {
 	ASSERT_FIFO_LOCKED(&streambuf_fifo);
 
+	if (streambuf_read_next) {
+		if (!streambuf_next_pending) {
+			/* flushed */
+			return 0;
+		}
+		return (streambuf_fifo.wptr + STREAMBUF_SIZE - streambuf_next_rptr) % STREAMBUF_SIZE;
+	}
+
+	if (streambuf_next_pending) {
+		return (streambuf_next_ptr + STREAMBUF_SIZE - streambuf_fifo.rptr) % STREAMBUF_SIZE;
+	}
+
 	return fifo_bytes_used(&streambuf_fifo);
 }
 
+size_t streambuf_fast_usedbytes(void) {
+	ASSERT_FIFO_LOCKED(&streambuf_fifo);
+
+	return streambuf_track_bytes_used();
+}
+
 /* returns true if the stream is still open but cannot yet supply the requested bytes */
 bool_t streambuf_would_wait_for(size_t bytes) {
 	size_t n;
 	
-	if (!streambuf_streaming) {
+	/* the decoder waits until a seek has been made */
+	if (streambuf_seek_state == STREAMBUF_SEEK_REQUESTED
+	    || streambuf_seek_state == STREAMBUF_SEEK_CONNECTING) {
+		return TRUE;
+	}
+
+	if (streambuf_read_next) {
+		if (!streambuf_streaming) {
+			return FALSE;
+		}
+	}
+	/* the current track is complete if the next one is streaming */
+	else if (!streambuf_streaming || streambuf_next_pending) {
 		return FALSE;
 	}
 
 	fifo_lock(&streambuf_fifo);
 
-	n = fifo_bytes_used(&streambuf_fifo);
+	n = streambuf_track_bytes_used();
 
 	fifo_unlock(&streambuf_fifo);
 
@@ -153,6 +241,18 @@ void streambuf_flush(void) {
 
 	streambuf_fifo.rptr = 0;
 	streambuf_fifo.wptr = 0;
+	streambuf_flush_count++;
+	streambuf_seek_state = STREAMBUF_SEEK_NONE;
+
+	if (streambuf_next_pending) {
+		streambuf_next_pending = FALSE;
+		streambuf_filter = streambuf_pending_filter;
+		streambuf_pending_filter = NULL;
+	}
+	streambuf_next_seek_failed = FALSE;
+
+	/* wake the reader thread, it may be waiting for space */
+	fifo_signal(&streambuf_fifo);
 
 	fifo_unlock(&streambuf_fifo);
 }
@@ -237,10 +337,10 @@ size_t streambuf_fast_read(u8_t *buf, size_t min, size_t max, bool_t *streaming)
 	ASSERT_FIFO_LOCKED(&streambuf_fifo);
 
 	if (streaming) {
-		*streaming = streambuf_streaming;
+		*streaming = streambuf_streaming && (streambuf_read_next || !streambuf_next_pending);
 	}
 
-	sz = fifo_bytes_used(&streambuf_fifo);
+	sz = streambuf_track_bytes_used();
 	if (sz < min) {
 		return 0; /* underrun */
 	}
@@ -249,6 +349,21 @@ size_t streambuf_fast_read(u8_t *buf, size_t min, size_t max, bool_t *streaming)
 		sz = max;
 	}
 
+	if (streambuf_read_next) {
+		/* the current track still holds the space before the next
+		 * track, so the reader thread is not woken.
+		 */
+		w = STREAMBUF_SIZE - streambuf_next_rptr;
+		if (w < sz) {
+			sz = w;
+		}
+
+		memcpy(buf, streambuf_buf + streambuf_next_rptr, sz);
+		streambuf_next_rptr = (streambuf_next_rptr + sz) % STREAMBUF_SIZE;
+
+		return sz;
+	}
+
 	w = fifo_bytes_until_rptr_wrap(&streambuf_fifo);
 	if (w < sz) {
 		sz = w;
@@ -272,7 +387,7 @@ size_t streambuf_read(u8_t *buf, size_t min, size_t max, bool_t *streaming) {
 
 	fifo_lock(&streambuf_fifo);
 
-	if (streambuf_filter) {
+	if (streambuf_filter && !streambuf_read_next) {
 		/* filters are called with the streambuf locked */
 		n = streambuf_filter(buf, min, max, streaming);
 
@@ -338,7 +453,7 @@ ssize_t streambuf_icy_filter(u8_t *buf, size_t min, size_t max, bool_t *streamin
 	 */
 	assert(min == 0);
 
-	avail = fifo_bytes_used(&streambuf_fifo);
+	avail = streambuf_track_bytes_used();
 	while (avail && n < max) {
 		if (icy_meta_remaining > 0) {
 			/* we're waiting for the metadata */
@@ -358,56 +473,769 @@ ssize_t streambuf_icy_filter(u8_t *buf, size_t min, size_t max, bool_t *streamin
 			/* we're reading the metadata length byte */
 			u8_t len;
 
-			r = streambuf_fast_read(&len, 1, 1, NULL);
-			assert(r == 1);
+			r = streambuf_fast_read(&len, 1, 1, NULL);
+			assert(r == 1);
+
+			icy_meta_remaining = -16 * len;
+			if (!icy_meta_remaining) {
+				/* it's a zero length metadata, reset to the next interval */
+				icy_meta_remaining = icy_meta_interval;
+			}
+		}
+		else {
+			/* we're reading the metadata */
+			u8_t *icy_buf;
+			size_t icy_len = -icy_meta_remaining;
+
+			if (avail < icy_len) {
+				/* wait for more data */
+				break;
+			}
+
+			icy_buf = alloca(icy_len);
+			r = streambuf_fast_read(icy_buf, icy_len, icy_len, NULL);
+			assert(r == icy_len);
+			LOG_DEBUG(log_audio_decode, "got icy metadata: %s", (char *) icy_buf);
+
+			decode_queue_metadata(SHOUTCAST, icy_buf, icy_len);
+
+			icy_meta_remaining = icy_meta_interval;
+		}
+
+		avail = streambuf_track_bytes_used();
+	}
+
+	return n;
+}
+
+
+bool_t streambuf_is_icy()
+{
+	if (streambuf_read_next) {
+		return streambuf_pending_filter == streambuf_icy_filter;
+	}
+
+	return streambuf_filter == streambuf_icy_filter;
+}
+
+
+bool_t streambuf_can_seek(void) {
+	return !streambuf_filter && !streambuf_loop && !streambuf_next_pending;
+}
+
+
+/* returns the bytes from rptr to offset, or -1 if offset is not in the
+ * buffered data. the data behind rptr may be overwritten by the reader at
+ * any time. the fifo must be locked.
+ */
+static ssize_t streambuf_buffered_skip(u64_t offset) {
+	u64_t rptr_offset;
+	size_t used;
+
+	if (!streambuf_can_seek()) {
+		return -1;
+	}
+
+	used = fifo_bytes_used(&streambuf_fifo);
+	rptr_offset = streambuf_stream_offset + streambuf_bytes_received - used;
+
+	if (offset < rptr_offset || offset - rptr_offset > used) {
+		return -1;
+	}
+
+	return (ssize_t)(offset - rptr_offset);
+}
+
+
+bool_t streambuf_is_buffered(u64_t offset) {
+	bool_t buffered;
+
+	fifo_lock(&streambuf_fifo);
+	buffered = (streambuf_buffered_skip(offset) >= 0);
+	fifo_unlock(&streambuf_fifo);
+
+	return buffered;
+}
+
+
+bool_t streambuf_can_fetch(void) {
+	bool_t ranged;
+
+	fifo_lock(&streambuf_fifo);
+	ranged = streambuf_ranged && streambuf_can_seek();
+	fifo_unlock(&streambuf_fifo);
+
+	return ranged;
+}
+
+
+void streambuf_seek(u64_t offset) {
+	ssize_t skip;
+
+	fifo_lock(&streambuf_fifo);
+
+	if (streambuf_read_next) {
+		LOG_DEBUG(log_audio_decode, "can't seek the next track to %llu", (unsigned long long)offset);
+		streambuf_next_seek_failed = TRUE;
+
+		fifo_unlock(&streambuf_fifo);
+		return;
+	}
+
+	/* seeks forward within the buffered data are made immediately */
+	skip = streambuf_buffered_skip(offset);
+	if (skip >= 0) {
+		LOG_DEBUG(log_audio_decode, "seek to %llu in buffer", (unsigned long long)offset);
+
+		streambuf_fifo.rptr = (streambuf_fifo.rptr + (size_t)skip) % streambuf_fifo.size;
+		streambuf_seek_state = STREAMBUF_SEEK_NONE;
+
+		fifo_signal(&streambuf_fifo);
+		fifo_unlock(&streambuf_fifo);
+		return;
+	}
+
+	if (streambuf_next_pending || !streambuf_ranged) {
+		/* the next track is already streaming, or the stream can't be
+		 * fetched from an offset */
+		LOG_DEBUG(log_audio_decode, "can't seek to %llu", (unsigned long long)offset);
+		streambuf_seek_state = STREAMBUF_SEEK_FAILED;
+	}
+	else {
+		streambuf_seek_offset = offset;
+		streambuf_seek_state = STREAMBUF_SEEK_REQUESTED;
+	}
+
+	fifo_unlock(&streambuf_fifo);
+}
+
+
+enum streambuf_seek_state streambuf_get_seek_state(void) {
+	enum streambuf_seek_state state;
+
+	fifo_lock(&streambuf_fifo);
+	if (streambuf_read_next) {
+		state = streambuf_next_seek_failed ? STREAMBUF_SEEK_FAILED : STREAMBUF_SEEK_NONE;
+	}
+	else {
+		state = streambuf_seek_state;
+	}
+	fifo_unlock(&streambuf_fifo);
+
+	return state;
+}
+
+
+/* the decoder thread reads the next track while next is set, see
+ * decode_prepare_next(). the current track's reads are not changed.
+ */
+void streambuf_select_next(bool_t next) {
+	streambuf_read_next = next;
+}
+
+
+/* true if the next track is streaming and can be read ahead of the
+ * switch. filtered streams are only read after the switch.
+ */
+bool_t streambuf_next_available(void) {
+	bool_t available;
+
+	fifo_lock(&streambuf_fifo);
+	available = streambuf_next_pending && !streambuf_pending_filter;
+	fifo_unlock(&streambuf_fifo);
+
+	return available;
+}
+
+
+bool_t streambuf_next_track(bool_t prepared) {
+	fifo_lock(&streambuf_fifo);
+
+	if (!streambuf_next_pending) {
+		fifo_unlock(&streambuf_fifo);
+		return FALSE;
+	}
+
+	/* drop anything the decoder left of the current track, and the
+	 * start of the next track if its decoder has already read it.
+	 */
+	streambuf_fifo.rptr = prepared ? streambuf_next_rptr : streambuf_next_ptr;
+	streambuf_next_pending = FALSE;
+	streambuf_next_seek_failed = FALSE;
+
+	streambuf_copyright = FALSE;
+	streambuf_filter = streambuf_pending_filter;
+	streambuf_pending_filter = NULL;
+
+	if (streambuf_filter == streambuf_icy_filter) {
+		icy_meta_interval = icy_next_interval;
+		icy_meta_remaining = icy_meta_interval;
+	}
+
+	/* wake the reader thread, it may be waiting for space */
+	fifo_signal(&streambuf_fifo);
+
+	fifo_unlock(&streambuf_fifo);
+
+	return TRUE;
+}
+
+
+struct stream {
+	socket_t fd;
+	int num_crlf;
+
+	/* save http headers or body */
+	u8_t *body;
+	int body_len;
+
+	/* native reader thread, when running it owns fd */
+	SDL_Thread *reader;
+	bool_t seek;
+	socket_t event_fd[2];
+	volatile bool_t reader_stop;
+	volatile bool_t reader_hold;
+	char *request;
+	size_t request_len;
+
+	/* progress accounting, streambuf locks */
+	bool_t progress_pending;
+	size_t progress_bytes;
+	bool_t reader_done;
+
+	/* proxy clients, the streambuf locks adding clients. each client
+	 * has its own cursor into streambuf_buf, counted from body_start.
+	 */
+	struct stream_proxy {
+		socket_t fd;
+		size_t header_sent;
+		u64_t body_sent;
+	} proxy[STREAM_PROXY_MAX_CLIENTS];
+	int num_proxies;
+	size_t body_start;
+};
+
+struct stream_event {
+	u32_t type;
+	u32_t val;
+};
+
+
+/* accumulate the http response headers, returns the number of bytes used */
+static size_t stream_parse_headers(struct stream *stream, u8_t *buf, size_t n) {
+	u8_t *buf_ptr, *body_ptr;
+
+	stream->body = realloc(stream->body, stream->body_len + n);
+	body_ptr = stream->body + stream->body_len;
+	buf_ptr = buf;
+
+	while (n && stream->num_crlf < 4) {
+		*body_ptr++ = *buf_ptr;
+
+		if (*buf_ptr == '\n' || *buf_ptr == '\r') {
+			stream->num_crlf++;
+		}
+		else {
+			stream->num_crlf = 0;
+		}
+
+		buf_ptr++;
+		n--;
+	}
+
+	stream->body_len = body_ptr - stream->body;
+
+	return buf_ptr - buf;
+}
+
+
+/* returns true if the response headers are for partial content */
+static bool_t stream_is_partial(struct stream *stream) {
+	u8_t *ptr = stream->body, *end = stream->body + stream->body_len;
+
+	/* HTTP/1.x 206 */
+	while (ptr < end && *ptr != ' ') {
+		ptr++;
+	}
+
+	return (end - ptr > 4 && memcmp(ptr, " 206", 4) == 0);
+}
+
+
+static void stream_set_nonblocking(socket_t fd) {
+#if defined(WIN32)
+	u_long iMode = 1;
+	ioctlsocket(fd, FIONBIO, &iMode);
+#else
+	int flags;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	flags |= O_NONBLOCK;
+	fcntl(fd, F_SETFL, flags);
+#endif
+}
+
+
+/* wait until fd is readable (or writable), returns < 0 on error and 0 on timeout */
+static int stream_wait_fd(socket_t fd, bool_t write, Uint32 ms) {
+	fd_set fds;
+	struct timeval tv;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+
+	return select(fd + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tv);
+}
+
+
+static void stream_post_event(struct stream *stream, u32_t type, u32_t val) {
+	struct stream_event event;
+
+	event.type = type;
+	event.val = val;
+
+	send(stream->event_fd[1], (void *)&event, sizeof(event), 0);
+}
+
+
+/* wait until rfd is readable or any of wfds is writable, returns > 0 if
+ * rfd is readable, < 0 on error and 0 otherwise.
+ */
+static int stream_wait_io(socket_t rfd, socket_t *wfds, int nwfds, Uint32 ms) {
+	fd_set rset, wset;
+	struct timeval tv;
+	socket_t maxfd = 0;
+	int i, r;
+
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+
+	if (rfd != INVALID_SOCKET) {
+		FD_SET(rfd, &rset);
+		maxfd = rfd;
+	}
+	for (i = 0; i < nwfds; i++) {
+		FD_SET(wfds[i], &wset);
+		if (wfds[i] > maxfd) {
+			maxfd = wfds[i];
+		}
+	}
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+
+	r = select(maxfd + 1, &rset, &wset, NULL, &tv);
+	if (r <= 0) {
+		return r;
+	}
+
+	return (rfd != INVALID_SOCKET && FD_ISSET(rfd, &rset)) ? 1 : 0;
+}
+
+
+static void stream_proxy_close(struct stream *stream, int i, const char *reason) {
+	if (reason) {
+		LOG_WARN(log_audio_decode, "proxy client %d closed: %s", i, reason);
+	}
+
+	CLOSESOCKET(stream->proxy[i].fd);
+
+	stream->num_proxies--;
+	stream->proxy[i] = stream->proxy[stream->num_proxies];
+}
+
+
+/* write pending data to the proxy clients, straight from the streambuf.
+ * returns true if any client still has data pending.
+ */
+static bool_t stream_proxy_pump(struct stream *stream) {
+	struct stream_proxy *p;
+	u8_t discard[256];
+	size_t lag, pos, len;
+	ssize_t n;
+	bool_t pending = FALSE;
+	int i;
+
+	ASSERT_FIFO_LOCKED(&streambuf_fifo);
+
+	if (stream->num_crlf < 4) {
+		/* nothing to send until we have the headers */
+		return FALSE;
+	}
+
+	for (i = stream->num_proxies - 1; i >= 0; i--) {
+		p = &stream->proxy[i];
+
+		/* discard the client's request, so closing sends a fin */
+		while (recv(p->fd, discard, sizeof(discard), 0) > 0) {
+		}
+
+		/* http headers first */
+		if (p->header_sent < (size_t)stream->body_len) {
+			n = send(p->fd, stream->body + p->header_sent, stream->body_len - p->header_sent,
+#ifdef MSG_NOSIGNAL
+				 MSG_NOSIGNAL
+#else
+				 0
+#endif
+				 );
+			if (n < 0) {
+				if (SOCKETERROR != EAGAIN) {
+					stream_proxy_close(stream, i, strerror(SOCKETERROR));
+				}
+				else {
+					pending = TRUE;
+				}
+				continue;
+			}
+
+			p->header_sent += n;
+			if (p->header_sent < (size_t)stream->body_len) {
+				pending = TRUE;
+				continue;
+			}
+		}
+
+		lag = streambuf_bytes_received - p->body_sent;
+		if (lag == 0) {
+			continue;
+		}
+
+		pos = (stream->body_start + p->body_sent) % STREAMBUF_SIZE;
+		len = STREAMBUF_SIZE - pos;
+		if (len > lag) {
+			len = lag;
+		}
+
+#if defined(WIN32)
+		n = send(p->fd, streambuf_buf + pos, len, 0);
+#else
+		{
+			/* both sides of the wrap in one call */
+			struct iovec iov[2];
+			struct msghdr msg;
+
+			iov[0].iov_base = streambuf_buf + pos;
+			iov[0].iov_len = len;
+			iov[1].iov_base = streambuf_buf;
+			iov[1].iov_len = lag - len;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = (lag > len) ? 2 : 1;
+
+			n = sendmsg(p->fd, &msg,
+#ifdef MSG_NOSIGNAL
+				    MSG_NOSIGNAL
+#else
+				    0
+#endif
+				    );
+		}
+#endif
+		if (n < 0) {
+			if (SOCKETERROR != EAGAIN) {
+				stream_proxy_close(stream, i, strerror(SOCKETERROR));
+			}
+			else {
+				pending = TRUE;
+			}
+			continue;
+		}
+
+		p->body_sent += n;
+		if ((size_t)n < lag) {
+			pending = TRUE;
+		}
+	}
+
+	return pending;
+}
+
+
+/* evict clients that would be overwritten by the next len bytes */
+static void stream_proxy_evict(struct stream *stream, size_t len) {
+	int i;
+
+	ASSERT_FIFO_LOCKED(&streambuf_fifo);
+
+	for (i = stream->num_proxies - 1; i >= 0; i--) {
+		if (streambuf_bytes_received - stream->proxy[i].body_sent + len > STREAM_PROXY_MAX_LAG) {
+			stream_proxy_close(stream, i, "too slow");
+		}
+	}
+}
+
+
+static int stream_proxy_fds(struct stream *stream, socket_t *fds) {
+	int i;
+
+	for (i = 0; i < stream->num_proxies; i++) {
+		fds[i] = stream->proxy[i].fd;
+	}
+
+	return stream->num_proxies;
+}
+
+
+/* end of stream, let the clients drain before closing them */
+static void stream_proxy_drain(struct stream *stream) {
+	socket_t wfds[STREAM_PROXY_MAX_CLIENTS];
+	Uint32 start = jive_jiffies();
+	int nwfds;
+
+	ASSERT_FIFO_LOCKED(&streambuf_fifo);
+
+	while (!stream->reader_stop && stream_proxy_pump(stream)) {
+		if (jive_jiffies() - start > STREAM_PROXY_DRAIN_TIMEOUT) {
+			break;
+		}
+
+		nwfds = stream_proxy_fds(stream, wfds);
+
+		fifo_unlock(&streambuf_fifo);
+		stream_wait_io(INVALID_SOCKET, wfds, nwfds, STREAM_POLL_INTERVAL);
+		fifo_lock(&streambuf_fifo);
+	}
+
+	while (stream->num_proxies) {
+		stream_proxy_close(stream, 0, stream_proxy_pump(stream) ? "drain timeout" : NULL);
+	}
+}
+
+
+/* reader thread: completes the connect, sends the request and fills the
+ * streambuf at network speed. lua is told about progress, the http headers
+ * and the end of stream over the event socket.
+ */
+static int stream_reader_run(struct stream *stream) {
+	socket_t wfds[STREAM_PROXY_MAX_CLIENTS];
+	u8_t buf[1024];
+	Uint32 start;
+	size_t len, n, flush_count;
+	ssize_t r;
+	int err = 0, nwfds;
+	bool_t pending, can_read;
+
+	/* wait for the non-blocking connect, then send the request */
+	start = jive_jiffies();
+	len = 0;
+	while (len < stream->request_len) {
+		if (stream->reader_stop) {
+			return 0;
+		}
+
+		if (jive_jiffies() - start > STREAM_CONNECT_TIMEOUT) {
+			err = ETIMEDOUT;
+			goto stream_error;
+		}
+
+		if (stream_wait_fd(stream->fd, TRUE, STREAM_POLL_INTERVAL) <= 0) {
+			continue;
+		}
+
+		r = send(stream->fd, stream->request + len, stream->request_len - len, 0);
+		if (r < 0) {
+			err = SOCKETERROR;
+			if (err == EAGAIN || err == EINPROGRESS) {
+				continue;
+			}
+			goto stream_error;
+		}
+		len += r;
+	}
+
+	/* http headers */
+	while (stream->num_crlf < 4) {
+		if (stream->reader_stop) {
+			return 0;
+		}
+
+		if (stream_wait_fd(stream->fd, FALSE, STREAM_POLL_INTERVAL) <= 0) {
+			continue;
+		}
+
+		r = recv(stream->fd, buf, sizeof(buf), 0);
+		if (r == 0) {
+			goto stream_closed;
+		}
+		if (r < 0) {
+			err = SOCKETERROR;
+			if (err == EAGAIN) {
+				continue;
+			}
+			goto stream_error;
+		}
+
+		n = stream_parse_headers(stream, buf, r);
+		if (stream->num_crlf == 4) {
+			if (stream->seek) {
+				/* the server has already had the headers, a
+				 * seek needs partial content from the offset
+				 */
+				if (!stream_is_partial(stream)) {
+					LOG_WARN(log_audio_decode, "stream seek not supported by server");
+
+					fifo_lock(&streambuf_fifo);
+					streambuf_seek_state = STREAMBUF_SEEK_FAILED;
+					fifo_unlock(&streambuf_fifo);
+					goto stream_closed;
+				}
+			}
+			else {
+				stream_post_event(stream, STREAM_EVENT_HEADERS, stream->body_len);
+			}
+
+			fifo_lock(&streambuf_fifo);
+			streambuf_lptr = streambuf_fifo.wptr;
+			stream->body_start = streambuf_fifo.wptr;
+			if (stream->seek) {
+				streambuf_streaming = TRUE;
+				streambuf_seek_state = STREAMBUF_SEEK_NONE;
+			}
+			fifo_unlock(&streambuf_fifo);
+
+			streambuf_feedL(buf + n, r - n, NULL);
+		}
+	}
+
+	/* body */
+	fifo_lock(&streambuf_fifo);
+
+	streambuf_streaming = TRUE;
+
+	while (!stream->reader_stop) {
+		pending = stream_proxy_pump(stream);
+
+		/* while held the body is left in the socket, so synced
+		 * players that connect late still get the stream from the
+		 * start.
+		 */
+		n = fifo_bytes_free(&streambuf_fifo);
+		can_read = (n >= 4096) && !stream->reader_hold;
+
+		if (!can_read && !pending) {
+			/* wait for the decoder to make space */
+			fifo_wait_timeout(&streambuf_fifo, STREAM_POLL_INTERVAL);
+			continue;
+		}
+
+		len = fifo_bytes_until_wptr_wrap(&streambuf_fifo);
+		if (len > n) {
+			len = n;
+		}
+
+		if (can_read) {
+			stream_proxy_evict(stream, len);
+		}
+
+		nwfds = pending ? stream_proxy_fds(stream, wfds) : 0;
+
+		/* don't hold the streambuf lock while waiting on the network,
+		 * the decoder only touches data between rptr and wptr.
+		 */
+		n = streambuf_fifo.wptr;
+		flush_count = streambuf_flush_count;
+		fifo_unlock(&streambuf_fifo);
+
+		if (stream_wait_io(can_read ? stream->fd : INVALID_SOCKET, wfds, nwfds, STREAM_POLL_INTERVAL) <= 0) {
+			fifo_lock(&streambuf_fifo);
+			continue;
+		}
 
-			icy_meta_remaining = -16 * len;
-			if (!icy_meta_remaining) {
-				/* it's a zero length metadata, reset to the next interval */
-				icy_meta_remaining = icy_meta_interval;
-			}
+		r = recv(stream->fd, streambuf_buf + n, len, 0);
+		if (r < 0) {
+			err = SOCKETERROR;
 		}
-		else {
-			/* we're reading the metadata */
-			u8_t *icy_buf;
-			size_t icy_len = -icy_meta_remaining;
 
-			if (avail < icy_len) {
-				/* wait for more data */
-				break;
+		fifo_lock(&streambuf_fifo);
+
+		if (r == 0) {
+			streambuf_streaming = FALSE;
+			stream_proxy_drain(stream);
+			fifo_unlock(&streambuf_fifo);
+			goto stream_closed;
+		}
+		if (r < 0) {
+			if (err == EAGAIN) {
+				continue;
 			}
+			streambuf_streaming = FALSE;
+			fifo_unlock(&streambuf_fifo);
+			goto stream_error;
+		}
 
-			icy_buf = alloca(icy_len);
-			r = streambuf_fast_read(icy_buf, icy_len, icy_len, NULL);
-			assert(r == icy_len);
-			LOG_DEBUG(log_audio_decode, "got icy metadata: %s", (char *) icy_buf);
+		if (flush_count != streambuf_flush_count) {
+			/* streambuf was flushed during the read, drop the data */
+			continue;
+		}
 
-			decode_queue_metadata(SHOUTCAST, icy_buf, icy_len);
+		fifo_wptr_incby(&streambuf_fifo, r);
+		streambuf_bytes_received += r;
 
-			icy_meta_remaining = icy_meta_interval;
+		/* coalesce progress events until lua has seen the last one */
+		stream->progress_bytes += r;
+		if (!stream->progress_pending) {
+			stream->progress_pending = TRUE;
+			stream_post_event(stream, STREAM_EVENT_PROGRESS, 0);
 		}
-
-		avail = fifo_bytes_used(&streambuf_fifo);
 	}
 
-	return n;
+	fifo_unlock(&streambuf_fifo);
+	return 0;
+
+ stream_closed:
+	stream_post_event(stream, STREAM_EVENT_CLOSED, 0);
+	return 0;
+
+ stream_error:
+	LOG_WARN(log_audio_decode, "stream reader error %s", strerror(err));
+	stream_post_event(stream, STREAM_EVENT_ERROR, err);
+	return 0;
 }
 
 
-bool_t streambuf_is_icy()
-{
-	return streambuf_filter == streambuf_icy_filter;
+static int stream_reader_thread(void *ptr) {
+	struct stream *stream = (struct stream *)ptr;
+
+	stream_reader_run(stream);
+
+	fifo_lock(&streambuf_fifo);
+	stream->reader_done = TRUE;
+	fifo_unlock(&streambuf_fifo);
+
+	return 0;
 }
 
 
-struct stream {
-	socket_t fd;
-	int num_crlf;
+static void stream_reader_stop(struct stream *stream) {
+	if (!stream->reader) {
+		return;
+	}
 
-	/* save http headers or body */
-	u8_t *body;
-	int body_len;
-};
+	stream->reader_stop = TRUE;
+
+	fifo_lock(&streambuf_fifo);
+	fifo_signal(&streambuf_fifo);
+	fifo_unlock(&streambuf_fifo);
+
+	SDL_WaitThread(stream->reader, NULL);
+	stream->reader = NULL;
+
+	CLOSESOCKET(stream->event_fd[0]);
+	CLOSESOCKET(stream->event_fd[1]);
+
+	free(stream->request);
+	stream->request = NULL;
+	stream->request_len = 0;
+
+	while (stream->num_proxies) {
+		stream_proxy_close(stream, 0, NULL);
+	}
+}
 
 
 static int stream_load_loopL(lua_State *L) {
@@ -476,14 +1304,32 @@ static int stream_connectL(lua_State *L) {
 	 * 1: self
 	 * 2: server_ip
 	 * 3: server_port
+	 * 4: next track, stream behind the current track
 	 */
 
 	struct sockaddr_in serv_addr;
 	struct stream *stream;
+	bool_t next;
 	int flags;
 	int err;
 	socket_t fd;
 
+	next = lua_toboolean(L, 4);
+	if (next) {
+		bool_t busy;
+
+		/* the current track must have been received */
+		fifo_lock(&streambuf_fifo);
+		busy = streambuf_streaming || streambuf_loop || streambuf_next_pending;
+		fifo_unlock(&streambuf_fifo);
+
+		if (busy) {
+			lua_pushnil(L);
+			lua_pushstring(L, "stream busy");
+			return 2;
+		}
+	}
+
 	/* Server address and port */
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	if (lua_type(L, 2) == LUA_TSTRING) {
@@ -543,10 +1389,26 @@ static int stream_connectL(lua_State *L) {
 
 	fifo_lock(&streambuf_fifo);
 
+	if (next) {
+		streambuf_next_pending = TRUE;
+		streambuf_next_ptr = streambuf_fifo.wptr;
+		streambuf_next_rptr = streambuf_next_ptr;
+		streambuf_next_seek_failed = FALSE;
+	}
+
 	streambuf_loop = FALSE;
 	streambuf_bytes_received = 0;
-	streambuf_copyright = FALSE;
-	streambuf_filter = streambuf_next_filter;
+	streambuf_stream_offset = 0;
+	streambuf_ranged = FALSE;
+
+	if (streambuf_next_pending) {
+		/* the current track keeps its state until the decoder switches */
+		streambuf_pending_filter = streambuf_next_filter;
+	}
+	else {
+		streambuf_copyright = FALSE;
+		streambuf_filter = streambuf_next_filter;
+	}
 	streambuf_next_filter = NULL;
 
 	fifo_unlock(&streambuf_fifo);
@@ -564,6 +1426,9 @@ static int stream_disconnectL(lua_State *L) {
 
 	stream = lua_touserdata(L, 1);
 
+	/* join the reader before releasing anything it uses */
+	stream_reader_stop(stream);
+
 	if (stream->body) {
 		free(stream->body);
 		stream->body = NULL;
@@ -594,7 +1459,11 @@ static int stream_getfdL(lua_State *L) {
 
 	stream = lua_touserdata(L, 1);
 
-	if (stream->fd > 0) {
+	if (stream->reader) {
+		/* the reader thread owns the socket, lua waits for events */
+		lua_pushinteger(L, stream->event_fd[0]);
+	}
+	else if (stream->fd > 0) {
 		lua_pushinteger(L, stream->fd);
 	}
 	else {
@@ -604,11 +1473,56 @@ static int stream_getfdL(lua_State *L) {
 }
 
 
+/* handle one event from the reader thread, with the same results as a read */
+static int stream_read_eventL(lua_State *L, struct stream *stream) {
+	struct stream_event event;
+	ssize_t n;
+
+	n = recv(stream->event_fd[0], (void *)&event, sizeof(event), 0);
+	if (n != sizeof(event)) {
+		/* no event pending */
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	switch (event.type) {
+	case STREAM_EVENT_PROGRESS:
+		fifo_lock(&streambuf_fifo);
+		n = stream->progress_bytes;
+		stream->progress_bytes = 0;
+		stream->progress_pending = FALSE;
+		fifo_unlock(&streambuf_fifo);
+
+		lua_pushinteger(L, n);
+		return 1;
+
+	case STREAM_EVENT_HEADERS:
+		/* Send headers to SqueezeCenter */
+		lua_getfield(L, 2, "_streamHttpHeaders");
+		lua_pushvalue(L, 2);
+		lua_pushlstring(L, (char *)stream->body, event.val);
+		lua_call(L, 2, 0);
+
+		lua_pushboolean(L, TRUE);
+		return 1;
+
+	case STREAM_EVENT_CLOSED:
+		lua_pushboolean(L, FALSE);
+		return 1;
+
+	case STREAM_EVENT_ERROR:
+	default:
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(event.val));
+		return 2;
+	}
+}
+
+
 static int stream_readL(lua_State *L) {
 	struct stream *stream;
 	u8_t buf[1024];
-	u8_t *buf_ptr, *body_ptr;
-	size_t header_len;
+	u8_t *buf_ptr;
 	ssize_t n;
 
 	/*
@@ -618,6 +1532,10 @@ static int stream_readL(lua_State *L) {
 
 	stream = lua_touserdata(L, 1);
 
+	if (stream->reader) {
+		return stream_read_eventL(L, stream);
+	}
+
 
 	/* shortcut, just read to streambuf */
 	if (stream->num_crlf == 4) {
@@ -675,43 +1593,26 @@ static int stream_readL(lua_State *L) {
 
 	/* read http header */
 	if (stream->num_crlf < 4) {
-		stream->body = realloc(stream->body, stream->body_len + n);
-		body_ptr = stream->body + stream->body_len;
-		stream->body_len += n;
-
-		while (n) {
-			*body_ptr++ = *buf_ptr;
-
-			if (*buf_ptr == '\n' || *buf_ptr == '\r') {
-				stream->num_crlf++;
-			}
-			else {
-				stream->num_crlf = 0;
-			}
-
-			buf_ptr++;
-			n--;
-
-			if (stream->num_crlf == 4) {
-				header_len = body_ptr - stream->body;
+		size_t header_used = stream_parse_headers(stream, buf_ptr, n);
 
-				//LOG_DEBUG(log_audio_decode, "headers %d %*s\n", header_len, header_len, stream->body);
+		buf_ptr += header_used;
+		n -= header_used;
 
-				/* Send headers to SqueezeCenter */
-				lua_getfield(L, 2, "_streamHttpHeaders");
-				lua_pushvalue(L, 2);
-				lua_pushlstring(L, (char *)stream->body, header_len);
-				lua_call(L, 2, 0);
+		if (stream->num_crlf == 4) {
+			//LOG_DEBUG(log_audio_decode, "headers %d %*s\n", stream->body_len, stream->body_len, stream->body);
 
-				/* do not free the header here - leave it to disconnect -
-				 * so that it can be used by the proxy code
-				 */
+			/* Send headers to SqueezeCenter */
+			lua_getfield(L, 2, "_streamHttpHeaders");
+			lua_pushvalue(L, 2);
+			lua_pushlstring(L, (char *)stream->body, stream->body_len);
+			lua_call(L, 2, 0);
 
-				/* Send headers to proxy clients */
-				proxy_chunk(stream->body, header_len, L);
+			/* do not free the header here - leave it to disconnect -
+			 * so that it can be used by the proxy code
+			 */
 
-				break;
-			}
+			/* Send headers to proxy clients */
+			proxy_chunk(stream->body, stream->body_len, L);
 		}
 	}
 
@@ -741,6 +1642,12 @@ static int stream_writeL(lua_State *L) {
 	stream = lua_touserdata(L, 1);
 	header = lua_tolstring(L, 3, &len);
 
+	if (stream->reader) {
+		/* the reader thread has sent the request */
+		lua_pushboolean(L, TRUE);
+		return 1;
+	}
+
 	while (len > 0) {
 		n = send(stream->fd, header, len, 0);
 
@@ -770,6 +1677,154 @@ static int stream_writeL(lua_State *L) {
 }
 
 
+static int stream_start_readerL(lua_State *L) {
+	struct stream *stream;
+	const char *request;
+	size_t len;
+	bool_t seek;
+
+	/*
+	 * 1: Stream (self)
+	 * 2: request header
+	 * 3: seek, the request is for the offset the decoder asked for
+	 * 4: hold, don't read the body until releaseReader is called
+	 */
+
+	stream = lua_touserdata(L, 1);
+	request = luaL_checklstring(L, 2, &len);
+	seek = lua_toboolean(L, 3);
+
+	if (stream->reader || stream->num_crlf) {
+		return luaL_error(L, "stream already reading");
+	}
+
+	if (seek) {
+		fifo_lock(&streambuf_fifo);
+
+		if (streambuf_seek_state != STREAMBUF_SEEK_CONNECTING) {
+			fifo_unlock(&streambuf_fifo);
+			return luaL_error(L, "no stream seek requested");
+		}
+
+		/* drop the data from before the seek */
+		streambuf_fifo.rptr = 0;
+		streambuf_fifo.wptr = 0;
+		streambuf_flush_count++;
+
+		streambuf_bytes_received = 0;
+		streambuf_stream_offset = streambuf_seek_offset;
+
+		fifo_unlock(&streambuf_fifo);
+	}
+	stream->seek = seek;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, stream->event_fd) < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(SOCKETERROR));
+		return 2;
+	}
+	stream_set_nonblocking(stream->event_fd[0]);
+
+	stream->request = malloc(len);
+	memcpy(stream->request, request, len);
+	stream->request_len = len;
+
+	stream->reader_stop = FALSE;
+	stream->reader_hold = lua_toboolean(L, 4);
+	stream->progress_pending = FALSE;
+	stream->progress_bytes = 0;
+	stream->reader_done = FALSE;
+	stream->num_proxies = 0;
+
+	stream->reader = SDL_CreateThread(stream_reader_thread, stream);
+	if (!stream->reader) {
+		CLOSESOCKET(stream->event_fd[0]);
+		CLOSESOCKET(stream->event_fd[1]);
+		free(stream->request);
+		stream->request = NULL;
+
+		lua_pushnil(L);
+		lua_pushstring(L, SDL_GetError());
+		return 2;
+	}
+
+	lua_pushboolean(L, TRUE);
+	return 1;
+}
+
+
+static int stream_release_readerL(lua_State *L) {
+	struct stream *stream;
+
+	/*
+	 * 1: Stream (self)
+	 */
+
+	stream = lua_touserdata(L, 1);
+
+	fifo_lock(&streambuf_fifo);
+	stream->reader_hold = FALSE;
+	fifo_signal(&streambuf_fifo);
+	fifo_unlock(&streambuf_fifo);
+
+	return 0;
+}
+
+
+#if !defined(WIN32)
+static int stream_add_proxyL(lua_State *L) {
+	struct stream *stream;
+	socket_t fd;
+
+	/*
+	 * 1: Stream (self)
+	 * 2: proxy client fd, the stream uses its own copy
+	 */
+
+	stream = lua_touserdata(L, 1);
+
+	fifo_lock(&streambuf_fifo);
+
+	if (!stream->reader || stream->reader_done) {
+		fifo_unlock(&streambuf_fifo);
+
+		lua_pushnil(L);
+		lua_pushstring(L, "stream closed");
+		return 2;
+	}
+
+	if (stream->num_proxies == STREAM_PROXY_MAX_CLIENTS
+	    || (streambuf_bytes_received > STREAM_PROXY_MAX_LAG)) {
+		fifo_unlock(&streambuf_fifo);
+
+		lua_pushnil(L);
+		lua_pushstring(L, "too many clients or client too late");
+		return 2;
+	}
+
+	fd = dup(luaL_checkinteger(L, 2));
+	if (fd < 0) {
+		fifo_unlock(&streambuf_fifo);
+
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(SOCKETERROR));
+		return 2;
+	}
+	stream_set_nonblocking(fd);
+
+	stream->proxy[stream->num_proxies].fd = fd;
+	stream->proxy[stream->num_proxies].header_sent = 0;
+	stream->proxy[stream->num_proxies].body_sent = 0;
+	stream->num_proxies++;
+
+	fifo_unlock(&streambuf_fifo);
+
+	lua_pushboolean(L, TRUE);
+	return 1;
+}
+#endif
+
+
 static int stream_proxyWriteL(lua_State *L) {
 	struct stream *stream;
 	struct chunk *chunk;
@@ -934,10 +1989,71 @@ static int stream_icy_metaintervalL(lua_State *L) {
 
 	fifo_lock(&streambuf_fifo);
 
-	streambuf_filter = streambuf_icy_filter;
+	if (streambuf_next_pending) {
+		streambuf_pending_filter = streambuf_icy_filter;
+		icy_next_interval = lua_tointeger(L, 2);
+	}
+	else {
+		streambuf_filter = streambuf_icy_filter;
+
+		icy_meta_interval = lua_tointeger(L, 2);
+		icy_meta_remaining = icy_meta_interval;
+	}
+
+	fifo_unlock(&streambuf_fifo);
+
+	return 0;
+}
+
+
+static int stream_seek_requestL(lua_State *L) {
+	u64_t offset;
+
+	/*
+	 * 1: Stream (self)
+	 *
+	 * returns the offset the decoder wants the stream from, or nil. the
+	 * seek is then made by starting a reader with the seek flag, or
+	 * cancelled.
+	 */
+
+	fifo_lock(&streambuf_fifo);
+
+	if (streambuf_seek_state != STREAMBUF_SEEK_REQUESTED) {
+		fifo_unlock(&streambuf_fifo);
+		return 0;
+	}
+
+	streambuf_seek_state = STREAMBUF_SEEK_CONNECTING;
+	offset = streambuf_seek_offset;
+
+	fifo_unlock(&streambuf_fifo);
+
+	lua_pushnumber(L, (lua_Number)offset);
+	return 1;
+}
+
+
+static int stream_set_rangedL(lua_State *L) {
+	/*
+	 * 1: Stream (self)
+	 * 2: true if the stream can be fetched again from an offset
+	 */
+
+	fifo_lock(&streambuf_fifo);
+	streambuf_ranged = lua_toboolean(L, 2);
+	fifo_unlock(&streambuf_fifo);
+
+	return 0;
+}
+
+
+static int stream_cancel_seekL(lua_State *L) {
+	fifo_lock(&streambuf_fifo);
 
-	icy_meta_interval = lua_tointeger(L, 2);
-	icy_meta_remaining = icy_meta_interval;
+	if (streambuf_seek_state != STREAMBUF_SEEK_NONE) {
+		streambuf_seek_state = STREAMBUF_SEEK_FAILED;
+	}
 
 	fifo_unlock(&streambuf_fifo);
 
@@ -952,6 +2068,9 @@ static const struct luaL_Reg stream_f[] = {
 	{ "markLoop", stream_mark_loopL },
 	{ "icyMetaInterval", stream_icy_metaintervalL },
 	{ "proxyWrite", stream_proxyWriteL },
+	{ "seekRequest", stream_seek_requestL },
+	{ "cancelSeek", stream_cancel_seekL },
+	{ "setRanged", stream_set_rangedL },
 	{ NULL, NULL }
 };
 
@@ -961,6 +2080,11 @@ static const struct luaL_Reg stream_m[] = {
 	{ "getfd", stream_getfdL },
 	{ "read", stream_readL },
 	{ "write", stream_writeL },
+	{ "startReader", stream_start_readerL },
+	{ "releaseReader", stream_release_readerL },
+#if !defined(WIN32)
+	{ "addProxy", stream_add_proxyL },
+#endif
 	{ "feedFromLua", stream_feedfromL },
 	{ "readToLua", stream_readtoL },
 	{ "readToNull", stream_readtonullL },
@@ -54,4 +54,42 @@ extern void streambuf_set_filter(streambuf_filter_t filter);
 
 extern bool_t streambuf_is_icy();
 
+/* switch to the next track in double-buffered mode, returns false if the
+ * next track is not streaming yet. prepared is true if the next track's
+ * decoder has already read from the stream.
+ */
+extern bool_t streambuf_next_track(bool_t prepared);
+
+/* read the next track ahead of the switch, decoder thread only */
+extern bool_t streambuf_next_available(void);
+
+extern void streambuf_select_next(bool_t next);
+
+/* ranged seeks, the decoder asks for the stream from an offset and waits
+ * while the state is requested or connecting. a seek forward within the
+ * buffered data is made immediately, other seeks fail at once unless
+ * Playback.lua has said the stream can be fetched with a Range header.
+ */
+enum streambuf_seek_state {
+	STREAMBUF_SEEK_NONE = 0,
+	STREAMBUF_SEEK_REQUESTED,
+	STREAMBUF_SEEK_CONNECTING,
+	STREAMBUF_SEEK_FAILED,
+};
+
+/* false if the stream is filtered, looping or the next track is already
+ * streaming.
+ */
+extern bool_t streambuf_can_seek(void);
+
+/* true if a seek to offset can be made within the buffered data */
+extern bool_t streambuf_is_buffered(u64_t offset);
+
+/* true if a seek outside the buffered data can fetch the stream */
+extern bool_t streambuf_can_fetch(void);
+
+extern void streambuf_seek(u64_t offset);
+
+extern enum streambuf_seek_state streambuf_get_seek_state(void);
+
 extern int luaopen_streambuf(lua_State *L);
@@ -131,8 +131,17 @@ static inline u32_t jive_jiffies(void)
 	clock_gettime(CLOCK_MONOTONIC, &now);
 	return (now.tv_sec*1000)+(now.tv_nsec/1000000);
 }
+
+static inline Uint64 jive_micros(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((Uint64)now.tv_sec*1000000)+(now.tv_nsec/1000);
+}
 #else
 #define jive_jiffies() SDL_GetTicks()
+#define jive_micros() ((Uint64)SDL_GetTicks()*1000)
 #endif
 
 
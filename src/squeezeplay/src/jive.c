@@ -30,7 +30,11 @@ extern int luaopen_log(lua_State *L);
 extern int luaopen_jive(lua_State *L);
 extern int luaopen_jive_ui_framework(lua_State *L);
 extern int luaopen_jive_net_dns(lua_State *L);
+extern int luaopen_jive_timerqueue(lua_State *L);
+extern int luaopen_jive_taskqueue(lua_State *L);
 extern int luaopen_jive_debug(lua_State *L);
+extern int luaopen_jive_bundle(lua_State *L);
+extern int luaopen_jive_stringtable(lua_State *L);
 
 /* LUA_DEFAULT_SCRIPT
 ** The default script this program runs, unless another script is given
@@ -80,6 +84,10 @@ static void squeezeplay_openlibs(lua_State *L) {
 	lua_setfield(L, -2, "JIVE_VERSION");
 	lua_setglobal(L, "jive");
 
+	// precompiled lua modules, before anything is required
+	lua_pushcfunction(L, luaopen_jive_bundle);
+	lua_call(L, 0, 0);
+
 	// jive lua extensions
 	lua_pushcfunction(L, luaopen_jive);
 	lua_call(L, 0, 0);
@@ -87,12 +95,21 @@ static void squeezeplay_openlibs(lua_State *L) {
 	lua_pushcfunction(L, luaopen_jive_ui_framework);
 	lua_call(L, 0, 0);
 
+	lua_pushcfunction(L, luaopen_jive_timerqueue);
+	lua_call(L, 0, 0);
+
+	lua_pushcfunction(L, luaopen_jive_taskqueue);
+	lua_call(L, 0, 0);
+
 	lua_pushcfunction(L, luaopen_jive_net_dns);
 	lua_call(L, 0, 0);
 
 	lua_pushcfunction(L, luaopen_jive_debug);
 	lua_call(L, 0, 0);
 
+	lua_pushcfunction(L, luaopen_jive_stringtable);
+	lua_call(L, 0, 0);
+
 	lua_pushcfunction(L, luaopen_decode);
 	lua_call(L, 0, 0);
 
@@ -541,6 +558,9 @@ int main (int argc, char **argv) {
 	// close state
 	lua_close(L);
 
+	// write any queued log messages
+	log_flush();
+
 	// report status to caller
 	return (status || s.status) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
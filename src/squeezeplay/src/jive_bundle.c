@@ -0,0 +1,520 @@
+/*
+** Copyright 2010 Logitech. All Rights Reserved.
+**
+** This file is licensed under BSD. Please see the LICENSE file for details.
+*/
+
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(WIN32)
+#include <sys/mman.h>
+#endif
+
+
+/* Precompiled Lua bundles.
+ *
+ * At install time the shipped Lua modules are compiled into a bundle file,
+ * see mkbundle. Bundles (*.luab) found in the directories on the Lua path
+ * are mapped into memory, and a loader is added to package.loaders before
+ * the Lua path searcher, so modules in a bundle are loaded without being
+ * read and compiled at each startup.
+ *
+ * The loader walks package.path in order like the path searcher. A module
+ * is loaded from the bundle in its directory only when the source file
+ * there is missing or not newer than the bundle. A source file found
+ * first, or edited after the bundle was made, is left to the searcher.
+ *
+ * Bundle layout, integers are 32 bit little endian:
+ *   magic "JLB1"
+ *   Lua bytecode header of the compiler, 12 bytes
+ *   module count
+ *   index sorted by name: name offset, name length, chunk offset, chunk length
+ *   names and chunks
+ *
+ * A bundle compiled for a different Lua build is ignored. Set
+ * JIVE_NO_BUNDLE in the environment to load the Lua sources instead.
+ */
+
+#define BUNDLE_MAGIC "JLB1"
+#define BUNDLE_HEADER_SIZE 12
+#define BUNDLE_INDEX_OFFSET (4 + BUNDLE_HEADER_SIZE + 4)
+#define BUNDLE_ENTRY_SIZE 16
+
+struct bundle {
+	struct bundle *next;
+	char *path;
+	char *dir;	/* directory on the lua path */
+	const unsigned char *data;
+	size_t size;
+	time_t mtime;
+	Uint32 count;
+};
+
+static struct bundle *bundle_head = NULL;
+
+static LOG_CATEGORY *log_bundle;
+
+
+static inline Uint32 bundle_u32(const unsigned char *ptr) {
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((Uint32)ptr[3] << 24);
+}
+
+
+static int bundle_dump_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	luaL_addlstring((luaL_Buffer *)ud, p, sz);
+	return 0;
+}
+
+
+/* compare the bytecode header with the one written by this interpreter */
+static int bundle_check_header(lua_State *L, const unsigned char *header) {
+	luaL_Buffer b;
+	const char *str;
+	size_t len;
+	int ok;
+
+	luaL_loadstring(L, "");
+	luaL_buffinit(L, &b);
+	lua_dump(L, bundle_dump_writer, &b);
+	luaL_pushresult(&b);
+
+	str = lua_tolstring(L, -1, &len);
+	ok = (len >= BUNDLE_HEADER_SIZE && memcmp(str, header, BUNDLE_HEADER_SIZE) == 0);
+
+	lua_pop(L, 2);
+	return ok;
+}
+
+
+static int bundle_valid(lua_State *L, const unsigned char *data, size_t size) {
+	Uint32 i, count, off, len;
+
+	if (size < BUNDLE_INDEX_OFFSET || memcmp(data, BUNDLE_MAGIC, 4) != 0) {
+		return 0;
+	}
+
+	count = bundle_u32(data + 4 + BUNDLE_HEADER_SIZE);
+	if (count > (size - BUNDLE_INDEX_OFFSET) / BUNDLE_ENTRY_SIZE) {
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		const unsigned char *entry = data + BUNDLE_INDEX_OFFSET + i * BUNDLE_ENTRY_SIZE;
+
+		off = bundle_u32(entry);
+		len = bundle_u32(entry + 4);
+		if (off > size || len > size - off) {
+			return 0;
+		}
+
+		off = bundle_u32(entry + 8);
+		len = bundle_u32(entry + 12);
+		if (off > size || len > size - off) {
+			return 0;
+		}
+	}
+
+	return bundle_check_header(L, data + 4);
+}
+
+
+static void bundle_open(lua_State *L, const char *dir, const char *path) {
+	struct bundle *bundle;
+	unsigned char *data;
+	size_t size;
+	time_t mtime;
+
+	for (bundle = bundle_head; bundle; bundle = bundle->next) {
+		if (strcmp(bundle->path, path) == 0) {
+			return;
+		}
+	}
+
+#if defined(WIN32)
+	{
+		struct stat st;
+		FILE *fp;
+
+		if (stat(path, &st) < 0) {
+			return;
+		}
+		mtime = st.st_mtime;
+
+		fp = fopen(path, "rb");
+		if (!fp) {
+			return;
+		}
+
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+
+		data = malloc(size);
+		if (!data || fread(data, 1, size, fp) != size) {
+			LOG_WARN(log_bundle, "can't read %s", path);
+			free(data);
+			fclose(fp);
+			return;
+		}
+		fclose(fp);
+	}
+#else
+	{
+		struct stat st;
+		int fd;
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+
+		if (fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			return;
+		}
+		size = st.st_size;
+		mtime = st.st_mtime;
+
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (data == MAP_FAILED) {
+			LOG_WARN(log_bundle, "can't map %s: %s", path, strerror(errno));
+			return;
+		}
+	}
+#endif
+
+	if (!bundle_valid(L, data, size)) {
+		LOG_WARN(log_bundle, "ignoring %s, it was not compiled for this Lua", path);
+#if defined(WIN32)
+		free(data);
+#else
+		munmap(data, size);
+#endif
+		return;
+	}
+
+	bundle = malloc(sizeof(struct bundle));
+	bundle->path = strdup(path);
+	bundle->dir = strdup(dir);
+	bundle->data = data;
+	bundle->size = size;
+	bundle->mtime = mtime;
+	bundle->count = bundle_u32(data + 4 + BUNDLE_HEADER_SIZE);
+
+	/* keep the bundles in lua path order */
+	bundle->next = NULL;
+	if (bundle_head) {
+		struct bundle *tail = bundle_head;
+		while (tail->next) {
+			tail = tail->next;
+		}
+		tail->next = bundle;
+	}
+	else {
+		bundle_head = bundle;
+	}
+
+	LOG_INFO(log_bundle, "%s: %d modules", path, (int)bundle->count);
+}
+
+
+/* open the bundles in the directories on package.path */
+static void bundle_scan(lua_State *L) {
+	const char *lpath, *ptr, *end;
+	char *dir, *path;
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "path");
+	lpath = lua_tostring(L, -1);
+
+	dir = alloca(PATH_MAX);
+	path = alloca(PATH_MAX);
+
+	for (ptr = lpath; ptr && *ptr; ptr = (*end) ? end + 1 : end) {
+		DIR *d;
+		struct dirent *entry;
+		const char *mark;
+
+		end = strchr(ptr, ';');
+		if (!end) {
+			end = ptr + strlen(ptr);
+		}
+
+		/* only templates like dir/?.lua */
+		mark = strchr(ptr, '?');
+		if (!mark || mark > end || mark == ptr || mark - ptr >= PATH_MAX
+		    || strncmp(mark, "?.lua", 5) != 0) {
+			continue;
+		}
+
+		memcpy(dir, ptr, mark - ptr);
+		dir[mark - ptr] = '\0';
+
+		d = opendir(dir);
+		if (!d) {
+			continue;
+		}
+
+		while ((entry = readdir(d)) != NULL) {
+			size_t len = strlen(entry->d_name);
+
+			if (len > 5 && strcmp(entry->d_name + len - 5, ".luab") == 0
+			    && strlen(dir) + len < PATH_MAX) {
+				strcpy(path, dir);
+				strcat(path, entry->d_name);
+
+				bundle_open(L, dir, path);
+			}
+		}
+		closedir(d);
+	}
+
+	lua_pop(L, 2);
+}
+
+
+/* find a module in one bundle */
+static const unsigned char *bundle_find(struct bundle *bundle, const char *name, size_t *len) {
+	size_t name_len = strlen(name);
+	Uint32 lo = 0, hi = bundle->count;
+
+	/* binary search of the sorted index */
+	while (lo < hi) {
+		Uint32 mid = (lo + hi) / 2;
+		const unsigned char *entry = bundle->data + BUNDLE_INDEX_OFFSET + mid * BUNDLE_ENTRY_SIZE;
+		const char *ename = (const char *)bundle->data + bundle_u32(entry);
+		Uint32 elen = bundle_u32(entry + 4);
+		int r;
+
+		r = memcmp(name, ename, (name_len < elen) ? name_len : elen);
+		if (r == 0) {
+			r = (name_len > elen) - (name_len < elen);
+		}
+
+		if (r == 0) {
+			*len = bundle_u32(entry + 12);
+			return bundle->data + bundle_u32(entry + 8);
+		}
+		else if (r < 0) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* find a module in the bundles for dir, the source file for the module
+ * in dir is source. returns NULL if the source is newer than the bundle.
+ */
+static const unsigned char *bundle_find_source(const char *dir, size_t dir_len, const char *name, const char *source, size_t *len) {
+	struct bundle *bundle;
+	const unsigned char *chunk;
+	struct stat st;
+
+	for (bundle = bundle_head; bundle; bundle = bundle->next) {
+		if (strlen(bundle->dir) != dir_len || strncmp(bundle->dir, dir, dir_len) != 0) {
+			continue;
+		}
+
+		chunk = bundle_find(bundle, name, len);
+		if (!chunk) {
+			continue;
+		}
+
+		if (stat(source, &st) == 0 && st.st_mtime > bundle->mtime) {
+			LOG_DEBUG(log_bundle, "%s is newer than %s", source, bundle->path);
+			return NULL;
+		}
+
+		return chunk;
+	}
+
+	return NULL;
+}
+
+
+/* find a module in package.path order. the module is pushed as a chunk,
+ * or a message is pushed and NULL returned if the path searcher should
+ * load it.
+ */
+static const unsigned char *bundle_search(lua_State *L, const char *name, size_t *len) {
+	const unsigned char *chunk = NULL;
+	const char *lpath, *ptr, *end, *mark, *modpath, *source;
+	struct stat st;
+	int top = lua_gettop(L);
+
+	modpath = luaL_gsub(L, name, ".", LUA_DIRSEP);
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "path");
+	lpath = lua_tostring(L, -1);
+
+	for (ptr = lpath; ptr && *ptr; ptr = (*end) ? end + 1 : end) {
+		end = strchr(ptr, ';');
+		if (!end) {
+			end = ptr + strlen(ptr);
+		}
+
+		lua_pushlstring(L, ptr, end - ptr);
+		source = luaL_gsub(L, lua_tostring(L, -1), LUA_PATH_MARK, modpath);
+
+		/* bundles are only made for templates like dir/?.lua */
+		mark = strchr(ptr, '?');
+		if (mark && mark + 5 == end && strncmp(mark, "?.lua", 5) == 0) {
+			chunk = bundle_find_source(ptr, mark - ptr, name, source, len);
+			if (chunk) {
+				break;
+			}
+		}
+
+		if (stat(source, &st) == 0) {
+			/* the source comes first */
+			break;
+		}
+
+		lua_pop(L, 2);
+	}
+
+	lua_settop(L, top);
+	return chunk;
+}
+
+
+static int bundle_loader(lua_State *L) {
+	const unsigned char *chunk;
+	const char *name;
+	size_t len;
+
+	/* stack is:
+	 * 1: module name
+	 */
+
+	name = luaL_checkstring(L, 1);
+
+	chunk = bundle_search(L, name, &len);
+	if (!chunk) {
+		lua_pushfstring(L, "\n\tno module " LUA_QS " in bundles", name);
+		return 1;
+	}
+
+	if (luaL_loadbuffer(L, (const char *)chunk, len, name) != 0) {
+		luaL_error(L, "error loading module " LUA_QS " from bundle:\n\t%s",
+			   name, lua_tostring(L, -1));
+	}
+
+	return 1;
+}
+
+
+static int jiveL_bundle_load(lua_State *L) {
+	struct bundle *bundle;
+	const unsigned char *chunk = NULL;
+	const char *name, *path, *modpath;
+	size_t len, dir_len;
+
+	/* stack is:
+	 * 1: module name
+	 * 2: path of the module source
+	 *
+	 * returns the compiled module, or nil and an error. the module is
+	 * only loaded from a bundle in the lua path directory of path, and
+	 * not if the source is newer than the bundle.
+	 */
+
+	name = luaL_checkstring(L, 1);
+	path = luaL_checkstring(L, 2);
+
+	modpath = luaL_gsub(L, name, ".", LUA_DIRSEP);
+	lua_pushstring(L, ".lua");
+	lua_concat(L, 2);
+	modpath = lua_tostring(L, -1);
+
+	for (bundle = bundle_head; bundle && !chunk; bundle = bundle->next) {
+		dir_len = strlen(bundle->dir);
+
+		if (strncmp(path, bundle->dir, dir_len) == 0 && strcmp(path + dir_len, modpath) == 0) {
+			chunk = bundle_find_source(bundle->dir, dir_len, name, path, &len);
+		}
+	}
+	lua_pop(L, 1);
+
+	if (!chunk) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "no module " LUA_QS " in bundles", name);
+		return 2;
+	}
+
+	if (luaL_loadbuffer(L, (const char *)chunk, len, name) != 0) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+
+	return 1;
+}
+
+
+static int jiveL_bundle_paths(lua_State *L) {
+	struct bundle *bundle;
+	int i = 1;
+
+	lua_newtable(L);
+	for (bundle = bundle_head; bundle; bundle = bundle->next) {
+		lua_pushstring(L, bundle->path);
+		lua_rawseti(L, -2, i++);
+	}
+
+	return 1;
+}
+
+
+static const struct luaL_Reg bundle_lib[] = {
+	{ "load", jiveL_bundle_load },
+	{ "paths", jiveL_bundle_paths },
+	{ NULL, NULL }
+};
+
+
+int luaopen_jive_bundle(lua_State *L) {
+	int i, n;
+
+	log_bundle = LOG_CATEGORY_GET("squeezeplay");
+
+	luaL_register(L, "jive.bundle", bundle_lib);
+	lua_pop(L, 1);
+
+	if (getenv("JIVE_NO_BUNDLE")) {
+		return 0;
+	}
+
+	bundle_scan(L);
+	if (!bundle_head) {
+		return 0;
+	}
+
+	/* insert the loader after the preload loader */
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaders");
+
+	n = lua_objlen(L, -1);
+	for (i = n; i >= 2; i--) {
+		lua_rawgeti(L, -1, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	lua_pushcfunction(L, bundle_loader);
+	lua_rawseti(L, -2, 2);
+
+	lua_pop(L, 2);
+
+	return 0;
+}
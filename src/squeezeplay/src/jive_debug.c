@@ -6,7 +6,9 @@
 
 
 #include <time.h>
+#include <signal.h>
 #include "common.h"
+#include "ui/jive.h"
 
 
 static struct log_category *log_debug_hooks;
@@ -105,6 +107,323 @@ static int jiveL_perfhook(lua_State *L) {
 }
 
 
+/* Sampling profiler.
+ *
+ * A count hook takes a sample of the Lua stack every interval VM
+ * instructions. The hook is only called when a sample is due, so the
+ * profiler can be left running on a unit without changing its timing.
+ * Time spent in C functions is not counted. Samples are stored as frame
+ * ids in a ring buffer, and folded into one line per stack for the
+ * flame graph tools when the profile is dumped.
+ *
+ * SIGUSR2 toggles the profiler, when it is stopped by the signal the
+ * profile is written to PROFILE_PATH.
+ */
+
+#define PROFILE_INTERVAL 100000
+#define PROFILE_RING 2048
+#define PROFILE_DEPTH 24
+#define PROFILE_FRAMES 4096
+#define PROFILE_PATH "/tmp/squeezeplay.folded"
+
+struct profile_sample {
+	Uint16 depth;
+	Uint16 frames[PROFILE_DEPTH];
+};
+
+struct profile_frame {
+	Uint32 hash;
+	char *name;
+};
+
+static struct profile_state {
+	lua_State *L;
+	int active;
+	int interval;
+	Uint32 samples;
+	Uint32 head, count;
+	struct profile_sample *ring;
+	struct profile_frame *frames;
+	int nframes;
+} prof;
+
+
+static Uint16 profile_frame_id(lua_Debug *ar) {
+	char name[128], *ptr;
+	Uint32 hash = 2166136261u;
+	int i;
+
+	if (ar->name) {
+		snprintf(name, sizeof(name), "%s (%s:%d)", ar->name, ar->short_src, ar->linedefined);
+	}
+	else if (*ar->what == 'm') {
+		snprintf(name, sizeof(name), "main (%s)", ar->short_src);
+	}
+	else {
+		snprintf(name, sizeof(name), "? (%s:%d)", ar->short_src, ar->linedefined);
+	}
+
+	for (ptr = name; *ptr; ptr++) {
+		if (*ptr == ';') {
+			*ptr = ':';
+		}
+		hash = (hash ^ (Uint8)*ptr) * 16777619u;
+	}
+
+	/* open addressing, id 0 is used when the table is full */
+	i = hash % PROFILE_FRAMES;
+	while (prof.frames[i].name) {
+		if (prof.frames[i].hash == hash && strcmp(prof.frames[i].name, name) == 0) {
+			return i + 1;
+		}
+		i = (i + 1) % PROFILE_FRAMES;
+	}
+
+	if (prof.nframes >= PROFILE_FRAMES - 1) {
+		return 0;
+	}
+
+	prof.frames[i].hash = hash;
+	prof.frames[i].name = strdup(name);
+	prof.nframes++;
+
+	return i + 1;
+}
+
+
+static void profile_hook(lua_State *L, lua_Debug *ar) {
+	struct profile_sample *sample;
+	lua_Debug fr;
+	int level;
+
+	if (!prof.active) {
+		lua_sethook(L, NULL, 0, 0);
+		return;
+	}
+
+	if (ar->event != LUA_HOOKCOUNT) {
+		return;
+	}
+
+	sample = &prof.ring[prof.head];
+	sample->depth = 0;
+
+	for (level = 0; sample->depth < PROFILE_DEPTH && lua_getstack(L, level, &fr); level++) {
+		lua_getinfo(L, "Sn", &fr);
+		sample->frames[sample->depth++] = profile_frame_id(&fr);
+	}
+
+	prof.head = (prof.head + 1) % PROFILE_RING;
+	if (prof.count < PROFILE_RING) {
+		prof.count++;
+	}
+	prof.samples++;
+}
+
+
+static void profile_reset(void) {
+	int i;
+
+	for (i = 0; i < PROFILE_FRAMES; i++) {
+		if (prof.frames[i].name) {
+			free(prof.frames[i].name);
+		}
+	}
+	memset(prof.frames, 0, PROFILE_FRAMES * sizeof(struct profile_frame));
+
+	prof.nframes = 0;
+	prof.head = prof.count = 0;
+	prof.samples = 0;
+}
+
+
+static int profile_start(lua_State *L, int interval) {
+	if (prof.active) {
+		return 1;
+	}
+
+	/* the perf hook is already installed */
+	if (lua_gethook(L) != NULL) {
+		return 0;
+	}
+
+	if (!prof.ring) {
+		prof.ring = malloc(PROFILE_RING * sizeof(struct profile_sample));
+		prof.frames = calloc(PROFILE_FRAMES, sizeof(struct profile_frame));
+
+		if (!prof.ring || !prof.frames) {
+			free(prof.ring);
+			free(prof.frames);
+			prof.ring = NULL;
+			prof.frames = NULL;
+			return 0;
+		}
+	}
+
+	prof.active = 1;
+	prof.interval = interval;
+
+	lua_sethook(L, profile_hook, LUA_MASKCOUNT, interval);
+
+	jive_task_hook_count = interval;
+	jive_task_hook = profile_hook;
+
+	return 1;
+}
+
+
+static void profile_stop(lua_State *L) {
+	if (!prof.active) {
+		return;
+	}
+
+	/* hooks on coroutines remove themselves */
+	prof.active = 0;
+	jive_task_hook = NULL;
+
+	lua_sethook(L, NULL, 0, 0);
+}
+
+
+/* push the folded stacks, one line per stack and its sample count */
+static void profile_fold(lua_State *L) {
+	luaL_Buffer b;
+	Uint32 i, n;
+	int j, top;
+
+	lua_newtable(L);
+	top = lua_gettop(L);
+
+	n = (prof.head + PROFILE_RING - prof.count) % PROFILE_RING;
+	for (i = 0; i < prof.count; i++) {
+		struct profile_sample *sample = &prof.ring[(n + i) % PROFILE_RING];
+
+		/* root first */
+		luaL_buffinit(L, &b);
+		for (j = sample->depth - 1; j >= 0; j--) {
+			Uint16 id = sample->frames[j];
+
+			luaL_addstring(&b, id ? prof.frames[id - 1].name : "?");
+			if (j) {
+				luaL_addchar(&b, ';');
+			}
+		}
+		luaL_pushresult(&b);
+
+		lua_pushvalue(L, -1);
+		lua_rawget(L, top);
+		lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+		lua_remove(L, -2);
+		lua_rawset(L, top);
+	}
+
+	/* one line per stack */
+	lua_newtable(L);
+	n = 0;
+
+	lua_pushnil(L);
+	while (lua_next(L, top) != 0) {
+		lua_pushfstring(L, "%s %d\n", lua_tostring(L, -2), lua_tointeger(L, -1));
+		lua_rawseti(L, top + 1, ++n);
+		lua_pop(L, 1);
+	}
+
+	luaL_buffinit(L, &b);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, top + 1, i);
+		luaL_addvalue(&b);
+	}
+	luaL_pushresult(&b);
+
+	lua_replace(L, top);
+	lua_settop(L, top);
+}
+
+
+static void profile_write(lua_State *L, const char *path) {
+	FILE *fp;
+
+	profile_fold(L);
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		LOG_WARN(log_debug_hooks, "Can't write profile %s", path);
+		lua_pop(L, 1);
+		return;
+	}
+
+	fwrite(lua_tostring(L, -1), 1, lua_objlen(L, -1), fp);
+	fclose(fp);
+
+	LOG_INFO(log_debug_hooks, "Profile %d samples written to %s", prof.samples, path);
+	lua_pop(L, 1);
+}
+
+
+#ifndef _WIN32
+static void profile_signal_hook(lua_State *L, lua_Debug *ar) {
+	lua_sethook(L, NULL, 0, 0);
+
+	if (prof.active) {
+		profile_stop(L);
+		profile_write(L, PROFILE_PATH);
+	}
+	else {
+		if (prof.ring) {
+			profile_reset();
+		}
+		profile_start(L, PROFILE_INTERVAL);
+	}
+}
+
+
+static void profile_signal(int sig) {
+	/* toggle the profiler on the next instruction, as lua.c does */
+	lua_sethook(prof.L, profile_signal_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+#endif
+
+
+/*
+ * Start or stop the sampling profiler. With a number argument the
+ * profiler is started, sampling every that many instructions. With
+ * false it is stopped. Returns true if the profiler is running.
+ */
+static int jiveL_profiler(lua_State *L) {
+	if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+		profile_stop(prof.L);
+	}
+	else {
+		profile_start(prof.L, luaL_optinteger(L, 1, PROFILE_INTERVAL));
+	}
+
+	lua_pushboolean(L, prof.active);
+	return 1;
+}
+
+
+/*
+ * Returns the profile as folded stacks, and the number of samples taken.
+ * If the argument is true the profile is cleared.
+ */
+static int jiveL_profiler_dump(lua_State *L) {
+	if (!prof.ring) {
+		lua_pushstring(L, "");
+		lua_pushinteger(L, 0);
+		return 2;
+	}
+
+	profile_fold(L);
+	lua_pushinteger(L, prof.samples);
+
+	if (lua_toboolean(L, 1)) {
+		profile_reset();
+	}
+
+	return 2;
+}
+
+
 struct heap_state {
 	long number;
 	long integer;
@@ -384,9 +703,196 @@ static int jiveL_heap(lua_State *L) {
 }
 
 
+/* Garbage collector controller.
+ *
+ * The event loop stops the Lua collector and calls gcstep once per frame
+ * with the time left before the next frame is due. The collector is
+ * stepped to pay off the memory allocated since the last call, within
+ * that budget. If it falls behind the budget may be overrun, up to
+ * GC_MAX_PAUSE. When nothing needs drawing a full collection is done
+ * if the heap has grown since the last one.
+ */
+
+/* kbytes of work for each collector step */
+#define GC_STEP_KB 8
+
+/* allowed overrun when the collector is behind */
+#define GC_MAX_PAUSE 20
+#define GC_BEHIND_KB 256
+
+/* heap growth and time between full collections when idle */
+#define GC_FULL_GROWTH_KB 128
+#define GC_FULL_INTERVAL 10000
+
+static struct gc_state {
+	int heap_kb;
+	int peak_kb;
+	int debt_kb;
+	int full_kb;
+	Uint32 full_ticks;
+	Uint32 last_ticks;
+	lua_Number alloc_rate;
+
+	/* statistics */
+	Uint32 steps;
+	Uint32 cycles;
+	Uint32 fulls;
+	Uint32 overruns;
+	Uint64 pause_total;
+	Uint32 pause_max;
+	Uint32 full_max;
+} gc;
+
+
+static int jiveL_gcstep(lua_State *L) {
+	Uint32 now, pause, budget;
+	Uint64 t0;
+	int ms, kb, alloc, idle;
+
+	/* stack is:
+	 * 1: time budget in ms
+	 * 2: idle, true if nothing needs drawing
+	 */
+
+	ms = luaL_optinteger(L, 1, 0);
+	budget = (ms > 0) ? ms * 1000 : 0;
+	idle = lua_toboolean(L, 2);
+
+	now = jive_jiffies();
+	kb = lua_gc(L, LUA_GCCOUNT, 0);
+
+	/* allocation since the last call */
+	alloc = kb - gc.heap_kb;
+	if (alloc < 0) {
+		alloc = 0;
+	}
+	gc.debt_kb += alloc;
+
+	if (gc.last_ticks && now != gc.last_ticks) {
+		gc.alloc_rate = (gc.alloc_rate * 7 + ((lua_Number)alloc * 1000) / (now - gc.last_ticks)) / 8;
+	}
+	gc.last_ticks = now;
+
+	if (kb > gc.peak_kb) {
+		gc.peak_kb = kb;
+	}
+
+	t0 = jive_micros();
+
+	if (idle && kb - gc.full_kb > GC_FULL_GROWTH_KB && now - gc.full_ticks > GC_FULL_INTERVAL) {
+		lua_gc(L, LUA_GCCOLLECT, 0);
+
+		pause = (Uint32)(jive_micros() - t0);
+		if (pause > gc.full_max) {
+			gc.full_max = pause;
+		}
+
+		gc.fulls++;
+		gc.cycles++;
+		gc.debt_kb = 0;
+		gc.full_kb = lua_gc(L, LUA_GCCOUNT, 0);
+		gc.full_ticks = now;
+	}
+	else if (gc.debt_kb > 0) {
+		if (gc.debt_kb > GC_BEHIND_KB && budget < GC_MAX_PAUSE * 1000) {
+			budget = GC_MAX_PAUSE * 1000;
+		}
+
+		do {
+			gc.steps++;
+			gc.debt_kb -= GC_STEP_KB;
+
+			if (lua_gc(L, LUA_GCSTEP, GC_STEP_KB)) {
+				/* cycle finished */
+				gc.cycles++;
+				gc.debt_kb = 0;
+				break;
+			}
+
+			pause = (Uint32)(jive_micros() - t0);
+		} while (gc.debt_kb > 0 && pause < budget);
+
+		pause = (Uint32)(jive_micros() - t0);
+		if (pause > budget) {
+			gc.overruns++;
+		}
+	}
+	else {
+		pause = 0;
+	}
+
+	gc.pause_total += pause;
+	if (pause > gc.pause_max) {
+		gc.pause_max = pause;
+	}
+
+	/* a step restarts the collector, keep it under our control */
+	lua_gc(L, LUA_GCSTOP, 0);
+
+	gc.heap_kb = lua_gc(L, LUA_GCCOUNT, 0);
+
+	return 0;
+}
+
+
+/* Garbage collector statistics, times are in ms and sizes in kbytes */
+static int jiveL_gcstats(lua_State *L) {
+	lua_newtable(L);
+
+	lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0));
+	lua_setfield(L, -2, "heap");
+
+	lua_pushinteger(L, gc.peak_kb);
+	lua_setfield(L, -2, "peak");
+
+	lua_pushinteger(L, gc.full_kb);
+	lua_setfield(L, -2, "live");
+
+	lua_pushnumber(L, gc.alloc_rate);
+	lua_setfield(L, -2, "allocRate");
+
+	lua_pushinteger(L, gc.debt_kb);
+	lua_setfield(L, -2, "debt");
+
+	lua_pushinteger(L, gc.steps);
+	lua_setfield(L, -2, "steps");
+
+	lua_pushinteger(L, gc.cycles);
+	lua_setfield(L, -2, "cycles");
+
+	lua_pushinteger(L, gc.fulls);
+	lua_setfield(L, -2, "fullCollections");
+
+	lua_pushinteger(L, gc.overruns);
+	lua_setfield(L, -2, "overruns");
+
+	lua_pushnumber(L, (lua_Number)gc.pause_total / 1000);
+	lua_setfield(L, -2, "pauseTotal");
+
+	lua_pushnumber(L, (lua_Number)gc.pause_max / 1000);
+	lua_setfield(L, -2, "pauseMax");
+
+	lua_pushnumber(L, (lua_Number)gc.full_max / 1000);
+	lua_setfield(L, -2, "fullMax");
+
+	/* reset peak values */
+	if (lua_toboolean(L, 1)) {
+		gc.peak_kb = 0;
+		gc.pause_max = 0;
+		gc.full_max = 0;
+	}
+
+	return 1;
+}
+
+
 static const struct luaL_Reg debug_funcs[] = {
 	{ "perfhook", jiveL_perfhook },
 	{ "heap", jiveL_heap },
+	{ "gcstep", jiveL_gcstep },
+	{ "gcstats", jiveL_gcstats },
+	{ "profiler", jiveL_profiler },
+	{ "profilerDump", jiveL_profiler_dump },
 	{ NULL, NULL }
 };
 
@@ -394,6 +900,11 @@ static const struct luaL_Reg debug_funcs[] = {
 int luaopen_jive_debug(lua_State *L) {
 	log_debug_hooks = log_category_get("lua.hooks");
 
+	prof.L = L;
+#ifndef _WIN32
+	signal(SIGUSR2, profile_signal);
+#endif
+
 	/* heap history */
 	lua_newtable(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, "heap_debug");
@@ -0,0 +1,373 @@
+/*
+** Copyright 2010 Logitech. All Rights Reserved.
+**
+** This file is licensed under BSD. Please see the LICENSE file for details.
+*/
+
+#include "common.h"
+
+#if !defined(WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+/* Compiled string tables for jive.utils.locale.
+ *
+ * At install time the strings.txt files are compiled into one string
+ * table per locale, see mkstrings. A string table is mapped into memory
+ * and the strings are looked up by token, so the strings.txt files are
+ * not parsed and only the strings for the current locale are loaded.
+ *
+ * String table layout, integers are 32 bit little endian:
+ *   magic "JST1"
+ *   file count
+ *   entry count
+ *   file index sorted by path: path offset, path length, first entry,
+ *     entry count
+ *   entries for each file sorted by token hash: hash, token offset,
+ *     token length, string offset, string length
+ *   interned paths, tokens and strings
+ */
+
+#define STRINGTABLE_MAGIC "JST1"
+#define STRINGTABLE_INDEX_OFFSET 12
+#define STRINGTABLE_FILE_SIZE 16
+#define STRINGTABLE_ENTRY_SIZE 20
+
+struct stringtable {
+	const unsigned char *data;
+	size_t size;
+	Uint32 files;
+	const unsigned char *entries;
+};
+
+
+static inline Uint32 stringtable_u32(const unsigned char *ptr) {
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((Uint32)ptr[3] << 24);
+}
+
+
+/* this must match the hash in mkstrings */
+static Uint32 stringtable_hash(const char *str, size_t len) {
+	Uint32 h = 5381;
+
+	while (len--) {
+		h = (h * 33 + (unsigned char)*str++) % 16777213;
+	}
+	return h;
+}
+
+
+static int stringtable_compare(const char *str, size_t len, const unsigned char *data, const unsigned char *ptr) {
+	const char *other = (const char *)data + stringtable_u32(ptr);
+	Uint32 other_len = stringtable_u32(ptr + 4);
+	int r;
+
+	r = memcmp(str, other, (len < other_len) ? len : other_len);
+	if (r == 0) {
+		r = (len > other_len) - (len < other_len);
+	}
+	return r;
+}
+
+
+static int stringtable_range(size_t size, const unsigned char *ptr) {
+	Uint32 off = stringtable_u32(ptr);
+	Uint32 len = stringtable_u32(ptr + 4);
+
+	return off <= size && len <= size - off;
+}
+
+
+static int stringtable_valid(const unsigned char *data, size_t size) {
+	Uint32 i, files, entries;
+	const unsigned char *ptr;
+
+	if (size < STRINGTABLE_INDEX_OFFSET || memcmp(data, STRINGTABLE_MAGIC, 4) != 0) {
+		return 0;
+	}
+
+	files = stringtable_u32(data + 4);
+	entries = stringtable_u32(data + 8);
+
+	if (files > (size - STRINGTABLE_INDEX_OFFSET) / STRINGTABLE_FILE_SIZE
+	    || entries > (size - STRINGTABLE_INDEX_OFFSET - files * STRINGTABLE_FILE_SIZE) / STRINGTABLE_ENTRY_SIZE) {
+		return 0;
+	}
+
+	for (i = 0; i < files; i++) {
+		Uint32 first, count;
+
+		ptr = data + STRINGTABLE_INDEX_OFFSET + i * STRINGTABLE_FILE_SIZE;
+		first = stringtable_u32(ptr + 8);
+		count = stringtable_u32(ptr + 12);
+
+		if (!stringtable_range(size, ptr) || first > entries || count > entries - first) {
+			return 0;
+		}
+	}
+
+	ptr = data + STRINGTABLE_INDEX_OFFSET + files * STRINGTABLE_FILE_SIZE;
+	for (i = 0; i < entries; i++, ptr += STRINGTABLE_ENTRY_SIZE) {
+		if (!stringtable_range(size, ptr + 4) || !stringtable_range(size, ptr + 12)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+static void stringtable_unmap(struct stringtable *st) {
+	if (!st->data) {
+		return;
+	}
+
+#if defined(WIN32)
+	free((void *)st->data);
+#else
+	munmap((void *)st->data, st->size);
+#endif
+	st->data = NULL;
+}
+
+
+/* find the file index entry for file */
+static const unsigned char *stringtable_file(struct stringtable *st, const char *file, size_t len) {
+	Uint32 lo = 0, hi = st->files;
+
+	while (lo < hi) {
+		Uint32 mid = (lo + hi) / 2;
+		const unsigned char *ptr = st->data + STRINGTABLE_INDEX_OFFSET + mid * STRINGTABLE_FILE_SIZE;
+		int r;
+
+		r = stringtable_compare(file, len, st->data, ptr);
+		if (r == 0) {
+			return ptr;
+		}
+		else if (r < 0) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+
+static int jiveL_stringtable_open(lua_State *L) {
+	struct stringtable *st;
+	const char *path;
+	unsigned char *data;
+	size_t size;
+
+	/* stack is:
+	 * 1: path
+	 *
+	 * returns the string table, or nil and an error.
+	 */
+
+	path = luaL_checkstring(L, 1);
+
+#if defined(WIN32)
+	{
+		FILE *fp = fopen(path, "rb");
+		if (!fp) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't open %s", path);
+			return 2;
+		}
+
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+
+		data = malloc(size);
+		if (!data || fread(data, 1, size, fp) != size) {
+			free(data);
+			fclose(fp);
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't read %s", path);
+			return 2;
+		}
+		fclose(fp);
+	}
+#else
+	{
+		struct stat st;
+		int fd;
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't open %s: %s", path, strerror(errno));
+			return 2;
+		}
+
+		if (fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't stat %s", path);
+			return 2;
+		}
+		size = st.st_size;
+
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (data == MAP_FAILED) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't map %s: %s", path, strerror(errno));
+			return 2;
+		}
+	}
+#endif
+
+	st = lua_newuserdata(L, sizeof(struct stringtable));
+	st->data = data;
+	st->size = size;
+
+	luaL_getmetatable(L, "jive.stringtable");
+	lua_setmetatable(L, -2);
+
+	if (!stringtable_valid(data, size)) {
+		stringtable_unmap(st);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s is not a string table", path);
+		return 2;
+	}
+
+	st->files = stringtable_u32(data + 4);
+	st->entries = data + STRINGTABLE_INDEX_OFFSET + st->files * STRINGTABLE_FILE_SIZE;
+
+	return 1;
+}
+
+
+static struct stringtable *stringtable_check(lua_State *L) {
+	struct stringtable *st = luaL_checkudata(L, 1, "jive.stringtable");
+
+	if (!st->data) {
+		luaL_error(L, "string table is closed");
+	}
+	return st;
+}
+
+
+static int jiveL_stringtable_contains(lua_State *L) {
+	struct stringtable *st;
+	const char *file;
+	size_t len;
+
+	/* stack is:
+	 * 1: string table
+	 * 2: strings file, relative to the lua path
+	 */
+
+	st = stringtable_check(L);
+	file = luaL_checklstring(L, 2, &len);
+
+	lua_pushboolean(L, stringtable_file(st, file, len) != NULL);
+	return 1;
+}
+
+
+static int jiveL_stringtable_lookup(lua_State *L) {
+	struct stringtable *st;
+	const unsigned char *ptr;
+	const char *file, *token;
+	size_t file_len, token_len;
+	Uint32 hash, first, lo, hi;
+
+	/* stack is:
+	 * 1: string table
+	 * 2: strings file, relative to the lua path
+	 * 3: token
+	 *
+	 * returns the string, or nil if the token is not translated.
+	 */
+
+	st = stringtable_check(L);
+	file = luaL_checklstring(L, 2, &file_len);
+	token = luaL_checklstring(L, 3, &token_len);
+
+	ptr = stringtable_file(st, file, file_len);
+	if (!ptr) {
+		return 0;
+	}
+
+	first = stringtable_u32(ptr + 8);
+	lo = first;
+	hi = first + stringtable_u32(ptr + 12);
+
+	/* find the first entry with the hash */
+	hash = stringtable_hash(token, token_len);
+	while (lo < hi) {
+		Uint32 mid = (lo + hi) / 2;
+
+		if (stringtable_u32(st->entries + mid * STRINGTABLE_ENTRY_SIZE) < hash) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	hi = first + stringtable_u32(ptr + 12);
+	for (; lo < hi; lo++) {
+		ptr = st->entries + lo * STRINGTABLE_ENTRY_SIZE;
+
+		if (stringtable_u32(ptr) != hash) {
+			break;
+		}
+
+		if (stringtable_compare(token, token_len, st->data, ptr + 4) == 0) {
+			lua_pushlstring(L, (const char *)st->data + stringtable_u32(ptr + 12), stringtable_u32(ptr + 16));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int jiveL_stringtable_close(lua_State *L) {
+	struct stringtable *st = luaL_checkudata(L, 1, "jive.stringtable");
+
+	stringtable_unmap(st);
+	return 0;
+}
+
+
+static const struct luaL_Reg stringtable_m[] = {
+	{ "__gc", jiveL_stringtable_close },
+	{ "contains", jiveL_stringtable_contains },
+	{ "lookup", jiveL_stringtable_lookup },
+	{ "close", jiveL_stringtable_close },
+	{ NULL, NULL }
+};
+
+
+static const struct luaL_Reg stringtable_lib[] = {
+	{ "open", jiveL_stringtable_open },
+	{ NULL, NULL }
+};
+
+
+int luaopen_jive_stringtable(lua_State *L) {
+	luaL_newmetatable(L, "jive.stringtable");
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	luaL_register(L, NULL, stringtable_m);
+	lua_pop(L, 1);
+
+	luaL_register(L, "jive.stringtable", stringtable_lib);
+	lua_pop(L, 1);
+
+	return 0;
+}
@@ -13,6 +13,7 @@
 #if defined(WIN32)
 #include <winsock2.h>
 #define strcasecmp stricmp
+#define snprintf _snprintf
 #endif
 
 #define LOG_BUFFER_SIZE 512
@@ -22,6 +23,114 @@ static enum log_priority appender_syslog = LOG_PRIORITY_OFF;
 
 static struct log_category *category_head = NULL;
 
+
+/* Asynchronous logging.
+ *
+ * Messages are not formatted or written on the calling thread, the audio
+ * threads must never block on stdout or syslog. Each thread that logs
+ * claims a single producer ring of preallocated records, a record holds
+ * the format string and a copy of the arguments. The writer thread runs
+ * at a low priority, it formats the records and writes them in the order
+ * they were logged. When a ring is full the message is dropped and
+ * counted, except on the main thread which waits for the writer instead.
+ *
+ * Threads come and go, so rings are not kept for the life of a thread.
+ * When no ring is free, a thread takes over the drained ring that was
+ * least recently used. If every ring has records queued the message is
+ * written synchronously.
+ *
+ * Before the writer is started, or after log_sync() is called, messages
+ * are written synchronously.
+ */
+
+#define LOG_RINGS	16
+#define LOG_RING_SLOTS	16	/* power of two */
+#define LOG_MAX_ARGS	16
+#define LOG_SPEC_SIZE	24
+
+#define LOG_WRITER_NICE	10
+
+#if defined(_MSC_VER)
+#define log_cas(ptr, old, val) (InterlockedCompareExchange((LONG volatile *)(ptr), (val), (old)) == (LONG)(old))
+#define log_inc(ptr) ((Uint32)InterlockedIncrement((LONG volatile *)(ptr)))
+#define log_barrier() MemoryBarrier()
+#else
+#define log_cas(ptr, old, val) __sync_bool_compare_and_swap((ptr), (old), (val))
+#define log_inc(ptr) __sync_add_and_fetch((ptr), 1)
+#define log_barrier() __sync_synchronize()
+#endif
+
+enum log_arg_type {
+	LOG_ARG_UNSUPPORTED = 0,
+	LOG_ARG_NONE,		/* %% */
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_SIZE,
+	LOG_ARG_SSIZE,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_LDOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+};
+
+union log_arg {
+	int i;
+	long l;
+	long long ll;
+	double d;
+	void *p;
+	const char *s;	/* points into the record text */
+};
+
+struct log_spec {
+	enum log_arg_type type;
+	int stars;		/* width and precision arguments */
+	int precision;		/* -1 if not given */
+	bool_t precision_star;	/* precision is the last star argument */
+	const char *end;	/* after the conversion */
+	char conv[LOG_SPEC_SIZE];	/* normalized conversion for snprintf */
+};
+
+struct log_record {
+	Uint32 seq;
+	struct timeval t;
+	struct log_category *category;
+	enum log_priority priority;
+	const char *format;
+	int nspecs;		/* conversions captured */
+	bool_t truncated;
+	union log_arg args[LOG_MAX_ARGS];
+	char text[LOG_BUFFER_SIZE];	/* string arguments */
+};
+
+struct log_ring {
+	volatile Uint32 busy;	/* held while a thread logs to the ring */
+	volatile Uint32 active;
+	volatile Uint32 thread;
+	Uint32 last_seq;
+
+	volatile Uint32 head;	/* written by the producer */
+	volatile Uint32 tail;	/* written by the writer */
+
+	volatile Uint32 dropped;
+	Uint32 reported;
+
+	struct log_record slot[LOG_RING_SLOTS];
+};
+
+static struct log_ring log_rings[LOG_RINGS];
+static volatile Uint32 log_seq = 0;
+
+static SDL_Thread *log_writer = NULL;
+static SDL_sem *log_writer_sem = NULL;
+static SDL_mutex *log_drain_mutex = NULL;
+static volatile bool_t log_writer_running = false;
+static volatile bool_t log_writer_bypass = false;
+static Uint32 log_main_thread_id;
+
+static struct log_category *log_self;
+
 #if defined(WIN32)
 
 #if defined(_MSC_VER) || defined(_MSC_EXTENSIONS)
@@ -87,16 +196,548 @@ int gettimeofday(struct timeval *tv, struct timezone *tz)
 }
 #endif
 
+static void log_output(struct log_category *category, enum log_priority priority, struct timeval *t, char *buf) {
+	struct tm tm;
+
+	if (appender_stdout >= priority) {
+		char *color;
+
+		gmtime_r(&t->tv_sec, &tm);
+
+		switch (priority) {
+		case LOG_PRIORITY_ERROR:
+			color = "\033[0;31m";
+			break;
+		case LOG_PRIORITY_WARN:
+			color = "\033[0;32m";
+			break;
+		case LOG_PRIORITY_INFO:
+			color = "\033[0;33m";
+			break;
+		default:
+		case LOG_PRIORITY_DEBUG:
+			color = "\033[0;34m";
+		}
+
+#if defined(WIN32)
+		printf("%02d.%03ld %-6s %s - %s\n",
+		       t->tv_sec,
+		       (long)(t->tv_usec / 1000),
+		       log_priority_to_string(priority), category->name, buf);
+#else
+		printf("%s%04d%02d%02d %02d:%02d:%02d.%03ld %-6s %s - %s\033[0m\n",
+		       color,
+		       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		       tm.tm_hour, tm.tm_min, tm.tm_sec,
+		       (long)(t->tv_usec / 1000),
+		       log_priority_to_string(priority), category->name, buf);
+
+#endif
+	}
+
+#ifdef HAVE_SYSLOG
+	if (appender_syslog >= priority) {
+		char *ptr, *lasts = NULL;
+
+		/* log individual lines to syslog */
+		ptr = strtok_r(buf, "\n", &lasts);
+		syslog(priority, "%-6s %s - %s", log_priority_to_string(priority), category->name, ptr);
+
+		ptr = strtok_r(NULL, "\n", &lasts);
+		while (ptr) {
+			syslog(priority, "%s", ptr);
+			ptr = strtok_r(NULL, "\n", &lasts);
+		}
+	}
+#endif
+}
+
+
+
+/* parse the conversion at fmt, which points after the '%' */
+static void log_parse_spec(const char *fmt, struct log_spec *spec) {
+	const char *ptr = fmt;
+	char *conv = spec->conv;
+	char length = 0;
+
+	spec->type = LOG_ARG_UNSUPPORTED;
+	spec->stars = 0;
+	spec->precision = -1;
+	spec->precision_star = false;
+	spec->end = ptr;
+
+	*conv++ = '%';
+
+	/* flags, width and precision */
+	while (*ptr && strchr("-+ #0123456789.*", *ptr)) {
+		if (*ptr == '*' && ++spec->stars > 2) {
+			return;
+		}
+		if (*ptr == '.') {
+			spec->precision = 0;
+		}
+		else if (spec->precision >= 0 && *ptr == '*') {
+			spec->precision_star = true;
+		}
+		else if (spec->precision >= 0 && *ptr >= '0' && *ptr <= '9') {
+			spec->precision = spec->precision * 10 + (*ptr - '0');
+		}
+		if (conv - spec->conv > LOG_SPEC_SIZE - 5) {
+			return;
+		}
+		*conv++ = *ptr++;
+	}
+
+	/* length, normalized to l or ll */
+	while (*ptr && strchr("hlLqjzt", *ptr)) {
+		switch (*ptr) {
+		case 'h':
+			break;
+		case 'l':
+			length = (length == 'l') ? 'q' : 'l';
+			break;
+		case 'z':
+		case 't':
+			length = 'z';
+			break;
+		default:
+			length = *ptr;
+			break;
+		}
+		ptr++;
+	}
+
+	switch (*ptr) {
+	case '%':
+		spec->type = LOG_ARG_NONE;
+		break;
+
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		switch (length) {
+		case 0:
+			spec->type = LOG_ARG_INT;
+			break;
+		case 'l':
+			spec->type = LOG_ARG_LONG;
+			*conv++ = 'l';
+			break;
+		case 'z':
+			spec->type = (*ptr == 'd' || *ptr == 'i') ? LOG_ARG_SSIZE : LOG_ARG_SIZE;
+			*conv++ = 'l';
+			*conv++ = 'l';
+			break;
+		default:
+			spec->type = LOG_ARG_LLONG;
+			*conv++ = 'l';
+			*conv++ = 'l';
+			break;
+		}
+		break;
+
+	case 'c':
+		if (length == 0) {
+			spec->type = LOG_ARG_INT;
+		}
+		break;
+
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+		/* a long double is captured as a double */
+		spec->type = (length == 'L') ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+		break;
+
+	case 'p':
+		spec->type = LOG_ARG_PTR;
+		break;
+
+	case 's':
+		if (length == 0) {
+			spec->type = LOG_ARG_STR;
+		}
+		break;
+	}
+
+	if (spec->type != LOG_ARG_UNSUPPORTED) {
+		*conv++ = *ptr;
+		*conv = '\0';
+		spec->end = ptr + 1;
+	}
+}
+
+
+/* copy the arguments into the record, this runs on the logging thread
+ * so it must not allocate or block.
+ */
+static void log_capture(struct log_record *rec, const char *format, va_list args) {
+	struct log_spec spec;
+	union log_arg *arg = rec->args;
+	size_t text = 0;
+	int i;
+
+	rec->format = format;
+	rec->nspecs = 0;
+	rec->truncated = false;
+
+	while ((format = strchr(format, '%'))) {
+		log_parse_spec(format + 1, &spec);
+		format = spec.end;
+
+		if (spec.type == LOG_ARG_UNSUPPORTED
+		    || (arg - rec->args) + spec.stars + 1 > LOG_MAX_ARGS) {
+			rec->truncated = true;
+			return;
+		}
+
+		for (i = 0; i < spec.stars; i++) {
+			(arg++)->i = va_arg(args, int);
+		}
+		if (spec.precision_star) {
+			/* a negative precision is taken as if it was omitted */
+			spec.precision = (arg - 1)->i;
+		}
+
+		switch (spec.type) {
+		case LOG_ARG_UNSUPPORTED:
+		case LOG_ARG_NONE:
+			break;
+		case LOG_ARG_INT:
+			(arg++)->i = va_arg(args, int);
+			break;
+		case LOG_ARG_LONG:
+			(arg++)->l = va_arg(args, long);
+			break;
+		case LOG_ARG_LLONG:
+			(arg++)->ll = va_arg(args, long long);
+			break;
+		case LOG_ARG_SIZE:
+			(arg++)->ll = va_arg(args, size_t);
+			break;
+		case LOG_ARG_SSIZE:
+			(arg++)->ll = va_arg(args, ssize_t);
+			break;
+		case LOG_ARG_DOUBLE:
+			(arg++)->d = va_arg(args, double);
+			break;
+		case LOG_ARG_LDOUBLE:
+			(arg++)->d = (double) va_arg(args, long double);
+			break;
+		case LOG_ARG_PTR:
+			(arg++)->p = va_arg(args, void *);
+			break;
+		case LOG_ARG_STR: {
+			const char *str = va_arg(args, const char *);
+			size_t len;
+
+			if (!str || text >= sizeof(rec->text)) {
+				(arg++)->s = (str) ? "" : NULL;
+				rec->truncated = (str != NULL);
+				break;
+			}
+
+			/* with a precision the string need not be terminated */
+			len = (spec.precision >= 0) ? strnlen(str, spec.precision) : strlen(str);
+			if (len > sizeof(rec->text) - text - 1) {
+				len = sizeof(rec->text) - text - 1;
+				rec->truncated = true;
+			}
+
+			memcpy(rec->text + text, str, len);
+			rec->text[text + len] = '\0';
+
+			(arg++)->s = rec->text + text;
+			text += len + 1;
+			break;
+		}
+		}
+
+		rec->nspecs++;
+	}
+}
+
+
+#define LOG_SNPRINTF(field) \
+	((spec.stars == 0) ? snprintf(buf + n, len + 1 - n, spec.conv, arg[0].field) : \
+	 (spec.stars == 1) ? snprintf(buf + n, len + 1 - n, spec.conv, arg[0].i, arg[1].field) : \
+	 snprintf(buf + n, len + 1 - n, spec.conv, arg[0].i, arg[1].i, arg[2].field))
+
+/* format a captured record, this runs on the writer thread */
+static void log_format(struct log_record *rec, char *buf, size_t len) {
+	struct log_spec spec;
+	union log_arg *arg = rec->args;
+	const char *format = rec->format;
+	size_t n = 0;
+	int i = 0, r;
+
+	len--;	/* space for the terminator */
+
+	while (*format && n < len) {
+		if (*format != '%') {
+			buf[n++] = *format++;
+			continue;
+		}
+
+		if (i++ == rec->nspecs) {
+			/* the remaining arguments were not captured */
+			break;
+		}
+
+		log_parse_spec(format + 1, &spec);
+		format = spec.end;
+
+		switch (spec.type) {
+		case LOG_ARG_NONE:
+			buf[n++] = '%';
+			continue;
+		case LOG_ARG_INT:
+			r = LOG_SNPRINTF(i);
+			break;
+		case LOG_ARG_LONG:
+			r = LOG_SNPRINTF(l);
+			break;
+		case LOG_ARG_LLONG:
+		case LOG_ARG_SIZE:
+		case LOG_ARG_SSIZE:
+			r = LOG_SNPRINTF(ll);
+			break;
+		case LOG_ARG_DOUBLE:
+		case LOG_ARG_LDOUBLE:
+			r = LOG_SNPRINTF(d);
+			break;
+		case LOG_ARG_PTR:
+			r = LOG_SNPRINTF(p);
+			break;
+		case LOG_ARG_STR:
+			r = LOG_SNPRINTF(s);
+			break;
+		default:
+			r = 0;
+			break;
+		}
+		arg += spec.stars + 1;
+
+		if (r < 0 || (size_t)r > len - n) {
+			n = len;
+		}
+		else {
+			n += r;
+		}
+	}
+
+	if (rec->truncated && n + 3 <= len) {
+		memcpy(buf + n, "...", 3);
+		n += 3;
+	}
+	buf[n] = '\0';
+}
+
+
+static void log_report_dropped(Uint32 dropped, Uint32 *reported) {
+	struct timeval t;
+	char buf[64];
+
+	if (dropped == *reported) {
+		return;
+	}
+
+	gettimeofday(&t, NULL);
+	snprintf(buf, sizeof(buf), "%u log messages dropped", (unsigned int)(dropped - *reported));
+	buf[sizeof(buf) - 1] = '\0';
+	*reported = dropped;
+
+	log_output(log_self, LOG_PRIORITY_WARN, &t, buf);
+}
+
+
+/* write all queued records in the order they were logged */
+static void log_drain(void) {
+	struct log_ring *ring, *next;
+	struct log_record *rec;
+	char *buf = alloca(LOG_BUFFER_SIZE);
+	int i;
+
+	SDL_mutexP(log_drain_mutex);
+
+	while (1) {
+		/* the oldest record */
+		next = NULL;
+		for (i = 0; i < LOG_RINGS; i++) {
+			ring = &log_rings[i];
+			if (!ring->active || ring->tail == ring->head) {
+				continue;
+			}
+			log_barrier();
+
+			if (!next || (Sint32)(ring->slot[ring->tail % LOG_RING_SLOTS].seq - next->slot[next->tail % LOG_RING_SLOTS].seq) < 0) {
+				next = ring;
+			}
+		}
+
+		if (!next) {
+			break;
+		}
+
+		rec = &next->slot[next->tail % LOG_RING_SLOTS];
+		log_format(rec, buf, LOG_BUFFER_SIZE);
+		log_output(rec->category, rec->priority, &rec->t, buf);
+
+		log_barrier();
+		next->tail++;
+	}
+
+	for (i = 0; i < LOG_RINGS; i++) {
+		ring = &log_rings[i];
+		log_report_dropped(ring->dropped, &ring->reported);
+	}
+
+	fflush(stdout);
+
+	SDL_mutexV(log_drain_mutex);
+}
+
+
+static int log_writer_thread(void *unused) {
+#if defined(__linux__)
+	/* on linux this only changes the priority of this thread */
+	if (nice(LOG_WRITER_NICE) == -1) {
+		/* ignore */
+	}
+#endif
+
+	while (log_writer_running) {
+		SDL_SemWait(log_writer_sem);
+		log_drain();
+	}
+
+	return 0;
+}
+
+
+static void log_ring_put(struct log_ring *ring) {
+	log_barrier();
+	ring->busy = 0;
+}
+
+
+/* find the ring for the calling thread, or take over the drained ring
+ * that was least recently used. the ring is held until log_ring_put().
+ */
+static struct log_ring *log_ring_get(void) {
+	struct log_ring *ring, *lru;
+	Uint32 thread = SDL_ThreadID();
+	int i;
+
+	for (i = 0; i < LOG_RINGS; i++) {
+		ring = &log_rings[i];
+		if (ring->active && ring->thread == thread && log_cas(&ring->busy, 0, 1)) {
+			/* it may have been taken over before it was held */
+			if (ring->thread == thread) {
+				return ring;
+			}
+			log_ring_put(ring);
+		}
+	}
+
+	while (1) {
+		lru = NULL;
+		for (i = 0; i < LOG_RINGS; i++) {
+			ring = &log_rings[i];
+			if (ring->busy || ring->tail != ring->head) {
+				continue;
+			}
+
+			if (!ring->active) {
+				lru = ring;
+				break;
+			}
+			if (!lru || (Sint32)(ring->last_seq - lru->last_seq) < 0) {
+				lru = ring;
+			}
+		}
+
+		if (!lru) {
+			return NULL;
+		}
+
+		if (log_cas(&lru->busy, 0, 1)) {
+			if (lru->tail == lru->head) {
+				lru->thread = thread;
+				log_barrier();
+				lru->active = 1;
+				return lru;
+			}
+			log_ring_put(lru);
+		}
+	}
+}
+
+
+static void log_category_vlog_sync(struct log_category *category, enum log_priority priority, const char *format, va_list args) {
+	struct timeval t;
+	char *buf = alloca(LOG_BUFFER_SIZE);
+
+	vsnprintf(buf, LOG_BUFFER_SIZE, format, args);
+	buf[LOG_BUFFER_SIZE - 1] = '\0';
+
+	gettimeofday(&t, NULL);
+	log_output(category, priority, &t, buf);
+}
+
+
 void log_init() {
 #ifdef HAVE_SYSLOG
 	openlog("squeezeplay", LOG_ODELAY | LOG_CONS, LOG_USER);
 #endif
+
+	if (log_writer) {
+		return;
+	}
+
+	log_self = log_category_get("squeezeplay.log");
+	log_main_thread_id = SDL_ThreadID();
+
+	/* touch the rings now, not on an audio thread */
+	memset(log_rings, 0, sizeof(log_rings));
+
+	log_drain_mutex = SDL_CreateMutex();
+	log_writer_sem = SDL_CreateSemaphore(0);
+	log_writer_running = true;
+
+	log_writer = SDL_CreateThread(log_writer_thread, NULL);
+	if (!log_writer) {
+		log_writer_running = false;
+		fprintf(stderr, "can't start log writer, logging synchronously\n");
+	}
+}
+
+
+void log_flush() {
+	if (log_writer && !log_writer_bypass) {
+		log_drain();
+	}
+	fflush(stdout);
+}
+
+
+void log_sync() {
+	log_writer_bypass = true;
+	log_barrier();
 }
 
 
 void log_free() {
 	struct log_category *next, *ptr = category_head;
 
+	if (log_writer) {
+		log_writer_running = false;
+		SDL_SemPost(log_writer_sem);
+		SDL_WaitThread(log_writer, NULL);
+
+		log_drain();
+		log_writer = NULL;
+
+		SDL_DestroySemaphore(log_writer_sem);
+		SDL_DestroyMutex(log_drain_mutex);
+	}
+
 #ifdef HAVE_SYSLOG
 	closelog();
 #endif
@@ -134,66 +775,49 @@ struct log_category *log_category_get(const char *name) {
 
 
 void log_category_vlog(struct log_category *category, enum log_priority priority, const char *format, va_list args) {
-	struct timeval t;
-	struct tm tm;
+	struct log_ring *ring;
+	struct log_record *rec;
 
-	char *buf = alloca(LOG_BUFFER_SIZE);
-	vsnprintf(buf, LOG_BUFFER_SIZE, format, args);
+	if (appender_stdout < priority && appender_syslog < priority) {
+		return;
+	}
 
-	if (appender_stdout >= priority) {
-		char *color;
+	if (!log_writer || log_writer_bypass) {
+		log_category_vlog_sync(category, priority, format, args);
+		return;
+	}
 
-		gettimeofday(&t, NULL);
-		gmtime_r(&t.tv_sec, &tm);
+	ring = log_ring_get();
+	if (!ring) {
+		/* every ring has records queued */
+		log_category_vlog_sync(category, priority, format, args);
+		return;
+	}
 
-		switch (priority) {
-		case LOG_PRIORITY_ERROR:
-			color = "\033[0;31m";
-			break;
-		case LOG_PRIORITY_WARN:
-			color = "\033[0;32m";
-			break;
-		case LOG_PRIORITY_INFO:
-			color = "\033[0;33m";
-			break;
-		default:
-		case LOG_PRIORITY_DEBUG:
-			color = "\033[0;34m";
+	if (ring->head - ring->tail >= LOG_RING_SLOTS) {
+		if (ring->thread != log_main_thread_id) {
+			ring->dropped++;
+			log_ring_put(ring);
+			return;
 		}
 
-#if defined(WIN32)
-		printf("%02d.%03ld %-6s %s - %s\n",
-		       t.tv_sec,
-		       (long)(t.tv_usec / 1000),
-		       log_priority_to_string(priority), category->name, buf);
-#else
-		printf("%s%04d%02d%02d %02d:%02d:%02d.%03ld %-6s %s - %s\033[0m\n",
-		       color,
-		       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-		       tm.tm_hour, tm.tm_min, tm.tm_sec,
-		       (long)(t.tv_usec / 1000),
-		       log_priority_to_string(priority), category->name, buf);
-
-#endif
+		/* the main thread can wait */
+		log_drain();
 	}
 
-#ifdef HAVE_SYSLOG
-	if (appender_syslog >= priority) {
-		char *ptr, *lasts = NULL;
-
-		/* log individual lines to syslog */
-		ptr = strtok_r(buf, "\n", &lasts);
-		syslog(priority, "%-6s %s - %s", log_priority_to_string(priority), category->name, ptr);
+	rec = &ring->slot[ring->head % LOG_RING_SLOTS];
+	gettimeofday(&rec->t, NULL);
+	rec->seq = log_inc(&log_seq);
+	rec->category = category;
+	rec->priority = priority;
+	log_capture(rec, format, args);
+	ring->last_seq = rec->seq;
 
-		ptr = strtok_r(NULL, "\n", &lasts);
-		while (ptr) {
-			syslog(priority, "%s", ptr);
-			ptr = strtok_r(NULL, "\n", &lasts);
-		}
-	}
-#endif
+	log_barrier();
+	ring->head++;
+	log_ring_put(ring);
 
-	return;
+	SDL_SemPost(log_writer_sem);
 }
 
 
@@ -472,19 +1096,19 @@ int luaopen_log(lua_State *L) {
 }
 
 
-int squeezeplay_log_init(lua_State *L) {
+static void log_configure(lua_State *L) {
 	char *log_path;
 
 	/* configure logging */
 	log_path = alloca(PATH_MAX);
 	if (!squeezeplay_find_file("logconf.lua", log_path)) {
-		return 0;
+		return;
 	}
 
 	/* load environment */
 	if (luaL_loadfile(L, log_path) != 0) {
 		fprintf(stderr, "error loading logconf: %s\n", lua_tostring(L, -1));
-		return 0;
+		return;
 	}
 
 	/* sandbox and evaluate environment */
@@ -492,7 +1116,7 @@ int squeezeplay_log_init(lua_State *L) {
 	lua_setfenv(L, -2);
 	if (lua_pcall(L, 0, 1, 0) != 0) {
 		fprintf(stderr, "error in logconf: %s\n", lua_tostring(L, -1));
-		return 0;
+		return;
 	}
 
 	/* configure appenders */
@@ -526,7 +1150,11 @@ int squeezeplay_log_init(lua_State *L) {
 		}
 	}
 	lua_pop(L, 1);
+}
 
+
+int squeezeplay_log_init(lua_State *L) {
+	log_configure(L);
 	log_init();
 
 	return 0;
@@ -54,6 +54,8 @@ struct log_category {
 
 
 extern void log_init();
+extern void log_flush();
+extern void log_sync();
 extern void log_free();
 extern struct log_category *log_category_get(const char *name);
 extern void log_category_vlog(struct log_category *category, enum log_priority priority, const char *format, va_list args);
@@ -64,6 +66,9 @@ extern const char *log_priority_to_string(enum log_priority priority);
 extern enum log_priority log_priority_to_int(const char *str);
 
 
+/* messages are formatted later on the log writer thread, the format must
+ * be a string constant. string arguments are copied.
+ */
 static __inline void log_category_log(struct log_category *category, enum log_priority priority, const char *format, ...) {
 	if (category->priority >= priority) {
 		va_list va;
@@ -24,14 +24,14 @@ typedef int socket_t;
 #endif
 
 /* fm - 01/12/2010
-Userland DNS resolve requests are queued into a pipe in jiveL_dns_write(), then
-dns_resolver_thread() reads the pipe and calls gethostbyaddr() or gethostbyname().
-Both of these functions are blocking and can take a couple of seconds to return,
-especially if the network is down.
-To allow the pipe to empty if a lot of DNS requests are issued while the network
+Userland DNS resolve requests are queued in jiveL_dns_write(), then one of
+the dns_resolver_thread()s calls getaddrinfo() or getnameinfo() and writes
+the reply to a socketpair. These functions are blocking and can take a
+couple of seconds to return, especially if the network is down.
+To allow the queue to empty if a lot of DNS requests are issued while the network
 is down a 'shortcut' is taken as long as the following timeout is active. The
-shortcut path doesn't call the blocking functions but just reads from the pipe
-and returns the last error code again.
+shortcut path doesn't call the blocking functions but just returns the last
+error code again.
 The timeout was set to 2 minutes which I found in my tests on Jive, Baby and
 Touch not to be necessary to make sure the pipe gets emptied. 10 seconds seem
 to be enough.
@@ -139,33 +139,87 @@ int socketpair(int domain, int type, int protocol, SOCKET socks[2])
 #endif
 
 
-/* write a string to the pipe fd */
-static void write_str(socket_t fd, char *str) {
+/* Number of resolver threads, lookups for different names run in parallel */
+#define DNS_RESOLVER_THREADS 4
+
+/* Lookups are cached, the resolver api does not expose the record ttl so
+ * fixed lifetimes are used */
+#define DNS_CACHE_SIZE 32
+#define DNS_CACHE_TTL (120 * 1000)		/* 2 minutes */
+#define DNS_NEGATIVE_TTL (30 * 1000)		/* 30 seconds */
+
+
+struct dns_buf {
+	char *data;
+	size_t len, size;
+};
+
+struct dns_request {
+	struct dns_request *next;
+	char *query;
+};
+
+struct dns_cache_entry {
+	char *query;
+	char *reply;
+	size_t reply_len;
+	Uint32 expires;
+};
+
+struct dns_userdata {
+	socket_t fd[2];
+	SDL_Thread *t[DNS_RESOLVER_THREADS];
+};
+
+
+static SDL_mutex *dns_mutex;
+static SDL_mutex *dns_write_mutex;
+static SDL_cond *dns_cond;
+static struct dns_request *dns_pending, *dns_pending_tail;
+static struct dns_cache_entry dns_cache[DNS_CACHE_SIZE];
+
+/* shortcut while the network is down, see RESOLV_TIMEOUT */
+static const char *failed_error = NULL;
+static Uint32 failed_timeout = 0;
+
+/* incremented when resolv.conf changes */
+static int resolv_generation = 0;
+
+
+/* append a string to the buffer */
+static void buf_put_str(struct dns_buf *b, const char *str) {
 	size_t len;
 
 	len = strlen(str);
-	send(fd, &len, sizeof(len), 0);
-	send(fd, str, len, 0);
+	if (b->len + sizeof(len) + len > b->size) {
+		b->size = (b->len + sizeof(len) + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+
+	memcpy(b->data + b->len, &len, sizeof(len));
+	memcpy(b->data + b->len + sizeof(len), str, len);
+	b->len += sizeof(len) + len;
 }
 
 
-/* read a string to the lua stack from the pipe fd */
-static void read_pushstring(lua_State *L, socket_t fd) {
+/* push a string from the buffer to the lua stack, an empty string is nil */
+static void buf_pushstring(lua_State *L, const char **p, const char *end) {
 	size_t len;
-	char *buf;
-
-	recv(fd, &len, sizeof(len), 0);
 
-	if (len == 0) {
+	if (*p + sizeof(len) > end) {
 		lua_pushnil(L);
+		return;
 	}
-	else {
-		buf = malloc(len);
 
-		recv(fd, buf, len, 0);
-		lua_pushlstring(L, buf, len);
+	memcpy(&len, *p, sizeof(len));
+	*p += sizeof(len);
 
-		free(buf);
+	if (len == 0 || *p + len > end) {
+		lua_pushnil(L);
+	}
+	else {
+		lua_pushlstring(L, *p, len);
+		*p += len;
 	}
 }
 
@@ -188,107 +242,292 @@ static int stat_resolv_conf(void) {
 }
 
 
+static const char *dns_strerror(int r) {
+	switch (r) {
+	case EAI_NONAME:
+		return "Not found";
+#if defined(EAI_NODATA) && EAI_NODATA != EAI_NONAME
+	case EAI_NODATA:
+		return "No data";
+#endif
+	case EAI_AGAIN:
+		return "Try again";
+	default:
+		return "No recovery";
+	}
+}
+
+
+/* append the numeric addresses of one family, followed by an end marker */
+static void dns_put_addrs(struct dns_buf *b, struct addrinfo *res, int family) {
+	char host[NI_MAXHOST];
+	struct addrinfo *ai;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family != family) {
+			continue;
+		}
+		if (getnameinfo(ai->ai_addr, (socklen_t) ai->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) == 0) {
+			buf_put_str(b, host);
+		}
+	}
+	buf_put_str(b, "");
+}
+
+
+/* resolve query, the reply is the error, or the host name, aliases,
+ * ipv4 addresses and ipv6 addresses. returns the error code. */
+static int dns_resolve(const char *query, struct dns_buf *b) {
+	struct addrinfo hints, *res;
+	char host[NI_MAXHOST];
+	int r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	/* address to host name? */
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(query, NULL, &hints, &res) == 0) {
+		r = getnameinfo(res->ai_addr, (socklen_t) res->ai_addrlen, host, sizeof(host), NULL, 0, NI_NAMEREQD);
+		if (r != 0) {
+			freeaddrinfo(res);
+			buf_put_str(b, dns_strerror(r));
+			return r;
+		}
+	}
+	else {
+		hints.ai_flags = AI_CANONNAME;
+		r = getaddrinfo(query, NULL, &hints, &res);
+		if (r != 0) {
+			buf_put_str(b, dns_strerror(r));
+			return r;
+		}
+
+		strncpy(host, res->ai_canonname ? res->ai_canonname : query, sizeof(host));
+		host[sizeof(host) - 1] = '\0';
+	}
+
+	buf_put_str(b, ""); // no error
+	buf_put_str(b, host);
+	buf_put_str(b, ""); // end of aliases
+
+	dns_put_addrs(b, res, AF_INET);
+	dns_put_addrs(b, res, AF_INET6);
+
+	freeaddrinfo(res);
+	return 0;
+}
+
+
+static void dns_cache_flush(void) {
+	int i;
+
+	for (i = 0; i < DNS_CACHE_SIZE; i++) {
+		free(dns_cache[i].query);
+		free(dns_cache[i].reply);
+		dns_cache[i].query = NULL;
+		dns_cache[i].reply = NULL;
+	}
+}
+
+
+/* must be called with dns_mutex locked */
+static void dns_cache_put(const char *query, struct dns_buf *b, Uint32 ttl) {
+	struct dns_cache_entry *entry = &dns_cache[0];
+	Uint32 now = jive_jiffies();
+	int i;
+
+	/* replace the same query, a free entry, or the entry expiring first */
+	for (i = 0; i < DNS_CACHE_SIZE; i++) {
+		if (!dns_cache[i].query || strcmp(dns_cache[i].query, query) == 0) {
+			entry = &dns_cache[i];
+			break;
+		}
+		if ((Sint32) (dns_cache[i].expires - entry->expires) < 0) {
+			entry = &dns_cache[i];
+		}
+	}
+
+	free(entry->query);
+	free(entry->reply);
+
+	entry->query = strdup(query);
+	entry->reply = malloc(b->len);
+	memcpy(entry->reply, b->data, b->len);
+	entry->reply_len = b->len;
+	entry->expires = now + ttl;
+}
+
+
+/* send a complete reply message, replies from the resolver threads must
+ * not interleave */
+static void dns_send_reply(socket_t fd, const char *query, struct dns_buf *body) {
+	struct dns_buf msg;
+	size_t len, sent;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	buf_put_str(&msg, query);
+
+	len = msg.len + body->len;
+	msg.data = realloc(msg.data, sizeof(len) + len);
+	memmove(msg.data + sizeof(len), msg.data, msg.len);
+	memcpy(msg.data, &len, sizeof(len));
+	memcpy(msg.data + sizeof(len) + msg.len, body->data, body->len);
+	len += sizeof(len);
+
+	SDL_LockMutex(dns_write_mutex);
+	for (sent = 0; sent < len; sent += n) {
+		n = send(fd, msg.data + sent, len - sent, 0);
+		if (n <= 0) {
+			break;
+		}
+	}
+	SDL_UnlockMutex(dns_write_mutex);
+
+	free(msg.data);
+}
+
+
 /* dns resolver thread */
 static int dns_resolver_thread(void *p) {
 	socket_t fd = (long) p;
-	struct hostent *hostent;
-	struct in_addr **addr, byaddr;
-	char **alias;
-	size_t len;
-	char *buf;
-	char *failed_error = NULL;
-	Uint32 failed_timeout = 0;
+	struct dns_request *req;
+	struct dns_buf b;
+	int generation = 0;
+	int r;
+
+	memset(&b, 0, sizeof(b));
 
 	while (1) {
-		if (recv(fd, &len, sizeof(len), 0) < 0) {
-			/* broken pipe */
-			return 0;
+		SDL_LockMutex(dns_mutex);
+		while (!dns_pending) {
+			SDL_CondWait(dns_cond, dns_mutex);
 		}
 
-		buf = malloc(len + 1);
-		if (recv(fd, buf, len, 0) < 0) {
-			/* broken pipe */
-			free(buf);
-			return 0;
+		req = dns_pending;
+		dns_pending = req->next;
+		if (!dns_pending) {
+			dns_pending_tail = NULL;
 		}
-		buf[len] = '\0';
-		if (failed_error && stat_resolv_conf()) {
-			#ifndef _WIN32
-			//reload resolv.conf
-			res_init();
-			#endif
+
+		b.len = 0;
+
+		if (stat_resolv_conf()) {
+			/* network configuration changed */
+			resolv_generation++;
+			failed_error = NULL;
+			dns_cache_flush();
 		}
-		else if (failed_error && !stat_resolv_conf()) {
+		else if (failed_error) {
 			Uint32 now = jive_jiffies();
-			
+
 			if (now - failed_timeout < RESOLV_TIMEOUT) {
-				write_str(fd, failed_error);
-				free(buf);
-				continue;
+				buf_put_str(&b, failed_error);
+			}
+			else {
+				failed_error = NULL;
 			}
 		}
-		failed_error = NULL;
 
-		if (inet_aton(buf, &byaddr)) {
-			hostent = gethostbyaddr((char *) &byaddr, sizeof(addr), AF_INET);
-		}
-		else {
-			hostent = gethostbyname(buf);
+		if (generation != resolv_generation) {
+			generation = resolv_generation;
+#ifndef _WIN32
+			//reload resolv.conf
+			res_init();
+#endif
 		}
-		free(buf);
+		SDL_UnlockMutex(dns_mutex);
 
-		if (hostent == NULL) {
-			/* error */
-			switch (h_errno) {
-			case HOST_NOT_FOUND:
-				write_str(fd, "Not found");
-				break;
-			case NO_DATA:
-				write_str(fd, "No data");
+		if (b.len == 0) {
+			r = dns_resolve(req->query, &b);
+
+			SDL_LockMutex(dns_mutex);
+			switch (r) {
+			case 0:
+				dns_cache_put(req->query, &b, DNS_CACHE_TTL);
 				break;
-			case NO_RECOVERY:
-				failed_error = "No recovery";
+			case EAI_AGAIN:
+			case EAI_FAIL:
+				failed_error = dns_strerror(r);
 				failed_timeout = jive_jiffies();
-				write_str(fd, failed_error);
 				break;
-			case TRY_AGAIN:
-				failed_error = "Try again"; 
-				failed_timeout = jive_jiffies();
-				write_str(fd, failed_error);
+			default:
+				dns_cache_put(req->query, &b, DNS_NEGATIVE_TTL);
 				break;
 			}
+			SDL_UnlockMutex(dns_mutex);
 		}
-		else {
-			write_str(fd, ""); // no error
-			write_str(fd, hostent->h_name);
-
-			alias = hostent->h_aliases;
-			while (*alias) {
-				write_str(fd, *alias);
-				alias++;
-			}
-			write_str(fd, ""); // end of aliases
 
-			addr = (struct in_addr **) hostent->h_addr_list;
-			while (*addr) {
-				write_str(fd, inet_ntoa(**addr));
-				addr++;
-			}
-			write_str(fd, ""); // end if addrs
-		}
+		dns_send_reply(fd, req->query, &b);
+
+		free(req->query);
+		free(req);
 	}
+
+	return 0;
 }
 
 
-struct dns_userdata {
-	socket_t fd[2];
-	SDL_Thread *t;
-};
+/* push the hostent table, or nil and the error */
+static int dns_push_reply(lua_State *L, const char *p, const char *end) {
+	int i, resolved;
+
+	/* error? */
+	buf_pushstring(L, &p, end);
+	if (!lua_isnil(L, -1)) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	lua_pop(L, 1);
+
+	/* read hostent table */
+	lua_newtable(L);
+	resolved = lua_gettop(L);
+
+	lua_pushstring(L, "name");
+	buf_pushstring(L, &p, end);
+	lua_settable(L, resolved);
+
+	i = 1;
+	lua_newtable(L);
+	buf_pushstring(L, &p, end);
+	while (!lua_isnil(L, -1)) {
+		lua_rawseti(L, -2, i++);
+		buf_pushstring(L, &p, end);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, resolved, "alias");
+
+	i = 1;
+	lua_newtable(L);
+	buf_pushstring(L, &p, end);
+	while (!lua_isnil(L, -1)) {
+		lua_rawseti(L, -2, i++);
+		buf_pushstring(L, &p, end);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, resolved, "ip");
+
+	i = 1;
+	lua_newtable(L);
+	buf_pushstring(L, &p, end);
+	while (!lua_isnil(L, -1)) {
+		lua_rawseti(L, -2, i++);
+		buf_pushstring(L, &p, end);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, resolved, "ip6");
+
+	return 1;
+}
 
 
 static int jiveL_dns_open(lua_State *L) {
 	struct dns_userdata *u;
-	int r;
+	int i, r;
 
 	u = lua_newuserdata(L, sizeof(struct dns_userdata));
 
@@ -297,7 +536,15 @@ static int jiveL_dns_open(lua_State *L) {
 		return luaL_error(L, "socketpair failed: %s", strerror(r));
 	}
 
-	u->t = SDL_CreateThread(dns_resolver_thread, (void *)(long)(u->fd[1]));
+	if (!dns_mutex) {
+		dns_mutex = SDL_CreateMutex();
+		dns_write_mutex = SDL_CreateMutex();
+		dns_cond = SDL_CreateCond();
+	}
+
+	for (i = 0; i < DNS_RESOLVER_THREADS; i++) {
+		u->t[i] = SDL_CreateThread(dns_resolver_thread, (void *)(long)(u->fd[1]));
+	}
 
 	luaL_getmetatable(L, "jive.dns");
 	lua_setmetatable(L, -2);
@@ -327,62 +574,105 @@ static int jiveL_dns_getfd(lua_State *L) {
 }
 
 
+/* read the next reply, returns the query followed by the hostent table
+ * or nil and the error */
 static int jiveL_dns_read(lua_State *L) {
 	struct dns_userdata *u;
-	int i, resolved;
+	size_t len, got;
+	ssize_t n;
+	char *buf;
+	const char *p;
+	int r;
 
 	u = lua_touserdata(L, 1);
 
-	/* error? */
-	read_pushstring(L, u->fd[0]);
-	if (!lua_isnil(L, -1)) {
-		lua_pushnil(L);
-		lua_insert(L, -2);
-		return 2;
+	if (recv(u->fd[0], &len, sizeof(len), 0) != sizeof(len)) {
+		return luaL_error(L, "dns read failed");
 	}
 
-	/* read hostent table */
-	lua_newtable(L);
-	resolved = lua_gettop(L);
+	buf = malloc(len);
+	for (got = 0; got < len; got += n) {
+		n = recv(u->fd[0], buf + got, len - got, 0);
+		if (n <= 0) {
+			free(buf);
+			return luaL_error(L, "dns read failed");
+		}
+	}
 
-	lua_pushstring(L, "name");
-	read_pushstring(L, u->fd[0]);
-	lua_settable(L, resolved);
+	p = buf;
+	buf_pushstring(L, &p, buf + len);
+	r = dns_push_reply(L, p, buf + len);
 
-	i = 1;
-	lua_newtable(L);
-	read_pushstring(L, u->fd[0]);
-	while (!lua_isnil(L, -1)) {
-		lua_rawseti(L, -2, i++);
-		read_pushstring(L, u->fd[0]);
+	free(buf);
+	return r + 1;
+}
+
+
+/* returns the cached hostent table, nil and the error for a cached
+ * failure, or false if the query is not cached */
+static int jiveL_dns_lookup(lua_State *L) {
+	struct dns_cache_entry *entry;
+	const char *query;
+	char *reply = NULL;
+	size_t reply_len = 0;
+	Uint32 now;
+	int i, r;
+
+	query = luaL_checkstring(L, 2);
+	now = jive_jiffies();
+
+	SDL_LockMutex(dns_mutex);
+	for (i = 0; i < DNS_CACHE_SIZE; i++) {
+		entry = &dns_cache[i];
+
+		if (!entry->query || strcmp(entry->query, query) != 0) {
+			continue;
+		}
+
+		if ((Sint32) (entry->expires - now) > 0) {
+			reply = malloc(entry->reply_len);
+			memcpy(reply, entry->reply, entry->reply_len);
+			reply_len = entry->reply_len;
+		}
+		break;
 	}
-	lua_pop(L, 1);
-	lua_setfield(L, resolved, "alias");
+	SDL_UnlockMutex(dns_mutex);
 
-	i = 1;
-	lua_newtable(L);
-	read_pushstring(L, u->fd[0]);
-	while (!lua_isnil(L, -1)) {
-		lua_rawseti(L, -2, i++);
-		read_pushstring(L, u->fd[0]);
+	if (!reply) {
+		lua_pushboolean(L, 0);
+		return 1;
 	}
-	lua_pop(L, 1);
-	lua_setfield(L, resolved, "ip");
 
-	return 1;
+	r = dns_push_reply(L, reply, reply + reply_len);
+	free(reply);
+
+	return r;
 }
 
 
 static int jiveL_dns_write(lua_State *L) {
-	struct dns_userdata *u;
-	const char *buf;
-	size_t len;
+	struct dns_request *req;
 
-	u = lua_touserdata(L, 1);
-	buf = lua_tolstring(L, 2, &len);
+	/* stack is:
+	 * 1: dns
+	 * 2: query
+	 */
 
-	send(u->fd[0], &len, sizeof(len), 0);
-	send(u->fd[0], buf, len, 0);
+	req = malloc(sizeof(struct dns_request));
+	req->next = NULL;
+	req->query = strdup(luaL_checkstring(L, 2));
+
+	SDL_LockMutex(dns_mutex);
+	if (dns_pending_tail) {
+		dns_pending_tail->next = req;
+	}
+	else {
+		dns_pending = req;
+	}
+	dns_pending_tail = req;
+
+	SDL_CondSignal(dns_cond);
+	SDL_UnlockMutex(dns_mutex);
 
 	return 0;
 }
@@ -406,6 +696,9 @@ int luaopen_jive_net_dns(lua_State *L) {
 	lua_pushcfunction(L, jiveL_dns_write);
 	lua_setfield(L, -2, "write");
 
+	lua_pushcfunction(L, jiveL_dns_lookup);
+	lua_setfield(L, -2, "lookup");
+
 	lua_pushcfunction(L, jiveL_dns_getfd);
 	lua_setfield(L, -2, "getfd");
 
@@ -320,6 +320,9 @@ void jive_send_key_event(JiveEventType keyType, JiveKey keyCode, Uint32 ticks);
 void jive_send_gesture_event(JiveGesture code);
 void jive_send_char_press_event(Uint16 unicode);
 
+/* input file descriptors read by the pump, the event loop sleeps on these */
+void jive_add_event_fd(int fd);
+
 
 /* platform functions */
 void platform_init(lua_State *L);
@@ -331,6 +334,13 @@ char *platform_get_arch();
 /* global counter used to invalidate widget */
 extern Uint32 jive_origin;
 
+/* set when a widget needs layout before the next frame */
+extern bool jive_layout_pending;
+
+/* debug hook set on task coroutines when they are resumed */
+extern lua_Hook jive_task_hook;
+extern int jive_task_hook_count;
+
 /* Util functions */
 void jive_print_stack(lua_State *L, char *str);
 void jive_debug_traceback(lua_State *L, int n);
@@ -351,6 +361,11 @@ JiveSurface *jive_surface_new_SDLSurface(SDL_Surface *sdl_surface);
 JiveSurface *jive_surface_ref(JiveSurface *srf);
 JiveSurface *jive_surface_load_image(const char *path);
 JiveSurface *jive_surface_load_image_data(const char *data, size_t len);
+int jive_surface_load_image_data_async(const char *data, size_t len, Uint16 w, Uint16 h);
+int jive_surface_load_image_data_fd(void);
+JiveSurface *jive_surface_load_image_data_result(int *ticket);
+int jive_surface_save_pixels(JiveSurface *srf, const char *path, const char *key);
+JiveSurface *jive_surface_load_pixels(const char *path, const char *key);
 int jive_surface_set_wm_icon(JiveSurface *srf);
 int jive_surface_save_bmp(JiveSurface *srf, const char *file);
 int jive_surface_cmp(JiveSurface *a, JiveSurface *b, Uint32 key);
@@ -368,6 +383,8 @@ void jive_surface_blit_clip(JiveSurface *src, Uint16 sx, Uint16 sy, Uint16 sw, U
 void jive_surface_blit_alpha(JiveSurface *src, JiveSurface *dst, Uint16 dx, Uint16 dy, Uint8 alpha);
 void jive_surface_get_size(JiveSurface *srf, Uint16 *w, Uint16 *h);
 int jive_surface_get_bytes(JiveSurface *srf);
+size_t jive_surface_image_cache_usage(void);
+size_t jive_surface_shed_image_cache(size_t bytes);
 void jive_surface_free(JiveSurface *srf);
 void jive_surface_release(JiveSurface *srf);
 
@@ -497,6 +514,8 @@ int jiveL_label_skin(lua_State *L);
 int jiveL_label_layout(lua_State *L);
 int jiveL_label_animate(lua_State *L);
 int jiveL_label_draw(lua_State *L);
+int jiveL_label_text_cache_usage(lua_State *L);
+int jiveL_label_shed_text_cache(lua_State *L);
 int jiveL_label_gc(lua_State *L);
 
 int jiveL_group_get_preferred_bounds(lua_State *L);
@@ -547,6 +566,8 @@ int jiveL_style_rawvalue(lua_State *L);
 int jiveL_style_color(lua_State *L);
 int jiveL_style_array_color(lua_State *L);
 int jiveL_style_font(lua_State *L);
+int jiveL_style_cache_usage(lua_State *L);
+int jiveL_style_shed_cache(lua_State *L);
 
 
 #define JIVEL_STACK_CHECK_BEGIN(L) { int _sc = lua_gettop((L));
@@ -23,6 +23,9 @@ SDL_Rect jive_dirty_region, last_dirty_region;
 Uint32 jive_origin = 0;
 static Uint32 next_jive_origin = 0;
 
+/* widgets are waiting for layout */
+bool jive_layout_pending = false;
+
 
 /* performance warning thresholds, 0 = disabled */
 struct jive_perfwarn perfwarn = { 0, 0, 0, 0, 0, 0 };
@@ -35,6 +38,15 @@ struct jive_perfwarn perfwarn = { 0, 0, 0, 0, 0, 0 };
 
 #define POINTER_TIMEOUT 20000
 
+/* keep pumping input each frame after an event, the platform pumps
+ * detect key up, repeats and holds by polling */
+#define INPUT_ACTIVE_TIMEOUT 4000
+
+/* input poll interval when the platform has no event fds to sleep on */
+#define INPUT_POLL_TIMEOUT 100
+
+#define MAX_EVENT_FDS 8
+
 static bool update_screen = true;
 
 static JiveTile *jive_background = NULL;
@@ -75,6 +87,11 @@ static Uint32 mouse_timeout_arg;
 
 static Uint32 pointer_timeout = 0;
 
+static Uint32 input_timeout = 0;
+
+static int event_fds[MAX_EVENT_FDS];
+static int num_event_fds = 0;
+
 static Uint16 mouse_origin_x, mouse_origin_y;
 
 static int ui_watchdog;
@@ -395,6 +412,103 @@ static int jiveL_process_events(lua_State *L) {
 }
 
 
+static int jiveL_is_frame_needed(lua_State *L) {
+	bool needed = false;
+
+	/* stack is:
+	 * 1: framework
+	 */
+
+	if (update_screen) {
+		needed = jive_dirty_region.w || jive_layout_pending || jive_origin != next_jive_origin;
+
+		if (!needed) {
+			lua_getfield(L, 1, "transition");
+			needed = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+		}
+
+		if (!needed) {
+			lua_getfield(L, 1, "animations");
+			needed = lua_objlen(L, -1) > 0;
+			lua_pop(L, 1);
+		}
+	}
+
+	lua_pushboolean(L, needed);
+	return 1;
+}
+
+
+static Uint32 next_timeout(Uint32 timeout, Uint32 t) {
+	if (t && (!timeout || t < timeout)) {
+		return t;
+	}
+	return timeout;
+}
+
+
+static int jiveL_get_event_timeout(lua_State *L) {
+	Uint32 now, timeout = 0;
+
+	/* stack is:
+	 * 1: framework
+	 */
+
+	now = jive_jiffies();
+
+	/* events are queued, or the input pumps are timing a key or touch */
+	if (SDL_EventQueueLength() > 0 || (input_timeout && now < input_timeout)) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	timeout = next_timeout(timeout, key_timeout);
+	timeout = next_timeout(timeout, mouse_timeout);
+	timeout = next_timeout(timeout, mouse_long_timeout);
+	timeout = next_timeout(timeout, pointer_timeout);
+
+	/* input can only be found by polling */
+	if (num_event_fds == 0) {
+		timeout = next_timeout(timeout, now + INPUT_POLL_TIMEOUT);
+	}
+
+	if (!timeout) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushinteger(L, (timeout > now) ? timeout - now : 0);
+	return 1;
+}
+
+
+void jive_add_event_fd(int fd) {
+	if (fd < 0 || num_event_fds == MAX_EVENT_FDS) {
+		return;
+	}
+
+	event_fds[num_event_fds++] = fd;
+}
+
+
+static int jiveL_get_event_fds(lua_State *L) {
+	int i;
+
+	/* stack is:
+	 * 1: framework
+	 */
+
+	lua_createtable(L, num_event_fds, 0);
+	for (i = 0; i < num_event_fds; i++) {
+		lua_pushinteger(L, event_fds[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+}
+
+
 int jiveL_set_update_screen(lua_State *L) {
 	/* stack is:
 	 * 1: framework
@@ -468,6 +582,8 @@ static int _draw_screen(lua_State *L) {
 		/* check in case the origin changes during layout */
 	} while (jive_origin != next_jive_origin);
 
+	jive_layout_pending = false;
+
 	if (perfwarn.screen) t1 = jive_jiffies();
  
 	/* Widget animations - don't update in a standalone draw as its not the main screen update */
@@ -976,6 +1092,58 @@ int jiveL_thread_time(lua_State *L) {
 }
 
 
+static int jiveL_surface_load_image_data_async(lua_State *L) {
+	const char *data;
+	size_t len;
+	int ticket;
+
+	/* stack is:
+	 * 1: Surface
+	 * 2: data
+	 * 3: width
+	 * 4: height
+	 */
+
+	data = luaL_checklstring(L, 2, &len);
+	ticket = jive_surface_load_image_data_async(data, len, (Uint16) luaL_optinteger(L, 3, 0), (Uint16) luaL_optinteger(L, 4, 0));
+
+	if (ticket == 0) {
+		return 0;
+	}
+
+	lua_pushinteger(L, ticket);
+	return 1;
+}
+
+
+static int jiveL_surface_load_image_data_fd(lua_State *L) {
+	int fd;
+
+	fd = jive_surface_load_image_data_fd();
+	if (fd < 0) {
+		return 0;
+	}
+
+	lua_pushinteger(L, fd);
+	return 1;
+}
+
+
+static int jiveL_surface_load_image_data_result(lua_State *L) {
+	JiveSurface *srf;
+	int ticket;
+
+	srf = jive_surface_load_image_data_result(&ticket);
+	if (ticket == 0) {
+		return 0;
+	}
+
+	lua_pushinteger(L, ticket);
+	tolua_pushusertype_and_takeownership(L, srf, "Surface");
+	return 2;
+}
+
+
 static int do_dispatch_event(lua_State *L, JiveEvent *jevent) {
 	int r;
 
@@ -1291,6 +1459,10 @@ static int process_event(lua_State *L, SDL_Event *event) {
 		return 0;
 	}
 
+	if (jevent.type & JIVE_EVENT_ALL_INPUT) {
+		input_timeout = now + INPUT_ACTIVE_TIMEOUT;
+	}
+
 	return do_dispatch_event(L, &jevent);
 }
 
@@ -1384,6 +1556,8 @@ static const struct luaL_Reg label_methods[] = {
 	{ "_layout", jiveL_label_layout },
 	{ "animate", jiveL_label_animate },
 	{ "draw", jiveL_label_draw },
+	{ "textCacheUsage", jiveL_label_text_cache_usage },
+	{ "shedTextCache", jiveL_label_shed_text_cache },
 	{ NULL, NULL }
 };
 
@@ -1483,6 +1657,79 @@ static const struct luaL_Reg event_methods[] = {
 	{ NULL, NULL }
 };
 
+static int jiveL_surface_save_pixels(lua_State *L) {
+	JiveSurface *srf;
+	int len;
+
+	/* stack is:
+	 * 1: surface
+	 * 2: path
+	 * 3: key
+	 */
+
+	srf = tolua_tousertype(L, 1, 0);
+	if (!srf) {
+		return luaL_argerror(L, 1, "Surface expected");
+	}
+
+	len = jive_surface_save_pixels(srf, luaL_checkstring(L, 2), luaL_checkstring(L, 3));
+	if (!len) {
+		return 0;
+	}
+
+	lua_pushinteger(L, len);
+	return 1;
+}
+
+
+static int jiveL_surface_load_pixels(lua_State *L) {
+	JiveSurface *srf;
+
+	/* stack is:
+	 * 1: Surface
+	 * 2: path
+	 * 3: key
+	 */
+
+	srf = jive_surface_load_pixels(luaL_checkstring(L, 2), luaL_checkstring(L, 3));
+	if (!srf) {
+		return 0;
+	}
+
+	tolua_pushusertype_and_takeownership(L, srf, "Surface");
+	return 1;
+}
+
+
+static int jiveL_surface_image_cache_usage(lua_State *L) {
+	lua_pushinteger(L, jive_surface_image_cache_usage());
+	return 1;
+}
+
+
+static int jiveL_surface_shed_image_cache(lua_State *L) {
+
+	/* stack is:
+	 * 1: Surface
+	 * 2: bytes
+	 */
+
+	lua_pushinteger(L, jive_surface_shed_image_cache(luaL_checkinteger(L, 2)));
+	return 1;
+}
+
+
+static const struct luaL_Reg surface_methods[] = {
+	{ "loadImageDataAsync", jiveL_surface_load_image_data_async },
+	{ "loadImageDataFd", jiveL_surface_load_image_data_fd },
+	{ "loadImageDataResult", jiveL_surface_load_image_data_result },
+	{ "savePixels", jiveL_surface_save_pixels },
+	{ "loadPixels", jiveL_surface_load_pixels },
+	{ "imageCacheUsage", jiveL_surface_image_cache_usage },
+	{ "shedImageCache", jiveL_surface_shed_image_cache },
+	{ NULL, NULL }
+};
+
 static const struct luaL_Reg core_methods[] = {
 	{ "initSDL", jiveL_initSDL },
 	{ "quit", jiveL_quit },
@@ -1490,6 +1737,9 @@ static const struct luaL_Reg core_methods[] = {
 	{ "setUpdateScreen", jiveL_set_update_screen },
 	{ "draw", jiveL_draw },
 	{ "updateScreen", jiveL_update_screen },
+	{ "isFrameNeeded", jiveL_is_frame_needed },
+	{ "getEventTimeout", jiveL_get_event_timeout },
+	{ "getEventFds", jiveL_get_event_fds },
 	{ "reDraw", jiveL_redraw },
 	{ "pushEvent", jiveL_push_event },
 	{ "dispatchEvent", jiveL_dispatch_event },
@@ -1499,6 +1749,8 @@ static const struct luaL_Reg core_methods[] = {
 	{ "getBackground", jiveL_get_background },
 	{ "setBackground", jiveL_set_background },
 	{ "styleChanged", jiveL_style_changed },
+	{ "styleCacheUsage", jiveL_style_cache_usage },
+	{ "shedStyleCache", jiveL_style_shed_cache },
 	{ "perfwarn", jiveL_perfwarn },
 	{ "_event", jiveL_event },
 	{ NULL, NULL }
@@ -1557,6 +1809,10 @@ static int jiveL_core_init(lua_State *L) {
 	luaL_register(L, NULL, event_methods);
 	lua_pop(L, 1);
 
+	lua_getfield(L, 2, "Surface");
+	luaL_register(L, NULL, surface_methods);
+	lua_pop(L, 1);
+
 	lua_getfield(L, 2, "Framework");
 	luaL_register(L, NULL, core_methods);
 	lua_pop(L, 1);
@@ -56,9 +56,20 @@ typedef struct label_widget {
 	size_t num_lines;
 	Uint16 text_w, text_h; // maximum label width and height
 	LabelLine *line;
+
+	// text surface cache
+	struct label_widget *lru_prev, *lru_next;
+	size_t text_bytes;
+	bool shed;               // lines freed to save memory
 } LabelWidget;
 
 
+/* labels with text surfaces, most recently drawn first */
+static LabelWidget *lru_head = NULL;
+static LabelWidget *lru_tail = NULL;
+static size_t lru_bytes = 0;
+
+
 static JivePeerMeta labelPeerMeta = {
 	sizeof(LabelWidget),
 	"JiveLabel",
@@ -70,6 +81,46 @@ static void jive_label_gc_lines(LabelWidget *peer);
 static void jive_label_gc_formats(LabelWidget *format);
 
 
+static void lru_unlink(LabelWidget *peer) {
+	if (!peer->lru_prev && lru_head != peer) {
+		return;
+	}
+
+	if (peer->lru_prev) {
+		peer->lru_prev->lru_next = peer->lru_next;
+	}
+	else {
+		lru_head = peer->lru_next;
+	}
+	if (peer->lru_next) {
+		peer->lru_next->lru_prev = peer->lru_prev;
+	}
+	else {
+		lru_tail = peer->lru_prev;
+	}
+
+	peer->lru_prev = peer->lru_next = NULL;
+}
+
+
+static void lru_touch(LabelWidget *peer) {
+	if (lru_head == peer) {
+		return;
+	}
+
+	lru_unlink(peer);
+
+	peer->lru_next = lru_head;
+	if (lru_head) {
+		lru_head->lru_prev = peer;
+	}
+	else {
+		lru_tail = peer;
+	}
+	lru_head = peer;
+}
+
+
 int jiveL_label_skin(lua_State *L) {
 	LabelWidget *peer;
 	JiveTile *bg_tile;
@@ -150,6 +201,7 @@ static void prepare(lua_State *L) {
 
 	/* free existing text surfaces */
 	jive_label_gc_lines(peer);
+	peer->shed = false;
 
 	/* split multi-line text */
 	lua_getglobal(L, "tostring");
@@ -229,6 +281,11 @@ static void prepare(lua_State *L) {
 		line->text_sh = is_sh ? jive_font_draw_text(font, sh, tmp) : NULL;
 		line->text_fg = jive_font_draw_text(font, fg, tmp);
 
+		if (line->text_sh) {
+			peer->text_bytes += jive_surface_get_bytes(line->text_sh);
+		}
+		peer->text_bytes += jive_surface_get_bytes(line->text_fg);
+
 		/* label dimensions */
 		jive_surface_get_size(line->text_fg, &width, NULL);
 		max_width = MAX(max_width, width);
@@ -250,6 +307,9 @@ static void prepare(lua_State *L) {
 	peer->text_h = total_height;
 	peer->text_w = max_width;
 
+	lru_bytes += peer->text_bytes;
+	lru_touch(peer);
+
 	/* reset scroll position */
 	peer->scroll_offset = SCROLL_PAD_START;
 }
@@ -407,11 +467,21 @@ int jiveL_label_draw(lua_State *L) {
 
 	//jive_surface_boxColor(srf, peer->w.bounds.x, peer->w.bounds.y, peer->w.bounds.x + peer->w.bounds.w-1, peer->w.bounds.y + peer->w.bounds.h-1, 0x00FF007F);
 
+	/* render the text again if it was shed */
+	if (drawLayer && peer->shed) {
+		int scroll_offset = peer->scroll_offset;
+
+		jiveL_label_layout(L);
+		peer->scroll_offset = scroll_offset;
+	}
+
 	/* draw text label */
 	if (!(drawLayer && peer->num_lines)) {
 		return 0;
 	}
 
+	lru_touch(peer);
+
 	for (i = 0; i < peer->num_lines; i++) {
 		Uint16 w, h, o, s;
 		Uint16 text_w;
@@ -493,9 +563,44 @@ int jiveL_label_get_preferred_bounds(lua_State *L) {
 }
 
 
+int jiveL_label_text_cache_usage(lua_State *L) {
+	lua_pushinteger(L, lru_bytes);
+	return 1;
+}
+
+
+int jiveL_label_shed_text_cache(lua_State *L) {
+	size_t bytes, start = lru_bytes;
+
+	/* stack is:
+	 * 1: Label
+	 * 2: bytes
+	 *
+	 * frees the text of the least recently drawn labels, returns the
+	 * bytes freed. the text is rendered again when the label is drawn.
+	 */
+
+	bytes = luaL_checkinteger(L, 2);
+
+	while (lru_tail && start - lru_bytes < bytes) {
+		LabelWidget *peer = lru_tail;
+
+		jive_label_gc_lines(peer);
+		peer->shed = true;
+	}
+
+	lua_pushinteger(L, start - lru_bytes);
+	return 1;
+}
+
+
 static void jive_label_gc_lines(LabelWidget *peer) {
 	size_t i;
 
+	lru_unlink(peer);
+	lru_bytes -= peer->text_bytes;
+	peer->text_bytes = 0;
+
 	if (!peer->num_lines) {
 		return;
 	}
@@ -774,3 +774,53 @@ JiveFont *jive_style_array_font(lua_State *L, int index, const char *array, int
 
 	return value;
 }
+
+
+/* approximate size of a style cache entry, used for memory accounting */
+#define STYLE_CACHE_ENTRY_BYTES 64
+
+int jiveL_style_cache_usage(lua_State *L) {
+	int n = 0;
+
+	/* returns the approximate bytes used by the style cache */
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "jiveStyleCache");
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			n++;
+
+			if (lua_istable(L, -1)) {
+				lua_pushnil(L);
+				while (lua_next(L, -2) != 0) {
+					n++;
+					lua_pop(L, 1);
+				}
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_pushinteger(L, n * STYLE_CACHE_ENTRY_BYTES);
+	return 1;
+}
+
+
+int jiveL_style_shed_cache(lua_State *L) {
+
+	/* stack is:
+	 * 1: framework
+	 * 2: bytes
+	 *
+	 * clears the style cache, returns the approximate bytes freed. the
+	 * style values are looked up again when they are next used.
+	 */
+
+	jiveL_style_cache_usage(L);
+
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "jiveStyleCache");
+
+	return 1;
+}
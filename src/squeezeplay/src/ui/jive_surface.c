@@ -7,6 +7,14 @@
 #include "common.h"
 #include "jive.h"
 
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#endif
+
 #ifndef JIVE_NO_DISPLAY
 
 /*
@@ -30,6 +38,7 @@ struct loaded_image_surface {
 #define MAX_LOADED_IMAGES 75
 static struct loaded_image_surface lruHead, lruTail;
 static Uint16 nloadedImages;
+static size_t loadedImageBytes;
 
 struct image {
 	const char * path;
@@ -62,6 +71,10 @@ struct jive_surface {
 	SDL_Surface *sdl;
 	Sint16 offset_x, offset_y;
 
+	/* pixel cache file mapped for the sdl pixels */
+	char *map;
+	size_t map_len;
+
 	/* Fields for tiles */
 	Uint16 image[9];
 	Uint16 w[2];
@@ -80,6 +93,8 @@ struct jive_surface {
 
 #define IS_DYNAMIC_IMAGE(tile) ((tile)->flags & (TILE_FLAG_IMAGE | TILE_FLAG_TILE))
 
+static void jive_surface_free_sdl(JiveSurface *srf);
+
 #ifdef SCREEN_ROTATION_ENABLED
 static SDL_Surface *real_sdl = NULL;
 #endif
@@ -136,6 +151,7 @@ static void _unload_image(Uint16 index) {
 
 	if (loaded->next) {
 		nloadedImages--;	/* only counted if actually in LRU list */
+		loadedImageBytes -= loaded->srf->pitch * loaded->srf->h;
 		loaded->prev->next = loaded->next;
 		loaded->next->prev = loaded->prev;
 	}
@@ -192,12 +208,32 @@ static void _use_image(Uint16 index) {
 		loaded->prev = &lruHead;
 		lruHead.next = loaded;
 
+		loadedImageBytes += loaded->srf->pitch * loaded->srf->h;
+
 		if (++nloadedImages > MAX_LOADED_IMAGES) {
 			_unload_image(lruTail.prev->image);
 		}
 	}
 }
 
+/* bytes used by the images in the LRU list */
+size_t jive_surface_image_cache_usage(void) {
+	return loadedImageBytes;
+}
+
+/* unload the least recently used images until bytes have been freed,
+ * returns the bytes freed. the images are loaded again when next drawn.
+ */
+size_t jive_surface_shed_image_cache(size_t bytes) {
+	size_t start = loadedImageBytes;
+
+	while (nloadedImages && start - loadedImageBytes < bytes) {
+		_unload_image(lruTail.prev->image);
+	}
+
+	return start - loadedImageBytes;
+}
+
 static void _load_image (Uint16 index, bool hasAlphaFlags, Uint32 alphaFlags) {
 	struct image *image = &images[index];
 	SDL_Surface *tmp, *srf;
@@ -613,8 +649,7 @@ void jive_tile_free(JiveTile *tile) {
 	}
 
 	if (tile->sdl) {
-		SDL_FreeSurface (tile->sdl);
-		tile->sdl = NULL;
+		jive_surface_free_sdl(tile);
 	}
 
 	else for (i=0; i<9; i++) {
@@ -979,7 +1014,7 @@ static JiveSurface *jive_surface_display_format(JiveSurface *srf) {
 	else {
 		sdl = SDL_DisplayFormat(srf->sdl);
 	}
-	SDL_FreeSurface(srf->sdl);
+	jive_surface_free_sdl(srf);
 	srf->sdl = sdl;
 
 	return srf;
@@ -1003,6 +1038,511 @@ JiveSurface *jive_surface_load_image_data(const char *data, size_t len) {
 }
 
 
+/*
+ * Asynchronous image decoding. Compressed image data is decoded (and
+ * optionally scaled) on a worker thread so that artwork arriving while
+ * a menu scrolls does not stall the ui. The conversion to the display
+ * format must be done on the main thread, and happens when the result
+ * is collected. The same thread writes pixel cache files.
+ *
+ * The thread writes a byte to a socketpair for each result, so the ui
+ * waits for results in the network select rather than polling.
+ */
+struct decode_request {
+	struct decode_request *next;
+	int ticket;
+	char *data;
+	size_t len;
+	Uint16 w, h;
+	SDL_Surface *sdl;
+
+	/* if set, data is written to this file rather than decoded */
+	char *path;
+};
+
+static SDL_Thread *decode_thread;
+static SDL_mutex *decode_mutex;
+static SDL_cond *decode_cond;
+static struct decode_request *decode_pending, *decode_pending_tail;
+static struct decode_request *decode_done, *decode_done_tail;
+static int decode_ticket;
+
+#ifdef WIN32
+/* from jive_dns.c */
+extern int socketpair(int domain, int type, int protocol, SOCKET socks[2]);
+
+static SOCKET decode_fd[2];
+#define DECODE_CLOSESOCKET(s) closesocket(s)
+#else
+static int decode_fd[2];
+#define DECODE_CLOSESOCKET(s) close(s)
+#endif
+
+
+static int write_file(const char *path, const char *data, size_t len);
+
+
+static int decode_image_thread(void *unused) {
+	struct decode_request *req;
+	SDL_Surface *sdl, *tmp;
+
+	while (1) {
+		SDL_LockMutex(decode_mutex);
+		while (!decode_pending) {
+			SDL_CondWait(decode_cond, decode_mutex);
+		}
+
+		req = decode_pending;
+		decode_pending = req->next;
+		if (!decode_pending) {
+			decode_pending_tail = NULL;
+		}
+		SDL_UnlockMutex(decode_mutex);
+
+		if (req->path) {
+			if (!write_file(req->path, req->data, req->len)) {
+				LOG_DEBUG(log_ui, "Can't write pixel cache file %s", req->path);
+			}
+
+			free(req->path);
+			free(req->data);
+			free(req);
+			continue;
+		}
+
+		sdl = IMG_Load_RW(SDL_RWFromConstMem(req->data, (int) req->len), 1);
+
+		/* same rule as SlimServer used to apply in lua: resize unless
+		 * one dimension already matches */
+		if (sdl && sdl->w && sdl->h && req->w && req->h
+		    && sdl->w != req->w && sdl->h != req->h) {
+			tmp = rotozoomSurface(sdl, 0, (double) req->w / sdl->w, 1);
+			if (tmp) {
+				SDL_FreeSurface(sdl);
+				sdl = tmp;
+			}
+		}
+
+		free(req->data);
+		req->data = NULL;
+		req->sdl = sdl;
+		req->next = NULL;
+
+		SDL_LockMutex(decode_mutex);
+		if (decode_done_tail) {
+			decode_done_tail->next = req;
+		}
+		else {
+			decode_done = req;
+		}
+		decode_done_tail = req;
+
+		/* written before the result can be collected, so collecting
+		 * it never waits for the byte */
+		send(decode_fd[1], "", 1, 0);
+		SDL_UnlockMutex(decode_mutex);
+	}
+
+	return 0;
+}
+
+
+static int decode_thread_start(void) {
+	if (decode_thread) {
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, decode_fd) < 0) {
+		LOG_ERROR(log_ui, "Can't create image decode socket");
+		return 0;
+	}
+
+	decode_mutex = SDL_CreateMutex();
+	decode_cond = SDL_CreateCond();
+	if (decode_mutex && decode_cond) {
+		decode_thread = SDL_CreateThread(decode_image_thread, NULL);
+	}
+
+	if (!decode_thread) {
+		LOG_ERROR(log_ui, "Can't create image decode thread");
+
+		DECODE_CLOSESOCKET(decode_fd[0]);
+		DECODE_CLOSESOCKET(decode_fd[1]);
+
+		if (decode_cond) {
+			SDL_DestroyCond(decode_cond);
+			decode_cond = NULL;
+		}
+		if (decode_mutex) {
+			SDL_DestroyMutex(decode_mutex);
+			decode_mutex = NULL;
+		}
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/* queue a request for the worker thread, returns its ticket */
+static int decode_queue(struct decode_request *req) {
+	int ticket;
+
+	SDL_LockMutex(decode_mutex);
+	if (++decode_ticket <= 0) {
+		decode_ticket = 1;
+	}
+	req->ticket = ticket = decode_ticket;
+
+	if (decode_pending_tail) {
+		decode_pending_tail->next = req;
+	}
+	else {
+		decode_pending = req;
+	}
+	decode_pending_tail = req;
+
+	SDL_CondSignal(decode_cond);
+	SDL_UnlockMutex(decode_mutex);
+
+	return ticket;
+}
+
+
+int jive_surface_load_image_data_async(const char *data, size_t len, Uint16 w, Uint16 h) {
+	struct decode_request *req;
+
+	if (!decode_thread_start()) {
+		return 0;
+	}
+
+	req = calloc(sizeof(struct decode_request), 1);
+	if (!req) {
+		return 0;
+	}
+	req->data = malloc(len);
+	if (!req->data) {
+		free(req);
+		return 0;
+	}
+	memcpy(req->data, data, len);
+	req->len = len;
+	req->w = w;
+	req->h = h;
+
+	return decode_queue(req);
+}
+
+
+/* returns the socket that is readable when a result can be collected,
+ * or -1 if images can't be decoded in the background */
+int jive_surface_load_image_data_fd(void) {
+	if (!decode_thread_start()) {
+		return -1;
+	}
+
+	return (int) decode_fd[0];
+}
+
+
+JiveSurface *jive_surface_load_image_data_result(int *ticket) {
+	struct decode_request *req;
+	JiveSurface *srf;
+	char c;
+
+	*ticket = 0;
+
+	if (!decode_thread) {
+		return NULL;
+	}
+
+	SDL_LockMutex(decode_mutex);
+	req = decode_done;
+	if (req) {
+		decode_done = req->next;
+		if (!decode_done) {
+			decode_done_tail = NULL;
+		}
+	}
+	SDL_UnlockMutex(decode_mutex);
+
+	if (!req) {
+		return NULL;
+	}
+
+	/* consume the byte for this result */
+	recv(decode_fd[0], &c, 1, 0);
+
+	*ticket = req->ticket;
+
+	srf = calloc(sizeof(JiveSurface), 1);
+	srf->refcount = 1;
+	srf->sdl = req->sdl;
+	free(req);
+
+	return jive_surface_display_format(srf);
+}
+
+
+/*
+ * Pixel cache files hold a surface already converted to the display
+ * format, so they can be shown without decoding. The key is stored in
+ * the file to guard against hash collisions in the file name. The
+ * pixels start aligned, so a loaded surface uses the file mapping for
+ * its pixels.
+ */
+#define PIXEL_CACHE_MAGIC 0x4a505832 /* JPX2 */
+
+struct pixel_cache_header {
+	Uint32 magic;
+	Uint16 w, h;
+	Uint16 pitch;
+	Uint8 bpp;
+	Uint8 pad;
+	Uint32 rmask, gmask, bmask, amask;
+	Uint32 key_len;
+};
+
+#define PIXEL_CACHE_PIXELS(key_len) ((sizeof(struct pixel_cache_header) + (key_len) + 15) & ~15)
+
+
+static char *map_file(const char *path, size_t *len) {
+#ifndef WIN32
+	struct stat st;
+	char *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* private and writable, drawing on the surface must not change
+	 * the file */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	*len = st.st_size;
+	return map;
+#else
+	FILE *fp;
+	char *buf;
+	long n;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	buf = (n > 0) ? malloc(n) : NULL;
+	if (!buf || fread(buf, 1, n, fp) != (size_t) n) {
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+
+	*len = n;
+	return buf;
+#endif
+}
+
+
+static void unmap_file(char *map, size_t len) {
+#ifndef WIN32
+	munmap(map, len);
+#else
+	free(map);
+#endif
+}
+
+
+static void jive_surface_free_sdl(JiveSurface *srf) {
+	SDL_FreeSurface(srf->sdl);
+	srf->sdl = NULL;
+
+	if (srf->map) {
+		unmap_file(srf->map, srf->map_len);
+		srf->map = NULL;
+	}
+}
+
+
+/* write a temporary file and rename it, so a partial file is never seen
+ * by a reader */
+static int write_file(const char *path, const char *data, size_t len) {
+	char *tmppath;
+	FILE *fp;
+	int ok;
+
+	tmppath = malloc(strlen(path) + 5);
+	if (!tmppath) {
+		return 0;
+	}
+	sprintf(tmppath, "%s.tmp", path);
+
+	fp = fopen(tmppath, "wb");
+	if (!fp) {
+		free(tmppath);
+		return 0;
+	}
+
+	ok = (fwrite(data, 1, len, fp) == len);
+
+	if (fclose(fp) != 0) {
+		ok = 0;
+	}
+
+#ifdef WIN32
+	if (ok) {
+		remove(path);
+	}
+#endif
+	if (!ok || rename(tmppath, path) != 0) {
+		remove(tmppath);
+		ok = 0;
+	}
+
+	free(tmppath);
+	return ok;
+}
+
+
+/* the file is written by the worker thread, returns its size in bytes */
+int jive_surface_save_pixels(JiveSurface *srf, const char *path, const char *key) {
+	struct pixel_cache_header hdr;
+	struct decode_request *req;
+	SDL_Surface *sdl;
+	char *pixels;
+	size_t len;
+	Uint16 y;
+
+	sdl = srf->sdl;
+	if (!sdl) {
+		LOG_ERROR(log_ui, "Underlying sdl surface already freed, possibly with release()");
+		return 0;
+	}
+
+	if (!decode_thread_start()) {
+		return 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PIXEL_CACHE_MAGIC;
+	hdr.w = sdl->w;
+	hdr.h = sdl->h;
+	hdr.pitch = sdl->w * sdl->format->BytesPerPixel;
+	hdr.bpp = sdl->format->BitsPerPixel;
+	hdr.rmask = sdl->format->Rmask;
+	hdr.gmask = sdl->format->Gmask;
+	hdr.bmask = sdl->format->Bmask;
+	hdr.amask = sdl->format->Amask;
+	hdr.key_len = strlen(key);
+
+	req = calloc(sizeof(struct decode_request), 1);
+	if (!req) {
+		return 0;
+	}
+	req->len = len = PIXEL_CACHE_PIXELS(hdr.key_len) + (size_t) hdr.h * hdr.pitch;
+	req->data = calloc(len, 1);
+	req->path = strdup(path);
+	if (!req->data || !req->path) {
+		free(req->data);
+		free(req->path);
+		free(req);
+		return 0;
+	}
+
+	memcpy(req->data, &hdr, sizeof(hdr));
+	memcpy(req->data + sizeof(hdr), key, hdr.key_len);
+
+	pixels = req->data + PIXEL_CACHE_PIXELS(hdr.key_len);
+
+	if (SDL_MUSTLOCK(sdl)) {
+		SDL_LockSurface(sdl);
+	}
+	for (y = 0; y < hdr.h; y++) {
+		memcpy(pixels + y * hdr.pitch, (Uint8 *)sdl->pixels + y * sdl->pitch, hdr.pitch);
+	}
+	if (SDL_MUSTLOCK(sdl)) {
+		SDL_UnlockSurface(sdl);
+	}
+
+	decode_queue(req);
+
+	return (int) len;
+}
+
+
+JiveSurface *jive_surface_load_pixels(const char *path, const char *key) {
+	struct pixel_cache_header hdr;
+	SDL_Surface *sdl, *video;
+	JiveSurface *srf;
+	char *map;
+	size_t len, key_len;
+
+	map = map_file(path, &len);
+	if (!map) {
+		return NULL;
+	}
+
+	key_len = strlen(key);
+
+	if (len < sizeof(hdr)) {
+		goto bad_file;
+	}
+	memcpy(&hdr, map, sizeof(hdr));
+
+	if (hdr.magic != PIXEL_CACHE_MAGIC
+	    || hdr.key_len != key_len
+	    || len < PIXEL_CACHE_PIXELS(key_len) + (size_t) hdr.h * hdr.pitch
+	    || memcmp(map + sizeof(hdr), key, key_len) != 0) {
+		goto bad_file;
+	}
+
+	/* the surface pixels are the mapped file */
+	sdl = SDL_CreateRGBSurfaceFrom(map + PIXEL_CACHE_PIXELS(key_len), hdr.w, hdr.h, hdr.bpp, hdr.pitch, hdr.rmask, hdr.gmask, hdr.bmask, hdr.amask);
+	if (!sdl) {
+		goto bad_file;
+	}
+
+	srf = calloc(sizeof(JiveSurface), 1);
+	srf->refcount = 1;
+	srf->sdl = sdl;
+	srf->map = map;
+	srf->map_len = len;
+
+	/* convert if the display format has changed since it was saved */
+	video = SDL_GetVideoSurface();
+	if (!hdr.amask && video
+	    && (video->format->BitsPerPixel != hdr.bpp
+		|| video->format->Rmask != hdr.rmask
+		|| video->format->Gmask != hdr.gmask
+		|| video->format->Bmask != hdr.bmask)) {
+		srf = jive_surface_display_format(srf);
+	}
+
+	return srf;
+
+ bad_file:
+	unmap_file(map, len);
+	return NULL;
+}
+
+
 int jive_surface_set_wm_icon(JiveSurface *srf) {
 	SDL_WM_SetIcon(_resolve_SDL_surface(srf), NULL);
 	return 1;
@@ -1347,8 +1887,7 @@ void jive_surface_release(JiveSurface *srf) {
 	}
 
 	if (srf->sdl) {
-		SDL_FreeSurface (srf->sdl);
-		srf->sdl = NULL;
+		jive_surface_free_sdl(srf);
 	}
 }
 
@@ -1693,6 +2232,16 @@ JiveSurface *jive_surface_load_image(const char *path) {return DUMMY_SURFACE;}
 
 JiveSurface *jive_surface_load_image_data(const char *data, size_t len) {return DUMMY_SURFACE;}
 
+int jive_surface_load_image_data_async(const char *data, size_t len, Uint16 w, Uint16 h) {return 0;}
+
+int jive_surface_load_image_data_fd(void) {return -1;}
+
+JiveSurface *jive_surface_load_image_data_result(int *ticket) {*ticket = 0; return NULL;}
+
+int jive_surface_save_pixels(JiveSurface *srf, const char *path, const char *key) {return 0;}
+
+JiveSurface *jive_surface_load_pixels(const char *path, const char *key) {return NULL;}
+
 int jive_surface_set_wm_icon(JiveSurface *srf) {return 1;}
 
 int jive_surface_save_bmp(JiveSurface *srf, const char *file) {return 0;}
@@ -1730,6 +2279,10 @@ void jive_surface_get_size(JiveSurface *srf, Uint16 *w, Uint16 *h) {
 
 int jive_surface_get_bytes(JiveSurface *srf) {return 0;}
 
+size_t jive_surface_image_cache_usage(void) {return 0;}
+
+size_t jive_surface_shed_image_cache(size_t bytes) {return 0;}
+
 void jive_surface_free(JiveSurface *srf) {return;}
 
 void jive_surface_release(JiveSurface *srf) {return;}
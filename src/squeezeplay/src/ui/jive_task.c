@@ -0,0 +1,293 @@
+/*
+** Copyright 2010 Logitech. All Rights Reserved.
+**
+** This file is licensed under BSD. Please see the LICENSE file for details.
+*/
+
+#include "common.h"
+#include "jive.h"
+
+
+/* Run queue for jive.ui.Task.
+ *
+ * Each priority has a doubly linked queue with head and tail pointers,
+ * so adding and removing a task is O(1). Each Lua task owns a node
+ * userdata that links it into its queue and records its run time. While
+ * a task is queued the queue holds a reference to the Lua task object.
+ *
+ * The run queue is iterated by the event loop while tasks are added and
+ * removed, the iterator cursor is moved back if its task is removed.
+ */
+
+#define TASK_PRIORITIES 3
+
+struct task_node {
+	struct task_node *prev, *next;
+	int priority;
+	int queued;
+	int ref;	/* reference to the task object while queued */
+
+	/* runtime accounting */
+	Uint32 resumes;
+	Uint32 yields;
+	Uint64 runtime;	/* microseconds */
+	Uint32 max_slice;
+	Uint64 t0;
+};
+
+static struct task_node *queue_head[TASK_PRIORITIES];
+static struct task_node *queue_tail[TASK_PRIORITIES];
+
+static int iter_priority = 0;
+static struct task_node *iter_pos = NULL;
+
+lua_Hook jive_task_hook = NULL;
+int jive_task_hook_count = 0;
+
+
+static int jiveL_task_node(lua_State *L) {
+	struct task_node *node;
+	int priority;
+
+	/* stack is:
+	 * 1: priority
+	 */
+
+	priority = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, priority >= 1 && priority <= TASK_PRIORITIES, 1, "invalid priority");
+
+	node = lua_newuserdata(L, sizeof(struct task_node));
+	memset(node, 0, sizeof(struct task_node));
+	node->priority = priority - 1;
+	node->ref = LUA_NOREF;
+
+	luaL_getmetatable(L, "jive.taskqueue.node");
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+
+static int jiveL_task_add(lua_State *L) {
+	struct task_node *node;
+	int p;
+
+	/* stack is:
+	 * 1: node
+	 * 2: task
+	 */
+
+	node = luaL_checkudata(L, 1, "jive.taskqueue.node");
+	if (node->queued) {
+		return 0;
+	}
+
+	lua_pushvalue(L, 2);
+	node->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	p = node->priority;
+	node->next = NULL;
+	node->prev = queue_tail[p];
+	if (queue_tail[p]) {
+		queue_tail[p]->next = node;
+	}
+	else {
+		queue_head[p] = node;
+	}
+	queue_tail[p] = node;
+	node->queued = 1;
+
+	return 0;
+}
+
+
+static int jiveL_task_remove(lua_State *L) {
+	struct task_node *node;
+	int p;
+
+	/* stack is:
+	 * 1: node
+	 */
+
+	node = luaL_checkudata(L, 1, "jive.taskqueue.node");
+	if (!node->queued) {
+		return 0;
+	}
+
+	if (iter_pos == node) {
+		iter_pos = node->prev;
+	}
+
+	p = node->priority;
+	if (node->prev) {
+		node->prev->next = node->next;
+	}
+	else {
+		queue_head[p] = node->next;
+	}
+	if (node->next) {
+		node->next->prev = node->prev;
+	}
+	else {
+		queue_tail[p] = node->prev;
+	}
+
+	node->prev = node->next = NULL;
+	node->queued = 0;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, node->ref);
+	node->ref = LUA_NOREF;
+
+	return 0;
+}
+
+
+static int jiveL_task_rewind(lua_State *L) {
+	iter_priority = 0;
+	iter_pos = NULL;
+
+	return 0;
+}
+
+
+static int jiveL_task_next(lua_State *L) {
+	struct task_node *node;
+
+	/* returns the next queued task, in priority order. tasks added
+	 * while iterating are returned if they are after the cursor.
+	 */
+
+	while (1) {
+		node = (iter_pos) ? iter_pos->next : queue_head[iter_priority];
+		if (node) {
+			iter_pos = node;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, node->ref);
+			return 1;
+		}
+
+		if (iter_priority == TASK_PRIORITIES - 1) {
+			return 0;
+		}
+
+		iter_priority++;
+		iter_pos = NULL;
+	}
+}
+
+
+static int jiveL_task_list(lua_State *L) {
+	struct task_node *node;
+	int p, i = 1;
+
+	lua_newtable(L);
+	for (p = 0; p < TASK_PRIORITIES; p++) {
+		for (node = queue_head[p]; node; node = node->next) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, node->ref);
+			lua_rawseti(L, -2, i++);
+		}
+	}
+
+	return 1;
+}
+
+
+static int jiveL_task_begin(lua_State *L) {
+	struct task_node *node;
+
+	/* stack is:
+	 * 1: node
+	 * 2: coroutine
+	 */
+
+	node = luaL_checkudata(L, 1, "jive.taskqueue.node");
+
+	/* coroutines created before a hook was installed don't inherit it */
+	if (jive_task_hook && lua_isthread(L, 2)) {
+		lua_State *T = lua_tothread(L, 2);
+
+		if (lua_gethook(T) == NULL) {
+			lua_sethook(T, jive_task_hook, LUA_MASKCOUNT, jive_task_hook_count);
+		}
+	}
+
+	node->t0 = jive_micros();
+
+	return 0;
+}
+
+
+static int jiveL_task_finish(lua_State *L) {
+	struct task_node *node;
+	Uint32 slice;
+
+	/* stack is:
+	 * 1: node
+	 * 2: true if the task yielded
+	 */
+
+	node = luaL_checkudata(L, 1, "jive.taskqueue.node");
+
+	slice = (Uint32)(jive_micros() - node->t0);
+	node->runtime += slice;
+	if (slice > node->max_slice) {
+		node->max_slice = slice;
+	}
+
+	node->resumes++;
+	if (lua_toboolean(L, 2)) {
+		node->yields++;
+	}
+
+	return 0;
+}
+
+
+static int jiveL_task_stats(lua_State *L) {
+	struct task_node *node;
+
+	/* stack is:
+	 * 1: node
+	 */
+
+	node = luaL_checkudata(L, 1, "jive.taskqueue.node");
+
+	lua_createtable(L, 0, 4);
+
+	lua_pushinteger(L, node->resumes);
+	lua_setfield(L, -2, "resumes");
+
+	lua_pushinteger(L, node->yields);
+	lua_setfield(L, -2, "yields");
+
+	lua_pushnumber(L, (lua_Number)node->runtime / 1000);
+	lua_setfield(L, -2, "runtime");
+
+	lua_pushnumber(L, (lua_Number)node->max_slice / 1000);
+	lua_setfield(L, -2, "maxSlice");
+
+	return 1;
+}
+
+
+static const struct luaL_Reg taskqueue_lib[] = {
+	{ "node", jiveL_task_node },
+	{ "add", jiveL_task_add },
+	{ "remove", jiveL_task_remove },
+	{ "rewind", jiveL_task_rewind },
+	{ "next", jiveL_task_next },
+	{ "list", jiveL_task_list },
+	{ "begin", jiveL_task_begin },
+	{ "finish", jiveL_task_finish },
+	{ "stats", jiveL_task_stats },
+	{ NULL, NULL }
+};
+
+
+int luaopen_jive_taskqueue(lua_State *L) {
+	luaL_newmetatable(L, "jive.taskqueue.node");
+	lua_pop(L, 1);
+
+	luaL_register(L, "jive.taskqueue", taskqueue_lib);
+
+	return 0;
+}
@@ -0,0 +1,233 @@
+/*
+** Copyright 2010 Logitech. All Rights Reserved.
+**
+** This file is licensed under BSD. Please see the LICENSE file for details.
+*/
+
+#include "common.h"
+#include "jive.h"
+
+
+/* Timer queue for jive.ui.Timer.
+ *
+ * Running timers are kept in a binary min-heap ordered by expiry time,
+ * timers with the same expiry time run in the order they were started.
+ * Each Lua timer owns a node userdata that records its position in the
+ * heap, so starting, restarting and stopping a timer is O(log n). While
+ * a timer is queued the heap holds a reference to the Lua timer object.
+ */
+
+struct timer_node {
+	Uint32 expires;
+	Uint32 seq;
+	int index;	/* position in the heap, 0 when not queued */
+	int ref;	/* reference to the timer object while queued */
+};
+
+static struct timer_node **heap = NULL;
+static int heap_size = 0;
+static int heap_alloc = 0;
+
+static Uint32 timer_seq = 0;
+
+
+/* compare expiry times allowing for the jiffies wrapping */
+static inline int node_before(struct timer_node *a, struct timer_node *b) {
+	Sint32 d = (Sint32)(a->expires - b->expires);
+
+	if (d == 0) {
+		return (Sint32)(a->seq - b->seq) < 0;
+	}
+	return d < 0;
+}
+
+
+static inline void heap_set(int i, struct timer_node *node) {
+	heap[i] = node;
+	node->index = i;
+}
+
+
+static void heap_up(int i) {
+	struct timer_node *node = heap[i];
+
+	while (i > 1 && node_before(node, heap[i / 2])) {
+		heap_set(i, heap[i / 2]);
+		i = i / 2;
+	}
+	heap_set(i, node);
+}
+
+
+static void heap_down(int i) {
+	struct timer_node *node = heap[i];
+	int child;
+
+	while ((child = i * 2) <= heap_size) {
+		if (child < heap_size && node_before(heap[child + 1], heap[child])) {
+			child++;
+		}
+		if (!node_before(heap[child], node)) {
+			break;
+		}
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	heap_set(i, node);
+}
+
+
+static void heap_remove(lua_State *L, struct timer_node *node) {
+	int i = node->index;
+	struct timer_node *last;
+
+	last = heap[heap_size--];
+	if (last != node) {
+		heap_set(i, last);
+		heap_up(i);
+		heap_down(last->index);
+	}
+
+	node->index = 0;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, node->ref);
+	node->ref = LUA_NOREF;
+}
+
+
+static int jiveL_timer_node(lua_State *L) {
+	struct timer_node *node;
+
+	node = lua_newuserdata(L, sizeof(struct timer_node));
+	memset(node, 0, sizeof(struct timer_node));
+	node->ref = LUA_NOREF;
+
+	luaL_getmetatable(L, "jive.timerqueue.node");
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+
+static int jiveL_timer_insert(lua_State *L) {
+	struct timer_node *node;
+
+	/* stack is:
+	 * 1: node
+	 * 2: expires
+	 * 3: timer
+	 */
+
+	node = luaL_checkudata(L, 1, "jive.timerqueue.node");
+	node->expires = (Uint32) luaL_checknumber(L, 2);
+	node->seq = timer_seq++;
+
+	if (node->index) {
+		/* already queued, move to the new position */
+		heap_up(node->index);
+		heap_down(node->index);
+		return 0;
+	}
+
+	if (heap_size + 1 >= heap_alloc) {
+		int n = heap_alloc ? heap_alloc * 2 : 64;
+		struct timer_node **tmp = realloc(heap, n * sizeof(struct timer_node *));
+		if (!tmp) {
+			return luaL_error(L, "out of memory");
+		}
+		heap = tmp;
+		heap_alloc = n;
+	}
+
+	lua_pushvalue(L, 3);
+	node->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	heap_set(++heap_size, node);
+	heap_up(heap_size);
+
+	return 0;
+}
+
+
+static int jiveL_timer_remove(lua_State *L) {
+	struct timer_node *node;
+
+	/* stack is:
+	 * 1: node
+	 */
+
+	node = luaL_checkudata(L, 1, "jive.timerqueue.node");
+	if (node->index) {
+		heap_remove(L, node);
+	}
+
+	return 0;
+}
+
+
+static int jiveL_timer_next(lua_State *L) {
+	if (heap_size == 0) {
+		return 0;
+	}
+
+	lua_pushinteger(L, heap[1]->expires);
+	return 1;
+}
+
+
+static int jiveL_timer_expired(lua_State *L) {
+	struct timer_node *node;
+	Uint32 now;
+
+	/* stack is:
+	 * 1: now
+	 *
+	 * returns the next expired timer and its expiry time, the timer is
+	 * removed from the queue.
+	 */
+
+	now = (Uint32) luaL_checknumber(L, 1);
+
+	if (heap_size == 0) {
+		return 0;
+	}
+
+	node = heap[1];
+	if ((Sint32)(node->expires - now) > 0) {
+		return 0;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, node->ref);
+	lua_pushinteger(L, node->expires);
+
+	heap_remove(L, node);
+
+	return 2;
+}
+
+
+static int jiveL_timer_count(lua_State *L) {
+	lua_pushinteger(L, heap_size);
+	return 1;
+}
+
+
+static const struct luaL_Reg timerqueue_lib[] = {
+	{ "node", jiveL_timer_node },
+	{ "insert", jiveL_timer_insert },
+	{ "remove", jiveL_timer_remove },
+	{ "next", jiveL_timer_next },
+	{ "expired", jiveL_timer_expired },
+	{ "count", jiveL_timer_count },
+	{ NULL, NULL }
+};
+
+
+int luaopen_jive_timerqueue(lua_State *L) {
+	luaL_newmetatable(L, "jive.timerqueue.node");
+	lua_pop(L, 1);
+
+	luaL_register(L, "jive.timerqueue", timerqueue_lib);
+
+	return 0;
+}
@@ -325,6 +325,7 @@ int jiveL_widget_relayout(lua_State *L) {
 
 	/* mark widgets for layout until a layout root is reached */
 	dirty = true;
+	jive_layout_pending = true;
 	while (!lua_isnil(L, 1)) {
 		lua_getfield(L, 1, "peer");
 		peer = lua_touserdata(L, -1);
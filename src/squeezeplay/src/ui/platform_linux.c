@@ -247,7 +247,7 @@ static void print_trace(void)
 				while (ptr < end && *ptr != '\n') ptr++;
 
 				if (ptr < end) {
-					log_category_log(log_sp, LOG_PRIORITY_INFO, "%.*s", ptr-str, str);
+					log_category_log(log_sp, LOG_PRIORITY_INFO, "%.*s", (int) (ptr-str), str);
 					ptr++;
 					str = ptr;
 				}
@@ -297,8 +297,13 @@ static void segv_handler(int signum) {
 	sa.sa_flags = 0;
 	sigaction(signum, &sa, NULL);
 
+	/* the writer thread may hold the log lock, or be the thread that
+	 * crashed */
+	log_sync();
+
 	LOG_ERROR(log_sp, "SIGSEGV squeezeplay %s", JIVE_VERSION);
 	print_trace();
+	log_flush();
 
 	/* dump core */
 	raise(signum);
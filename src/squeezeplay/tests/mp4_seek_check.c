@@ -0,0 +1,477 @@
+/*
+** Copyright 2010 Logitech. All Rights Reserved.
+**
+** This file is licensed under BSD. Please see the LICENSE file for details.
+*/
+
+/*
+ * Checks that the mp4 parser plays a file with the moov box after mdat,
+ * using a local HTTP stand-in for the server. The file is requested as
+ * the stream would be, then with a Range header for each seek the parser
+ * asks for, like Playback.lua does.
+ *
+ * Two servers are checked. One answers ranged requests with 206 partial
+ * content, and every sample must then be read back. The other ignores
+ * the Range header and answers 200, as a server transcoding the stream
+ * does, and the parser must fail the open.
+ *
+ * This is not part of the player, make check builds and runs it. Pass
+ * -v to see the parser log. The exit status is non-zero on failure.
+ */
+
+#include "common.h"
+#include "audio/streambuf.h"
+#include "audio/decode/decode_priv.h"
+#include "audio/mp4.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#define CHECK_SAMPLES 40
+#define CHECK_SAMPLES_PER_CHUNK 8
+#define CHECK_FILE_SIZE 8192
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+
+LOG_CATEGORY *log_audio_codec;
+struct decode_audio *decode_audio;
+
+
+/* the fixture, ftyp, mdat, moov and a trailing free box */
+static u8_t file[CHECK_FILE_SIZE];
+static size_t file_len;
+static size_t mdat_data;
+
+
+/* the stand-in streambuf, a blocking http connection */
+static struct sockaddr_in server_addr;
+static int stream_fd = -1;
+static bool_t stream_eof;
+static enum streambuf_seek_state seek_state;
+static u64_t seek_offset;
+static int seek_count;
+
+
+static size_t sample_size(int i) {
+	return 100 + (i * 37) % 50;
+}
+
+
+static u8_t sample_byte(int i, size_t j) {
+	return (u8_t) ((i * 7 + j) & 0xff);
+}
+
+
+static void put_u32(u32_t v) {
+	file[file_len++] = (v >> 24) & 0xff;
+	file[file_len++] = (v >> 16) & 0xff;
+	file[file_len++] = (v >> 8) & 0xff;
+	file[file_len++] = v & 0xff;
+}
+
+
+static void put_bytes(const void *ptr, size_t n) {
+	memcpy(file + file_len, ptr, n);
+	file_len += n;
+}
+
+
+static void put_zero(size_t n) {
+	memset(file + file_len, 0, n);
+	file_len += n;
+}
+
+
+/* start a box, returns its offset for box_end() */
+static size_t box_start(const char *type, bool_t full) {
+	size_t start = file_len;
+
+	put_u32(0);
+	put_bytes(type, 4);
+	if (full) {
+		put_u32(0);
+	}
+
+	return start;
+}
+
+
+static void box_end(size_t start) {
+	size_t len = file_len;
+
+	file_len = start;
+	put_u32(len - start);
+	file_len = len;
+}
+
+
+static void build_file(void) {
+	size_t ftyp, mdat, moov, trak, mdia, minf, stbl, box, alac;
+	size_t pos, j;
+	int i;
+
+	ftyp = box_start("ftyp", FALSE);
+	put_bytes("M4A ", 4);
+	put_u32(0);
+	put_bytes("M4A mp42", 8);
+	box_end(ftyp);
+
+	mdat = box_start("mdat", FALSE);
+	mdat_data = file_len;
+	for (i = 0; i < CHECK_SAMPLES; i++) {
+		for (j = 0; j < sample_size(i); j++) {
+			file[file_len++] = sample_byte(i, j);
+		}
+	}
+	box_end(mdat);
+
+	moov = box_start("moov", FALSE);
+	trak = box_start("trak", FALSE);
+
+	box = box_start("tkhd", TRUE);
+	put_zero(8);
+	put_u32(1);
+	put_zero(60);
+	box_end(box);
+
+	mdia = box_start("mdia", FALSE);
+
+	box = box_start("mdhd", TRUE);
+	put_u32(0);
+	put_u32(0);
+	put_u32(44100);
+	put_u32(CHECK_SAMPLES * 4096);
+	put_zero(4);
+	box_end(box);
+
+	minf = box_start("minf", FALSE);
+	stbl = box_start("stbl", FALSE);
+
+	box = box_start("stsd", TRUE);
+	put_u32(1);
+	alac = box_start("alac", FALSE);
+	put_zero(6);
+	put_bytes("\0\1", 2);
+	put_zero(20);
+	j = box_start("alac", TRUE);
+	put_zero(24);
+	box_end(j);
+	box_end(alac);
+	box_end(box);
+
+	box = box_start("stts", TRUE);
+	put_u32(1);
+	put_u32(CHECK_SAMPLES);
+	put_u32(4096);
+	box_end(box);
+
+	box = box_start("stsz", TRUE);
+	put_u32(0);
+	put_u32(CHECK_SAMPLES);
+	for (i = 0; i < CHECK_SAMPLES; i++) {
+		put_u32(sample_size(i));
+	}
+	box_end(box);
+
+	box = box_start("stsc", TRUE);
+	put_u32(1);
+	put_u32(1);
+	put_u32(CHECK_SAMPLES_PER_CHUNK);
+	put_u32(1);
+	box_end(box);
+
+	box = box_start("stco", TRUE);
+	put_u32(CHECK_SAMPLES / CHECK_SAMPLES_PER_CHUNK);
+	for (i = 0, pos = mdat_data; i < CHECK_SAMPLES; i++) {
+		if (i % CHECK_SAMPLES_PER_CHUNK == 0) {
+			put_u32(pos);
+		}
+		pos += sample_size(i);
+	}
+	box_end(box);
+
+	box_end(stbl);
+	box_end(minf);
+	box_end(mdia);
+	box_end(trak);
+	box_end(moov);
+
+	box = box_start("free", FALSE);
+	put_zero(10);
+	box_end(box);
+}
+
+
+/* the stand-in server, it answers each request with the file from the
+ * requested offset. without range support the whole file is sent.
+ */
+static void serve(int listen_fd, bool_t ranges) {
+	char req[1024];
+	const char *status;
+	char *range;
+	size_t off, n;
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		n = 0;
+		while (n < sizeof(req) - 1 && recv(fd, req + n, 1, 0) == 1) {
+			req[++n] = '\0';
+			if (n >= 4 && memcmp(req + n - 4, "\r\n\r\n", 4) == 0) {
+				break;
+			}
+		}
+
+		off = 0;
+		status = "200 OK";
+
+		range = strstr(req, "Range: bytes=");
+		if (ranges && range) {
+			off = strtoul(range + 13, NULL, 10);
+			status = "206 Partial Content";
+		}
+		if (off > file_len) {
+			off = file_len;
+		}
+
+		snprintf(req, sizeof(req), "HTTP/1.0 %s\r\nContent-Length: %u\r\n\r\n",
+			 status, (unsigned int) (file_len - off));
+		send(fd, req, strlen(req), 0);
+		send(fd, file + off, file_len - off, 0);
+		close(fd);
+	}
+
+	_exit(0);
+}
+
+
+static pid_t server_start(bool_t ranges) {
+	socklen_t len = sizeof(server_addr);
+	pid_t pid;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (fd < 0
+	    || bind(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0
+	    || listen(fd, 4) < 0
+	    || getsockname(fd, (struct sockaddr *) &server_addr, &len) < 0) {
+		perror("mp4_seek_check: server");
+		exit(1);
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		serve(fd, ranges);
+	}
+	close(fd);
+
+	return pid;
+}
+
+
+static void server_stop(pid_t pid) {
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+
+/* connect and read the response headers, like the stream reader thread */
+static void stream_connect(u64_t offset, bool_t seek) {
+	char req[256], hdr[1024];
+	size_t n = 0;
+	int crlf = 0;
+
+	if (stream_fd >= 0) {
+		close(stream_fd);
+	}
+
+	stream_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (stream_fd < 0 || connect(stream_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+		perror("mp4_seek_check: connect");
+		exit(1);
+	}
+
+	if (seek) {
+		snprintf(req, sizeof(req), "GET /check.m4a HTTP/1.0\r\nRange: bytes=%llu-\r\n\r\n", (unsigned long long) offset);
+	}
+	else {
+		snprintf(req, sizeof(req), "GET /check.m4a HTTP/1.0\r\n\r\n");
+	}
+	send(stream_fd, req, strlen(req), 0);
+
+	while (crlf < 4 && n < sizeof(hdr) - 1 && recv(stream_fd, hdr + n, 1, 0) == 1) {
+		crlf = (hdr[n] == '\r' || hdr[n] == '\n') ? crlf + 1 : 0;
+		n++;
+	}
+	hdr[n] = '\0';
+
+	/* a seek needs partial content, see stream_reader_run */
+	if (seek && !strstr(hdr, " 206")) {
+		seek_state = STREAMBUF_SEEK_FAILED;
+	}
+	else {
+		seek_state = STREAMBUF_SEEK_NONE;
+	}
+	stream_eof = FALSE;
+}
+
+
+/* reconnect if the parser asked for a seek, as Playback.lua does */
+static void stream_poll(void) {
+	if (seek_state == STREAMBUF_SEEK_REQUESTED) {
+		seek_count++;
+		stream_connect(seek_offset, TRUE);
+	}
+}
+
+
+size_t streambuf_read(u8_t *buf, size_t min, size_t max, bool_t *streaming) {
+	ssize_t n = 0;
+
+	if (max && !stream_eof && seek_state == STREAMBUF_SEEK_NONE) {
+		/* small reads, so boxes are split across reads */
+		n = recv(stream_fd, buf, MIN(max, 61), 0);
+		if (n <= 0) {
+			stream_eof = TRUE;
+			n = 0;
+		}
+	}
+
+	if (streaming) {
+		*streaming = !stream_eof;
+	}
+	return n;
+}
+
+
+void streambuf_seek(u64_t offset) {
+	seek_offset = offset;
+	seek_state = STREAMBUF_SEEK_REQUESTED;
+}
+
+
+enum streambuf_seek_state streambuf_get_seek_state(void) {
+	return seek_state;
+}
+
+
+size_t fifo_bytes_used(struct fifo *fifo) {
+	return 0;
+}
+
+
+void *decode_alloc(size_t size) {
+	return calloc(size, 1);
+}
+
+
+void decode_free(void *ptr) {
+	free(ptr);
+}
+
+
+void log_category_vlog(struct log_category *category, enum log_priority priority, const char *format, va_list args) {
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+
+/* returns the number of samples read back correctly, or -1 if the open
+ * failed */
+static int check_stream(void) {
+	struct decode_mp4 mp4;
+	bool_t streaming;
+	size_t status, len;
+	u8_t *ptr;
+	int i = 0;
+	size_t j;
+
+	memset(&mp4, 0, sizeof(mp4));
+	mp4_init(&mp4);
+
+	seek_count = 0;
+	stream_connect(0, FALSE);
+
+	while ((status = mp4_open(&mp4)) == 2) {
+		stream_poll();
+	}
+
+	if (status != 1) {
+		mp4_free(&mp4);
+		return -1;
+	}
+
+	while ((ptr = mp4_read(&mp4, 0, &len, &streaming)) || streaming) {
+		if (!ptr) {
+			stream_poll();
+			continue;
+		}
+
+		if (i >= CHECK_SAMPLES || len != sample_size(i)) {
+			break;
+		}
+		for (j = 0; j < len; j++) {
+			if (ptr[j] != sample_byte(i, j)) {
+				break;
+			}
+		}
+		if (j != len) {
+			break;
+		}
+		i++;
+	}
+
+	mp4_free(&mp4);
+	return i;
+}
+
+
+int main(int argc, char **argv) {
+	pid_t pid;
+	int n, failed = 0;
+
+	log_audio_codec = calloc(sizeof(LOG_CATEGORY) + 6, 1);
+	strcpy(log_audio_codec->name, "codec");
+	log_audio_codec->priority = (argc > 1 && strcmp(argv[1], "-v") == 0) ? LOG_PRIORITY_DEBUG : LOG_PRIORITY_OFF;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	build_file();
+
+	/* 206: the moov box is fetched, then the media data */
+	pid = server_start(TRUE);
+	n = check_stream();
+	server_stop(pid);
+
+	if (n != CHECK_SAMPLES || seek_count != 2) {
+		printf("FAIL partial content: %d of %d samples, %d seeks\n", n, CHECK_SAMPLES, seek_count);
+		failed = 1;
+	}
+	else {
+		printf("ok partial content: %d samples, %d seeks\n", n, seek_count);
+	}
+
+	/* 200: the server ignores the range, the open must fail */
+	pid = server_start(FALSE);
+	n = check_stream();
+	server_stop(pid);
+
+	if (n != -1) {
+		printf("FAIL whole file response: open did not fail\n");
+		failed = 1;
+	}
+	else {
+		printf("ok whole file response: open failed after %d seek\n", seek_count);
+	}
+
+	return failed;
+}
@@ -448,10 +448,23 @@ static const struct luaL_Reg babybsp_lib[] = {
 
 
 int luaopen_baby_bsp(lua_State *L) {
+	struct pollfd pfds[4];
+	int i, nfds = 0;
+
 	if (open_input_devices() | open_mixer()) {
 		jive_sdlevent_pump = event_pump;
 	}
 
+	/* wake the event loop on input or mixer changes */
+	jive_add_event_fd(msp430_event_fd);
+
+	if (hctl) {
+		nfds = snd_hctl_poll_descriptors(hctl, pfds, 4);
+	}
+	for (i=0; i<nfds; i++) {
+		jive_add_event_fd(pfds[i].fd);
+	}
+
 	luaL_register(L, "baby_bsp", babybsp_lib);
 
 	return 1;
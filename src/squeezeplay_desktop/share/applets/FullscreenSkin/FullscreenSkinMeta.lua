@@ -38,6 +38,11 @@ function registerApplet(self)
 	--jiveMain:registerSkin(self:string("DESKTOP_SKIN"), 'FullscreenSkin', 'skin')
 end
 
+
+function registerOnDemand(self)
+	return true
+end
+
 --[[
 
 =head1 LICENSE
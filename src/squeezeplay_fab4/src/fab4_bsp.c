@@ -523,5 +523,10 @@ int luaopen_fab4_bsp(lua_State *L) {
 
 	open_uevent_fd();
 
+	/* wake the event loop on input */
+	jive_add_event_fd(clearpad_event_fd);
+	jive_add_event_fd(ir_event_fd);
+	jive_add_event_fd(uevent_fd);
+
 	return 1;
 }